@@ -0,0 +1,94 @@
+/*
+ * alloc.c - Allocation counting for the frame path
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * When knd is built with KND_ALLOC_COUNT, malloc(), calloc(), and realloc()
+ * are replaced with wrappers that count each call before passing it on to
+ * glibc.  Calls made by a thread between KND_FRAME_PATH_BEGIN() and
+ * KND_FRAME_PATH_END(), which surround the work done for every depth frame,
+ * are also counted as frame path allocations, so the steady-state frame path
+ * can be checked for allocations.  Without KND_ALLOC_COUNT, the macros do
+ * nothing and this file is empty.
+ */
+#include "knd.h"
+
+#ifdef KND_ALLOC_COUNT
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t total_allocs; // Accessed atomically
+static uint64_t frame_allocs; // Accessed atomically
+
+static __thread unsigned int frame_path; // Nesting depth of frame path scopes
+
+
+static void count_alloc(void)
+{
+	__atomic_fetch_add(&total_allocs, 1, __ATOMIC_RELAXED);
+	if(frame_path) {
+		__atomic_fetch_add(&frame_allocs, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void *malloc(size_t size)
+{
+	count_alloc();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	count_alloc();
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	// Shrinking or freeing with realloc() is not counted
+	if(ptr == NULL || size != 0) {
+		count_alloc();
+	}
+	return __libc_realloc(ptr, size);
+}
+
+/*
+ * Starts counting the calling thread's allocations as frame path
+ * allocations.  Scopes may be nested.  Use KND_FRAME_PATH_BEGIN() instead of
+ * calling this directly.
+ */
+void frame_path_begin(void)
+{
+	frame_path++;
+}
+
+/*
+ * Ends a scope started by frame_path_begin().  Use KND_FRAME_PATH_END()
+ * instead of calling this directly.
+ */
+void frame_path_end(void)
+{
+	frame_path--;
+}
+
+/*
+ * Stores the number of allocations made by the whole process and by the
+ * frame path since startup or the last reset_alloc_counts().
+ */
+void get_alloc_counts(uint64_t *total, uint64_t *frame)
+{
+	*total = __atomic_load_n(&total_allocs, __ATOMIC_RELAXED);
+	*frame = __atomic_load_n(&frame_allocs, __ATOMIC_RELAXED);
+}
+
+/*
+ * Clears the allocation counts.
+ */
+void reset_alloc_counts(void)
+{
+	__atomic_store_n(&total_allocs, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&frame_allocs, 0, __ATOMIC_RELAXED);
+}
+
+#endif /* KND_ALLOC_COUNT */
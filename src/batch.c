@@ -0,0 +1,759 @@
+/*
+ * batch.c - Offline zone analysis of depth recordings
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * Runs the zone engine over one or more recordings (see record.c) as fast as
+ * possible, writing every zone's state for every frame as CSV or as a binary
+ * columnar file.  Recordings are split into work units of a fixed number of
+ * frames that are processed in parallel.  Each unit after the first in a
+ * recording first replays a warm-up period without output, which usually
+ * brings the zones to the state sequential processing would have reached.
+ * It can't always: occupancy has hysteresis, so a zone whose population stays
+ * between its off and on levels through the warm-up keeps its initial state.
+ * Each unit's zone state before its first frame is therefore compared with
+ * the previous unit's state after its last frame, and a unit that started
+ * differently is processed again from the previous unit's state before its
+ * results are written.  Results are always written in recording and frame
+ * order, and match sequential processing.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+
+#include "knd.h"
+
+// Binary output format (host byte order; all sections padded to 8 bytes):
+//
+// File header:
+//   char magic[8]		BATCH_MAGIC
+//   uint32_t version		BATCH_VERSION
+//   uint32_t zone_count
+//   uint32_t recording_count
+//   uint32_t reserved
+//   char names[zone_count][ZONE_NAME_LENGTH]	NUL-padded zone names
+//   For each recording: uint32_t length, path bytes, padding
+//
+// Followed by row groups of consecutive frames from a single recording:
+//   uint32_t magic		BATCH_GROUP_MAGIC
+//   uint32_t recording		Index of the recording in the file header
+//   uint32_t rows
+//   uint32_t reserved
+//   uint32_t frame[rows]
+//   uint32_t timestamp[rows]	libfreenect timestamp
+//   uint64_t time_ns[rows]	Time since the start of the recording
+//   For each zone:
+//     uint8_t occupied[rows]
+//     int32_t pop[rows]
+//     int32_t sa[rows]
+//     int32_t xc[rows]
+//     int32_t yc[rows]
+//     int32_t zc[rows]
+
+#define BATCH_MAGIC		"KNDBATCH"
+#define BATCH_VERSION		1
+#define BATCH_GROUP_MAGIC	0x47524b42 // "BKRG"
+
+#define BATCH_DEFAULT_CHUNK	9000	// 5 minutes at 30fps
+#define BATCH_DEFAULT_WARMUP	300	// 10 seconds at 30fps
+
+#define BATCH_PAD(size) (((size) + 7) & ~(size_t)7)
+
+enum batch_format {
+	BATCH_CSV,
+	BATCH_BINARY,
+};
+
+/*
+ * Zone state carried from one frame to the next.
+ */
+struct batch_zone_state {
+	int count; // Frames seen while waiting for the on or off delay
+	unsigned int occupied:1;
+};
+
+/*
+ * A range of frames from one recording, processed by one worker.
+ */
+struct batch_unit {
+	unsigned int recording; // Index into batch_info.paths
+	unsigned int start; // First frame to output
+	unsigned int end; // One past the last frame to output
+
+	struct batch_zone_state *start_state; // Zone state before the first frame
+	struct batch_zone_state *end_state; // Zone state after the last frame
+	const struct batch_zone_state *seed; // Replaces start_state if not NULL
+
+	char *output; // Results (allocated by open_memstream())
+	size_t output_size;
+
+	unsigned int done:1;
+	unsigned int failed:1;
+};
+
+struct batch_info {
+	struct nl_thread_ctx *thread_ctx;
+
+	const char *zonefile;
+	char **paths;
+	unsigned int path_count;
+	enum batch_format format;
+	unsigned int warmup;
+	int zone_count;
+
+	struct batch_unit *units;
+	unsigned int unit_count;
+
+	// Work queue (protected by lock)
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int next_unit; // Next unit to claim
+	unsigned int written; // Units already written to the output
+	unsigned int window; // Maximum units claimed beyond written
+	unsigned int failed:1;
+};
+
+/*
+ * Per-frame state for collecting zone results in a work unit.
+ */
+struct batch_rows {
+	struct batch_info *batch;
+	struct batch_unit *unit;
+	FILE *out;
+	struct recording_frame *frame;
+
+	unsigned int row; // Row within the unit
+	unsigned int collected; // Rows collected so far
+	int zone; // Zone within the row
+
+	// Binary columns
+	uint32_t *frames;
+	uint32_t *timestamps;
+	uint64_t *times;
+	uint8_t *occupied; // [zone][row]
+	int32_t *pop;
+	int32_t *sa;
+	int32_t *xc;
+	int32_t *yc;
+	int32_t *zc;
+};
+
+
+// Writes a zone's state for one frame in CSV or binary column form.
+static void collect_zone(void *data, struct zone *zone)
+{
+	struct batch_rows *rows = data;
+	unsigned int rowcount = rows->unit->end - rows->unit->start;
+	size_t idx = (size_t)rows->zone * rowcount + rows->row;
+	int sa = zone->pop > 0 ? (int)(zone->pop * surface_area((float)zone->zsum / zone->pop)) : 0;
+	int occupied = zone->occupied ^ zone->negate;
+
+	if(rows->zone >= rows->batch->zone_count) {
+		return;
+	}
+
+	if(rows->batch->format == BATCH_CSV) {
+		fprintf(rows->out, "%u,%u,%u,%llu,\"%s\",%d,%d,%d,%d,%d,%d,%d\n",
+				rows->unit->recording, rows->frame->frame, rows->frame->timestamp,
+				(unsigned long long)(rows->frame->time_ns / 1000000),
+				zone->name, occupied, zone->pop, zone->maxpop, sa,
+				zone_xc(zone), zone_yc(zone), zone_zc(zone));
+	} else {
+		rows->occupied[idx] = occupied;
+		rows->pop[idx] = zone->pop;
+		rows->sa[idx] = sa;
+		rows->xc[idx] = zone_xc(zone);
+		rows->yc[idx] = zone_yc(zone);
+		rows->zc[idx] = zone_zc(zone);
+	}
+
+	rows->zone++;
+}
+
+/*
+ * Zone states being saved or restored with iterate_zonelist().
+ */
+struct batch_state {
+	struct batch_zone_state *zones;
+	int zone; // Next zone
+	int zone_count;
+};
+
+// Copies a zone's state into a saved state.
+static void save_zone_state(void *data, struct zone *zone)
+{
+	struct batch_state *state = data;
+
+	if(state->zone < state->zone_count) {
+		state->zones[state->zone].count = zone->count;
+		state->zones[state->zone].occupied = zone->occupied;
+	}
+	state->zone++;
+}
+
+// Restores a zone's state from a saved state.
+static void load_zone_state(void *data, struct zone *zone)
+{
+	struct batch_state *state = data;
+
+	if(state->zone < state->zone_count) {
+		zone->count = state->zones[state->zone].count;
+		zone->occupied = state->zones[state->zone].occupied;
+	}
+	state->zone++;
+}
+
+// Returns nonzero if the given saved zone states are the same.
+static int same_zone_state(const struct batch_zone_state *a, const struct batch_zone_state *b, int zone_count)
+{
+	int i;
+
+	for(i = 0; i < zone_count; i++) {
+		if(a[i].count != b[i].count || a[i].occupied != b[i].occupied) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Writes size bytes of data followed by padding to an 8-byte boundary.
+static int write_padded(FILE *out, const void *data, size_t size)
+{
+	static const uint8_t padding[8];
+	size_t pad = BATCH_PAD(size) - size;
+
+	if((size && fwrite(data, size, 1, out) != 1) || (pad && fwrite(padding, pad, 1, out) != 1)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+// Writes a unit's binary columns as a row group.
+static int write_row_group(struct batch_rows *rows)
+{
+	uint32_t rowcount = rows->unit->end - rows->unit->start;
+	uint32_t header[4] = { BATCH_GROUP_MAGIC, rows->unit->recording, rowcount, 0 };
+	int zones = rows->batch->zone_count;
+	int i;
+
+	if(write_padded(rows->out, header, sizeof(header)) ||
+			write_padded(rows->out, rows->frames, rowcount * sizeof(rows->frames[0])) ||
+			write_padded(rows->out, rows->timestamps, rowcount * sizeof(rows->timestamps[0])) ||
+			write_padded(rows->out, rows->times, rowcount * sizeof(rows->times[0]))) {
+		return -1;
+	}
+
+	for(i = 0; i < zones; i++) {
+		size_t off = (size_t)i * rowcount;
+		if(write_padded(rows->out, rows->occupied + off, rowcount * sizeof(rows->occupied[0])) ||
+				write_padded(rows->out, rows->pop + off, rowcount * sizeof(rows->pop[0])) ||
+				write_padded(rows->out, rows->sa + off, rowcount * sizeof(rows->sa[0])) ||
+				write_padded(rows->out, rows->xc + off, rowcount * sizeof(rows->xc[0])) ||
+				write_padded(rows->out, rows->yc + off, rowcount * sizeof(rows->yc[0])) ||
+				write_padded(rows->out, rows->zc + off, rowcount * sizeof(rows->zc[0]))) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Frees binary column buffers.
+static void free_columns(struct batch_rows *rows)
+{
+	free(rows->frames);
+	free(rows->timestamps);
+	free(rows->times);
+	free(rows->occupied);
+	free(rows->pop);
+	free(rows->sa);
+	free(rows->xc);
+	free(rows->yc);
+	free(rows->zc);
+}
+
+/*
+ * Runs the zones over one work unit, storing the results in unit->output and
+ * the zone state before the unit's first and after its last frame in
+ * unit->start_state and unit->end_state.  If unit->seed is set, the zones
+ * start the unit's first frame in that state instead of the state reached by
+ * the warm-up.  Returns 0 on success, -1 on error.
+ */
+static int run_unit(struct batch_info *batch, struct batch_unit *unit)
+{
+	struct batch_rows rows = { .batch = batch, .unit = unit };
+	struct knd_recording *rec = NULL;
+	struct zonelist *zones = NULL;
+	struct recording_frame frame;
+	const uint8_t *last_video = NULL;
+	unsigned int rowcount = unit->end - unit->start;
+	size_t cells = (size_t)rowcount * batch->zone_count;
+	uint8_t *packed = NULL;
+	unsigned int first;
+	int ret = -1;
+
+	packed = malloc(KND_DEPTH_SIZE);
+	if(packed == NULL) {
+		ERRNO_OUT("Error allocating depth buffer");
+		goto out;
+	}
+
+	if(batch->format == BATCH_BINARY) {
+		rows.frames = malloc(rowcount * sizeof(rows.frames[0]));
+		rows.timestamps = malloc(rowcount * sizeof(rows.timestamps[0]));
+		rows.times = malloc(rowcount * sizeof(rows.times[0]));
+		rows.occupied = malloc(cells * sizeof(rows.occupied[0]) + 1);
+		rows.pop = malloc(cells * sizeof(rows.pop[0]) + 1);
+		rows.sa = malloc(cells * sizeof(rows.sa[0]) + 1);
+		rows.xc = malloc(cells * sizeof(rows.xc[0]) + 1);
+		rows.yc = malloc(cells * sizeof(rows.yc[0]) + 1);
+		rows.zc = malloc(cells * sizeof(rows.zc[0]) + 1);
+		if(rows.frames == NULL || rows.timestamps == NULL || rows.times == NULL ||
+				rows.occupied == NULL || rows.pop == NULL || rows.sa == NULL ||
+				rows.xc == NULL || rows.yc == NULL || rows.zc == NULL) {
+			ERRNO_OUT("Error allocating result columns");
+			goto out;
+		}
+	}
+
+	if(unit->start_state == NULL) {
+		unit->start_state = calloc(batch->zone_count + 1, sizeof(unit->start_state[0]));
+		unit->end_state = calloc(batch->zone_count + 1, sizeof(unit->end_state[0]));
+		if(unit->start_state == NULL || unit->end_state == NULL) {
+			ERRNO_OUT("Error allocating zone state");
+			goto out;
+		}
+	}
+
+	// Each unit gets a fresh zone list so zone state starts from scratch
+	zones = create_zonelist(2, 2);
+	if(zones == NULL) {
+		ERROR_OUT("Error creating zone list.\n");
+		goto out;
+	}
+	if(load_zone_file(batch->zonefile, zones, NULL) < 0 || zone_count(zones) != batch->zone_count) {
+		ERROR_OUT("Zone file '%s' changed while processing.\n", batch->zonefile);
+		goto out;
+	}
+
+	rec = open_recording(batch->paths[unit->recording]);
+	if(rec == NULL) {
+		goto out;
+	}
+
+	first = unit->start > batch->warmup ? unit->start - batch->warmup : 0;
+	if(seek_recording(rec, first)) {
+		goto out;
+	}
+
+	rows.out = open_memstream(&unit->output, &unit->output_size);
+	if(rows.out == NULL) {
+		ERRNO_OUT("Error creating result buffer");
+		goto out;
+	}
+
+	while((ret = read_recording(rec, &frame)) == 0 && frame.frame < unit->end) {
+		if(frame.frame == unit->start) {
+			if(unit->seed != NULL) {
+				iterate_zonelist(zones, load_zone_state, &(struct batch_state){
+						.zones = (struct batch_zone_state *)unit->seed,
+						.zone_count = batch->zone_count });
+			}
+			iterate_zonelist(zones, save_zone_state, &(struct batch_state){
+					.zones = unit->start_state, .zone_count = batch->zone_count });
+		}
+
+		if(frame.video != NULL && frame.video != last_video) {
+			update_zonelist_video(zones, (uint8_t *)frame.video);
+			last_video = frame.video;
+		}
+
+		pack_11(frame.depth, packed, FREENECT_FRAME_PIX);
+		update_zonelist_depth(zones, packed);
+
+		if(frame.frame < unit->start) {
+			continue;
+		}
+
+		rows.frame = &frame;
+		rows.row = frame.frame - unit->start;
+		rows.zone = 0;
+
+		if(batch->format == BATCH_BINARY) {
+			rows.frames[rows.row] = frame.frame;
+			rows.timestamps[rows.row] = frame.timestamp;
+			rows.times[rows.row] = frame.time_ns;
+		}
+
+		iterate_zonelist(zones, collect_zone, &rows);
+		rows.collected++;
+	}
+	if(ret < 0) {
+		goto out;
+	}
+	if(rows.collected != rowcount) {
+		ERROR_OUT("Recording '%s' ended early (frame %u of %u).\n",
+				batch->paths[unit->recording], unit->start + rows.collected, unit->end);
+		ret = -1;
+		goto out;
+	}
+
+	iterate_zonelist(zones, save_zone_state, &(struct batch_state){
+			.zones = unit->end_state, .zone_count = batch->zone_count });
+
+	if(batch->format == BATCH_BINARY && write_row_group(&rows)) {
+		ERRNO_OUT("Error writing result columns");
+		ret = -1;
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	if(rows.out != NULL && fclose(rows.out)) {
+		ERRNO_OUT("Error closing result buffer");
+		ret = -1;
+	}
+	free_columns(&rows);
+	close_recording(rec);
+	if(zones != NULL) {
+		destroy_zonelist(zones);
+	}
+	free(packed);
+
+	return ret;
+}
+
+static void *batch_thread(void *data)
+{
+	struct batch_info *batch = data;
+	struct batch_unit *unit;
+	int ret, failed;
+
+	for(;;) {
+		if((ret = pthread_mutex_lock(&batch->lock))) {
+			ERROR_OUT("Error locking work queue: %s\n", strerror(ret));
+			return NULL;
+		}
+
+		// Don't get too far ahead of the writer, to limit memory use
+		while(!batch->failed && batch->next_unit < batch->unit_count &&
+				batch->next_unit >= batch->written + batch->window) {
+			if((ret = pthread_cond_wait(&batch->cond, &batch->lock))) {
+				ERROR_OUT("Error waiting for work queue: %s\n", strerror(ret));
+				break;
+			}
+		}
+		if(batch->failed || batch->next_unit >= batch->unit_count) {
+			pthread_mutex_unlock(&batch->lock);
+			return NULL;
+		}
+		unit = &batch->units[batch->next_unit++];
+
+		if((ret = pthread_mutex_unlock(&batch->lock))) {
+			ERROR_OUT("Error unlocking work queue: %s\n", strerror(ret));
+		}
+
+		failed = run_unit(batch, unit) != 0;
+
+		if((ret = pthread_mutex_lock(&batch->lock))) {
+			ERROR_OUT("Error locking work queue: %s\n", strerror(ret));
+			return NULL;
+		}
+		unit->done = 1;
+		unit->failed = failed;
+		batch->failed |= failed;
+		if((ret = pthread_cond_broadcast(&batch->cond))) {
+			ERROR_OUT("Error signaling work queue: %s\n", strerror(ret));
+		}
+		if((ret = pthread_mutex_unlock(&batch->lock))) {
+			ERROR_OUT("Error unlocking work queue: %s\n", strerror(ret));
+		}
+	}
+}
+
+// Adds a zone's name to the binary file header.
+static void write_zone_name(void *data, struct zone *zone)
+{
+	char name[ZONE_NAME_LENGTH] = { 0 };
+	snprintf(name, sizeof(name), "%s", zone->name);
+	fwrite(name, sizeof(name), 1, data);
+}
+
+// Writes the CSV column names or binary file header.
+static int write_header(struct batch_info *batch, struct zonelist *zones, FILE *out)
+{
+	uint32_t header[4] = { BATCH_VERSION, batch->zone_count, batch->path_count, 0 };
+	static const uint8_t padding[8];
+	uint32_t len;
+	size_t pad;
+	unsigned int i;
+
+	if(batch->format == BATCH_CSV) {
+		return fprintf(out, "recording,frame,timestamp,time_ms,zone,occupied,pop,maxpop,sa,xc,yc,zc\n") < 0 ? -1 : 0;
+	}
+
+	if(fwrite(BATCH_MAGIC, 8, 1, out) != 1 || write_padded(out, header, sizeof(header))) {
+		return -1;
+	}
+
+	iterate_zonelist(zones, write_zone_name, out);
+
+	for(i = 0; i < batch->path_count; i++) {
+		len = strlen(batch->paths[i]);
+		pad = BATCH_PAD(len + sizeof(len)) - len - sizeof(len);
+		if(fwrite(&len, sizeof(len), 1, out) != 1 || (len && fwrite(batch->paths[i], len, 1, out) != 1) ||
+				(pad && fwrite(padding, pad, 1, out) != 1)) {
+			return -1;
+		}
+	}
+
+	return ferror(out) ? -1 : 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options] zones.knd recording.knr [recording.knr ...]\n", name);
+	fprintf(stderr, "\nRuns zones from a saved zone file over depth recordings.\n");
+	fprintf(stderr, "\nOptions:\n");
+	fprintf(stderr, "\t-o path - Output file (defaults to standard output)\n");
+	fprintf(stderr, "\t-f csv|bin - Output format (defaults to csv; see README for bin)\n");
+	fprintf(stderr, "\t-j jobs - Worker threads (defaults to the number of CPUs)\n");
+	fprintf(stderr, "\t-c frames - Frames per work unit (defaults to %d; 0 for one unit per recording)\n",
+			BATCH_DEFAULT_CHUNK);
+	fprintf(stderr, "\t-w frames - Warm-up frames before each unit (defaults to %d)\n",
+			BATCH_DEFAULT_WARMUP);
+}
+
+int main(int argc, char *argv[])
+{
+	struct batch_info batch = {
+		.format = BATCH_CSV,
+		.warmup = BATCH_DEFAULT_WARMUP,
+	};
+	struct nl_thread **threads = NULL;
+	struct zonelist *zones;
+	struct knd_recording *rec;
+	const char *outpath = NULL;
+	FILE *out;
+	unsigned int chunk = BATCH_DEFAULT_CHUNK;
+	unsigned int frames, start, i;
+	unsigned int reruns = 0;
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt, ret;
+	int started = 0;
+	int fd;
+
+	while((opt = getopt(argc, argv, "o:f:j:c:w:h")) != -1) {
+		switch(opt) {
+			case 'o':
+				outpath = optarg;
+				break;
+
+			case 'f':
+				if(!strcmp(optarg, "csv")) {
+					batch.format = BATCH_CSV;
+				} else if(!strcmp(optarg, "bin")) {
+					batch.format = BATCH_BINARY;
+				} else {
+					usage(argv[0]);
+					return -1;
+				}
+				break;
+
+			case 'j':
+				jobs = atoi(optarg);
+				break;
+
+			case 'c':
+				chunk = MAX_NUM(atoi(optarg), 0);
+				break;
+
+			case 'w':
+				batch.warmup = MAX_NUM(atoi(optarg), 0);
+				break;
+
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : -1;
+		}
+	}
+
+	if(argc - optind < 2) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	jobs = CLAMP(1, 256, jobs);
+	batch.zonefile = argv[optind];
+	batch.paths = argv + optind + 1;
+	batch.path_count = argc - optind - 1;
+	batch.window = jobs * 2;
+
+	// Keep log messages out of results written to standard output
+	if(outpath == NULL) {
+		fd = dup(STDOUT_FILENO);
+		if(fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0 || (out = fdopen(fd, "wb")) == NULL) {
+			ERRNO_OUT("Error redirecting standard output");
+			return -1;
+		}
+	} else {
+		out = fopen(outpath, "wb");
+		if(out == NULL) {
+			ERRNO_OUT("Error creating output file '%s'", outpath);
+			return -1;
+		}
+	}
+
+	init_lut();
+
+	zones = create_zonelist(2, 2);
+	if(zones == NULL) {
+		ERROR_OUT("Error creating zone list.\n");
+		return -1;
+	}
+	if(load_zone_file(batch.zonefile, zones, NULL) < 0) {
+		return -1;
+	}
+	batch.zone_count = zone_count(zones);
+	if(batch.zone_count == 0) {
+		ERROR_OUT("Zone file '%s' does not contain any zones.\n", batch.zonefile);
+		return -1;
+	}
+
+	// Split recordings into work units
+	for(i = 0; i < batch.path_count; i++) {
+		rec = open_recording(batch.paths[i]);
+		if(rec == NULL) {
+			return -1;
+		}
+		frames = recording_frame_count(rec);
+		close_recording(rec);
+
+		for(start = 0; start < frames; start += chunk ? chunk : frames) {
+			struct batch_unit *units = realloc(batch.units, (batch.unit_count + 1) * sizeof(units[0]));
+			if(units == NULL) {
+				ERRNO_OUT("Error allocating work units");
+				return -1;
+			}
+			batch.units = units;
+			batch.units[batch.unit_count++] = (struct batch_unit){
+				.recording = i,
+				.start = start,
+				.end = chunk ? MIN_NUM(start + chunk, frames) : frames,
+			};
+		}
+	}
+
+	nl_ptmf("Processing %d zone(s) over %u recording(s) in %u unit(s) with %d thread(s).\n",
+			batch.zone_count, batch.path_count, batch.unit_count, jobs);
+
+	if(write_header(&batch, zones, out)) {
+		ERRNO_OUT("Error writing output header");
+		return -1;
+	}
+	destroy_zonelist(zones);
+
+	if((ret = pthread_mutex_init(&batch.lock, NULL)) || (ret = pthread_cond_init(&batch.cond, NULL))) {
+		ERROR_OUT("Error initializing work queue: %s\n", strerror(ret));
+		return -1;
+	}
+
+	batch.thread_ctx = nl_create_thread_context();
+	threads = calloc(jobs, sizeof(threads[0]));
+	if(batch.thread_ctx == NULL || threads == NULL) {
+		ERRNO_OUT("Error creating worker thread context");
+		return -1;
+	}
+
+	for(started = 0; started < jobs; started++) {
+		ret = nl_create_thread(batch.thread_ctx, NULL, batch_thread, &batch, "batch_thread", &threads[started]);
+		if(ret) {
+			ERROR_OUT("Error starting worker thread: %s\n", strerror(ret));
+			batch.failed = 1;
+			break;
+		}
+	}
+
+	// Write completed units in order
+	for(i = 0; i < batch.unit_count && started; i++) {
+		struct batch_unit *unit = &batch.units[i];
+
+		pthread_mutex_lock(&batch.lock);
+		while(!unit->done && !batch.failed) {
+			pthread_cond_wait(&batch.cond, &batch.lock);
+		}
+		pthread_mutex_unlock(&batch.lock);
+
+		if(!unit->done || unit->failed) {
+			break;
+		}
+
+		// The warm-up can't settle zones held between their off and on
+		// levels, so redo the unit from where the previous unit ended
+		if(i > 0 && batch.units[i - 1].recording == unit->recording &&
+				!same_zone_state(batch.units[i - 1].end_state, unit->start_state, batch.zone_count)) {
+			free(unit->output);
+			unit->output = NULL;
+			unit->output_size = 0;
+			unit->seed = batch.units[i - 1].end_state;
+			reruns++;
+
+			if(run_unit(&batch, unit)) {
+				ERROR_OUT("Error reprocessing frames %u to %u of '%s'.\n",
+						unit->start, unit->end - 1, batch.paths[unit->recording]);
+				pthread_mutex_lock(&batch.lock);
+				batch.failed = 1;
+				pthread_cond_broadcast(&batch.cond);
+				pthread_mutex_unlock(&batch.lock);
+				break;
+			}
+		}
+
+		if(unit->output_size && fwrite(unit->output, unit->output_size, 1, out) != 1) {
+			ERRNO_OUT("Error writing results");
+			pthread_mutex_lock(&batch.lock);
+			batch.failed = 1;
+			pthread_mutex_unlock(&batch.lock);
+		}
+		free(unit->output);
+		unit->output = NULL;
+
+		pthread_mutex_lock(&batch.lock);
+		batch.written++;
+		pthread_cond_broadcast(&batch.cond);
+		pthread_mutex_unlock(&batch.lock);
+	}
+
+	for(opt = 0; opt < started; opt++) {
+		nl_join_thread(threads[opt], NULL);
+	}
+
+	for(i = 0; i < batch.unit_count; i++) {
+		free(batch.units[i].output);
+		free(batch.units[i].start_state);
+		free(batch.units[i].end_state);
+	}
+
+	if(fclose(out)) {
+		ERRNO_OUT("Error closing output");
+		batch.failed = 1;
+	}
+
+	if(batch.failed) {
+		ERROR_OUT("Batch processing failed.\n");
+	} else {
+		nl_ptmf("Processed %u unit(s) (%u reprocessed to carry zone state across units).\n",
+				batch.unit_count, reruns);
+	}
+
+	free(threads);
+	free(batch.units);
+	nl_destroy_thread_context(batch.thread_ctx);
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.lock);
+
+	return batch.failed ? -1 : 0;
+}
@@ -0,0 +1,511 @@
+/*
+ * checkpoint.c - Runtime state checkpoints for warm restarts
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * knd exits whenever anything goes wrong and is restarted by knd_monitor.sh.
+ * Without help, every restart would clear each zone's occupied flag and delay
+ * counter, so occupied zones would turn off and back on.  A checkpoint thread
+ * copies every zone's detection state and the motor tilt into a file mapped
+ * with MAP_SHARED every CHECKPOINT_INTERVAL_NS.  The kernel keeps the mapped
+ * pages when the process dies, so even a crash leaves a recent checkpoint.
+ * If the checkpoint is recent enough at startup, it is restored before the
+ * thread starts overwriting it.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "knd.h"
+
+#define CHECKPOINT_FILENAME "state.bin"
+#define CHECKPOINT_FORMAT 1 // File format version
+#define CHECKPOINT_INTERVAL_NS 1000000000 // Time between checkpoints
+
+// Checkpoint file header, followed by count struct checkpoint_zone.  Written
+// in native byte order.
+struct checkpoint_header {
+	char magic[4]; // "KNDS"
+	uint32_t format; // CHECKPOINT_FORMAT
+	uint32_t record_size; // sizeof(struct checkpoint_zone)
+	uint32_t count;
+	uint32_t seq; // Odd while a checkpoint is being written
+	int32_t tilt;
+	uint64_t time; // CLOCK_REALTIME nanoseconds when the checkpoint was written
+};
+
+// Detection state of a single zone
+struct checkpoint_zone {
+	char name[ZONE_NAME_LENGTH];
+	int32_t xmin, ymin, zmin, xmax, ymax, zmax; // Zones that changed are not restored
+	int32_t pop, lastpop;
+	int32_t xsum, ysum;
+	uint32_t zsum;
+	int32_t bsum;
+	int32_t count;
+	int32_t occupied;
+};
+
+struct knd_checkpoint {
+	struct knd_info *knd;
+	struct nl_thread *thread;
+
+	int fd;
+	struct checkpoint_header *header; // Mapped file (NULL if not mapped)
+	size_t size; // Size of the mapping
+	int capacity; // Zone records that fit in the mapping
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // Signaled to stop the thread
+	unsigned int stop:1;
+};
+
+// Used by write_checkpoint() to copy zones into the mapped file
+struct checkpoint_writer {
+	struct checkpoint_zone *zones;
+	int capacity;
+	int count; // Zones seen, which may exceed capacity
+};
+
+// Used by restore_checkpoint() to restore zones from the mapped file
+struct checkpoint_reader {
+	struct checkpoint_zone *zones;
+	struct checkpoint_zone **sorted; // Records sorted by name for bsearch()
+	int count;
+	int next; // Record expected for the next zone if the zone list is unchanged
+	int restored;
+};
+
+
+// Returns the current CLOCK_REALTIME time in nanoseconds.
+static uint64_t realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Maps the checkpoint file with room for at least count zone records, growing
+// the file if necessary.  Returns 0 on success, -1 on error.
+static int map_checkpoint(struct knd_checkpoint *cp, int count)
+{
+	size_t size;
+	void *data;
+
+	if(cp->header != NULL && count <= cp->capacity) {
+		return 0;
+	}
+
+	// Leave room for a few more zones so adding zones rarely remaps
+	count += 16;
+	size = sizeof(struct checkpoint_header) + sizeof(struct checkpoint_zone) * count;
+
+	if(cp->header != NULL) {
+		munmap(cp->header, cp->size);
+		cp->header = NULL;
+	}
+
+	if(ftruncate(cp->fd, size)) {
+		ERRNO_OUT("Error resizing state checkpoint file");
+		return -1;
+	}
+
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cp->fd, 0);
+	if(data == MAP_FAILED) {
+		ERRNO_OUT("Error mapping state checkpoint file");
+		return -1;
+	}
+
+	cp->header = data;
+	cp->size = size;
+	cp->capacity = count;
+
+	return 0;
+}
+
+// Copies one zone's state into the checkpoint, if there is room.
+static void write_zone_callback(void *data, struct zone *zone)
+{
+	struct checkpoint_writer *writer = data;
+	struct checkpoint_zone *cz;
+
+	if(writer->count++ >= writer->capacity) {
+		return;
+	}
+
+	cz = &writer->zones[writer->count - 1];
+	snprintf(cz->name, sizeof(cz->name), "%s", zone->name);
+	cz->xmin = zone->xmin;
+	cz->ymin = zone->ymin;
+	cz->zmin = zone->zmin;
+	cz->xmax = zone->xmax;
+	cz->ymax = zone->ymax;
+	cz->zmax = zone->zmax;
+	cz->pop = zone->pop;
+	cz->lastpop = zone->lastpop;
+	cz->xsum = zone->xsum;
+	cz->ysum = zone->ysum;
+	cz->zsum = zone->zsum;
+	cz->bsum = zone->bsum;
+	cz->count = zone->count;
+	cz->occupied = zone->occupied;
+}
+
+// Writes the state of every zone and the motor tilt to the checkpoint file.
+static void write_checkpoint(struct knd_checkpoint *cp)
+{
+	struct checkpoint_writer writer;
+	struct checkpoint_header *header;
+	uint32_t seq;
+
+	trace_begin("checkpoint");
+
+	if(map_checkpoint(cp, zone_count(cp->knd->zones))) {
+		goto out;
+	}
+
+	header = cp->header;
+
+	// A checkpoint interrupted by a crash is left with an odd sequence
+	seq = header->seq | 1;
+	__atomic_store_n(&header->seq, seq, __ATOMIC_RELEASE);
+
+	do {
+		writer = (struct checkpoint_writer){
+			.zones = (struct checkpoint_zone *)(cp->header + 1),
+			.capacity = cp->capacity,
+		};
+		iterate_zonelist(cp->knd->zones, write_zone_callback, &writer);
+	} while(writer.count > writer.capacity && map_checkpoint(cp, writer.count) == 0);
+
+	header = cp->header;
+	if(header == NULL || writer.count > writer.capacity) {
+		goto out;
+	}
+
+	memcpy(header->magic, "KNDS", 4);
+	header->format = CHECKPOINT_FORMAT;
+	header->record_size = sizeof(struct checkpoint_zone);
+	header->count = writer.count;
+	header->tilt = get_tilt(cp->knd->vid);
+	header->time = realtime_ns();
+	__atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELEASE);
+
+out:
+	trace_end("checkpoint");
+}
+
+// Sorts checkpoint records by name for qsort().
+static int compare_records(const void *a, const void *b)
+{
+	const struct checkpoint_zone *za = *(struct checkpoint_zone * const *)a;
+	const struct checkpoint_zone *zb = *(struct checkpoint_zone * const *)b;
+
+	return strncmp(za->name, zb->name, sizeof(za->name));
+}
+
+// Compares a zone name to a checkpoint record's name for bsearch().
+static int compare_record_name(const void *key, const void *elem)
+{
+	const struct checkpoint_zone *cz = *(struct checkpoint_zone * const *)elem;
+
+	return strncmp(key, cz->name, sizeof(cz->name));
+}
+
+// Restores one zone's state from the checkpoint if the zone has the same name
+// and dimensions as when it was checkpointed.  Records are written in zone
+// list order, so the next record usually matches without a search.
+static void restore_zone_callback(void *data, struct zone *zone)
+{
+	struct checkpoint_reader *reader = data;
+	struct checkpoint_zone **found;
+	struct checkpoint_zone *cz;
+
+	cz = NULL;
+	if(reader->next < reader->count &&
+			!strncmp(reader->zones[reader->next].name, zone->name, ZONE_NAME_LENGTH)) {
+		cz = &reader->zones[reader->next];
+	} else {
+		found = bsearch(zone->name, reader->sorted, reader->count,
+				sizeof(reader->sorted[0]), compare_record_name);
+		if(found != NULL) {
+			cz = *found;
+		}
+	}
+	if(cz == NULL) {
+		return;
+	}
+	reader->next = cz - reader->zones + 1;
+
+	if(cz->xmin != zone->xmin || cz->ymin != zone->ymin || cz->zmin != zone->zmin ||
+			cz->xmax != zone->xmax || cz->ymax != zone->ymax || cz->zmax != zone->zmax) {
+		return;
+	}
+
+	zone->pop = cz->pop;
+	zone->lastpop = cz->lastpop;
+	zone->xsum = cz->xsum;
+	zone->ysum = cz->ysum;
+	zone->zsum = cz->zsum;
+	zone->bsum = cz->bsum;
+	zone->count = cz->count;
+	zone->occupied = !!cz->occupied;
+	zone->lastoccupied = zone->occupied;
+
+	reader->restored++;
+}
+
+// Restores zone state and the motor tilt from the mapped checkpoint file if
+// the checkpoint is complete and no older than max_age nanoseconds.
+static void restore_checkpoint(struct knd_checkpoint *cp, uint64_t max_age)
+{
+	struct checkpoint_header *header = cp->header;
+	struct checkpoint_reader reader;
+	uint64_t now = realtime_ns();
+	uint64_t age;
+	int i;
+
+	if(cp->size < sizeof(*header) || memcmp(header->magic, "KNDS", 4) ||
+			header->format != CHECKPOINT_FORMAT ||
+			header->record_size != sizeof(struct checkpoint_zone) ||
+			header->count > (cp->size - sizeof(*header)) / sizeof(struct checkpoint_zone)) {
+		return;
+	}
+	if(header->seq & 1) {
+		nl_ptmf("Not restoring an incomplete state checkpoint.\n");
+		return;
+	}
+
+	age = now - header->time;
+	if(header->time > now || age > max_age) {
+		nl_ptmf("Not restoring a state checkpoint from %.1f seconds ago.\n",
+				((double)now - header->time) / 1000000000.0);
+		return;
+	}
+
+	reader = (struct checkpoint_reader){
+		.zones = (struct checkpoint_zone *)(header + 1),
+		.count = header->count,
+	};
+
+	// Zones that were added, removed, or renamed since the checkpoint are
+	// looked up by name, so thousands of zones don't take O(n^2) compares
+	reader.sorted = malloc(sizeof(reader.sorted[0]) * MAX_NUM(reader.count, 1));
+	if(reader.sorted == NULL) {
+		ERRNO_OUT("Error allocating state checkpoint index");
+		return;
+	}
+	for(i = 0; i < reader.count; i++) {
+		reader.sorted[i] = &reader.zones[i];
+	}
+	qsort(reader.sorted, reader.count, sizeof(reader.sorted[0]), compare_records);
+
+	iterate_zonelist(cp->knd->zones, restore_zone_callback, &reader);
+	free(reader.sorted);
+
+	if(header->tilt != get_tilt(cp->knd->vid)) {
+		set_tilt(cp->knd->vid, header->tilt);
+	}
+
+	nl_ptmf("Restored the state of %d zone(s) from %.3f seconds ago.\n",
+			reader.restored, age / 1000000000.0);
+}
+
+static void *checkpoint_thread(void *d)
+{
+	struct knd_checkpoint *cp = d;
+	struct timespec next;
+	int ret;
+
+	nl_set_threadname("checkpoint");
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	if((ret = pthread_mutex_lock(&cp->lock))) {
+		ERROR_OUT("Error locking checkpoint mutex: %s\n", strerror(ret));
+		return NULL;
+	}
+
+	while(!cp->stop) {
+		next = nl_add_timespec(next, (struct timespec){ .tv_nsec = CHECKPOINT_INTERVAL_NS });
+
+		while(!cp->stop) {
+			ret = pthread_cond_timedwait(&cp->cond, &cp->lock, &next);
+			if(ret == ETIMEDOUT) {
+				break;
+			} else if(ret) {
+				ERROR_OUT("Error waiting for checkpoint interval: %s\n", strerror(ret));
+				break;
+			}
+		}
+		if(cp->stop) {
+			break;
+		}
+
+		if((ret = pthread_mutex_unlock(&cp->lock))) {
+			ERROR_OUT("Error unlocking checkpoint mutex: %s\n", strerror(ret));
+		}
+
+		write_checkpoint(cp);
+
+		if((ret = pthread_mutex_lock(&cp->lock))) {
+			ERROR_OUT("Error locking checkpoint mutex: %s\n", strerror(ret));
+			return NULL;
+		}
+	}
+
+	if((ret = pthread_mutex_unlock(&cp->lock))) {
+		ERROR_OUT("Error unlocking checkpoint mutex: %s\n", strerror(ret));
+	}
+
+	return NULL;
+}
+
+/*
+ * Restores zone detection state and the motor tilt from the checkpoint file
+ * in the given data directory if it is no older than max_age seconds (0 to
+ * never restore), then starts a thread that checkpoints the state of the
+ * given knd context's zones every second.  Call after zones are loaded.
+ * Returns NULL on error.
+ */
+struct knd_checkpoint *create_checkpoint(struct knd_info *knd, const char *savedir, double max_age)
+{
+	struct knd_checkpoint *cp;
+	pthread_mutexattr_t mutex_attr;
+	pthread_condattr_t cond_attr;
+	char path[PATH_MAX];
+	struct stat statbuf;
+	void *data;
+	int ret;
+
+	if(snprintf(path, sizeof(path), "%s/%s", savedir, CHECKPOINT_FILENAME) >= (int)sizeof(path)) {
+		ERROR_OUT("State checkpoint path is too long.\n");
+		return NULL;
+	}
+
+	cp = calloc(1, sizeof(struct knd_checkpoint));
+	if(cp == NULL) {
+		ERRNO_OUT("Error allocating state checkpoint");
+		return NULL;
+	}
+
+	cp->knd = knd;
+
+	cp->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(cp->fd < 0) {
+		ERRNO_OUT("Error opening state checkpoint file '%s'", path);
+		free(cp);
+		return NULL;
+	}
+
+	if(fstat(cp->fd, &statbuf)) {
+		ERRNO_OUT("Error checking the size of state checkpoint file '%s'", path);
+		goto error;
+	}
+
+	if(statbuf.st_size > 0 && max_age > 0) {
+		data = mmap(NULL, statbuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, cp->fd, 0);
+		if(data == MAP_FAILED) {
+			ERRNO_OUT("Error mapping state checkpoint file '%s'", path);
+		} else {
+			cp->header = data;
+			cp->size = statbuf.st_size;
+			restore_checkpoint(cp, max_age * 1000000000.0);
+			munmap(cp->header, cp->size);
+			cp->header = NULL;
+		}
+	}
+
+	if((ret = pthread_mutexattr_init(&mutex_attr))) {
+		ERROR_OUT("Error initializing checkpoint mutex attributes: %s\n", strerror(ret));
+		goto error;
+	}
+	if((ret = pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_ERRORCHECK))) {
+		ERROR_OUT("Error setting checkpoint mutex type: %s\n", strerror(ret));
+		pthread_mutexattr_destroy(&mutex_attr);
+		goto error;
+	}
+	ret = pthread_mutex_init(&cp->lock, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+	if(ret) {
+		ERROR_OUT("Error initializing checkpoint mutex: %s\n", strerror(ret));
+		goto error;
+	}
+
+	// The interval is timed with the monotonic clock
+	if((ret = pthread_condattr_init(&cond_attr))) {
+		ERROR_OUT("Error initializing checkpoint condition attributes: %s\n", strerror(ret));
+		goto error_mutex;
+	}
+	if((ret = pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC))) {
+		ERROR_OUT("Error setting checkpoint condition clock: %s\n", strerror(ret));
+		pthread_condattr_destroy(&cond_attr);
+		goto error_mutex;
+	}
+	ret = pthread_cond_init(&cp->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	if(ret) {
+		ERROR_OUT("Error initializing checkpoint condition: %s\n", strerror(ret));
+		goto error_mutex;
+	}
+
+	ret = nl_create_thread(knd->thread_ctx, NULL, checkpoint_thread, cp, "checkpoint", &cp->thread);
+	if(ret) {
+		ERROR_OUT("Error starting checkpoint thread: %s\n", strerror(ret));
+		goto error_cond;
+	}
+
+	return cp;
+
+error_cond:
+	pthread_cond_destroy(&cp->cond);
+error_mutex:
+	pthread_mutex_destroy(&cp->lock);
+error:
+	close(cp->fd);
+	free(cp);
+	return NULL;
+}
+
+/*
+ * Stops the given checkpoint thread, writes a final checkpoint, and frees its
+ * resources.  Call before the zone list is destroyed.  Ignores a NULL cp.
+ */
+void destroy_checkpoint(struct knd_checkpoint *cp)
+{
+	int ret;
+
+	if(cp == NULL) {
+		return;
+	}
+
+	if((ret = pthread_mutex_lock(&cp->lock))) {
+		ERROR_OUT("Error locking checkpoint mutex: %s\n", strerror(ret));
+	}
+	cp->stop = 1;
+	if((ret = pthread_cond_signal(&cp->cond))) {
+		ERROR_OUT("Error signaling checkpoint thread: %s\n", strerror(ret));
+	}
+	if((ret = pthread_mutex_unlock(&cp->lock))) {
+		ERROR_OUT("Error unlocking checkpoint mutex: %s\n", strerror(ret));
+	}
+
+	ret = nl_join_thread(cp->thread, NULL);
+	if(ret) {
+		ERROR_OUT("Error joining checkpoint thread: %s\n", strerror(ret));
+	}
+
+	write_checkpoint(cp);
+
+	if(cp->header != NULL) {
+		munmap(cp->header, cp->size);
+	}
+	close(cp->fd);
+
+	pthread_cond_destroy(&cp->cond);
+	pthread_mutex_destroy(&cp->lock);
+	free(cp);
+}
@@ -0,0 +1,219 @@
+/*
+ * codec.c - Depth frame unpacking and lossless delta/RLE compression
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ */
+#include <stdlib.h>
+#include <endian.h>
+
+#include "knd.h"
+
+// Compressed stream format:
+//
+// Each pixel is predicted either from the same pixel of the previous frame
+// (temporal prediction) or, when there is no previous frame, from its left
+// neighbor (or the pixel above for the first pixel of a row).  The stream is
+// a sequence of single-byte tags, some followed by data:
+//
+// 0x00-0x7f: (tag + 1) pixels equal to their prediction
+// 0x80-0xbf: one pixel equal to its prediction plus ((tag & 0x3f) - 32)
+// 0xc0-0xdf: ((tag & 0x1f) + 1) literal pixels follow, 2 bytes each (LE)
+// 0xe0-0xef: two pixels equal to their predictions plus (((tag >> 2) & 3) - 2)
+//            and ((tag & 3) - 2) (dense sensor noise costs 4 bits per pixel)
+// 0xf0-0xfe: reserved
+// 0xff: 3-byte little-endian count follows; count pixels equal to prediction
+
+#define TAG_RUN		0x00
+#define TAG_SMALL	0x80
+#define TAG_LITERAL	0xc0
+#define TAG_PAIR	0xe0
+#define TAG_LONG_RUN	0xff
+
+#define MAX_SHORT_RUN	128
+#define MAX_LONG_RUN	0xffffff
+#define MAX_LITERALS	32
+
+/*
+ * Unpacks count 11-bit depth values from the Kinect's packed format into
+ * 16-bit values.  The count must be a multiple of 8.  This is much faster than
+ * calling pxval_11() for every pixel, as it processes 8 pixels (11 bytes) at
+ * a time with no per-pixel branches.
+ */
+void unpack_11(const uint8_t *in, uint16_t *out, int count)
+{
+	uint64_t hi;
+	uint32_t lo;
+	int i;
+
+	for(i = 0; i < count; i += 8, in += 11, out += 8) {
+		memcpy(&hi, in, sizeof(hi));
+		hi = be64toh(hi);
+		lo = ((uint32_t)in[8] << 16) | ((uint32_t)in[9] << 8) | in[10];
+
+		out[0] = hi >> 53;
+		out[1] = (hi >> 42) & 0x7ff;
+		out[2] = (hi >> 31) & 0x7ff;
+		out[3] = (hi >> 20) & 0x7ff;
+		out[4] = (hi >> 9) & 0x7ff;
+		out[5] = ((hi & 0x1ff) << 2) | (lo >> 22);
+		out[6] = (lo >> 11) & 0x7ff;
+		out[7] = lo & 0x7ff;
+	}
+}
+
+/*
+ * Returns the predicted value for pixel i of a frame with the given row width.
+ */
+static inline int predict(const uint16_t *cur, const uint16_t *prev, int i, int width)
+{
+	if(prev != NULL) {
+		return prev[i];
+	}
+	if(i % width) {
+		return cur[i - 1];
+	}
+	return i >= width ? cur[i - width] : 0;
+}
+
+// Appends the tag(s) for a run of predicted pixels.
+static uint8_t *put_run(uint8_t *out, int run)
+{
+	while(run > MAX_SHORT_RUN) {
+		int n = MIN_NUM(run, MAX_LONG_RUN);
+		out[0] = TAG_LONG_RUN;
+		out[1] = n;
+		out[2] = n >> 8;
+		out[3] = n >> 16;
+		out += 4;
+		run -= n;
+	}
+	if(run > 0) {
+		*out++ = TAG_RUN | (run - 1);
+	}
+	return out;
+}
+
+/*
+ * Compresses count 16-bit depth values from cur into out, predicting each
+ * pixel from prev (which may be NULL for a self-contained key frame).  The
+ * width is used for row-based prediction in key frames.  The output buffer
+ * must hold at least DEPTH_CODEC_MAX_SIZE(count) bytes.  Returns the number
+ * of bytes written.
+ */
+size_t encode_depth(const uint16_t *cur, const uint16_t *prev, int count, int width, uint8_t *out)
+{
+	uint8_t *o = out;
+	int run = 0;
+	int i, n, r;
+
+	for(i = 0; i < count; i++) {
+		r = cur[i] - predict(cur, prev, i, width);
+		if(r == 0) {
+			run++;
+			continue;
+		}
+
+		o = put_run(o, run);
+		run = 0;
+
+		if(r >= -2 && r <= 1 && i + 1 < count) {
+			n = cur[i + 1] - predict(cur, prev, i + 1, width);
+			if(n >= -2 && n <= 1) {
+				*o++ = TAG_PAIR | ((r + 2) << 2) | (n + 2);
+				i++;
+				continue;
+			}
+		}
+
+		if(r >= -32 && r <= 31) {
+			*o++ = TAG_SMALL | (r + 32);
+			continue;
+		}
+
+		// Collect consecutive pixels that can't be coded more compactly
+		for(n = 1; n < MAX_LITERALS && i + n < count; n++) {
+			r = cur[i + n] - predict(cur, prev, i + n, width);
+			if(r >= -32 && r <= 31) {
+				break;
+			}
+		}
+
+		*o++ = TAG_LITERAL | (n - 1);
+		for(; n > 0; n--, i++) {
+			*o++ = cur[i];
+			*o++ = cur[i] >> 8;
+		}
+		i--;
+	}
+
+	o = put_run(o, run);
+
+	return o - out;
+}
+
+/*
+ * Decompresses count 16-bit depth values from the len bytes of compressed
+ * data in in, using the same prev frame (or NULL) and width that were given to
+ * encode_depth().  Returns 0 on success, -1 if the data is corrupt.
+ */
+int decode_depth(const uint8_t *in, size_t len, const uint16_t *prev, int count, int width, uint16_t *out)
+{
+	const uint8_t *end = in + len;
+	int i = 0, n;
+	uint8_t tag;
+
+	while(in < end) {
+		tag = *in++;
+
+		if(tag < TAG_SMALL) {
+			n = (tag & 0x7f) + 1;
+		} else if(tag == TAG_LONG_RUN) {
+			if(end - in < 3) {
+				return -1;
+			}
+			n = in[0] | (in[1] << 8) | (in[2] << 16);
+			in += 3;
+		} else if(tag < TAG_LITERAL) {
+			if(i >= count) {
+				return -1;
+			}
+			out[i] = (predict(out, prev, i, width) + (tag & 0x3f) - 32) & 0x7ff;
+			i++;
+			continue;
+		} else if(tag < TAG_PAIR) {
+			n = (tag & 0x1f) + 1;
+			if(i + n > count || end - in < n * 2) {
+				return -1;
+			}
+			for(; n > 0; n--, i++, in += 2) {
+				out[i] = (in[0] | (in[1] << 8)) & 0x7ff;
+			}
+			continue;
+		} else if(tag < 0xf0) {
+			if(i + 2 > count) {
+				return -1;
+			}
+			out[i] = (predict(out, prev, i, width) + ((tag >> 2) & 3) - 2) & 0x7ff;
+			i++;
+			out[i] = (predict(out, prev, i, width) + (tag & 3) - 2) & 0x7ff;
+			i++;
+			continue;
+		} else {
+			return -1;
+		}
+
+		// Run of predicted pixels
+		if(i + n > count) {
+			return -1;
+		}
+		if(prev != NULL) {
+			memcpy(out + i, prev + i, n * sizeof(out[0]));
+			i += n;
+		} else {
+			for(; n > 0; n--, i++) {
+				out[i] = predict(out, NULL, i, width);
+			}
+		}
+	}
+
+	return i == count ? 0 : -1;
+}
@@ -0,0 +1,337 @@
+/*
+ * encoder.c - Background compression of depth frames for server clients
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ */
+#include <stdlib.h>
+
+#include "knd.h"
+
+/*
+ * Compresses each depth frame once (with the codec from codec.c) in its own
+ * thread, so the server thread only copies the result to subscribers.
+ */
+struct depth_encoder {
+	struct nl_thread *thread;
+
+	void (*notify)(void *data); // Called from the encoder thread when a frame is ready
+	void *notify_data;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// Protected by lock
+	unsigned int pending:1; // A new camera frame is waiting in packed
+	unsigned int working:1; // The encoder thread is compressing a frame
+	unsigned int ready:1; // Encoded data is waiting for the server
+	unsigned int key_requested:1; // A key frame is needed for the next frame
+	unsigned int stop:1;
+	unsigned int active; // Number of compressed subscribers
+	unsigned int key_clients; // Subscribers that receive only key frames
+	unsigned int seq; // Sequence number of the encoded frame
+
+	// Written by depth_encoder_frame() while the encoder is idle
+	uint8_t *packed;
+
+	// Only used by the encoder thread
+	uint16_t *cur; // Unpacked current frame
+	uint16_t *prev; // Unpacked previous frame (the reference for deltas)
+	unsigned int have_prev:1;
+
+	// Written by the encoder thread when ready is 0, read by the server
+	// thread when ready is 1
+	uint8_t *delta;
+	size_t delta_size; // 0 if there is no delta frame
+	uint8_t *key;
+	size_t key_size; // 0 if there is no key frame
+};
+
+
+static void *encoder_thread(void *data)
+{
+	struct depth_encoder *enc = data;
+	int need_key, need_delta;
+	uint16_t *tmp;
+	int ret;
+
+	for(;;) {
+		if((ret = pthread_mutex_lock(&enc->lock))) {
+			ERROR_OUT("Error locking depth encoder: %s\n", strerror(ret));
+			return NULL;
+		}
+
+		while(!enc->stop && !enc->pending) {
+			if((ret = pthread_cond_wait(&enc->cond, &enc->lock))) {
+				ERROR_OUT("Error waiting for depth frames: %s\n", strerror(ret));
+				break;
+			}
+		}
+
+		if(enc->stop) {
+			pthread_mutex_unlock(&enc->lock);
+			return NULL;
+		}
+
+		enc->pending = 0;
+		enc->working = 1;
+		need_key = enc->key_requested || enc->key_clients > 0 || !enc->have_prev;
+		need_delta = enc->have_prev && enc->active > enc->key_clients;
+		enc->key_requested = 0;
+
+		if((ret = pthread_mutex_unlock(&enc->lock))) {
+			ERROR_OUT("Error unlocking depth encoder: %s\n", strerror(ret));
+		}
+
+		unpack_11(enc->packed, enc->cur, FREENECT_FRAME_PIX);
+
+		enc->delta_size = need_delta ? encode_depth(enc->cur, enc->prev, FREENECT_FRAME_PIX, FREENECT_FRAME_W, enc->delta) : 0;
+		enc->key_size = need_key ? encode_depth(enc->cur, NULL, FREENECT_FRAME_PIX, FREENECT_FRAME_W, enc->key) : 0;
+
+		tmp = enc->prev;
+		enc->prev = enc->cur;
+		enc->cur = tmp;
+		enc->have_prev = 1;
+
+		if((ret = pthread_mutex_lock(&enc->lock))) {
+			ERROR_OUT("Error locking depth encoder: %s\n", strerror(ret));
+			return NULL;
+		}
+		enc->seq++;
+		enc->working = 0;
+		enc->ready = 1;
+		if((ret = pthread_mutex_unlock(&enc->lock))) {
+			ERROR_OUT("Error unlocking depth encoder: %s\n", strerror(ret));
+		}
+
+		enc->notify(enc->notify_data);
+	}
+}
+
+/*
+ * Creates a depth encoder and starts its thread in the given knd context's
+ * thread context.  The notify callback will be called from the encoder thread
+ * each time a frame has been compressed.  Returns NULL on error.
+ */
+struct depth_encoder *create_depth_encoder(struct knd_info *knd, void (*notify)(void *data), void *notify_data)
+{
+	struct depth_encoder *enc;
+	pthread_mutexattr_t mutex_attr;
+	int ret;
+
+	enc = calloc(1, sizeof(struct depth_encoder));
+	if(enc == NULL) {
+		ERRNO_OUT("Error allocating depth encoder");
+		return NULL;
+	}
+
+	enc->notify = notify;
+	enc->notify_data = notify_data;
+
+	enc->packed = malloc(KND_DEPTH_SIZE);
+	enc->cur = malloc(FREENECT_FRAME_PIX * sizeof(enc->cur[0]));
+	enc->prev = malloc(FREENECT_FRAME_PIX * sizeof(enc->prev[0]));
+	enc->delta = malloc(DEPTH_CODEC_MAX_SIZE(FREENECT_FRAME_PIX));
+	enc->key = malloc(DEPTH_CODEC_MAX_SIZE(FREENECT_FRAME_PIX));
+	if(enc->packed == NULL || enc->cur == NULL || enc->prev == NULL || enc->delta == NULL || enc->key == NULL) {
+		ERRNO_OUT("Error allocating depth encoder buffers");
+		goto error;
+	}
+
+	if((ret = pthread_mutexattr_init(&mutex_attr))) {
+		ERROR_OUT("Error initializing depth encoder mutex attributes: %s\n", strerror(ret));
+		goto error;
+	}
+	if((ret = pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_ERRORCHECK))) {
+		ERROR_OUT("Error setting depth encoder mutex type: %s\n", strerror(ret));
+		pthread_mutexattr_destroy(&mutex_attr);
+		goto error;
+	}
+	ret = pthread_mutex_init(&enc->lock, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+	if(ret) {
+		ERROR_OUT("Error initializing depth encoder mutex: %s\n", strerror(ret));
+		goto error;
+	}
+	if((ret = pthread_cond_init(&enc->cond, NULL))) {
+		ERROR_OUT("Error initializing depth encoder condition: %s\n", strerror(ret));
+		pthread_mutex_destroy(&enc->lock);
+		goto error;
+	}
+
+	ret = nl_create_thread(knd->thread_ctx, NULL, encoder_thread, enc, "encoder_thread", &enc->thread);
+	if(ret) {
+		ERROR_OUT("Error starting depth encoder thread: %s\n", strerror(ret));
+		pthread_cond_destroy(&enc->cond);
+		pthread_mutex_destroy(&enc->lock);
+		goto error;
+	}
+
+	return enc;
+
+error:
+	free(enc->packed);
+	free(enc->cur);
+	free(enc->prev);
+	free(enc->delta);
+	free(enc->key);
+	free(enc);
+	return NULL;
+}
+
+/*
+ * Stops the given encoder's thread and frees its resources.
+ */
+void destroy_depth_encoder(struct depth_encoder *enc)
+{
+	int ret;
+
+	if(enc == NULL) {
+		return;
+	}
+
+	if((ret = pthread_mutex_lock(&enc->lock))) {
+		ERROR_OUT("Error locking depth encoder: %s\n", strerror(ret));
+	}
+	enc->stop = 1;
+	if((ret = pthread_cond_signal(&enc->cond))) {
+		ERROR_OUT("Error signaling depth encoder: %s\n", strerror(ret));
+	}
+	if((ret = pthread_mutex_unlock(&enc->lock))) {
+		ERROR_OUT("Error unlocking depth encoder: %s\n", strerror(ret));
+	}
+
+	if((ret = nl_join_thread(enc->thread, NULL))) {
+		ERROR_OUT("Error joining depth encoder thread: %s\n", strerror(ret));
+	}
+
+	pthread_cond_destroy(&enc->cond);
+	pthread_mutex_destroy(&enc->lock);
+	free(enc->packed);
+	free(enc->cur);
+	free(enc->prev);
+	free(enc->delta);
+	free(enc->key);
+	free(enc);
+}
+
+/*
+ * Gives a new 11-bit packed depth frame to the encoder.  The frame is copied
+ * only if there are subscribers and the encoder is idle; frames that arrive
+ * while the previous frame is being compressed or sent are skipped.  Call
+ * from any thread.
+ */
+void depth_encoder_frame(struct depth_encoder *enc, const uint8_t *buffer)
+{
+	int ret;
+
+	if((ret = pthread_mutex_lock(&enc->lock))) {
+		ERROR_OUT("Error locking depth encoder: %s\n", strerror(ret));
+		return;
+	}
+	if(enc->active && !enc->pending && !enc->working && !enc->ready) {
+		memcpy(enc->packed, buffer, KND_DEPTH_SIZE);
+		enc->pending = 1;
+		if((ret = pthread_cond_signal(&enc->cond))) {
+			ERROR_OUT("Error signaling depth encoder: %s\n", strerror(ret));
+		}
+	}
+	if((ret = pthread_mutex_unlock(&enc->lock))) {
+		ERROR_OUT("Error unlocking depth encoder: %s\n", strerror(ret));
+	}
+}
+
+/*
+ * Adds (or with a negative count, removes) count compressed subscribers, of
+ * which key_count receive only key frames (e.g. due to a rate limit).  The
+ * encoder runs while there are any subscribers.
+ */
+void depth_encoder_add_clients(struct depth_encoder *enc, int count, int key_count)
+{
+	int ret;
+
+	if((ret = pthread_mutex_lock(&enc->lock))) {
+		ERROR_OUT("Error locking depth encoder: %s\n", strerror(ret));
+		return;
+	}
+	enc->active += count;
+	enc->key_clients += key_count;
+	if((ret = pthread_mutex_unlock(&enc->lock))) {
+		ERROR_OUT("Error unlocking depth encoder: %s\n", strerror(ret));
+	}
+}
+
+/*
+ * Requests a key frame for the next compressed frame (e.g. for a new
+ * subscriber).
+ */
+void depth_encoder_request_key(struct depth_encoder *enc)
+{
+	int ret;
+
+	if((ret = pthread_mutex_lock(&enc->lock))) {
+		ERROR_OUT("Error locking depth encoder: %s\n", strerror(ret));
+		return;
+	}
+	enc->key_requested = 1;
+	if((ret = pthread_mutex_unlock(&enc->lock))) {
+		ERROR_OUT("Error unlocking depth encoder: %s\n", strerror(ret));
+	}
+}
+
+/*
+ * Retrieves the most recently compressed frame, if it has not been retrieved
+ * already.  Stores the frame's sequence number in *seq (sequence numbers
+ * increase by one for each frame the encoder compresses) and the delta and key
+ * frame data and sizes in *delta, *delta_size, *key, and *key_size.  A size is
+ * 0 if that type of frame was not generated.  A delta frame must be decoded
+ * using the frame with the previous sequence number as its reference.  Call
+ * release_depth_encoder() when finished with the data.  Returns 1 if a frame
+ * was retrieved, 0 if there is no new frame (do not call
+ * release_depth_encoder()), or -1 on error.
+ */
+int get_depth_encoder_frame(struct depth_encoder *enc, unsigned int *seq,
+		const uint8_t **delta, size_t *delta_size, const uint8_t **key, size_t *key_size)
+{
+	int ready;
+	int ret;
+
+	if((ret = pthread_mutex_lock(&enc->lock))) {
+		ERROR_OUT("Error locking depth encoder: %s\n", strerror(ret));
+		return -1;
+	}
+
+	ready = enc->ready;
+	*seq = enc->seq;
+
+	if((ret = pthread_mutex_unlock(&enc->lock))) {
+		ERROR_OUT("Error unlocking depth encoder: %s\n", strerror(ret));
+	}
+
+	// The encoder thread doesn't touch the buffers until ready is cleared
+	*delta = enc->delta;
+	*delta_size = enc->delta_size;
+	*key = enc->key;
+	*key_size = enc->key_size;
+
+	return ready;
+}
+
+/*
+ * Allows the encoder to compress the next frame after a frame was retrieved
+ * with get_depth_encoder_frame().
+ */
+void release_depth_encoder(struct depth_encoder *enc)
+{
+	int ret;
+
+	if((ret = pthread_mutex_lock(&enc->lock))) {
+		ERROR_OUT("Error locking depth encoder: %s\n", strerror(ret));
+		return;
+	}
+	enc->ready = 0;
+	if((ret = pthread_cond_signal(&enc->cond))) {
+		ERROR_OUT("Error signaling depth encoder: %s\n", strerror(ret));
+	}
+	if((ret = pthread_mutex_unlock(&enc->lock))) {
+		ERROR_OUT("Error unlocking depth encoder: %s\n", strerror(ret));
+	}
+}
@@ -0,0 +1,267 @@
+/*
+ * freenect_src.c - libfreenect (Kinect) frame source for vidproc
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <libusb-1.0/libusb.h>
+
+#include "knd.h"
+
+struct freenect_src {
+	struct vidproc_info *vid;
+
+	libusb_context *camera_usb;
+	libusb_context *motor_usb;
+	freenect_context *camera_ctx;
+	freenect_context *motor_ctx;
+	freenect_device *camera_dev;
+	freenect_device *motor_dev;
+
+	unsigned int motor_missing:1;
+};
+
+static void fn_depth_callback(freenect_device *dev, void *depthbuf, uint32_t timestamp)
+{
+	struct freenect_src *src = freenect_get_user(dev);
+	vidproc_depth_frame(src->vid, depthbuf, timestamp);
+}
+
+static void fn_video_callback(freenect_device *dev, void *videobuf, uint32_t timestamp)
+{
+	struct freenect_src *src = freenect_get_user(dev);
+	vidproc_video_frame(src->vid, videobuf, timestamp);
+}
+
+// libfreenect logging callback
+static void log_callback(freenect_context *ctx, freenect_loglevel level, const char *msg)
+{
+	static const char * const levels[] = {
+		"fatal error",
+		"error",
+		"warning",
+		"notice",
+		"info",
+		"debug",
+		"spew",
+		"flood",
+	};
+
+	nl_ptmf("Camera %s: %s", levels[level], msg);
+}
+
+static void fn_cleanup(void *data)
+{
+	struct freenect_src *src = data;
+
+	if(CHECK_NULL(src)) {
+		return;
+	}
+
+	if(src->motor_dev != NULL) {
+		if(!src->motor_missing) {
+			freenect_set_led(src->motor_dev, LED_OFF);
+		}
+		freenect_close_device(src->motor_dev);
+	}
+	if(src->motor_ctx != NULL) {
+		freenect_shutdown(src->motor_ctx);
+	}
+
+	if(src->camera_dev != NULL) {
+		freenect_stop_depth(src->camera_dev);
+		freenect_stop_video(src->camera_dev);
+		freenect_close_device(src->camera_dev);
+	}
+	if(src->camera_ctx != NULL) {
+		freenect_shutdown(src->camera_ctx);
+	}
+
+	if(src->motor_usb != NULL) {
+		libusb_exit(src->motor_usb);
+	}
+	if(src->camera_usb != NULL) {
+		libusb_exit(src->camera_usb);
+	}
+
+	free(src);
+}
+
+/*
+ * Initializes libfreenect and opens the camera whose zero-based index is given
+ * in args (defaults to 0).
+ */
+static void *fn_init(struct vidproc_info *vid, const char *args)
+{
+	struct freenect_src *src;
+	int devcount, devindex;
+	int ret;
+
+	devindex = atoi(args);
+
+	src = calloc(1, sizeof(struct freenect_src));
+	if(src == NULL) {
+		ERRNO_OUT("Error allocating memory for libfreenect source");
+		return NULL;
+	}
+	src->vid = vid;
+
+	if((ret = libusb_init(&src->camera_usb)) != 0) {
+		ERROR_OUT("Error initializing libusb camera context: %d.\n", ret);
+		goto error;
+	}
+	if((ret = libusb_init(&src->motor_usb)) != 0) {
+		ERROR_OUT("Error initializing libusb motor context: %d.\n", ret);
+		goto error;
+	}
+
+	if(freenect_init(&src->motor_ctx, src->motor_usb) < 0) {
+		ERROR_OUT("Error initializing libfreenect motor context.\n");
+		goto error;
+	}
+	if(freenect_init(&src->camera_ctx, src->camera_usb) < 0) {
+		ERROR_OUT("Error initializing libfreenect camera context.\n");
+		goto error;
+	}
+
+	if(getenv("KND_LOG_LEVEL") != NULL) {
+		freenect_set_log_level(src->motor_ctx, CLAMP(FREENECT_LOG_FATAL, FREENECT_LOG_FLOOD, atoi(getenv("KND_LOG_LEVEL"))));
+		freenect_set_log_level(src->camera_ctx, CLAMP(FREENECT_LOG_FATAL, FREENECT_LOG_FLOOD, atoi(getenv("KND_LOG_LEVEL"))));
+	} else {
+		freenect_set_log_level(src->motor_ctx, FREENECT_LOG_ERROR);
+		freenect_set_log_level(src->camera_ctx, FREENECT_LOG_ERROR);
+	}
+	freenect_set_log_callback(src->motor_ctx, log_callback);
+	freenect_set_log_callback(src->camera_ctx, log_callback);
+
+	freenect_select_subdevices(src->motor_ctx, FREENECT_DEVICE_MOTOR);
+	freenect_select_subdevices(src->camera_ctx, FREENECT_DEVICE_CAMERA);
+
+	devcount = freenect_num_devices(src->camera_ctx);
+	if(devcount == 0) {
+		ERROR_OUT("No depth cameras were found.\n");
+		goto error;
+	}
+	if(devcount <= devindex) {
+		ERROR_OUT("Requested depth camera %d (zero-indexed) does not exist (there are %d total).\n",
+				devindex, devcount);
+		goto error;
+	}
+
+	// TODO: Use USB IDs to distinguish between K4Xbox old, K4Xbox new, and K4W
+	if(freenect_open_device(src->motor_ctx, &src->motor_dev, devindex) < 0) {
+		INFO_OUT("Opening motor %d (zero-indexed) failed.  Trying again.\n", devindex);
+		usleep(500000);
+		if(freenect_open_device(src->motor_ctx, &src->motor_dev, devindex) < 0) {
+			INFO_OUT("Opening motor failed.  Operating without tilt and LED support.\n");
+			src->motor_missing = 1;
+		}
+	}
+	if(!src->motor_missing) {
+		freenect_set_user(src->motor_dev, src);
+	}
+
+	if(freenect_open_device(src->camera_ctx, &src->camera_dev, devindex) < 0) {
+		INFO_OUT("Opening camera %d (zero-indexed) failed.  Trying again.\n", devindex);
+		usleep(500000);
+		if(freenect_open_device(src->camera_ctx, &src->camera_dev, devindex) < 0) {
+			ERROR_OUT("Error opening depth camera %d (zero-indexed).\n", devindex);
+			goto error;
+		}
+	}
+
+	freenect_set_user(src->camera_dev, src);
+	freenect_set_depth_callback(src->camera_dev, fn_depth_callback);
+	if(freenect_set_depth_mode(src->camera_dev, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT_PACKED))) {
+		ERROR_OUT("Error setting depth resolution and image format.\n");
+		goto error;
+	}
+	freenect_set_video_callback(src->camera_dev, fn_video_callback);
+	// TODO: Other video formats
+	if(freenect_set_video_mode(src->camera_dev, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, KND_VIDEO_FORMAT))) {
+		ERROR_OUT("Error setting video resolution and image format.\n");
+		goto error;
+	}
+
+	if(!src->motor_missing) {
+		vidproc_set_motor(vid, 1, freenect_get_tilt_degs(freenect_get_tilt_state(src->motor_dev)));
+	}
+
+	if(freenect_start_depth(src->camera_dev)) {
+		ERROR_OUT("Error starting depth processing.\n");
+		goto error;
+	}
+
+	return src;
+
+error:
+	fn_cleanup(src);
+	return NULL;
+}
+
+/*
+ * Processes USB events for the camera (blocking) and motor (non-blocking).
+ * Returns 0 on success, -1 if there was any error other than an interrupted
+ * system call (which happens frequently under some code profiling tools).
+ */
+static int fn_doevents(void *data)
+{
+	struct freenect_src *src = data;
+	int ret;
+
+	ret = freenect_process_events(src->camera_ctx);
+	if(ret && ret != LIBUSB_ERROR_INTERRUPTED) {
+		return -1;
+	}
+
+	ret = freenect_process_events_timeout(src->motor_ctx,
+			&(struct timeval){.tv_sec = 0, .tv_usec = 0});
+	if(ret && ret != LIBUSB_ERROR_INTERRUPTED) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int fn_set_video(void *data, int enable)
+{
+	struct freenect_src *src = data;
+
+	if(enable) {
+		if(freenect_start_video(src->camera_dev)) {
+			ERROR_OUT("Error starting video processing.\n");
+			return -1;
+		}
+	} else {
+		if(freenect_stop_video(src->camera_dev)) {
+			ERROR_OUT("Error stopping video processing.\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void fn_set_led(void *data, freenect_led_options led)
+{
+	struct freenect_src *src = data;
+	freenect_set_led(src->motor_dev, led);
+}
+
+static void fn_set_tilt(void *data, int tilt)
+{
+	struct freenect_src *src = data;
+	freenect_set_tilt_degs(src->motor_dev, tilt);
+}
+
+const struct vidproc_source freenect_source = {
+	.name = "freenect",
+	.init = fn_init,
+	.cleanup = fn_cleanup,
+	.doevents = fn_doevents,
+	.set_video = fn_set_video,
+	.set_led = fn_set_led,
+	.set_tilt = fn_set_tilt,
+	.reconnect = 1,
+};
@@ -13,9 +13,16 @@
 #include <ucontext.h>
 #include <sys/syscall.h>//XXX
 #include <dlfcn.h>
+#include <limits.h>
 
 #include "knd.h"
 
+#define WATCHDOG_TRACE_FILENAME "watchdog_trace.json" // Saved in the data directory on timeout
+#define WATCHDOG_TRACE_SECONDS 5
+
+#define RECONNECT_MIN_MS 100 // First delay between attempts to reopen a lost camera
+#define RECONNECT_MAX_MS 2000 // Longest delay between attempts to reopen a lost camera
+
 // Design goals/ideas:
 // - Accept multiple TCP/IP connections (UNIX domain as well?)
 // - Ability to listen on just localhost, a specific interface, or all
@@ -84,10 +91,19 @@
 static void watchdog_callback(void *data, struct timespec *interval)
 {
 	struct knd_info *info = data;
+	char path[PATH_MAX];
 
 	ERROR_OUT("Timed out: at least %ld.%09lds since last update.\n", (long)interval->tv_sec, (long)interval->tv_nsec);
 
 	if(!info->stop) {
+		// Keep a record of what each thread was doing before the stall
+		if(info->savedir != NULL) {
+			snprintf(path, sizeof(path), "%s/%s", info->savedir, WATCHDOG_TRACE_FILENAME);
+			if(!save_trace(path, WATCHDOG_TRACE_SECONDS)) {
+				ERROR_OUT("Saved the last %d seconds of trace events to '%s'.\n", WATCHDOG_TRACE_SECONDS, path);
+			}
+		}
+
 		pthread_kill(info->thread_ctx->main_thread, SIGUSR2);
 		info->stop = 1;
 	} else {
@@ -101,43 +117,92 @@ static void watchdog_callback(void *data, struct timespec *interval)
 static void depth_callback(uint8_t *buffer, void *data)
 {
 	struct knd_info *info = data;
-	struct timespec this_time;
 
 	kick_watchdog(info->wd);
 
+	trace_begin("zone_update");
 	update_zonelist_depth(info->zones, buffer);
+	trace_end("zone_update");
+	record_latency(info->latency, LATENCY_ZONES, info->depth_arrival);
 
-	// Calculate frame rate (TODO: do this in another thread so the fps
-	// goes to 0 when data stops coming)
-	info->frames++;
-	clock_gettime(CLOCK_MONOTONIC, &this_time);
-	if(this_time.tv_sec > info->next_time.tv_sec ||
-			(this_time.tv_sec == info->next_time.tv_sec &&
-			 this_time.tv_nsec > info->next_time.tv_nsec)) {
-		info->fps = info->frames * 100 /
-			((this_time.tv_sec - info->last_time.tv_sec) * 100 +
-			 (this_time.tv_nsec - info->last_time.tv_nsec) / 10000000);
-		info->last_time = this_time;
-		info->next_time = info->last_time;
-		info->next_time.tv_nsec += 200000000;
-		if(info->next_time.tv_nsec >= 1000000000) {
-			info->next_time.tv_nsec -= 1000000000;
-			info->next_time.tv_sec++;
-		}
-		info->frames = 0;
+	if(info->shm != NULL) {
+		publish_shm_depth(info->shm, buffer, info->zones);
+	}
+	if(info->mcast != NULL) {
+		publish_multicast(info->mcast, info->zones);
 	}
 
 	// Tell the server to process subscriptions
-	kndsrv_send_depth(info->srv);
+	kndsrv_send_depth(info->srv, buffer);
 }
 
 static void video_callback(uint8_t *buffer, void *data)
 {
 	struct knd_info *info = data;
+	trace_begin("zone_video");
 	update_zonelist_video(info->zones, buffer);
+	trace_end("zone_video");
+	if(info->shm != NULL) {
+		publish_shm_video(info->shm, buffer);
+	}
 	kndsrv_send_video(info->srv);
 }
 
+/*
+ * Reopens the frame source after vidproc_doevents() fails, retrying with
+ * exponential backoff until it succeeds or knd is told to stop.  The server,
+ * zones, and client connections are left running, and clients are sent
+ * CAMERA lines when the camera is lost and found.  The watchdog uses the
+ * initialization timeout until the source is open again.  Returns 0 once the
+ * source is open, -1 if the source doesn't support reconnection or knd is
+ * stopping.
+ */
+static int reconnect_source(struct knd_info *info, float init_timeout, float run_timeout)
+{
+	uint64_t start, elapsed;
+	long delay = RECONNECT_MIN_MS;
+	int attempts = 0;
+
+	if(info->stop || !vidproc_can_reopen(info->vid)) {
+		return -1;
+	}
+
+	ERROR_OUT("Lost the camera.  Reconnecting without stopping the server.\n");
+	start = latency_now();
+	kndsrv_set_camera(info->srv, 0);
+
+	set_watchdog_timeout(
+			info->wd,
+			&(struct timespec){ .tv_sec = (int)init_timeout,
+			.tv_nsec = (int)((init_timeout - (int)init_timeout) * 1000000000) });
+
+	while(!info->stop) {
+		kick_watchdog(info->wd);
+		attempts++;
+
+		if(!vidproc_reopen(info->vid)) {
+			elapsed = (latency_now() - start) / 1000000;
+			nl_ptmf("Reconnected to the camera after %d attempt(s) in %llums.\n",
+					attempts, (unsigned long long)elapsed);
+
+			kick_watchdog(info->wd);
+			set_watchdog_timeout(
+					info->wd,
+					&(struct timespec){ .tv_sec = (int)run_timeout,
+					.tv_nsec = (int)((run_timeout - (int)run_timeout) * 1000000000) });
+			kndsrv_set_camera(info->srv, 1);
+
+			return 0;
+		}
+
+		// Interrupted by a signal if knd is told to stop
+		nanosleep(&(struct timespec){ .tv_sec = delay / 1000, .tv_nsec = delay % 1000 * 1000000 }, NULL);
+		delay = MIN_NUM(delay * 2, RECONNECT_MAX_MS);
+	}
+
+	return -1;
+}
+
 /*
  * Signal handler and its data.
  */
@@ -188,8 +253,17 @@ int main(int argc, char *argv[])
 {
 	struct knd_info *info;
 	const char *savedir = NULL;
+	const char *source = NULL;
+	const char *record = NULL;
+	const char *shm_name = NULL;
+	const char *socket_spec = NULL;
+	const char *mcast_spec = NULL;
 	int savetime = 2;
-	float init_timeout = 7, run_timeout = 0.75;
+	int server_threads = 1;
+	int metrics_port = 0;
+	int port = 0;
+	double state_max_age = 30;
+	float init_timeout = 7, run_timeout = 0.75, soft_timeout = 0.1;
 
 	if(argc == 2 && !strcmp(argv[1], "--help")) {
 		printf("Usage:\n");
@@ -197,7 +271,17 @@ int main(int argc, char *argv[])
 		printf("\nEnvironment variables:\n");
 		printf("\tKND_INITTIMEOUT - Initialization timeout (defaults to 7 seconds)\n");
 		printf("\tKND_RUNTIMEOUT - Runtime timeout (defaults to 0.75 seconds)\n");
+		printf("\tKND_SOFTTIMEOUT - Warns when the average depth frame interval exceeds this (defaults to 0.1 seconds; 0 disables)\n");
 		printf("\tKND_SAVEDIR - Sets data location (no default; zones are not saved without this variable)\n");
+		printf("\tKND_SOURCE - Frame source (defaults to freenect:0; see README for replay and synth)\n");
+		printf("\tKND_RECORD - Records depth to a file from startup (path[,key=N][,video]; see README)\n");
+		printf("\tKND_SHM - Publishes frames and zone results to a shared memory object (e.g. /knd; see README)\n");
+		printf("\tKND_SOCKET - Also listens on a UNIX domain socket (path[,mode=octal][,uid=N][,gid=N]; see README)\n");
+		printf("\tKND_MULTICAST - Sends zone state to a multicast group (group[:port][,ttl=N][,iface=addr][,refresh=ms]; see README)\n");
+		printf("\tKND_PORT - TCP port for client connections (defaults to 14308)\n");
+		printf("\tKND_THREADS - Number of event loop threads for client connections (defaults to 1)\n");
+		printf("\tKND_METRICS_PORT - Serves Prometheus metrics over HTTP on this port (e.g. 9100; see README)\n");
+		printf("\tKND_STATE_MAXAGE - Restores zone occupancy saved up to this long before a restart (defaults to 30 seconds; 0 disables)\n");
 		printf("\nExample:\n");
 		printf("\tKND_SAVEDIR=/var/tmp %s\n", argv[0]);
 		exit(0);
@@ -215,11 +299,61 @@ int main(int argc, char *argv[])
 		nl_ptmf("Setting run timeout to %f\n", run_timeout);
 	}
 
+	if(getenv("KND_SOFTTIMEOUT") != NULL) {
+		soft_timeout = atof(getenv("KND_SOFTTIMEOUT"));
+		nl_ptmf("Setting soft timeout to %f\n", soft_timeout);
+	}
+
 	if(getenv("KND_SAVEDIR") != NULL) {
 		savedir = getenv("KND_SAVEDIR");
 		nl_ptmf("Setting save location to '%s'\n", savedir);
 	}
 
+	if(getenv("KND_SOURCE") != NULL) {
+		source = getenv("KND_SOURCE");
+		nl_ptmf("Setting frame source to '%s'\n", source);
+	}
+
+	if(getenv("KND_RECORD") != NULL) {
+		record = getenv("KND_RECORD");
+		nl_ptmf("Setting recording to '%s'\n", record);
+	}
+
+	if(getenv("KND_SHM") != NULL) {
+		shm_name = getenv("KND_SHM");
+		nl_ptmf("Setting shared memory object to '%s'\n", shm_name);
+	}
+
+	if(getenv("KND_SOCKET") != NULL) {
+		socket_spec = getenv("KND_SOCKET");
+		nl_ptmf("Setting local socket to '%s'\n", socket_spec);
+	}
+
+	if(getenv("KND_MULTICAST") != NULL) {
+		mcast_spec = getenv("KND_MULTICAST");
+		nl_ptmf("Setting multicast group to '%s'\n", mcast_spec);
+	}
+
+	if(getenv("KND_PORT") != NULL) {
+		port = atoi(getenv("KND_PORT"));
+		nl_ptmf("Setting client port to %d\n", port);
+	}
+
+	if(getenv("KND_THREADS") != NULL) {
+		server_threads = atoi(getenv("KND_THREADS"));
+		nl_ptmf("Setting client event loop threads to %d\n", server_threads);
+	}
+
+	if(getenv("KND_METRICS_PORT") != NULL) {
+		metrics_port = atoi(getenv("KND_METRICS_PORT"));
+		nl_ptmf("Setting metrics port to %d\n", metrics_port);
+	}
+
+	if(getenv("KND_STATE_MAXAGE") != NULL) {
+		state_max_age = atof(getenv("KND_STATE_MAXAGE"));
+		nl_ptmf("Setting state checkpoint maximum age to %f\n", state_max_age);
+	}
+
 	// TODO: KND_SAVETIME -- save interval in seconds
 
 	init_lut();
@@ -242,6 +376,19 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	// Latency measurement is optional, so failure isn't fatal
+	info->latency = create_latency();
+	if(info->latency == NULL) {
+		ERROR_OUT("Error creating latency histograms; latency will not be measured.\n");
+	}
+
+	// Also computes the frame rate; the fps command reports 0 if this fails
+	info->stats = create_stats(info);
+	if(info->stats == NULL) {
+		ERROR_OUT("Error starting frame statistics; frame rate will not be available.\n");
+	}
+
+	info->savedir = savedir;
 	if(savedir != NULL) {
 		nl_ptmf("Initializing zone persistence.\n");
 		info->save = init_save(info, info->zones, savedir, &(struct timespec){.tv_sec = savetime, .tv_nsec = 0});
@@ -258,6 +405,7 @@ int main(int argc, char *argv[])
 	sigemptyset(&crash_action.sa_mask);
 	if(signal(SIGTERM, intr) == SIG_ERR ||
 			signal(SIGINT, intr) == SIG_ERR ||
+			signal(SIGPIPE, SIG_IGN) == SIG_ERR ||
 			sigaction(SIGFPE, &crash_action, NULL) ||
 			sigaction(SIGILL, &crash_action, NULL) ||
 			sigaction(SIGBUS, &crash_action, NULL) ||
@@ -268,14 +416,30 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	info->server_threads = server_threads;
+
 	nl_ptmf("Creating server.\n");
-	info->srv = kndsrv_create(info, 0);
+	info->srv = kndsrv_create(info, port > 0 && port <= 65535 ? port : 0);
 	if(info->srv == NULL) {
 		ERROR_OUT("Error creating server.");
 		free(info);
 		return -1;
 	}
 
+	if(socket_spec != NULL && kndsrv_listen_unix(info->srv, socket_spec)) {
+		ERROR_OUT("Error listening on local socket.\n");
+		kndsrv_destroy(info->srv);
+		free(info);
+		return -1;
+	}
+
+	if(metrics_port > 0 && metrics_port <= 65535 && kndsrv_listen_metrics(info->srv, metrics_port)) {
+		ERROR_OUT("Error listening for metrics requests.\n");
+		kndsrv_destroy(info->srv);
+		free(info);
+		return -1;
+	}
+
 	nl_ptmf("Creating watchdog.\n");
 	info->wd = create_watchdog(
 			info,
@@ -291,25 +455,60 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
-	clock_gettime(CLOCK_MONOTONIC, &info->last_time);
-	info->next_time = info->last_time;
-	info->next_time.tv_nsec += 500000000;
-	if(info->next_time.tv_nsec >= 1000000000) {
-		info->next_time.tv_nsec -= 1000000000;
-		info->next_time.tv_sec++;
+	if(kndsrv_monitor_loops(info->srv, info->wd)) {
+		ERROR_OUT("Error monitoring server event loops; stalls will not be detected.\n");
 	}
 
 	// TODO: Tilt camera up and down a few degrees to re-align motor
 
+	if(shm_name != NULL) {
+		info->shm = create_shm(shm_name);
+		if(info->shm == NULL) {
+			ERROR_OUT("Error creating shared memory object.\n");
+			destroy_watchdog(info->wd);
+			free(info);
+			return -1;
+		}
+	}
+
+	if(mcast_spec != NULL) {
+		info->mcast = create_multicast(mcast_spec);
+		if(info->mcast == NULL) {
+			ERROR_OUT("Error creating multicast publisher.\n");
+			destroy_shm(info->shm);
+			destroy_watchdog(info->wd);
+			free(info);
+			return -1;
+		}
+	}
+
 	nl_ptmf("Starting video processing.\n");
-	info->vid = init_vidproc(info, 0, depth_callback, info, video_callback, info);
+	info->vid = init_vidproc(info, source, depth_callback, info, video_callback, info);
 	if(info->vid == NULL) {
 		ERROR_OUT("Error initializing video processing.\n");
+		destroy_multicast(info->mcast);
+		destroy_shm(info->shm);
 		destroy_watchdog(info->wd);
 		free(info);
 		return -1;
 	}
 
+	if(record != NULL) {
+		char path[PATH_MAX];
+		struct knd_recorder *rec;
+
+		snprintf(path, sizeof(path), "%.*s", (int)strcspn(record, ","), record);
+		record += strcspn(record, ",");
+
+		nl_ptmf("Starting recording.\n");
+		rec = create_recorder(info, path, vidproc_get_int_opt(record, "key", 0));
+		if(rec == NULL) {
+			ERROR_OUT("Error starting recording.\n");
+		} else {
+			vidproc_set_recorder(info->vid, rec, vidproc_get_opt(record, "video", NULL, 0));
+		}
+	}
+
 	if(savedir != NULL) {
 		nl_ptmf("Loading saved zones.\n");
 		int zone_count = load_zones(info->save);
@@ -318,12 +517,21 @@ int main(int argc, char *argv[])
 		} else {
 			nl_ptmf("Loaded %d zone(s).\n", zone_count);
 		}
+
+		// Occupancy continuity is nice to have, so failure isn't fatal
+		info->checkpoint = create_checkpoint(info, savedir, state_max_age);
+		if(info->checkpoint == NULL) {
+			ERROR_OUT("Error starting state checkpoints; zone state will not survive restarts.\n");
+		}
 	}
 
 	nl_ptmf("Starting server.\n");
 	if(kndsrv_run(info->srv)) {
 		ERROR_OUT("Error starting server.\n");
+		destroy_checkpoint(info->checkpoint);
 		cleanup_vidproc(info->vid);
+		destroy_multicast(info->mcast);
+		destroy_shm(info->shm);
 		destroy_watchdog(info->wd);
 		destroy_zonelist(info->zones);
 		free(info);
@@ -334,10 +542,14 @@ int main(int argc, char *argv[])
 			info->wd,
 			&(struct timespec){ .tv_sec = (int)run_timeout,
 			.tv_nsec = (int)((run_timeout - (int)run_timeout) * 1000000000) });
+	set_watchdog_soft_limit(
+			info->wd,
+			&(struct timespec){ .tv_sec = (int)soft_timeout,
+			.tv_nsec = (int)((soft_timeout - (int)soft_timeout) * 1000000000) });
 
 	nl_ptmf("Starting event processing.\n");
 	while(!info->stop) {
-		if(vidproc_doevents(info->vid)) {
+		if(vidproc_doevents(info->vid) && reconnect_source(info, init_timeout, run_timeout)) {
 			break;
 		}
 	}
@@ -351,9 +563,24 @@ int main(int argc, char *argv[])
 		cleanup_save(info->save);
 	}
 
+	if(info->checkpoint != NULL) {
+		nl_ptmf("Checkpointing zone state.\n");
+		destroy_checkpoint(info->checkpoint);
+	}
+
 	nl_ptmf("Stopping video processing.\n");
 	cleanup_vidproc(info->vid);
 
+	if(info->shm != NULL) {
+		nl_ptmf("Removing shared memory object.\n");
+		destroy_shm(info->shm);
+	}
+
+	if(info->mcast != NULL) {
+		nl_ptmf("Closing multicast publisher.\n");
+		destroy_multicast(info->mcast);
+	}
+
 	nl_ptmf("Destroying server.\n");
 	kndsrv_destroy(info->srv);
 
@@ -361,7 +588,9 @@ int main(int argc, char *argv[])
 	destroy_watchdog(info->wd);
 
 	nl_ptmf("Cleaning up.\n");
+	destroy_stats(info->stats);
 	destroy_zonelist(info->zones);
+	destroy_latency(info->latency);
 	nl_destroy_thread_context(info->thread_ctx);
 	free(info);
 
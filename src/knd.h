@@ -46,12 +46,38 @@
 
 
 struct knd_watchdog;
+struct knd_loop_monitor;
+struct latency_stats;
 struct vidproc_info;
 struct zone;
 struct zonelist;
 struct knd_server;
 struct knd_client;
 struct save_info;
+struct knd_recorder;
+struct knd_recording;
+struct depth_encoder;
+struct knd_shm;
+struct knd_multicast;
+struct knd_latency;
+struct knd_stats;
+struct knd_metrics;
+struct knd_checkpoint;
+
+/*
+ * Running frame totals, updated atomically by the threads that handle the
+ * frames and sampled by stats.c.
+ */
+struct knd_frame_counts {
+	uint64_t depth_received; // Depth frames from the frame source
+	uint64_t depth_dropped; // Depth frames dropped because the depth thread was busy
+	uint64_t depth_processed; // Depth frames passed to the depth callback
+	uint64_t depth_published; // Depth frames published to clients by the server
+	uint64_t depth_sent; // DEPTH messages sent to clients
+	uint64_t video_received; // Video frames from the frame source
+	uint64_t video_starts; // Times video was started for a request
+	uint64_t video_start_us; // Total time from video requests to their first frame
+};
 
 /*
  * Server/program state.
@@ -62,15 +88,20 @@ struct knd_info {
 	struct knd_watchdog *wd;
 	struct vidproc_info *vid;
 	struct knd_server *srv;
+	struct knd_shm *shm; // Shared memory publication (NULL if disabled)
+	struct knd_multicast *mcast; // Multicast zone publication (NULL if disabled)
+	int server_threads; // Number of client event loop threads (KND_THREADS)
+	struct knd_latency *latency; // Depth pipeline latency histograms (may be NULL)
+	uint64_t depth_arrival; // Arrival time of the frame in the depth callback (depth thread only)
 
-	// Framerate tracking (TODO: locking to make drd/helgrind happy)
-	int frames;
-	int fps;
-	struct timespec last_time;
-	struct timespec next_time;
+	struct knd_frame_counts counts; // Frame totals (accessed atomically)
+	struct knd_stats *stats; // Frame statistics sampling (may be NULL)
+	int fps; // Processed depth frame rate, updated by stats.c
 
 	struct zonelist *zones; // Global zone list
 	struct save_info *save; // Zone-saving info for the global zone list
+	const char *savedir; // Data directory (NULL if not saving)
+	struct knd_checkpoint *checkpoint; // Runtime state checkpoints (NULL if not saving)
 
 	volatile unsigned int stop:1;	  // Set to 1 to stop main loop
 	volatile unsigned int crashing:1; // Set to 1 if a crash handler has been called
@@ -131,6 +162,16 @@ struct zone {
 	int (*may_contain)(int x, int y, int z); // pixels
 };
 
+/*
+ * Saved parameters of a zone (see add_zones()).  Stored as-is in binary zone
+ * files, so fields may only be added at the end.
+ */
+struct zone_params {
+	char name[ZONE_NAME_LENGTH];
+	int32_t xmin, ymin, zmin, xmax, ymax, zmax; // World-space millimeters
+	int32_t param, rising_threshold, falling_threshold, rising_delay, falling_delay;
+};
+
 /*
  * List of zones.
  */
@@ -147,6 +188,10 @@ struct zonelist {
 	int count;
 	unsigned int version; // Overflow is okay if versions are assumed to be unordered
 
+	// Called with the lock held whenever version changes (see set_zonelist_notify())
+	void (*notify)(void *data);
+	void *notify_data;
+
 	int xskip;
 	int yskip;
 
@@ -195,7 +240,8 @@ struct knd_watchdog *create_watchdog(struct knd_info *knd, struct timespec *inte
 void destroy_watchdog(struct knd_watchdog *wd);
 
 /*
- * Resets the given watchdog's timeout countdown.  Doesn't check for a NULL
+ * Resets the given watchdog's timeout countdown, and records the time since
+ * the previous kick.  Never locks or allocates.  Doesn't check for a NULL
  * watchdog.
  */
 void kick_watchdog(struct knd_watchdog *wd);
@@ -206,6 +252,64 @@ void kick_watchdog(struct knd_watchdog *wd);
  */
 void set_watchdog_timeout(struct knd_watchdog *wd, struct timespec *timeout);
 
+/*
+ * Sets the rolling average interval between kicks above which the watchdog
+ * logs a warning (and below 3/4 of which it logs a recovery).  A zero limit
+ * disables the warning.
+ */
+void set_watchdog_soft_limit(struct knd_watchdog *wd, struct timespec *limit);
+
+/*
+ * Fills *intervals with statistics of the intervals between kicks, in
+ * microseconds, and stores the rolling average interval and jitter (standard
+ * deviation) in *average and *jitter.
+ */
+void get_watchdog_intervals(struct knd_watchdog *wd, struct latency_stats *intervals,
+		uint64_t *average, uint64_t *jitter);
+
+/*
+ * Adds a monitor for an event loop that will call loop_heartbeat() every
+ * interval_ms.  The watchdog logs the loop as stalled when a heartbeat is
+ * more than threshold_ms late.  The monitor belongs to the watchdog and is
+ * freed by destroy_watchdog().  Stalls are not detected until the first
+ * heartbeat.  Returns NULL on error.
+ */
+struct knd_loop_monitor *add_loop_monitor(struct knd_watchdog *wd, const char *name,
+		unsigned int interval_ms, unsigned int threshold_ms);
+
+/*
+ * Records a heartbeat from the monitored event loop, and how late it was.
+ * Call from the loop's thread every interval given to add_loop_monitor().
+ * Never allocates or locks.
+ */
+void loop_heartbeat(struct knd_loop_monitor *mon);
+
+/*
+ * Tells the watchdog that the monitored event loop has stopped on purpose, so
+ * missing heartbeats are not stalls.  The next heartbeat starts monitoring
+ * again.
+ */
+void stop_loop_monitor(struct knd_loop_monitor *mon);
+
+/*
+ * Sets what the monitored event loop is doing, to be logged if it stalls.
+ * The activity must be a string constant, or NULL when the loop returns to
+ * waiting for events.  Ignores a NULL mon.
+ */
+void set_loop_activity(struct knd_loop_monitor *mon, const char *activity);
+
+/*
+ * Fills *lateness with statistics of how late the monitored loop's heartbeats
+ * were, in microseconds.  Returns the number of stalls.
+ */
+uint64_t get_loop_stats(struct knd_loop_monitor *mon, struct latency_stats *lateness);
+
+/*
+ * Clears the heartbeat lateness histogram and stall count of the given
+ * monitor.
+ */
+void reset_loop_stats(struct knd_loop_monitor *mon);
+
 
 /***** vidproc.c *****/
 
@@ -239,28 +343,49 @@ float surface_area(float z);
 void init_lut();
 
 /*
- * Initializes libfreenect and opens the devindex-th camera.  If depth_cb
- * and/or video_cb are not NULL, then they will be called for every frame
- * received and processed.  Callbacks are called from the vidproc thread after
- * vidproc's own processing is complete, so use appropriate locking and avoid
- * spending too much time in callbacks.
+ * Initializes the frame source given by source (a source name, optionally
+ * followed by a colon and source-specific arguments, e.g. "freenect:0",
+ * "replay:/tmp/depth.knr,fast", or "synth:people=3"), and starts the depth and
+ * video processing threads.  A NULL or empty source uses the first camera
+ * found by libfreenect.  If depth_cb and/or video_cb are not NULL, then they
+ * will be called for every frame received and processed.  Callbacks are called
+ * from the vidproc thread after vidproc's own processing is complete, so use
+ * appropriate locking and avoid spending too much time in callbacks.
  */
-struct vidproc_info *init_vidproc(struct knd_info *knd, int devindex, vidproc_func depth_cb, void *depth_cb_data, vidproc_func video_cb, void *video_cb_data);
+struct vidproc_info *init_vidproc(struct knd_info *knd, const char *source, vidproc_func depth_cb, void *depth_cb_data, vidproc_func video_cb, void *video_cb_data);
 
 /*
  * Stops video processing associated with the given info structure and frees
- * associated resources.  Should only be called after the libfreenect event
+ * associated resources.  Should only be called after the frame source's event
  * loop has exited. Ignores a null parameter.
  */
 void cleanup_vidproc(struct vidproc_info *info);
 
 /*
- * Runs one iteration of libfreenect event processing.  This function blocks
- * until there are events to process, so it should be called through its own
- * event loop.
+ * Runs one iteration of frame source event processing.  This function blocks
+ * until there are events to process (or, for sources that generate frames
+ * themselves, until the next frame is due), so it should be called through
+ * its own event loop.  Returns 0 on success, -1 on error or when the source
+ * has no more frames.
  */
 int vidproc_doevents(struct vidproc_info *info);
 
+/*
+ * Closes the frame source and opens it again with the same arguments, after
+ * vidproc_doevents() fails on a source that supports reconnection (e.g. when
+ * the camera is unplugged or its USB connection resets).  The depth and video
+ * threads, buffers, and recorder are kept.  The requested tilt, LED color, and
+ * video state are restored once the source is open.  Call from the thread that
+ * calls vidproc_doevents().  Returns 0 on success, -1 if the source could not
+ * be opened (call again to retry) or does not support reconnection.
+ */
+int vidproc_reopen(struct vidproc_info *info);
+
+/*
+ * Returns nonzero if the frame source can be reopened by vidproc_reopen().
+ */
+int vidproc_can_reopen(struct vidproc_info *info);
+
 /*
  * Locks the depth buffer and calls the given callback once with a pointer to
  * the depth buffer.  Also schedules an update of the camera's LED to indicate
@@ -292,16 +417,26 @@ int reverse_lut(int zw);
 
 /*
  * Returns the currently-requested motor tilt in degrees from horizontal.  The
- * motor's actual current position may be different.
+ * motor's actual current position may be different.  While vidproc_reopen() is
+ * reopening the source, returns the tilt that will be restored.
  */
 int get_tilt(struct vidproc_info *info);
 
 /*
  * Requests that the motor tilt the camera to the specified number of degrees
- * from horizontal.  Takes no action if the motor device was not opened.
+ * from horizontal.  Takes no action if the motor device was not opened.  While
+ * vidproc_reopen() is reopening the source, the tilt is saved and applied once
+ * the source is open again.
  */
 void set_tilt(struct vidproc_info *info, int tilt);
 
+/*
+ * Packs count 11-bit depth values from in into the Kinect's 11-bit packed
+ * format (big-endian bit order, as read by pxval_11()).  The count must be a
+ * multiple of 8 (8 pixels occupy 11 bytes).
+ */
+void pack_11(const uint16_t *in, uint8_t *out, int count);
+
 /*
  * Unpacks the pixel-th 11-bit pixel from the given packed buffer.
  */
@@ -317,6 +452,279 @@ KND_INLINE int pxval_11(const uint8_t *buf, int pixel)
 	return (base >> shiftbits) & 0x7ff;
 }
 
+/*
+ * Frame source backend.  A frame source produces depth (and, on request,
+ * video) frames and hands them to vidproc by calling vidproc_depth_frame()
+ * and vidproc_video_frame() from its doevents function, which runs in the
+ * main thread.  Optional functions may be NULL.
+ */
+struct vidproc_source {
+	const char *name;
+
+	// Opens the source.  args is the part of the source specification
+	// after the first colon (an empty string if there was none).  Returns
+	// the source's private data on success, NULL on error.
+	void *(*init)(struct vidproc_info *vid, const char *args);
+
+	// Stops the source and frees its private data.
+	void (*cleanup)(void *data);
+
+	// Delivers pending frames, blocking until at least one event has been
+	// handled.  Returns 0 on success, -1 on error or end of input.
+	int (*doevents)(void *data);
+
+	// Starts (enable != 0) or stops video frame delivery.  Returns 0 on
+	// success, -1 on error.
+	int (*set_video)(void *data, int enable);
+
+	// Optional: sets the camera LED color.
+	void (*set_led)(void *data, freenect_led_options led);
+
+	// Optional: moves the tilt motor to the given angle in degrees.
+	void (*set_tilt)(void *data, int tilt);
+
+	// Nonzero if a doevents() error means the device was lost (e.g. a
+	// camera was unplugged) and the source should be reopened by
+	// vidproc_reopen(), rather than meaning the end of input.
+	unsigned int reconnect:1;
+};
+
+/*
+ * Hands a packed depth frame from the frame source to the depth processing
+ * thread.  The frame is dropped if the depth thread is still busy with the
+ * previous frame, unless the source asked for lossless delivery with
+ * vidproc_set_lossless().  Called by frame sources from their doevents
+ * function.
+ */
+void vidproc_depth_frame(struct vidproc_info *info, const void *depthbuf, uint32_t timestamp);
+
+/*
+ * Hands a video frame from the frame source to the video processing thread,
+ * waiting for the thread to finish with the previous frame.  Called by frame
+ * sources from their doevents function.
+ */
+void vidproc_video_frame(struct vidproc_info *info, const void *videobuf, uint32_t timestamp);
+
+/*
+ * Tells vidproc whether the frame source has a tilt motor, and the motor's
+ * current tilt in degrees.  Sources without a motor should not call this
+ * function.  Must only be called from a source's init function, which also
+ * runs during vidproc_reopen() while the server thread is using the motor.
+ */
+void vidproc_set_motor(struct vidproc_info *info, int present, int tilt);
+
+/*
+ * Sets whether depth frames passed to vidproc_depth_frame() should wait for
+ * the depth thread instead of being dropped when the thread is busy.  Sources
+ * that can produce frames faster than real time (e.g. file replay) should
+ * enable this.  Must only be called from a source's init function.
+ */
+void vidproc_set_lossless(struct vidproc_info *info, int lossless);
+
+/*
+ * Starts (rec is not NULL) or stops recording frames as they are processed.
+ * Depth frames are passed to record_depth() from the depth thread.  If video
+ * is nonzero, video is kept running and every video frame is passed to
+ * record_video().  Returns the previous recorder, if any, which the caller
+ * must destroy.  Only the server thread may change the recorder once the
+ * server is running; the recorder still set when vidproc is cleaned up is
+ * destroyed by cleanup_vidproc().
+ */
+struct knd_recorder *vidproc_set_recorder(struct vidproc_info *info, struct knd_recorder *rec, int video);
+
+/*
+ * Returns the recorder set by vidproc_set_recorder(), or NULL if frames are
+ * not being recorded.  See vidproc_set_recorder() for thread safety.
+ */
+struct knd_recorder *vidproc_get_recorder(struct vidproc_info *info);
+
+/*
+ * Looks up key in a comma-separated list of source options (key=value, or
+ * just key for flags).  Stores the value (an empty string for a flag) in
+ * value if value is not NULL.  Returns 1 if the key was found, 0 otherwise.
+ */
+int vidproc_get_opt(const char *args, const char *key, char *value, size_t value_size);
+
+/*
+ * Returns the integer value of the given source option, or def if the option
+ * was not given.
+ */
+int vidproc_get_int_opt(const char *args, const char *key, int def);
+
+
+/***** freenect_src.c *****/
+
+/*
+ * Live Kinect camera frame source using libfreenect.  The source argument is
+ * the zero-based index of the camera to open (defaults to 0).
+ */
+extern const struct vidproc_source freenect_source;
+
+
+/***** replay_src.c *****/
+
+/*
+ * File replay frame source.  See the comment at the top of replay_src.c for
+ * supported arguments.
+ */
+extern const struct vidproc_source replay_source;
+
+
+/***** synth_src.c *****/
+
+/*
+ * Synthetic scene frame source.  See the comment at the top of synth_src.c for
+ * supported arguments.
+ */
+extern const struct vidproc_source synth_source;
+
+
+/***** codec.c *****/
+
+/*
+ * Largest possible output of encode_depth() for the given number of pixels.
+ */
+#define DEPTH_CODEC_MAX_SIZE(count) ((count) * 2 + ((count) + 31) / 32 + 4)
+
+/*
+ * Unpacks count 11-bit depth values from the Kinect's packed format into
+ * 16-bit values.  The count must be a multiple of 8.  This is much faster than
+ * calling pxval_11() for every pixel, as it processes 8 pixels (11 bytes) at
+ * a time with no per-pixel branches.
+ */
+void unpack_11(const uint8_t *in, uint16_t *out, int count);
+
+/*
+ * Compresses count 16-bit depth values from cur into out, predicting each
+ * pixel from prev (which may be NULL for a self-contained key frame).  The
+ * width is used for row-based prediction in key frames.  The output buffer
+ * must hold at least DEPTH_CODEC_MAX_SIZE(count) bytes.  Returns the number
+ * of bytes written.
+ */
+size_t encode_depth(const uint16_t *cur, const uint16_t *prev, int count, int width, uint8_t *out);
+
+/*
+ * Decompresses count 16-bit depth values from the len bytes of compressed
+ * data in in, using the same prev frame (or NULL) and width that were given to
+ * encode_depth().  Returns 0 on success, -1 if the data is corrupt.
+ */
+int decode_depth(const uint8_t *in, size_t len, const uint16_t *prev, int count, int width, uint16_t *out);
+
+
+/***** record.c *****/
+
+/*
+ * Default number of depth frames between key frames in a recording (10s at
+ * 30fps).
+ */
+#define KNR_DEFAULT_KEYFRAME_INTERVAL 300
+
+/*
+ * File name suffix of recordings made with the record command.
+ */
+#define KNR_SUFFIX ".knr"
+
+/*
+ * A depth frame decoded from a recording by read_recording().
+ */
+struct recording_frame {
+	unsigned int frame; // Zero-based frame number within the recording
+	uint32_t timestamp; // libfreenect timestamp
+	uint64_t time_ns; // Nanoseconds since the start of the recording
+	const uint16_t *depth; // Unpacked 11-bit depth values
+
+	// Most recent video frame at or before this depth frame (NULL if none)
+	const uint8_t *video;
+	uint32_t video_timestamp;
+};
+
+/*
+ * Creates the given recording file (failing if the file already exists, so
+ * nothing is ever overwritten) and starts a thread to compress and write
+ * frames passed to record_depth() and record_video().  A key frame will be
+ * written every keyframe_interval depth frames (a default is used if
+ * keyframe_interval <= 0).  Returns NULL on error.
+ */
+struct knd_recorder *create_recorder(struct knd_info *knd, const char *path, int keyframe_interval);
+
+/*
+ * Tells the given recorder's thread to write the frames that are still queued
+ * and the key frame index, then close the file, without waiting for it.  The
+ * recorder must still be freed with destroy_recorder(), which returns quickly
+ * once recorder_finished() returns nonzero.  No frames may be queued after
+ * this is called.
+ */
+void stop_recorder(struct knd_recorder *rec);
+
+/*
+ * Returns nonzero once the given recorder's thread has closed the file after
+ * stop_recorder() or destroy_recorder() was called.
+ */
+int recorder_finished(struct knd_recorder *rec);
+
+/*
+ * Stops the given recorder's thread after all queued frames have been
+ * written, waits for it to write the key frame index and close the file, and
+ * frees the recorder.  Ignores a NULL recorder.
+ */
+void destroy_recorder(struct knd_recorder *rec);
+
+/*
+ * Queues an 11-bit packed depth frame for recording.  The frame is copied, so
+ * the buffer may be reused as soon as this function returns.  If the writer
+ * thread has fallen behind (e.g. due to slow storage), the frame is dropped.
+ */
+void record_depth(struct knd_recorder *rec, const uint8_t *depthbuf, uint32_t timestamp);
+
+/*
+ * Queues a video frame for recording.  See record_depth().
+ */
+void record_video(struct knd_recorder *rec, const uint8_t *videobuf, uint32_t timestamp);
+
+/*
+ * Retrieves the number of depth frames written, the number of frames dropped,
+ * and the current size of the given recording.  Any of the pointers may be
+ * NULL.  Returns the recording's path.
+ */
+const char *get_recorder_stats(struct knd_recorder *rec, unsigned int *frames, unsigned int *dropped, uint64_t *bytes);
+
+/*
+ * Returns 1 if the given data (e.g. the start of a mapped file) begins with a
+ * recording header, 0 otherwise.
+ */
+int is_recording(const void *data, size_t size);
+
+/*
+ * Opens and maps the given recording for reading with read_recording().
+ * Returns NULL on error.
+ */
+struct knd_recording *open_recording(const char *path);
+
+/*
+ * Unmaps and frees the given recording.  Ignores a NULL recording.
+ */
+void close_recording(struct knd_recording *rec);
+
+/*
+ * Returns the number of depth frames in the given recording.
+ */
+unsigned int recording_frame_count(struct knd_recording *rec);
+
+/*
+ * Decodes the next depth frame from the given recording into frame.  The
+ * frame's depth and video pointers remain valid until the next call to
+ * read_recording() or seek_recording().  Returns 0 on success, 1 at the end of
+ * the recording, -1 on error.
+ */
+int read_recording(struct knd_recording *rec, struct recording_frame *frame);
+
+/*
+ * Positions the given recording so the next call to read_recording() returns
+ * the given depth frame.  Decoding resumes at the nearest preceding key frame.
+ * Returns 0 on success, -1 on error.
+ */
+int seek_recording(struct knd_recording *rec, unsigned int frame);
+
 
 /***** zone.c *****/
 
@@ -376,12 +784,13 @@ int zone_count(struct zonelist *zones);
 int occupied_count(struct zonelist *zones);
 
 /*
- * Returns the name of the zone with the highest occupation.  The returned name
- * must be free()d.  If index, pop, and/or maxpop are not NULL, then the zone's
- * index, population, and screen area will be stored in *index, *pop, and
- * *maxpop.  Returns NULL and stores -1 if no zone is occupied.
+ * Returns the index of the zone with the highest occupation, and copies its
+ * name into name, which must hold ZONE_NAME_LENGTH bytes.  If pop and/or
+ * maxpop are not NULL, then the zone's population and screen area will be
+ * stored in *pop and *maxpop.  Returns -1 (and stores an empty name and -1)
+ * if no zone is occupied.
  */
-char *peak_zone(struct zonelist *zones, int *index, int *pop, int *maxpop);
+int peak_zone(struct zonelist *zones, char *name, int *pop, int *maxpop);
 
 /*
  * Adds a new rectangular zone to the given zone list.  Dimensions are in
@@ -404,6 +813,25 @@ int set_zone_nolock(struct zonelist *zones, struct zone *zone, float xmin, float
  */
 int set_zone(struct zonelist *zones, struct zone *zone, float xmin, float ymin, float zmin, float xmax, float ymax, float zmax);
 
+/*
+ * Adds count zones with the given parameters to the given zone list, locking
+ * the list and incrementing its version only once.  Names must not already be
+ * in the zone list or repeat within params.  If depth_map is not NULL and the
+ * zone list was empty, depth_map (640*480*2 entries, see struct zonelist) is
+ * used as the zone list's depth map instead of rebuilding it; it must have
+ * been built from the same zones (see get_zone_map()).  Invalid zones are
+ * skipped.  Returns the number of zones added, or -1 on error.
+ */
+int add_zones(struct zonelist *zones, const struct zone_params *params, int count, const uint16_t *depth_map);
+
+/*
+ * Copies the given zone list's depth map (640*480*2 entries, see struct
+ * zonelist) into depth_map, building it first if any zones changed since it
+ * was last built.  Returns the zone list version the map was built for, or
+ * (unsigned int)-1 on error.
+ */
+unsigned int get_zone_map(struct zonelist *zones, uint16_t *depth_map);
+
 /*
  * Sets the named attribute of the given zone to the given value.  A zone's
  * name, pop, maxpop, xc, yc, zc, sa, and occupied attributes may not be
@@ -420,10 +848,20 @@ int remove_zone(struct zonelist *zones, struct zone *zone);
 
 /*
  * Finds the first zone with the given name.  Returns NULL if the zone wasn't
- * found or on error.
+ * found or on error.  The zone may be freed as soon as the zone list is
+ * unlocked, so only use the result while preventing zone removal (e.g. with
+ * the server's command lock held); otherwise use copy_zone().
  */
 struct zone *find_zone(struct zonelist *zones, const char *name);
 
+/*
+ * Copies the first zone with the given name into *copy while the zone list is
+ * locked, so the copy stays valid if the zone is changed or removed
+ * afterward.  The copy's shape pointers must not be used.  Returns 0 on
+ * success, -1 if the zone wasn't found or on error.
+ */
+int copy_zone(struct zonelist *zones, const char *name, struct zone *copy);
+
 /*
  * Returns the version number of the given zone list.  The version number is
  * incremented every time a zone is added, removed, or modified.  Returns
@@ -433,8 +871,8 @@ unsigned int get_zonelist_version(struct zonelist *zones);
 
 /*
  * Increments the version number of the given zone list without locking or
- * error checking.  The version number is reset to zero if it reaches (unsigned
- * int)-1.
+ * error checking, and calls the zone list's change notification function, if
+ * any.  The version number is reset to zero if it reaches (unsigned int)-1.
  */
 unsigned int bump_zonelist_nolock(struct zonelist *zones);
 
@@ -446,6 +884,15 @@ unsigned int bump_zonelist_nolock(struct zonelist *zones);
  */
 unsigned int bump_zonelist_version(struct zonelist *zones);
 
+/*
+ * Locks the given zone list and sets the function called with the given data
+ * each time its version changes, replacing any previous function.  The
+ * function is called with the zone list locked, so it must not lock the zone
+ * list or wait on anything that does.  Pass NULL to remove the function.
+ * Returns 0 on success, -1 on error.
+ */
+int set_zonelist_notify(struct zonelist *zones, void (*notify)(void *data), void *data);
+
 /*
  * Information about parameters available for a zone's occupation detection
  * parameter.
@@ -503,6 +950,32 @@ KND_INLINE int zone_zc(struct zone *zone)
  */
 struct knd_server *kndsrv_create(struct knd_info *info, unsigned short port);
 
+/*
+ * Adds a UNIX domain socket listener to the given server, using the same
+ * event loop and protocol as TCP connections.  The spec is the socket path,
+ * optionally followed by comma-separated options: mode=octal (permissions of
+ * the socket file, default 0660), uid=N and gid=N (additional peer user and
+ * group IDs to trust).  Peers running as root or as knd's user are always
+ * trusted.  Any existing socket at the path is replaced, and the socket is
+ * removed when the server is destroyed.  Call before kndsrv_run().  Returns 0
+ * on success, -1 on error.
+ */
+int kndsrv_listen_unix(struct knd_server *server, const char *spec);
+
+/*
+ * Serves Prometheus metrics (see metrics.c) over HTTP at /metrics on the given
+ * TCP port, using the server thread's event loop.  Call before kndsrv_run().
+ * Returns 0 on success, -1 on error.
+ */
+int kndsrv_listen_metrics(struct knd_server *server, unsigned short port);
+
+/*
+ * Has the given watchdog monitor each of the server's event loops for stalls
+ * (see add_loop_monitor()), using a heartbeat timer on each loop.  Call
+ * before kndsrv_run().  Returns 0 on success, -1 on error.
+ */
+int kndsrv_monitor_loops(struct knd_server *server, struct knd_watchdog *wd);
+
 /*
  * Destroys the given server.  This should not be called while the server's
  * event loop is running.  Instead, call kndsrv_stop(), then call
@@ -523,54 +996,695 @@ int kndsrv_run(struct knd_server *server);
 void kndsrv_stop(struct knd_server *server);
 
 /*
- * Writes a depth wakeup instruction to the given server's wakeup pipe.  Call
- * this when a depth frame is received.
+ * Tells the given server that a depth frame was received, and passes the
+ * frame to the server's compressed depth encoder.  Wakeups are combined if the
+ * server falls behind, so only the most recent frame is published.  Call this
+ * when a depth frame is received, while the depth buffer is locked.
  */
-void kndsrv_send_depth(struct knd_server *server);
+void kndsrv_send_depth(struct knd_server *server, const uint8_t *buffer);
 
 /*
- * Writes a video wakeup instruction to the given server's wakeup pipe.  Call
- * this when a video frame is received.
+ * Tells the given server that a video frame was received.  Like depth frames,
+ * video wakeups are combined if the server falls behind.  Call this when a
+ * video frame is received.
  */
 void kndsrv_send_video(struct knd_server *server);
 
+/*
+ * Tells the given server that the camera was disconnected (connected is 0) or
+ * connected again, so clients subscribed to global zone updates are sent a
+ * CAMERA line.  Changes that are undone before the server thread wakes up are
+ * not sent.  May be called from any thread.
+ */
+void kndsrv_set_camera(struct knd_server *server, int connected);
+
+
+/***** stream.c *****/
+
+/*
+ * Largest supported pixel stride (pooling block width or height).
+ */
+#define DEPTH_STREAM_MAX_STRIDE 32
+
+/*
+ * How blocks of depth pixels are combined into a single pixel (invalid pixels
+ * are ignored in both cases).
+ */
+enum depth_pool {
+	DEPTH_POOL_MIN, // Nearest pixel
+	DEPTH_POOL_MEDIAN, // Median pixel
+};
+
+/*
+ * Pixel formats of a depth stream.
+ */
+enum depth_format {
+	DEPTH_FORMAT_PACKED, // 11-bit packed raw values, as sent by the camera
+	DEPTH_FORMAT_U16, // Unpacked raw values, 16-bit little-endian
+	DEPTH_FORMAT_MM, // Millimeters, 16-bit little-endian (0 if invalid)
+};
+
+/*
+ * Parameters of a cropped, decimated, and/or converted depth stream.
+ * Zero-initialize before filling in, as parameters are compared bytewise.
+ */
+struct depth_stream_params {
+	int x, y, w, h; // Region of interest in pixels
+	int xstride, ystride; // Pooling block size in pixels
+	enum depth_pool pool;
+	enum depth_format format;
+};
+
+struct depth_stream;
+
+/*
+ * Clamps the region of interest in params to the camera image and fills in
+ * default values.  Returns 0 on success, -1 if the parameters are invalid.
+ */
+int normalize_depth_stream_params(struct depth_stream_params *params);
+
+/*
+ * Returns nonzero if the given normalized parameters describe the full,
+ * unmodified camera image in its original packed format.
+ */
+int is_full_depth_stream(const struct depth_stream_params *params);
+
+/*
+ * Returns a reference to the stream with the given parameters from the given
+ * list, creating and adding the stream if no matching stream exists.  The
+ * parameters must have been normalized by normalize_depth_stream_params().
+ * Release the reference with put_depth_stream().  Returns NULL on error.
+ */
+struct depth_stream *get_depth_stream(struct depth_stream **list, const struct depth_stream_params *params);
+
+/*
+ * Releases a reference to the given stream (which may be NULL), removing the
+ * stream from the given list and freeing it when the last reference is
+ * released.
+ */
+void put_depth_stream(struct depth_stream **list, struct depth_stream *stream);
+
+/*
+ * Stores the given stream's output image width and height (in pixels) and the
+ * size of each packed image (in bytes) in *width, *height, and *size.
+ */
+void get_depth_stream_size(struct depth_stream *stream, int *width, int *height, size_t *size);
+
+/*
+ * Returns the pixel format of the given stream's images.
+ */
+enum depth_format get_depth_stream_format(struct depth_stream *stream);
+
+/*
+ * Returns the given stream's image for the given full-size 11-bit packed
+ * camera frame, computing it only if frame differs from the frame number
+ * given to the previous call.  Packed images are padded with invalid (2047)
+ * pixels to a multiple of 8 pixels.  16-bit images are little-endian.  The
+ * image remains valid until the next call for this stream.
+ */
+const uint8_t *encode_depth_stream(struct depth_stream *stream, const uint8_t *packed, unsigned int frame);
+
+
+/***** encoder.c *****/
+
+/*
+ * Creates a depth encoder and starts its thread in the given knd context's
+ * thread context.  The notify callback will be called from the encoder thread
+ * each time a frame has been compressed.  Returns NULL on error.
+ */
+struct depth_encoder *create_depth_encoder(struct knd_info *knd, void (*notify)(void *data), void *notify_data);
+
+/*
+ * Stops the given encoder's thread and frees its resources.
+ */
+void destroy_depth_encoder(struct depth_encoder *enc);
+
+/*
+ * Gives a new 11-bit packed depth frame to the encoder.  The frame is copied
+ * only if there are subscribers and the encoder is idle; frames that arrive
+ * while the previous frame is being compressed or sent are skipped.  Call
+ * from any thread.
+ */
+void depth_encoder_frame(struct depth_encoder *enc, const uint8_t *buffer);
+
+/*
+ * Adds (or with a negative count, removes) count compressed subscribers, of
+ * which key_count receive only key frames (e.g. due to a rate limit).  The
+ * encoder runs while there are any subscribers.
+ */
+void depth_encoder_add_clients(struct depth_encoder *enc, int count, int key_count);
+
+/*
+ * Requests a key frame for the next compressed frame (e.g. for a new
+ * subscriber).
+ */
+void depth_encoder_request_key(struct depth_encoder *enc);
+
+/*
+ * Retrieves the most recently compressed frame, if it has not been retrieved
+ * already.  Stores the frame's sequence number in *seq (sequence numbers
+ * increase by one for each frame the encoder compresses) and the delta and key
+ * frame data and sizes in *delta, *delta_size, *key, and *key_size.  A size is
+ * 0 if that type of frame was not generated.  A delta frame must be decoded
+ * using the frame with the previous sequence number as its reference.  Call
+ * release_depth_encoder() when finished with the data.  Returns 1 if a frame
+ * was retrieved, 0 if there is no new frame (do not call
+ * release_depth_encoder()), or -1 on error.
+ */
+int get_depth_encoder_frame(struct depth_encoder *enc, unsigned int *seq,
+		const uint8_t **delta, size_t *delta_size, const uint8_t **key, size_t *key_size);
+
+/*
+ * Allows the encoder to compress the next frame after a frame was retrieved
+ * with get_depth_encoder_frame().
+ */
+void release_depth_encoder(struct depth_encoder *enc);
+
+
+/***** shm.c *****/
+
+/*
+ * Shared memory layout.  The object begins with struct knd_shm_header,
+ * followed by the frame buffers and zone result arrays at the offsets given in
+ * each slot.  All fields use native byte order.
+ *
+ * Each slot is protected by a sequence lock: seq is odd while the slot is
+ * being written.  A reader copies seq, then the slot's data, then checks that
+ * the copied seq was even and that seq has not changed; otherwise it retries
+ * (or moves to a newer frame).  Frame N is stored in slot N % slots, and
+ * depth_frame/video_frame give the most recently published frame number.
+ *
+ * The doorbell is incremented after every published frame and can be waited
+ * on with FUTEX_WAIT (the object is shared, so use the non-private futex
+ * operations).  The magic number is cleared when knd exits.
+ */
+#define KND_SHM_MAGIC 0x4b4e4453 // "KNDS"
+#define KND_SHM_VERSION 1
+#define KND_SHM_DEPTH_SLOTS 4
+#define KND_SHM_VIDEO_SLOTS 2
+#define KND_SHM_MAX_ZONES 64 // Zones beyond this limit are not published
+
+struct knd_shm_zone {
+	char name[ZONE_NAME_LENGTH];
+	int32_t occupied;
+	int32_t pop;
+	int32_t maxpop;
+	int32_t sa;
+	int32_t xc;
+	int32_t yc;
+	int32_t zc;
+	int32_t bright;
+};
+
+struct knd_shm_slot {
+	uint32_t seq; // Odd while the slot is being written
+	uint32_t frame; // Frame number (starts at 1)
+	uint64_t time_ns; // CLOCK_MONOTONIC time when the frame was published
+	uint32_t zone_count; // Number of zone results (depth slots only)
+	uint32_t reserved;
+	uint64_t data_offset; // Offset of the frame data from the start of the object
+	uint64_t zones_offset; // Offset of the zone results (depth slots only)
+};
+
+struct knd_shm_header {
+	uint32_t magic; // KND_SHM_MAGIC while knd is running
+	uint32_t version; // KND_SHM_VERSION
+	uint32_t header_size; // sizeof(struct knd_shm_header)
+	uint32_t pid; // Process ID of knd
+	uint64_t total_size; // Size of the whole object
+	uint32_t depth_slots;
+	uint32_t video_slots;
+	uint32_t max_zones;
+	uint32_t width;
+	uint32_t height;
+	uint32_t depth_size; // Bytes of 11-bit packed depth data per frame
+	uint32_t video_size; // Bytes of 8-bit video data per frame
+	uint32_t doorbell; // Futex word incremented for every published frame
+	uint32_t depth_frame; // Most recently published depth frame number
+	uint32_t video_frame; // Most recently published video frame number
+	struct knd_shm_slot depth[KND_SHM_DEPTH_SLOTS];
+	struct knd_shm_slot video[KND_SHM_VIDEO_SLOTS];
+};
+
+/*
+ * Creates (replacing any existing object) and maps the POSIX shared memory
+ * object with the given name (e.g. "/knd").  Returns NULL on error.
+ */
+struct knd_shm *create_shm(const char *name);
+
+/*
+ * Unmaps and removes the given shared memory object.  Ignores a NULL shm.
+ */
+void destroy_shm(struct knd_shm *shm);
+
+/*
+ * Publishes the given 11-bit packed depth frame and the current results of
+ * the given zone list.  Call from the depth callback after the zones have been
+ * updated for the frame.
+ */
+void publish_shm_depth(struct knd_shm *shm, const uint8_t *buf, struct zonelist *zones);
+
+/*
+ * Publishes the given video frame.  Call from the video callback.
+ */
+void publish_shm_video(struct knd_shm *shm, const uint8_t *buf);
+
+/*
+ * Returns a read-only file descriptor for the shared memory object, suitable
+ * for passing to local clients over a UNIX domain socket.  The descriptor
+ * remains owned by the shm and must not be closed by the caller.
+ */
+int get_shm_fd(struct knd_shm *shm);
+
+/*
+ * Returns the total size of the shared memory object in bytes.
+ */
+size_t get_shm_size(struct knd_shm *shm);
+
+
+/***** multicast.c *****/
+
+/*
+ * Creates a multicast publisher from the given specification:
+ * group[:port][,ttl=N][,iface=addr][,refresh=ms].  The port defaults to
+ * KND_PORT, the TTL to 1 (local network only), and the full-state refresh
+ * interval to 1000ms.  Only IPv4 groups are supported.  Returns NULL on error.
+ */
+struct knd_multicast *create_multicast(const char *spec);
+
+/*
+ * Closes the given multicast publisher's socket and frees its resources.
+ * Ignores a NULL mc.
+ */
+void destroy_multicast(struct knd_multicast *mc);
+
+/*
+ * Sends the zones that changed since the previous call (and the full state of
+ * all zones if the refresh interval has passed or the zone list changed).
+ * Call from the depth callback after the zones have been updated for the
+ * frame.  The cost is independent of the number of listeners.
+ */
+void publish_multicast(struct knd_multicast *mc, struct zonelist *zones);
+
+
+/***** latency.c *****/
+
+/*
+ * Points in the depth frame pipeline whose latency is measured.  Each is
+ * measured from the frame's arrival from the camera (vidproc_depth_frame()).
+ */
+enum latency_stage {
+	LATENCY_DEQUEUE, // The depth thread starts processing the frame
+	LATENCY_ZONES, // Zones have been updated from the frame
+	LATENCY_WAKE, // The server thread publishes the frame to clients
+	LATENCY_FLUSH, // A client's output for the frame is queued to its socket
+
+	LATENCY_STAGES // Number of stages
+};
+
+/*
+ * Histogram buckets are logarithmic with LATENCY_SUB_BUCKETS linear
+ * sub-buckets per power of two, so values up to 2^LATENCY_MAX_BITS are kept
+ * to within 1/LATENCY_SUB_BUCKETS of their true value.
+ */
+#define LATENCY_SUB_BITS	3
+#define LATENCY_SUB_BUCKETS	(1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS	32 // Larger values (over an hour in microseconds) are clamped
+#define LATENCY_BUCKETS		((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/*
+ * A histogram of values (e.g. durations) updated with relaxed atomics.
+ * Zero-initialize before use.
+ */
+struct latency_histogram {
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t sum;
+	uint64_t max;
+};
+
+/*
+ * Statistics for one histogram (in microseconds for latency stages).
+ */
+struct latency_stats {
+	uint64_t count; // Number of values (e.g. frames) measured
+	uint64_t sum; // Total of all values
+	uint64_t p50;
+	uint64_t p90;
+	uint64_t p99;
+	uint64_t max;
+};
+
+/*
+ * Adds a value to the given histogram.  Safe to call from any thread; never
+ * allocates or locks.
+ */
+void record_histogram(struct latency_histogram *hist, uint64_t value);
+
+/*
+ * Fills *stats with the number and sum of the values and the 50th, 90th, and
+ * 99th percentile and maximum values recorded in the given histogram.
+ * Percentiles are the upper limit of the bucket holding the percentile, so
+ * they may be up to 1/8 above the true value.  Values recorded while the
+ * statistics are read may or may not be included.
+ */
+void get_histogram_stats(struct latency_histogram *hist, struct latency_stats *stats);
+
+/*
+ * Clears the given histogram.  Values recorded during the reset may be lost.
+ */
+void reset_histogram(struct latency_histogram *hist);
+
+/*
+ * Creates an empty set of latency histograms.  Returns NULL on error.
+ */
+struct knd_latency *create_latency(void);
+
+/*
+ * Frees the given latency histograms.  Ignores a NULL lat.
+ */
+void destroy_latency(struct knd_latency *lat);
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds, for use as the
+ * start time passed to record_latency().
+ */
+uint64_t latency_now(void);
+
+/*
+ * Records the time from start_ns (from latency_now()) to now in the given
+ * stage's histogram.  Does nothing if lat is NULL or start_ns is 0.  Safe to
+ * call from any thread; never allocates or locks.
+ */
+void record_latency(struct knd_latency *lat, enum latency_stage stage, uint64_t start_ns);
+
+/*
+ * Fills *stats with the number of samples and the 50th, 90th, and 99th
+ * percentile and maximum latencies (in microseconds) recorded for the given
+ * stage.  Percentiles are the upper limit of the bucket holding the
+ * percentile, so they may be up to 1/8 above the true value.  Samples
+ * recorded while the statistics are read may or may not be included.
+ */
+void get_latency_stats(struct knd_latency *lat, enum latency_stage stage, struct latency_stats *stats);
+
+/*
+ * Clears all of the histograms.  Samples recorded during the reset may be
+ * lost.
+ */
+void reset_latency(struct knd_latency *lat);
+
+/*
+ * Returns the name of the given latency stage.
+ */
+const char *latency_stage_name(enum latency_stage stage);
+
+
+/***** stats.c *****/
+
+/*
+ * Number of one-second samples kept by the stats thread.
+ */
+#define KND_STATS_HISTORY 60
+
+/*
+ * Frame counts for one second (see struct knd_frame_counts).
+ */
+struct knd_stats_sample {
+	time_t time; // Wall clock time at the end of the second
+	unsigned int depth_received;
+	unsigned int depth_dropped;
+	unsigned int depth_processed;
+	unsigned int depth_published;
+	unsigned int depth_sent;
+	unsigned int video_received;
+	unsigned int video_starts;
+	unsigned int video_start_ms; // Average time to the first video frame for video_starts
+};
+
+/*
+ * Starts a thread that samples the given knd context's frame counters, keeps
+ * the last KND_STATS_HISTORY seconds of samples, and updates knd->fps.
+ * Returns NULL on error.
+ */
+struct knd_stats *create_stats(struct knd_info *knd);
+
+/*
+ * Stops the given stats thread and frees its resources.  Ignores a NULL stats.
+ */
+void destroy_stats(struct knd_stats *stats);
+
+/*
+ * Copies up to max of the most recent one-second samples into samples, oldest
+ * first.  Returns the number of samples copied.
+ */
+int get_stats_history(struct knd_stats *stats, struct knd_stats_sample *samples, int max);
+
+
+/***** metrics.c *****/
+
+/*
+ * Creates a metrics cache for the given knd context.  Returns NULL on error.
+ */
+struct knd_metrics *create_metrics(struct knd_info *knd);
+
+/*
+ * Frees the given metrics cache.  Ignores a NULL metrics.
+ */
+void destroy_metrics(struct knd_metrics *metrics);
+
+/*
+ * Returns the metrics in the Prometheus text format, storing the length in
+ * *len.  The metrics are rendered again, with the given number of connected
+ * clients, only if the cached copy is older than one second.  The returned
+ * text belongs to the cache and remains valid until the next call.  Call from
+ * one thread at a time.  Returns NULL on error.
+ */
+const char *get_metrics(struct knd_metrics *metrics, int clients, size_t *len);
+
+
+/***** checkpoint.c *****/
+
+/*
+ * Restores zone detection state and the motor tilt from the checkpoint file
+ * in the given data directory if it is no older than max_age seconds (0 to
+ * never restore), then starts a thread that checkpoints the state of the
+ * given knd context's zones every second.  Call after zones are loaded.
+ * Returns NULL on error.
+ */
+struct knd_checkpoint *create_checkpoint(struct knd_info *knd, const char *savedir, double max_age);
+
+/*
+ * Stops the given checkpoint thread, writes a final checkpoint, and frees its
+ * resources.  Call before the zone list is destroyed.  Ignores a NULL cp.
+ */
+void destroy_checkpoint(struct knd_checkpoint *cp);
+
+
+/***** trace.c *****/
+
+/*
+ * Records the start of the named stage in the calling thread's trace ring.
+ * The name must be a string constant (only the pointer is stored) without
+ * quotes or backslashes.  Never blocks; only the first event in each thread
+ * allocates.
+ */
+void trace_begin(const char *name);
+
+/*
+ * Records the end of the named stage started by trace_begin().
+ */
+void trace_end(const char *name);
+
+/*
+ * Writes the trace events recorded in the last given number of seconds, with
+ * the names of the threads that recorded them, to out as a Chrome trace event
+ * JSON object.  Returns 0 on success, -1 on error.
+ */
+int write_trace(FILE *out, unsigned int seconds);
+
+/*
+ * Returns a newly allocated buffer containing the Chrome trace event JSON for
+ * the last given number of seconds (see write_trace()), storing its length in
+ * *size.  The buffer must be free()d.  Returns NULL on error.
+ */
+char *get_trace_json(unsigned int seconds, size_t *size);
+
+/*
+ * Writes the Chrome trace event JSON for the last given number of seconds to
+ * the file at the given path, replacing the file if it exists.  Returns 0 on
+ * success, -1 on error.
+ */
+int save_trace(const char *path, unsigned int seconds);
+
+
+/***** lockprof.c *****/
+
+#ifdef KND_LOCK_PROFILE
+
+/*
+ * Contention statistics for one place in the code that locks a profiled
+ * mutex.  Created by KND_MUTEX_LOCK().
+ */
+struct lock_site {
+	const char *name; // Name of the mutex
+	const char *file;
+	int line;
+
+	struct lock_site *next; // Next registered call site
+	unsigned int registered; // Accessed atomically
+
+	uint64_t contended; // Times the mutex was already locked (accessed atomically)
+	struct latency_histogram wait; // Nanoseconds spent waiting for the mutex
+	struct latency_histogram hold; // Nanoseconds the mutex was held
+};
+
+/*
+ * Locks the given mutex, recording the wait and hold times for this call site
+ * under the given lock_name (a string constant).  Returns the same values as
+ * pthread_mutex_lock().  The mutex must be unlocked with KND_MUTEX_UNLOCK().
+ */
+#define KND_MUTEX_LOCK(mutex, lock_name) ({\
+	static struct lock_site _lock_site = { .name = (lock_name), .file = __FILE__, .line = __LINE__ };\
+	profile_mutex_lock(&_lock_site, (mutex));\
+})
+
+/*
+ * Unlocks a mutex locked with KND_MUTEX_LOCK().  Returns the same values as
+ * pthread_mutex_unlock().
+ */
+#define KND_MUTEX_UNLOCK(mutex) profile_mutex_unlock(mutex)
+
+/*
+ * Locks the given mutex like pthread_mutex_lock(), recording the wait in the
+ * given call site's statistics.  Use KND_MUTEX_LOCK() instead of calling this
+ * directly.
+ */
+int profile_mutex_lock(struct lock_site *site, pthread_mutex_t *mutex);
+
+/*
+ * Unlocks the given mutex like pthread_mutex_unlock(), recording how long it
+ * was held in the statistics of the call site that locked it.  Use
+ * KND_MUTEX_UNLOCK() instead of calling this directly.
+ */
+int profile_mutex_unlock(pthread_mutex_t *mutex);
+
+/*
+ * Returns the first profiled call site that has been used, or NULL if none
+ * have.  Follow each site's next pointer for the rest.
+ */
+struct lock_site *get_lock_sites(void);
+
+/*
+ * Clears the statistics of every call site.  Locks taken during the reset may
+ * or may not be counted.
+ */
+void reset_lock_profile(void);
+
+#else /* KND_LOCK_PROFILE */
+
+#define KND_MUTEX_LOCK(mutex, lock_name) pthread_mutex_lock(mutex)
+#define KND_MUTEX_UNLOCK(mutex) pthread_mutex_unlock(mutex)
+
+#endif /* KND_LOCK_PROFILE */
+
+
+/***** alloc.c *****/
+
+#ifdef KND_ALLOC_COUNT
+
+/*
+ * Counts allocations made by the calling thread until KND_FRAME_PATH_END() as
+ * frame path allocations.  Scopes may be nested.
+ */
+#define KND_FRAME_PATH_BEGIN() frame_path_begin()
+
+/*
+ * Ends a scope started by KND_FRAME_PATH_BEGIN().
+ */
+#define KND_FRAME_PATH_END() frame_path_end()
+
+/*
+ * Starts counting the calling thread's allocations as frame path
+ * allocations.  Scopes may be nested.  Use KND_FRAME_PATH_BEGIN() instead of
+ * calling this directly.
+ */
+void frame_path_begin(void);
+
+/*
+ * Ends a scope started by frame_path_begin().  Use KND_FRAME_PATH_END()
+ * instead of calling this directly.
+ */
+void frame_path_end(void);
+
+/*
+ * Stores the number of allocations made by the whole process and by the
+ * frame path since startup or the last reset_alloc_counts().
+ */
+void get_alloc_counts(uint64_t *total, uint64_t *frame);
+
+/*
+ * Clears the allocation counts.
+ */
+void reset_alloc_counts(void);
+
+#else /* KND_ALLOC_COUNT */
+
+#define KND_FRAME_PATH_BEGIN() ((void)0)
+#define KND_FRAME_PATH_END() ((void)0)
+
+#endif /* KND_ALLOC_COUNT */
+
 
 /***** save.c *****/
 
 /*
- * Initializes zone saving (makes sure the directory exists and is writable).
- * This should not be called while the given zone list is being accessed by
- * another thread.  Returns a pointer to a save_info struct on success, NULL on
- * error.
+ * Initializes zone saving (makes sure the directory exists and is writable)
+ * and starts a background thread that saves the zones after they change.  The
+ * thread waits for changes to stop for half a second (e.g. while a zone is
+ * dragged in a UI), but no longer than the given interval after the first
+ * unsaved change.  This should not be called while the given zone list is
+ * being accessed by another thread.  Returns a pointer to a save_info struct
+ * on success, NULL on error.
  */
 struct save_info *init_save(struct knd_info *knd, struct zonelist *zones, const char *savedir, struct timespec *interval);
 
 /*
- * Frees the given save information.  Call this *before* the associated zone
- * list is freed.
+ * Frees the given save information and stops the associated thread.  Call this
+ * *before* the associated zone list is freed.
  */
 void cleanup_save(struct save_info *info);
 
 /*
- * Unconditionally saves the zone list associated with the given save info.
+ * Unconditionally saves the zone list associated with the given save info,
+ * rewriting the text and binary zone files and removing the journal.
  * Returns 0 on success, -1 on error.
  */
 int save_zones(struct save_info *info);
 
 /*
- * Loads zone information, if it exists, from the directory pointed to by info.
- * Does not remove any existing zones from the zone list.  Returns number of
+ * Loads zones from the given zone file into the given zone list.  Does not
+ * remove any existing zones from the zone list.  If tilt is not NULL and the
+ * file contains a motor tilt, the tilt is stored in *tilt.  Returns number of
  * zones read on success, -1 on error.
  */
+int load_zone_file(const char *path, struct zonelist *zones, int *tilt);
+
+/*
+ * Loads zone information, if it exists, from the directory pointed to by info,
+ * applying any changes recorded in the journal.  The binary zone file is used
+ * instead of the text zone file if it was saved with the current text file.
+ * Does not remove any existing zones from the zone list.  Returns number of
+ * zones in the zone list on success, -1 on error.
+ */
 int load_zones(struct save_info *info);
 
 /*
- * Saves the zone list associated with this save info if its save interval has
- * elapsed since the last save and the zone list's version has changed.  On the
- * off chance that approximately (2^32)-1 zone changes occur between calls to
- * this function, the zones will not be saved.  This function should not be
- * called while the zone list is locked.  Returns 1 if the zones were not
- * saved, 0 on successful save, -1 on error.
+ * Saves changes to the zone list associated with this save info if the zone
+ * list's version has changed since it was last saved or loaded.  Changes are
+ * appended to the journal, and the zone file is only rewritten when the
+ * journal grows too large.  On the off chance that approximately (2^32)-1 zone
+ * changes occur between calls to this function, the zones will not be saved.
+ * This function should not be called while the zone list is locked.  Returns
+ * 1 if the zones were not saved, 0 on successful save, -1 on error.
  */
 int check_save(struct save_info *info);
 
@@ -8,7 +8,12 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
 #include <arpa/inet.h>
+#include <limits.h>
+#include <ctype.h>
 
 #include <stdint.h>
 #define u_char uint8_t
@@ -24,6 +29,29 @@
 #define QUEUED_CONNECTIONS	8	// 2nd parameter to listen()
 #define CLIENT_TIMEOUT		0	// No timeout
 #define KND_PROTOCOL_VERSION	2	// Switched to millimeters in version 2
+#define MAX_SHARDS		64	// Maximum number of client event loops
+#define HTTP_MAX_REQUEST	8192	// Longest accepted metrics request header
+#define HTTP_TIMEOUT		10	// Seconds before an idle metrics connection is closed
+#define HEARTBEAT_MS		100	// Event loop heartbeat interval (see watchdog.c)
+#define STALL_MS		250	// Heartbeat lateness logged as an event loop stall
+#define SPARE_UPDATES		16	// Finished updates kept for reuse
+#define ZONE_INFO_LENGTH	(512 + ZONE_NAME_LENGTH) // Longest line from format_zone_info()
+
+// Reasons for waking an event loop (see wake_shard())
+#define WAKE_DEPTH		0x01	// A depth frame arrived (shard 0 only)
+#define WAKE_VIDEO		0x02	// A video frame arrived (shard 0 only)
+#define WAKE_COMPRESSED		0x04	// A compressed depth frame is ready (shard 0 only)
+#define WAKE_UPDATES		0x08	// Updates were queued for the shard
+#define WAKE_CONNECTIONS	0x10	// Connections were assigned to the shard
+#define WAKE_KILL		0x20	// The event loop should exit
+#define WAKE_CAMERA		0x40	// The camera was disconnected or reconnected (shard 0 only)
+
+// Subscription types shown by the clients command (see update_client_stats())
+#define CLIENT_SUB_ZONES	0x01
+#define CLIENT_SUB_DEPTH	0x02
+#define CLIENT_SUB_COMPRESSED	0x04
+#define CLIENT_SUB_BRIGHT	0x08
+#define CLIENT_SUB_VIDEO	0x10
 
 // Declares a function called [name]_func suitable for use as a command function
 #define DECLARE_FUNC(name) \
@@ -55,6 +83,84 @@
 #endif /* DEBUG */
 
 
+/*
+ * An immutable, reference-counted batch of output that is delivered to the
+ * clients of every shard in the order the updates were published.
+ */
+struct knd_update {
+	struct knd_update *next; // Next spare update (protected by update_lock)
+	int refs; // Shards that have not processed the update (protected by update_lock)
+
+	char *text; // SUB, ADD, and DEL lines for clients subscribed to zones
+	size_t text_len;
+	size_t text_alloc; // Allocated size of text, kept when the update is reused
+
+	unsigned int depth:1; // A depth frame arrived
+	unsigned int video:1; // A video frame arrived
+	unsigned int compressed:1; // A compressed depth frame is attached
+	unsigned int camera:1; // The camera status changed (sent to all clients)
+	unsigned int camera_connected:1; // New camera status (if camera is set)
+	unsigned int depth_frame; // Server depth frame counter (if depth is set)
+	struct timespec depth_time; // Time the depth frame arrived (if depth is set)
+	uint64_t depth_arrival; // Time the frame arrived from the camera (see latency_now())
+
+	unsigned int seq; // Compressed frame data (see get_depth_encoder_frame())
+	uint8_t *delta;
+	size_t delta_size;
+	size_t delta_alloc;
+	uint8_t *key;
+	size_t key_size;
+	size_t key_alloc;
+};
+
+/*
+ * A connection accepted by the server thread and waiting to be set up by a
+ * shard's thread.
+ */
+struct knd_connection {
+	struct knd_connection *next;
+	int fd;
+	char *addr;
+	unsigned short port; // Network byte order
+	unsigned int local:1;
+	unsigned int trusted:1;
+};
+
+/*
+ * An event loop that owns a subset of the server's clients.  Shard 0 runs in
+ * the server thread, which also accepts connections and receives frame
+ * notifications; any other shards run in their own threads.
+ */
+struct knd_shard {
+	struct knd_server *server;
+	int index;
+
+	struct nl_thread *thread; // NULL for shard 0
+	struct event_base *evloop;
+	struct event *wake_event;
+	int wake_fd; // eventfd signaled by wake_shard()
+	unsigned int wake_flags; // Pending WAKE_* bits (accessed atomically)
+
+	struct event *heartbeat_event; // Periodic timer for the stall monitor
+	struct knd_loop_monitor *monitor; // Owned by the watchdog (NULL if not monitored)
+
+	struct knd_client *client_list; // First element is a placeholder list head
+	int client_count; // Protected by update_lock
+
+	// Protected by update_lock
+	struct knd_update **queue; // Updates waiting to be processed
+	int queue_len;
+	int queue_size;
+	struct knd_connection *connections; // Connections waiting to be set up
+
+	// Only used by the shard's thread
+	struct knd_update **work; // Updates being processed (swapped with queue)
+	int work_size;
+	struct depth_stream *depth_streams; // Cropped/decimated depth streams in use by clients
+	unsigned int depth_frame; // Frame counter of the most recent depth update
+	struct timespec depth_time; // Time of the most recent depth update
+};
+
 /*
  * Depth camera server information.
  */
@@ -63,16 +169,72 @@ struct knd_server {
 
 	struct nl_thread *thread;
 
-	struct knd_client *client_list; // First element is a placeholder list head
-	int client_count;
+	struct knd_shard *shards;
+	int shard_count;
 
-	struct event_base *evloop;
+	// Serializes commands that change shared state (zones, recording)
+	// with each other and with zone update generation, so every client
+	// sees zone events in the same order.
+	pthread_mutex_t command_lock;
+
+	// Protects shard queues, pending connections, and client counts
+	pthread_mutex_t update_lock;
+
+	unsigned int locks_ready:1; // Whether the mutexes were initialized
+
+	struct event_base *evloop; // Shard 0's event loop
 	struct event *connect_event;
 	int listenfd;
 
-	struct event *wake_event;
-	int wake_read; // Used only by the server's event loop
-	int wake_write; // Used to wake or kill the server's event loop (write 'W' to wake, 'K' to kill)
+	struct event *unix_event; // Connection event for the UNIX domain socket
+	int unix_fd; // UNIX domain listening socket (-1 if not listening)
+	char *unix_path; // Socket path, removed when the server is destroyed
+	uid_t trusted_uid; // Additional trusted peer user ID ((uid_t)-1 for none)
+	gid_t trusted_gid; // Additional trusted peer group ID ((gid_t)-1 for none)
+
+	struct event *metrics_event; // Connection event for the metrics HTTP listener
+	int metrics_fd; // Metrics HTTP listening socket (-1 if not listening)
+	struct knd_metrics *metrics;
+	struct knd_http_client *http_clients; // Metrics HTTP connections (server thread only)
+
+	struct depth_encoder *encoder; // Compresses depth frames for compressed subscribers
+	unsigned int depth_frame; // Latest depth frame published to shards
+	unsigned int video_frame; // Latest video frame published to shards
+
+	// Incremented by the camera callbacks (accessed atomically)
+	unsigned int depth_received;
+	unsigned int video_received;
+	uint64_t depth_arrival; // Camera arrival time of the latest depth frame (accessed atomically)
+
+	int camera_connected; // Set by kndsrv_set_camera() (accessed atomically)
+	int camera_published; // Camera status last published to shards (server thread only)
+
+	unsigned int next_client_id; // Accessed atomically
+
+	// Finished updates kept so the frame path doesn't allocate (protected by update_lock)
+	struct knd_update *spare_updates;
+	int spare_count;
+
+	// Stopped recorders still finishing their files (protected by command_lock)
+	struct knd_recorder **closing;
+	int closing_count;
+
+#ifdef KND_ALLOC_COUNT
+	uint64_t alloc_frames; // Depth frames processed when allocations were last cleared (accessed atomically)
+#endif /* KND_ALLOC_COUNT */
+};
+
+/*
+ * A connection to the metrics HTTP listener.  Each connection is answered once
+ * and then closed.
+ */
+struct knd_http_client {
+	struct knd_server *server;
+	struct knd_http_client *prev, *next;
+
+	int fd;
+	struct bufferevent *buf_event;
+	unsigned int responded:1;
 };
 
 /*
@@ -80,6 +242,7 @@ struct knd_server {
  */
 struct knd_client {
 	struct knd_server *server;
+	struct knd_shard *shard; // The event loop that owns the client
 
 	struct knd_client *prev, *next;
 
@@ -88,6 +251,8 @@ struct knd_client {
 	unsigned short remote_port;
 	unsigned int shutdown_requested:1;
 	unsigned int shutdown:1;
+	unsigned int local:1; // Connected via the UNIX domain socket
+	unsigned int trusted:1; // Local peer credentials are trusted (see kndsrv_listen_unix())
 
 	// Subscription status flags
 	unsigned int subglobal:1; // Whether the client is subscribed to global zones
@@ -95,6 +260,14 @@ struct knd_client {
 	unsigned int subbright:1; // '' '' zone brightness
 	unsigned int subvideo:1;  // '' '' raw video data
 	int depth_limit;	  // Number of depth frames to capture before unsubscribing (<= 0 to go forever)
+	struct depth_stream *depth_stream; // Cropped/decimated depth (NULL for full frames)
+	struct timespec depth_interval; // Minimum time between depth frames (zero for every frame)
+	struct timespec next_depth; // Earliest time for the next depth frame if depth_interval is set
+	unsigned int depth_compress:1; // Whether depth frames are compressed
+	unsigned int depth_synced:1; // Whether a compressed frame with sequence depth_seq was sent
+	unsigned int depth_encoding:1; // Whether the client is counted by the depth encoder
+	unsigned int depth_key_only:1; // Whether the client is counted as receiving only key frames
+	unsigned int depth_seq; // Sequence number of the last compressed frame sent
 
 	struct bufferevent *buf_event;
 	struct evbuffer *buffer;
@@ -103,10 +276,30 @@ struct knd_client {
 	size_t last_len; // amount of data left in buffer
 
 	struct zonelist *zones;
+
+	// Statistics for the clients command, written by the shard's thread
+	// and read atomically by any thread (see update_client_stats())
+	unsigned int id; // Unique client number, used by the kick command
+	struct timespec connect_time;
+	uint64_t bytes_queued; // Total bytes moved to the bufferevent (shard's thread only)
+	uint64_t bytes_sent; // Bytes written to the socket
+	uint64_t out_queue; // Bytes waiting in the bufferevent as of the last write
+	uint64_t frames_skipped; // Depth frames dropped while subscribed
+	uint64_t commands;
+	uint64_t command_ns; // Total time spent running commands
+	uint64_t command_second; // Monotonic second of command_count
+	unsigned int command_count; // Commands run during command_second
+	unsigned int command_prev; // Commands run during the second before command_second
+	unsigned int sub_flags; // CLIENT_SUB_* bits
 };
 
 struct knd_cmd;
 
+static void publish_text(struct knd_shard *shard, struct evbuffer *buf);
+static void process_updates(struct knd_shard *shard);
+static int add_update_text(struct knd_update *update, const char *text, size_t len);
+static void wake_shard(struct knd_shard *shard, unsigned int flags);
+
 /*
  * Command handler function pointer type definition.
  */
@@ -119,10 +312,47 @@ struct knd_cmd {
 	char *name;
 	char *desc;
 	knd_cmd_func func;
+	unsigned int locked; // Run with the server's command lock held
 	// TODO: Change to space-separated arguments and add argc_min, argc_max, **argv
 };
 
 
+static void lock_commands(struct knd_server *server)
+{
+	int ret;
+	if((ret = pthread_mutex_lock(&server->command_lock))) {
+		ERROR_OUT("Error locking server command mutex: %s\n", strerror(ret));
+		abort();
+	}
+}
+
+static void unlock_commands(struct knd_server *server)
+{
+	int ret;
+	if((ret = pthread_mutex_unlock(&server->command_lock))) {
+		ERROR_OUT("Error unlocking server command mutex: %s\n", strerror(ret));
+		abort();
+	}
+}
+
+static void lock_updates(struct knd_server *server)
+{
+	int ret;
+	if((ret = pthread_mutex_lock(&server->update_lock))) {
+		ERROR_OUT("Error locking server update mutex: %s\n", strerror(ret));
+		abort();
+	}
+}
+
+static void unlock_updates(struct knd_server *server)
+{
+	int ret;
+	if((ret = pthread_mutex_unlock(&server->update_lock))) {
+		ERROR_OUT("Error unlocking server update mutex: %s\n", strerror(ret));
+		abort();
+	}
+}
+
 static void shutdown_client(struct knd_client *client)
 {
 	if(!client->shutdown && shutdown(client->fd, SHUT_RDWR)) {
@@ -144,49 +374,99 @@ static void request_shutdown_client(struct knd_client *client)
 	}
 }
 
+/*
+ * Publishes the given client's output queue length, bytes sent, and
+ * subscriptions for the clients command.  Called whenever output is queued or
+ * the socket drains.  Call from the client's shard thread.
+ */
+static void update_client_stats(struct knd_client *client)
+{
+	uint64_t out_queue = EVBUFFER_LENGTH(client->buf_event->output) + EVBUFFER_LENGTH(client->buffer);
+	unsigned int sub_flags = 0;
+
+	if(client->subglobal) {
+		sub_flags |= CLIENT_SUB_ZONES;
+	}
+	if(client->subdepth) {
+		sub_flags |= client->depth_compress ? CLIENT_SUB_COMPRESSED : CLIENT_SUB_DEPTH;
+	}
+	if(client->subbright) {
+		sub_flags |= CLIENT_SUB_BRIGHT;
+	}
+	if(client->subvideo) {
+		sub_flags |= CLIENT_SUB_VIDEO;
+	}
+
+	__atomic_store_n(&client->out_queue, out_queue, __ATOMIC_RELAXED);
+	__atomic_store_n(&client->bytes_sent,
+			client->bytes_queued - EVBUFFER_LENGTH(client->buf_event->output), __ATOMIC_RELAXED);
+	__atomic_store_n(&client->sub_flags, sub_flags, __ATOMIC_RELAXED);
+}
+
 /*
  * Queues data buffer for transmission, but doesn't actually send it to the
  * socket.
  */
 void flush_client(struct knd_client *client)
 {
+	client->bytes_queued += EVBUFFER_LENGTH(client->buffer);
 	if(bufferevent_write_buffer(client->buf_event, client->buffer)) {
 		ERROR_OUT("Error sending data to client on fd %d\n", client->fd);
 	}
+	update_client_stats(client);
 }
 
 /*
- * Sends information about the given zone to the given client as a single-line
- * list of key-value pairs.  If full is nonzero, sends all zone attributes;
- * otherwise only sends occupied, pop, maxpop, and name.
+ * Writes information about the given zone to buf as a single-line list of
+ * key-value pairs, truncating at size bytes (ZONE_INFO_LENGTH is always
+ * enough).  If full is nonzero, writes all zone attributes; otherwise only
+ * occupied, pop, maxpop, and name.  Returns the length of the line.
  */
-static void send_zone_info(struct knd_client *client, struct zone *zone, int full)
+static size_t format_zone_info(char *buf, size_t size, struct zone *zone, int full)
 {
 	int pop = MAX_NUM(1, zone->pop);
+	size_t len = 0;
 
 	if(full) {
-		evbuffer_add_printf(client->buffer, "xmin=%d ymin=%d zmin=%d xmax=%d ymax=%d zmax=%d ",
+		len += snprintf(buf + len, size - MIN_NUM(len, size),
+				"xmin=%d ymin=%d zmin=%d xmax=%d ymax=%d zmax=%d ",
 				zone->xmin, zone->ymin, zone->zmin, zone->xmax, zone->ymax, zone->zmax);
-		evbuffer_add_printf(client->buffer, "px_xmin=%d px_ymin=%d px_zmin=%d px_xmax=%d px_ymax=%d px_zmax=%d ",
+		len += snprintf(buf + len, size - MIN_NUM(len, size),
+				"px_xmin=%d px_ymin=%d px_zmin=%d px_xmax=%d px_ymax=%d px_zmax=%d ",
 				zone->px_xmin, zone->px_ymin, zone->px_zmin, zone->px_xmax, zone->px_ymax, zone->px_zmax);
-		evbuffer_add_printf(client->buffer, "negate=%d param=%s on_level=%d off_level=%d on_delay=%d off_delay=%d ",
+		len += snprintf(buf + len, size - MIN_NUM(len, size),
+				"negate=%d param=%s on_level=%d off_level=%d on_delay=%d off_delay=%d ",
 				zone->negate, param_ranges[zone->occupied_param].name,
 				zone->rising_threshold, zone->falling_threshold,
 				zone->rising_delay, zone->falling_delay);
 	}
 
 #ifdef DEBUG
-	evbuffer_add_printf(client->buffer, "delay_count=%d ", zone->count);
+	len += snprintf(buf + len, size - MIN_NUM(len, size), "delay_count=%d ", zone->count);
 #endif /* DEBUG */
 
 	// sa= is an approximation of area that is accurate to 3-4 digits
-	evbuffer_add_printf(client->buffer, "occupied=%u pop=%d maxpop=%d xc=%d yc=%d zc=%d sa=%d name=\"%s\"\n",
+	len += snprintf(buf + len, size - MIN_NUM(len, size),
+				"occupied=%u pop=%d maxpop=%d xc=%d yc=%d zc=%d sa=%d name=\"%s\"\n",
 				zone->occupied ^ zone->negate, zone->pop, zone->maxpop,
 				zone_xc(zone),
 				zone_yc(zone),
 				zone_zc(zone),
 				zone->pop > 0 ? (int)(zone->pop * surface_area((float)zone->zsum / pop)) : 0,
 				zone->name); // TODO: escape name
+
+	return MIN_NUM(len, size - 1);
+}
+
+/*
+ * Adds information about the given zone to the given buffer (see
+ * format_zone_info()).
+ */
+static void send_zone_info(struct evbuffer *buf, struct zone *zone, int full)
+{
+	char line[ZONE_INFO_LENGTH];
+
+	evbuffer_add(buf, line, format_zone_info(line, sizeof(line), zone, full));
 }
 
 
@@ -209,6 +489,19 @@ DECLARE_FUNC(tilt);
 DECLARE_FUNC(fps);
 DECLARE_FUNC(lut);
 DECLARE_FUNC(sa);
+DECLARE_FUNC(record);
+DECLARE_FUNC(getshm);
+DECLARE_FUNC(latency);
+DECLARE_FUNC(stats);
+DECLARE_FUNC(clients);
+DECLARE_FUNC(kick);
+DECLARE_FUNC(trace);
+#ifdef KND_LOCK_PROFILE
+DECLARE_FUNC(locks);
+#endif /* KND_LOCK_PROFILE */
+#ifdef KND_ALLOC_COUNT
+DECLARE_FUNC(allocs);
+#endif /* KND_ALLOC_COUNT */
 
 #ifdef DEBUG
 DECLARE_FUNC(die);
@@ -216,29 +509,43 @@ DECLARE_FUNC(segv);
 #endif /* DEBUG */
 
 static struct knd_cmd commands[] = {
-	{ "bye", "Disconnects from the server.", bye_func },
-	{ "ver", "Returns the server protocol version.", ver_func },
-	{ "help", "Lists available commands.", help_func },
-	{ "addzone", "Adds a new global zone (name, xmin, ymin, zmin, xmax, ymax, zmax).", addzone_func },
-	{ "setzone", "Sets a zone's parameters (name, all, xmin, ymin, zmin, xmax, ymax, zmax or name, [attr], value).", setzone_func },
-	{ "rmzone", "Removes a global zone (name).", rmzone_func },
-	{ "clear", "Removes all global zones.", clear_func },
-	{ "zones", "Lists all global zones.", zones_func },
-	{ "sub", "Subscribe to global zone updates.", sub_func },
-	{ "unsub", "Unsubscribe from global zone updates.", unsub_func },
-	{ "getdepth", "Grabs a single 11-bit packed depth image (increments subscription count if already subscribed).", getdepth_func },
-	{ "subdepth", "Subscribes to 11-bit packed depth data (count (optional, <=0 means forever)).", subdepth_func },
-	{ "unsubdepth", "Unsubscribes from 11-bit packed depth data.", unsubdepth_func },
-	{ "getbright", "Asynchronously returns the approximate brightness within each zone.", getbright_func },
-	{ "getvideo", "Grabs a single video image.", getvideo_func },
-	{ "tilt", "Sets or returns the camera tilt in degrees from horizontal.", tilt_func },
-	{ "fps", "Returns the approximate frame rate (updated every 200ms).", fps_func },
-	{ "lut", "Returns the depth look-up table, or looks up an entry in the table.", lut_func},
-	{ "sa", "Returns the surface area look-up table, or looks up an entry in the table.", sa_func},
+	{ "bye", "Disconnects from the server.", bye_func, 0 },
+	{ "ver", "Returns the server protocol version.", ver_func, 0 },
+	{ "help", "Lists available commands.", help_func, 0 },
+	{ "addzone", "Adds a new global zone (name, xmin, ymin, zmin, xmax, ymax, zmax).", addzone_func, 1 },
+	{ "setzone", "Sets a zone's parameters (name, all, xmin, ymin, zmin, xmax, ymax, zmax or name, [attr], value).", setzone_func, 1 },
+	{ "rmzone", "Removes a global zone (name).", rmzone_func, 1 },
+	{ "clear", "Removes all global zones.", clear_func, 1 },
+	{ "zones", "Lists all global zones.", zones_func, 0 },
+	{ "sub", "Subscribe to global zone updates.", sub_func, 1 },
+	{ "unsub", "Unsubscribe from global zone updates.", unsub_func, 0 },
+	{ "getdepth", "Grabs a single 11-bit packed depth image (increments subscription count if already subscribed) (depth options (optional)).", getdepth_func, 0 },
+	{ "subdepth", "Subscribes to 11-bit packed depth data (count (optional, <=0 means forever), depth options (optional): x=,y=,w=,h= or zone=name, stride=N[xM], pool=min|median, format=packed|u16|mm, fps=N, compress).", subdepth_func, 0 },
+	{ "unsubdepth", "Unsubscribes from 11-bit packed depth data.", unsubdepth_func, 0 },
+	{ "getbright", "Asynchronously returns the approximate brightness within each zone.", getbright_func, 0 },
+	{ "getvideo", "Grabs a single video image.", getvideo_func, 0 },
+	{ "tilt", "Sets or returns the camera tilt in degrees from horizontal.", tilt_func, 0 },
+	{ "fps", "Returns the approximate frame rate (updated every 200ms).", fps_func, 0 },
+	{ "lut", "Returns the depth look-up table, or looks up an entry in the table.", lut_func, 0 },
+	{ "sa", "Returns the surface area look-up table, or looks up an entry in the table.", sa_func, 0 },
+	{ "record", "Records depth to a new .knr file in the data directory, stops recording, or returns recording status (name[,key=N][,video] or stop).", record_func, 1 },
+	{ "getshm", "Passes a read-only descriptor for the shared memory frame region (trusted UNIX socket clients only).", getshm_func, 0 },
+	{ "latency", "Returns depth frame latency percentiles for each pipeline stage, or clears them (reset).", latency_func, 0 },
+	{ "stats", "Returns per-second frame counts for the last N seconds (N (optional, defaults to 10, up to 60)), event loop stall statistics (loops[,reset]), or depth frame interval statistics (intervals).", stats_func, 0 },
+	{ "clients", "Lists connected clients with their output queue, bytes sent, skipped frames, command rate, and subscriptions.", clients_func, 0 },
+	{ "kick", "Disconnects a client (id from the clients command).", kick_func, 0 },
+	{ "trace", "Returns recent stage timings from every thread as Chrome trace JSON (seconds (optional, defaults to 5)).", trace_func, 0 },
+
+#ifdef KND_LOCK_PROFILE
+	{ "locks", "Returns mutex wait and hold times for each profiled call site, or clears them (reset).", locks_func, 0 },
+#endif /* KND_LOCK_PROFILE */
+#ifdef KND_ALLOC_COUNT
+	{ "allocs", "Returns allocations made while handling depth frames and in total, or clears them (reset).", allocs_func, 0 },
+#endif /* KND_ALLOC_COUNT */
 
 #ifdef DEBUG
-	{ "die", "Shuts down the server.", die_func }, // TODO: Add a hidden flag so this command doesn't show up in help?
-	{ "segv", "Causes a segmentation fault in the server thread (for testing crash handling).", segv_func },
+	{ "die", "Shuts down the server.", die_func, 0 }, // TODO: Add a hidden flag so this command doesn't show up in help?
+	{ "segv", "Causes a segmentation fault in the server thread (for testing crash handling).", segv_func, 0 },
 	// TODO: Add a debugging command to trigger a watchdog timeout
 #endif /* DEBUG */
 };
@@ -267,19 +574,19 @@ static void help_func(struct knd_client *client, struct knd_cmd *command, int ar
 }
 
 // Used by addzone_func() to send zone addition events.
-static void process_addition(void *data, struct zone *zone)
+static void process_addition(struct knd_client *client, struct zone *zone)
 {
-	struct knd_client *client = data;
-	struct knd_server *server = client->server;
+	struct evbuffer *buf = evbuffer_new();
 
-	client = server->client_list->next;
-	while(client != NULL) {
-		if(client->subglobal) {
-			evbuffer_add(client->buffer, "ADD - ", 6);
-			send_zone_info(client, zone, 1);
-		}
-		client = client->next;
+	if(CHECK_NULL(buf)) {
+		ERROR_OUT("Error creating zone addition buffer.\n");
+		return;
 	}
+
+	evbuffer_add(buf, "ADD - ", 6);
+	send_zone_info(buf, zone, 1);
+	publish_text(client->shard, buf);
+	evbuffer_free(buf);
 }
 
 static void addzone_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
@@ -313,9 +620,6 @@ static void addzone_func(struct knd_client *client, struct knd_cmd *command, int
 		return;
 	}
 
-	// TODO: When using separate zone lists for connections, a global list
-	// lock will be needed to prevent the zonelist list from being modified
-	// during updates, and from being updated during modification.
 	zone = add_zone(client->server->info->zones, name, xmin, ymin, zmin, xmax, ymax, zmax);
 	if(zone == NULL) {
 		evbuffer_add_printf(client->buffer, "ERR - Error adding zone \"%s\" to zone list.\n", name);
@@ -354,8 +658,9 @@ static void setzone_func(struct knd_client *client, struct knd_cmd *command, int
 	}
 
 	// A race condition between find_zone and set_zone* is not possible
-	// here because all calls to add/remove/modify zones happen in the
-	// single libevent processing thread.
+	// here because every command that adds, removes, or modifies zones is
+	// marked locked in commands[], so it holds the command lock whichever
+	// shard runs it.  Unlocked commands must use copy_zone() instead.
 	z = find_zone(client->server->info->zones, name);
 	if(z == NULL) {
 		evbuffer_add_printf(client->buffer, "ERR - Zone \"%s\" does not exist.\n", name);
@@ -395,19 +700,31 @@ static void setzone_func(struct knd_client *client, struct knd_cmd *command, int
 	}
 }
 
-// Used by rmzone_func() and clear_func() to send zone removal events.
-static void process_removal(void *data, struct zone *zone)
+// Used by rmzone_func() and clear_func() to build zone removal events.
+static void removal_callback(void *data, struct zone *zone)
 {
-	struct knd_client *client = data;
-	struct knd_server *server = client->server;
+	struct evbuffer *buf = data;
+	evbuffer_add_printf(buf, "DEL - %s\n", zone->name);
+}
 
-	client = server->client_list->next;
-	while(client != NULL) {
-		if(client->subglobal) {
-			evbuffer_add_printf(client->buffer, "DEL - %s\n", zone->name);
-		}
-		client = client->next;
+// Sends zone removal events for the given zone (or all zones if zone is NULL)
+// to all subscribed clients.
+static void process_removal(struct knd_client *client, struct zone *zone)
+{
+	struct evbuffer *buf = evbuffer_new();
+
+	if(CHECK_NULL(buf)) {
+		ERROR_OUT("Error creating zone removal buffer.\n");
+		return;
+	}
+
+	if(zone == NULL) {
+		iterate_zonelist(client->server->info->zones, removal_callback, buf);
+	} else {
+		removal_callback(buf, zone);
 	}
+	publish_text(client->shard, buf);
+	evbuffer_free(buf);
 }
 
 static void rmzone_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
@@ -416,9 +733,9 @@ static void rmzone_func(struct knd_client *client, struct knd_cmd *command, int
 
 	// TODO: Accept multiple arguments to remove multiple zones
 
-	// Note: since kndsrv is single threaded and only kndsrv can trigger
-	// zone removal, there is no possibility of a zone struct being freed
-	// between find_zone() and remove_zone().
+	// Note: since only locked commands can trigger zone removal, and this
+	// is one of them, there is no possibility of a zone struct being freed
+	// by another shard between find_zone() and remove_zone().
 
 	zone = find_zone(client->server->info->zones, args);
 	if(zone == NULL) {
@@ -436,7 +753,7 @@ static void rmzone_func(struct knd_client *client, struct knd_cmd *command, int
 
 static void clear_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
 {
-	iterate_zonelist(client->server->info->zones, process_removal, client);
+	process_removal(client, NULL);
 
 	clear_zonelist(client->server->info->zones);
 	evbuffer_add_printf(client->buffer, "OK - All zones were removed.\n");
@@ -446,28 +763,24 @@ static void clear_func(struct knd_client *client, struct knd_cmd *command, int a
 static void zones_callback(void *data, struct zone *zone)
 {
 	struct knd_client *client = data;
-	send_zone_info(client, zone, 1);
+	send_zone_info(client->buffer, zone, 1);
 }
 
 static void zones_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
 {
-	char *name;
+	char name[ZONE_NAME_LENGTH];
 	unsigned int version;
-	int idx = -1;
+	int idx;
 
 	// FIXME: zone count could change between the following lines.  Use a
 	// count generated by zones_callback.
-	name = peak_zone(client->server->info->zones, &idx, NULL, NULL);
+	idx = peak_zone(client->server->info->zones, name, NULL, NULL);
 	version = get_zonelist_version(client->server->info->zones);
 	evbuffer_add_printf(client->buffer, "OK - %d zones - Version %u, %d occupied, peak zone is %d \"%s\"\n",
 			zone_count(client->server->info->zones), version,
 			occupied_count(client->server->info->zones),
-			idx, name ? name : "[none]");
+			idx, idx >= 0 ? name : "[none]");
 	iterate_zonelist(client->server->info->zones, zones_callback, client);
-
-	if(name) {
-		free(name);
-	}
 }
 
 // Used by sub_func to send the initial subscription values
@@ -475,11 +788,15 @@ static void sub_func_callback(void *data, struct zone *zone)
 {
 	struct knd_client *client = data;
 	evbuffer_add(client->buffer, "SUB - ", 6);
-	send_zone_info(client, zone, 1);
+	send_zone_info(client->buffer, zone, 1);
 }
 
 static void sub_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
 {
+	// Deliver queued zone updates to other clients first, so the
+	// subscriber doesn't receive changes older than its initial values
+	process_updates(client->shard);
+
 	client->subglobal = 1;
 	evbuffer_add_printf(client->buffer, "OK - Subscribed to global zone updates\n");
 	iterate_zonelist(client->server->info->zones, sub_func_callback, client);
@@ -491,19 +808,217 @@ static void unsub_func(struct knd_client *client, struct knd_cmd *command, int a
 	evbuffer_add_printf(client->buffer, "OK - Unsubscribed from global zone updates\n");
 }
 
+/*
+ * Updates the depth encoder's count of compressed subscribers to match the
+ * given client's subscription.  Call after changing subdepth, depth_compress,
+ * or depth_interval.
+ */
+static void update_depth_encoding(struct knd_client *client)
+{
+	struct depth_encoder *enc = client->server->encoder;
+	int encoding = client->subdepth && client->depth_compress;
+	int key_only = encoding && (client->depth_interval.tv_sec || client->depth_interval.tv_nsec);
+
+	if(enc == NULL || (encoding == client->depth_encoding && key_only == client->depth_key_only)) {
+		return;
+	}
+
+	depth_encoder_add_clients(enc, encoding - client->depth_encoding, key_only - client->depth_key_only);
+	client->depth_encoding = encoding;
+	client->depth_key_only = key_only;
+
+	if(encoding && !client->depth_synced) {
+		depth_encoder_request_key(enc);
+	}
+}
+
+// Names of depth stream pixel formats
+static const char * const depth_format_names[] = {
+	[DEPTH_FORMAT_PACKED] = "packed",
+	[DEPTH_FORMAT_U16] = "u16",
+	[DEPTH_FORMAT_MM] = "mm",
+};
+
+/*
+ * Selects the region of interest, pooling, format, and rate limit for the given
+ * client's depth frames from comma-separated options in args (an empty string
+ * selects full frames at the camera's frame rate).  Sends an ERR response and
+ * returns -1 if the options are invalid.  Returns 0 on success.
+ */
+static int set_depth_options(struct knd_client *client, const char *args)
+{
+	struct knd_server *server = client->server;
+	struct depth_stream_params params = {
+		.x = 0, .y = 0, .w = FREENECT_FRAME_W, .h = FREENECT_FRAME_H,
+		.xstride = 1, .ystride = 1,
+		.pool = DEPTH_POOL_MIN,
+	};
+	struct depth_stream *stream = NULL;
+	char value[ZONE_NAME_LENGTH];
+	struct zone zone;
+	int compress;
+	int fps;
+
+	if(vidproc_get_opt(args, "zone", value, sizeof(value))) {
+		// getdepth and subdepth don't hold the command lock, so another
+		// shard may remove the zone at any time
+		if(copy_zone(server->info->zones, value, &zone)) {
+			evbuffer_add_printf(client->buffer, "ERR - Zone \"%s\" not found\n", value);
+			return -1;
+		}
+
+		params.x = zone.px_xmin;
+		params.y = zone.px_ymin;
+		params.w = zone.px_xmax - zone.px_xmin + 1;
+		params.h = zone.px_ymax - zone.px_ymin + 1;
+	}
+
+	params.x = vidproc_get_int_opt(args, "x", params.x);
+	params.y = vidproc_get_int_opt(args, "y", params.y);
+	params.w = vidproc_get_int_opt(args, "w", params.w);
+	params.h = vidproc_get_int_opt(args, "h", params.h);
+
+	if(vidproc_get_opt(args, "stride", value, sizeof(value))) {
+		switch(sscanf(value, "%dx%d", &params.xstride, &params.ystride)) {
+			case 1:
+				params.ystride = params.xstride;
+				break;
+
+			case 2:
+				break;
+
+			default:
+				params.xstride = 0;
+				break;
+		}
+	}
+
+	if(vidproc_get_opt(args, "pool", value, sizeof(value))) {
+		if(!strcmp(value, "min")) {
+			params.pool = DEPTH_POOL_MIN;
+		} else if(!strcmp(value, "median")) {
+			params.pool = DEPTH_POOL_MEDIAN;
+		} else {
+			evbuffer_add_printf(client->buffer, "ERR - Pooling must be min or median\n");
+			return -1;
+		}
+	}
+
+	if(vidproc_get_opt(args, "format", value, sizeof(value))) {
+		if(!strcmp(value, "packed")) {
+			params.format = DEPTH_FORMAT_PACKED;
+		} else if(!strcmp(value, "u16")) {
+			params.format = DEPTH_FORMAT_U16;
+		} else if(!strcmp(value, "mm")) {
+			params.format = DEPTH_FORMAT_MM;
+		} else {
+			evbuffer_add_printf(client->buffer, "ERR - Format must be packed, u16, or mm\n");
+			return -1;
+		}
+	}
+
+	fps = vidproc_get_int_opt(args, "fps", 0);
+	if(fps < 0) {
+		evbuffer_add_printf(client->buffer, "ERR - Invalid frame rate %d\n", fps);
+		return -1;
+	}
+
+	if(normalize_depth_stream_params(&params)) {
+		evbuffer_add_printf(client->buffer,
+				"ERR - Invalid region (must overlap the %dx%d image) or stride (must be 1 to %d)\n",
+				FREENECT_FRAME_W, FREENECT_FRAME_H, DEPTH_STREAM_MAX_STRIDE);
+		return -1;
+	}
+
+	compress = vidproc_get_opt(args, "compress", NULL, 0);
+	if(compress && !is_full_depth_stream(&params)) {
+		evbuffer_add_printf(client->buffer, "ERR - Compression is only supported for full packed frames\n");
+		return -1;
+	}
+	if(compress && server->encoder == NULL) {
+		evbuffer_add_printf(client->buffer, "ERR - Depth compression is not available\n");
+		return -1;
+	}
+
+	if(!is_full_depth_stream(&params)) {
+		stream = get_depth_stream(&client->shard->depth_streams, &params);
+		if(stream == NULL) {
+			evbuffer_add_printf(client->buffer, "ERR - Error creating depth stream\n");
+			return -1;
+		}
+	}
+
+	put_depth_stream(&client->shard->depth_streams, client->depth_stream);
+	client->depth_stream = stream;
+
+	client->depth_interval = (struct timespec){
+		.tv_sec = fps == 1 ? 1 : 0,
+		.tv_nsec = fps > 1 ? 1000000000 / fps : 0,
+	};
+	client->next_depth = (struct timespec){ .tv_sec = 0, .tv_nsec = 0 };
+
+	if(compress != client->depth_compress) {
+		client->depth_compress = compress;
+		client->depth_synced = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the size of each depth frame that will be sent to the given client.
+ */
+static size_t depth_frame_size(struct knd_client *client)
+{
+	int width, height;
+	size_t size;
+
+	if(client->depth_stream == NULL) {
+		return FREENECT_DEPTH_11BIT_PACKED_SIZE;
+	}
+
+	get_depth_stream_size(client->depth_stream, &width, &height, &size);
+	return size;
+}
+
+/*
+ * Adds a description of the given client's depth frames (if not full frames)
+ * to the end of an OK response line.
+ */
+static void add_depth_description(struct knd_client *client)
+{
+	int width, height;
+	size_t size;
+
+	if(client->depth_stream != NULL) {
+		get_depth_stream_size(client->depth_stream, &width, &height, &size);
+		evbuffer_add_printf(client->buffer, " - width=%d height=%d bytes=%zu format=%s",
+				width, height, size, depth_format_names[get_depth_stream_format(client->depth_stream)]);
+	} else if(client->depth_compress) {
+		evbuffer_add_printf(client->buffer, " - width=%d height=%d compressed=1",
+				FREENECT_FRAME_W, FREENECT_FRAME_H);
+	}
+
+	evbuffer_add_printf(client->buffer, "\n");
+}
+
 static void getdepth_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
 {
 	if(client->subdepth) {
 		if(client->depth_limit <= 0) {
 			evbuffer_add_printf(client->buffer, "ERR - Already subscribed to depth data\n");
-		} else {
+		} else if(argc == 0 || !set_depth_options(client, args)) {
+			update_depth_encoding(client);
 			client->depth_limit++;
-			evbuffer_add_printf(client->buffer, "OK - Incremented depth subscription count to %d\n", client->depth_limit);
+			evbuffer_add_printf(client->buffer, "OK - Incremented depth subscription count to %d", client->depth_limit);
+			add_depth_description(client);
 		}
-	} else {
+	} else if(!set_depth_options(client, args)) {
 		client->depth_limit = 1;
 		client->subdepth = 1;
-		evbuffer_add_printf(client->buffer, "OK - Requested a single depth frame for delivery as a DEPTH message\n");
+		update_depth_encoding(client);
+		evbuffer_add_printf(client->buffer, "OK - Requested a single depth frame for delivery as a DEPTH message");
+		add_depth_description(client);
 	}
 }
 
@@ -511,25 +1026,30 @@ static void subdepth_func(struct knd_client *client, struct knd_cmd *command, in
 {
 	int count = -1;
 
-	if(argc > 1) {
-		evbuffer_add_printf(client->buffer, "ERR - Too many arguments (expected 0 or 1)\n");
-		return;
-	}
-	if(argc == 1) {
+	// An optional count comes before any depth options (which, like
+	// compress, may have no value)
+	if(argc >= 1 && (isdigit(args[0]) || args[0] == '-')) {
 		count = MAX_NUM(atoi(args), -1);
+		args += strcspn(args, ",");
+	}
+
+	if(set_depth_options(client, args)) {
+		return;
 	}
 
 	client->depth_limit = count;
 	client->subdepth = 1;
+	update_depth_encoding(client);
 
 	if(count > 0) {
 		evbuffer_add_printf(client->buffer,
-				"OK - %d depth frame(s) will be delivered as DEPTH messages\n",
+				"OK - %d depth frame(s) will be delivered as DEPTH messages",
 				count);
 	} else {
 		evbuffer_add_printf(client->buffer,
-				"OK - depth frames will be delivered as DEPTH messages until unsubscribed\n");
+				"OK - depth frames will be delivered as DEPTH messages until unsubscribed");
 	}
+	add_depth_description(client);
 }
 
 static void unsubdepth_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
@@ -539,6 +1059,9 @@ static void unsubdepth_func(struct knd_client *client, struct knd_cmd *command,
 	} else {
 		client->subdepth = 0;
 		client->depth_limit = -1;
+		put_depth_stream(&client->shard->depth_streams, client->depth_stream);
+		client->depth_stream = NULL;
+		update_depth_encoding(client);
 		evbuffer_add_printf(client->buffer, "OK - Unsubscribed from depth data\n");
 	}
 }
@@ -637,583 +1160,2172 @@ static void sa_func(struct knd_client *client, struct knd_cmd *command, int argc
 	}
 }
 
-#ifdef DEBUG
-static void die_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+/*
+ * Frees the recorders passed to close_recorder() that have finished writing
+ * their files, or waits for and frees all of them if wait is nonzero.  Call
+ * with the command lock held, or after the server has stopped.
+ */
+static void reap_recorders(struct knd_server *server, int wait)
 {
-	evbuffer_add_printf(client->buffer, "OK - Stopping server\n");
-	client->server->info->stop = 1;
-}
+	int i;
 
-static void segv_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
-{
-	// Write directly to the client's fd since the server is about to crash
-	const char * const msg = "OK - Crashing server\n";
-	if(write(client->fd, msg, strlen(msg)) != (ssize_t)strlen(msg)) {
-		ERRNO_KNDSRV(client, "Error writing crash message to client.\n");
+	for(i = 0; i < server->closing_count; ) {
+		if(wait || recorder_finished(server->closing[i])) {
+			destroy_recorder(server->closing[i]);
+			server->closing[i] = server->closing[--server->closing_count];
+		} else {
+			i++;
+		}
 	}
-	*(volatile int *)NULL = 0;
 }
-#endif /* DEBUG */
-
 
 /*
- * Parses an individual command line.  The contents of the line are modified
- * during parsing.  Responses are sent to the given socket.  Socket errors are
- * not reported (it is expected that they will be caught in the outer socket
- * loop).
+ * Tells the given recorder to finish its file in its own thread, so slow
+ * storage doesn't stall the event loop, and keeps it for reap_recorders().
+ * Ignores a NULL recorder.  Call with the command lock held.
  */
-static void parse_line(struct knd_client *client, char *line)
+static void close_recorder(struct knd_server *server, struct knd_recorder *rec)
 {
-	char *cmd, *args;
-	size_t line_len;
-	size_t cmd_len;
-	size_t args_len;
-	size_t args_count;
-	unsigned int i;
-
-	// TODO: Client API that speaks this protocol to a server
-
-	line_len = strlen(line);
-
-	cmd_len = strcspn(line, " ");
+	struct knd_recorder **tmp;
 
-	line[cmd_len] = 0;
-	cmd = line;
+	if(rec == NULL) {
+		return;
+	}
 
-	// FIXME: Support escaping of argument separator in string values
-	args = line + MIN_NUM(cmd_len + 1, line_len);
-	args_len = strlen(args);
-	args_count = nl_strcount(args, ',') + MIN_NUM(args_len, 1); // If args_len is 0, args_count will not have 1 added
+	reap_recorders(server, 0);
 
-	// TODO: Allow the user to assign a sequence number to each incoming
-	// command, and use an internal sequence number, to allow asynchronous
-	// command completion, track return values, and identify any dropped
-	// commands?
-	for(i = 0; i < ARRAY_SIZE(commands); i++) {
-		if(!strcmp(commands[i].name, cmd)) {
-			commands[i].func(client, &commands[i], args_count, args);
-			break;
-		}
-	}
-	if(i == ARRAY_SIZE(commands)) {
-		DEBUG_KNDSRV(client, "Unknown command\n");
-		evbuffer_add_printf(client->buffer, "ERR - Unknown command\n");
+	tmp = realloc(server->closing, (server->closing_count + 1) * sizeof(server->closing[0]));
+	if(tmp == NULL) {
+		ERRNO_OUT("Error growing list of closing recorders; waiting for the recording to close");
+		destroy_recorder(rec);
+		return;
 	}
 
-	return;
+	stop_recorder(rec);
+	server->closing = tmp;
+	server->closing[server->closing_count++] = rec;
+}
+
+static void record_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+{
+	struct knd_info *info = client->server->info;
+	struct knd_recorder *rec;
+	char path[PATH_MAX];
+	unsigned int frames, dropped;
+	uint64_t bytes;
+	const char *name, *suffix;
+	size_t namelen;
+
+	if(argc == 0) {
+		rec = vidproc_get_recorder(info->vid);
+		if(rec == NULL) {
+			evbuffer_add_printf(client->buffer, "OK - Not recording\n");
+		} else {
+			name = get_recorder_stats(rec, &frames, &dropped, &bytes);
+			evbuffer_add_printf(client->buffer,
+					"OK - Recording to \"%s\" - frames=%u dropped=%u bytes=%llu\n",
+					name, frames, dropped, (unsigned long long)bytes);
+		}
+		return;
+	}
+
+	namelen = strcspn(args, ",");
+
+	if(namelen == 4 && !strncmp(args, "stop", 4)) {
+		rec = vidproc_set_recorder(info->vid, NULL, 0);
+		if(rec == NULL) {
+			evbuffer_add_printf(client->buffer, "ERR - Not recording\n");
+			return;
+		}
+
+		close_recorder(client->server, rec);
+		evbuffer_add_printf(client->buffer, "OK - Stopped recording\n");
+		return;
+	}
+
+	if(info->savedir == NULL) {
+		evbuffer_add_printf(client->buffer, "ERR - Recording requires a data directory (KND_SAVEDIR)\n");
+		return;
+	}
+	if(namelen == 0 || args[0] == '.' || memchr(args, '/', namelen) != NULL) {
+		evbuffer_add_printf(client->buffer, "ERR - Recording names must not be empty, start with '.', or contain '/'\n");
+		return;
+	}
+
+	// Recordings always end in .knr, so they can't replace zone or state files
+	suffix = KNR_SUFFIX;
+	if(namelen > strlen(KNR_SUFFIX) && !strncmp(args + namelen - strlen(KNR_SUFFIX), KNR_SUFFIX, strlen(KNR_SUFFIX))) {
+		suffix = "";
+	}
+	if(snprintf(path, sizeof(path), "%s/%.*s%s", info->savedir, (int)namelen, args, suffix) >= (int)sizeof(path)) {
+		evbuffer_add_printf(client->buffer, "ERR - Recording name is too long\n");
+		return;
+	}
+
+	rec = create_recorder(info, path, vidproc_get_int_opt(args + namelen, "key", 0));
+	if(rec == NULL) {
+		evbuffer_add_printf(client->buffer, "ERR - Error creating recording \"%.*s%s\" (it may already exist)\n",
+				(int)namelen, args, suffix);
+		return;
+	}
+
+	close_recorder(client->server, vidproc_set_recorder(info->vid, rec, vidproc_get_opt(args + namelen, "video", NULL, 0)));
+
+	evbuffer_add_printf(client->buffer, "OK - Recording to \"%.*s%s\"\n", (int)namelen, args, suffix);
+}
+
+/*
+ * Sends the given data on the given socket with fd attached as SCM_RIGHTS
+ * ancillary data.  Returns the number of bytes sent (the descriptor is sent
+ * with the first byte), or -1 on error.
+ */
+static ssize_t send_with_fd(int sockfd, const char *data, size_t len, int fd)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	memset(cbuf, 0, sizeof(cbuf));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	do {
+		ret = sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+	} while(ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+static void getshm_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+{
+	struct knd_shm *shm = client->server->info->shm;
+	char line[128];
+	ssize_t sent;
+	int len;
+
+	if(!client->local || !client->trusted) {
+		evbuffer_add_printf(client->buffer, "ERR - Shared memory is only available to trusted UNIX socket clients\n");
+		return;
+	}
+	if(shm == NULL) {
+		evbuffer_add_printf(client->buffer, "ERR - Shared memory is not enabled (KND_SHM)\n");
+		return;
+	}
+
+	// The descriptor travels with the first byte of the response, so
+	// everything queued before it must reach the socket first
+	flush_client(client);
+	if(EVBUFFER_LENGTH(client->buf_event->output) != 0) {
+		evbuffer_add_printf(client->buffer, "ERR - Output is pending; try again when idle\n");
+		return;
+	}
+
+	len = snprintf(line, sizeof(line), "OK - Shared memory descriptor attached - bytes=%zu\n", get_shm_size(shm));
+
+	sent = send_with_fd(client->fd, line, len, get_shm_fd(shm));
+	if(sent < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK) {
+			ERRNO_KNDSRV(client, "Error passing shared memory descriptor");
+		}
+		evbuffer_add_printf(client->buffer, "ERR - Error passing shared memory descriptor\n");
+		return;
+	}
+
+	// Queue anything the socket didn't accept
+	evbuffer_add(client->buffer, line + sent, len - sent);
+}
+
+static void latency_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+{
+	struct knd_latency *lat = client->server->info->latency;
+	struct latency_stats stats;
+	int i;
+
+	if(lat == NULL) {
+		evbuffer_add_printf(client->buffer, "ERR - Latency is not being measured\n");
+		return;
+	}
+
+	if(argc == 1 && !strcmp(args, "reset")) {
+		reset_latency(lat);
+		evbuffer_add_printf(client->buffer, "OK - Cleared latency histograms\n");
+		return;
+	}
+	if(argc != 0) {
+		evbuffer_add_printf(client->buffer, "ERR - Expected no arguments or reset\n");
+		return;
+	}
+
+	evbuffer_add_printf(client->buffer, "OK - %d stages follow (microseconds from camera arrival)\n", LATENCY_STAGES);
+	for(i = 0; i < LATENCY_STAGES; i++) {
+		get_latency_stats(lat, i, &stats);
+		evbuffer_add_printf(client->buffer, "stage=%s count=%llu p50=%llu p90=%llu p99=%llu max=%llu\n",
+				latency_stage_name(i), (unsigned long long)stats.count,
+				(unsigned long long)stats.p50, (unsigned long long)stats.p90,
+				(unsigned long long)stats.p99, (unsigned long long)stats.max);
+	}
+}
+
+/*
+ * Writes the heartbeat lateness histogram and stall count of each monitored
+ * event loop to the client, clearing them afterward if reset is nonzero.
+ */
+static void loop_stats(struct knd_client *client, int reset)
+{
+	struct knd_server *server = client->server;
+	struct knd_shard *shard;
+	struct latency_stats lateness;
+	uint64_t stalls;
+	int count = 0;
+	int i;
+
+	for(i = 0; i < server->shard_count; i++) {
+		count += server->shards[i].monitor != NULL;
+	}
+	if(count == 0) {
+		evbuffer_add_printf(client->buffer, "ERR - Event loops are not being monitored\n");
+		return;
+	}
+
+	evbuffer_add_printf(client->buffer, "OK - %d event loops follow (heartbeat lateness in microseconds)\n", count);
+	for(i = 0; i < server->shard_count; i++) {
+		shard = &server->shards[i];
+		if(shard->monitor == NULL) {
+			continue;
+		}
+
+		stalls = get_loop_stats(shard->monitor, &lateness);
+		evbuffer_add_printf(client->buffer, "shard=%d heartbeats=%llu p50=%llu p90=%llu p99=%llu max=%llu stalls=%llu\n",
+				shard->index, (unsigned long long)lateness.count,
+				(unsigned long long)lateness.p50, (unsigned long long)lateness.p90,
+				(unsigned long long)lateness.p99, (unsigned long long)lateness.max,
+				(unsigned long long)stalls);
+		if(reset) {
+			reset_loop_stats(shard->monitor);
+		}
+	}
+}
+
+/*
+ * Writes statistics of the intervals between depth frames, as measured by the
+ * watchdog, to the client.
+ */
+static void frame_intervals(struct knd_client *client)
+{
+	struct knd_watchdog *wd = client->server->info->wd;
+	struct latency_stats intervals;
+	uint64_t average, jitter;
+
+	if(wd == NULL) {
+		evbuffer_add_printf(client->buffer, "ERR - The watchdog is not running\n");
+		return;
+	}
+
+	get_watchdog_intervals(wd, &intervals, &average, &jitter);
+	evbuffer_add_printf(client->buffer,
+			"OK - Depth frame intervals in microseconds: count=%llu p50=%llu p90=%llu p99=%llu max=%llu average=%llu jitter=%llu\n",
+			(unsigned long long)intervals.count, (unsigned long long)intervals.p50,
+			(unsigned long long)intervals.p90, (unsigned long long)intervals.p99,
+			(unsigned long long)intervals.max, (unsigned long long)average,
+			(unsigned long long)jitter);
+}
+
+static void stats_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+{
+	struct knd_stats_sample samples[KND_STATS_HISTORY];
+	struct knd_stats *stats = client->server->info->stats;
+	int count = 10;
+	int i;
+
+	if(argc == 1 && !strcmp(args, "intervals")) {
+		frame_intervals(client);
+		return;
+	}
+	if(argc >= 1 && !strncmp(args, "loops", 5) && (args[5] == 0 || args[5] == ',')) {
+		if(argc == 1) {
+			loop_stats(client, 0);
+		} else if(argc == 2 && !strcmp(args + 6, "reset")) {
+			loop_stats(client, 1);
+		} else {
+			evbuffer_add_printf(client->buffer, "ERR - Expected loops or loops,reset\n");
+		}
+		return;
+	}
+
+	if(stats == NULL) {
+		evbuffer_add_printf(client->buffer, "ERR - Frame statistics are not available\n");
+		return;
+	}
+
+	if(argc > 1) {
+		evbuffer_add_printf(client->buffer, "ERR - Too many arguments (expected 0 or 1)\n");
+		return;
+	}
+	if(argc == 1) {
+		count = atoi(args);
+		if(count < 1 || count > KND_STATS_HISTORY) {
+			evbuffer_add_printf(client->buffer, "ERR - Sample count must be 1 to %d\n", KND_STATS_HISTORY);
+			return;
+		}
+	}
+
+	count = get_stats_history(stats, samples, count);
+	evbuffer_add_printf(client->buffer, "OK - %d seconds follow (oldest first)\n", count);
+	for(i = 0; i < count; i++) {
+		evbuffer_add_printf(client->buffer,
+				"time=%lld received=%u dropped=%u processed=%u published=%u sent=%u "
+				"video=%u video_starts=%u video_start_ms=%u\n",
+				(long long)samples[i].time, samples[i].depth_received,
+				samples[i].depth_dropped, samples[i].depth_processed,
+				samples[i].depth_published, samples[i].depth_sent,
+				samples[i].video_received, samples[i].video_starts,
+				samples[i].video_start_ms);
+	}
+}
+
+/*
+ * Writes a comma-separated list of the subscription types in the given
+ * CLIENT_SUB_* bits to buf, or "none".  Returns buf.
+ */
+static char *subs_to_string(unsigned int sub_flags, char *buf, size_t size)
+{
+	static const char * const names[] = { "zones", "depth", "compressed", "bright", "video" }; // CLIENT_SUB_* order
+	size_t len = 0;
+	unsigned int i;
+
+	snprintf(buf, size, "none");
+	for(i = 0; i < ARRAY_SIZE(names); i++) {
+		if(sub_flags & (1 << i)) {
+			len += snprintf(buf + len, size - MIN_NUM(len, size), "%s%s", len ? "," : "", names[i]);
+		}
+	}
+
+	return buf;
+}
+
+static void clients_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+{
+	struct knd_server *server = client->server;
+	struct knd_client *c;
+	struct timespec now;
+	uint64_t second, command_second, commands;
+	unsigned int rate, sub_flags;
+	char subs[64];
+	int count = 0;
+	int i;
+
+	if(argc != 0) {
+		evbuffer_add_printf(client->buffer, "ERR - Expected no arguments\n");
+		return;
+	}
+
+	// The lists can't change while the update lock is held
+	lock_updates(server);
+
+	for(i = 0; i < server->shard_count; i++) {
+		for(c = server->shards[i].client_list->next; c != NULL; c = c->next) {
+			count++;
+		}
+	}
+	evbuffer_add_printf(client->buffer, "OK - %d clients follow\n", count);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	second = latency_now() / 1000000000;
+
+	for(i = 0; i < server->shard_count; i++) {
+		for(c = server->shards[i].client_list->next; c != NULL; c = c->next) {
+			// Commands in the last full second
+			command_second = __atomic_load_n(&c->command_second, __ATOMIC_RELAXED);
+			if(command_second == second) {
+				rate = __atomic_load_n(&c->command_prev, __ATOMIC_RELAXED);
+			} else if(command_second + 1 == second) {
+				rate = __atomic_load_n(&c->command_count, __ATOMIC_RELAXED);
+			} else {
+				rate = 0;
+			}
+
+			commands = __atomic_load_n(&c->commands, __ATOMIC_RELAXED);
+			sub_flags = __atomic_load_n(&c->sub_flags, __ATOMIC_RELAXED);
+
+			evbuffer_add_printf(client->buffer,
+					"id=%u shard=%d addr=%s port=%hu age=%ld queue=%llu sent=%llu skipped=%llu "
+					"commands=%llu command_rate=%u command_us=%llu subs=%s\n",
+					c->id, i, c->remote_addr, c->remote_port,
+					(long)(now.tv_sec - c->connect_time.tv_sec),
+					(unsigned long long)__atomic_load_n(&c->out_queue, __ATOMIC_RELAXED),
+					(unsigned long long)__atomic_load_n(&c->bytes_sent, __ATOMIC_RELAXED),
+					(unsigned long long)__atomic_load_n(&c->frames_skipped, __ATOMIC_RELAXED),
+					(unsigned long long)commands, rate,
+					commands ? (unsigned long long)(__atomic_load_n(&c->command_ns, __ATOMIC_RELAXED) / commands / 1000) : 0ULL,
+					subs_to_string(sub_flags, subs, sizeof(subs)));
+		}
+	}
+
+	unlock_updates(server);
+}
+
+static void kick_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+{
+	struct knd_server *server = client->server;
+	struct knd_client *c = NULL;
+	unsigned int id;
+	char *end;
+	int i;
+
+	if(argc != 1) {
+		evbuffer_add_printf(client->buffer, "ERR - Expected a client id\n");
+		return;
+	}
+
+	errno = 0;
+	id = strtoul(args, &end, 10);
+	if(errno || *end || end == args) {
+		evbuffer_add_printf(client->buffer, "ERR - Invalid client id\n");
+		return;
+	}
+
+	// Shutting down the socket makes the owning shard see the connection
+	// close and free the client; the socket isn't closed while the client
+	// is listed, and the list can't change while the update lock is held.
+	lock_updates(server);
+	for(i = 0; i < server->shard_count && c == NULL; i++) {
+		for(c = server->shards[i].client_list->next; c != NULL; c = c->next) {
+			if(c->id == id) {
+				if(shutdown(c->fd, SHUT_RDWR)) {
+					ERRNO_OUT("Error shutting down client connection on fd %d", c->fd);
+				}
+				break;
+			}
+		}
+	}
+	unlock_updates(server);
+
+	if(c == NULL) {
+		evbuffer_add_printf(client->buffer, "ERR - No client with id %u\n", id);
+		return;
+	}
+
+	evbuffer_add_printf(client->buffer, "OK - Disconnected client %u\n", id);
+}
+
+static void trace_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+{
+	unsigned long seconds = 5;
+	size_t size;
+	char *json;
+	char *end;
+
+	if(argc > 1) {
+		evbuffer_add_printf(client->buffer, "ERR - Too many arguments (expected 0 or 1)\n");
+		return;
+	}
+	if(argc == 1) {
+		errno = 0;
+		seconds = strtoul(args, &end, 10);
+		if(errno || *end || end == args || seconds == 0 || seconds > UINT_MAX) {
+			evbuffer_add_printf(client->buffer, "ERR - Invalid number of seconds\n");
+			return;
+		}
+	}
+
+	json = get_trace_json(seconds, &size);
+	if(json == NULL) {
+		evbuffer_add_printf(client->buffer, "ERR - Error exporting trace\n");
+		return;
+	}
+
+	evbuffer_add_printf(client->buffer, "OK - %zu bytes of trace JSON follow newline\n", size);
+	evbuffer_add(client->buffer, json, size);
+	free(json);
+}
+
+#ifdef KND_LOCK_PROFILE
+static void locks_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+{
+	struct latency_stats wait, hold;
+	struct lock_site *first, *site;
+	const char *file;
+	int count = 0;
+
+	if(argc == 1 && !strcmp(args, "reset")) {
+		reset_lock_profile();
+		evbuffer_add_printf(client->buffer, "OK - Cleared lock statistics\n");
+		return;
+	}
+	if(argc != 0) {
+		evbuffer_add_printf(client->buffer, "ERR - Expected no arguments or reset\n");
+		return;
+	}
+
+	// Sites used for the first time are added before first
+	first = get_lock_sites();
+	for(site = first; site != NULL; site = site->next) {
+		count++;
+	}
+
+	evbuffer_add_printf(client->buffer, "OK - %d call sites follow (nanoseconds)\n", count);
+	for(site = first; site != NULL; site = site->next) {
+		get_histogram_stats(&site->wait, &wait);
+		get_histogram_stats(&site->hold, &hold);
+
+		file = strrchr(site->file, '/');
+		file = file ? file + 1 : site->file;
+
+		evbuffer_add_printf(client->buffer,
+				"lock=%s site=%s:%d count=%llu contended=%llu "
+				"wait_p50=%llu wait_p99=%llu wait_max=%llu "
+				"hold_p50=%llu hold_p99=%llu hold_max=%llu\n",
+				site->name, file, site->line, (unsigned long long)wait.count,
+				(unsigned long long)__atomic_load_n(&site->contended, __ATOMIC_RELAXED),
+				(unsigned long long)wait.p50, (unsigned long long)wait.p99,
+				(unsigned long long)wait.max, (unsigned long long)hold.p50,
+				(unsigned long long)hold.p99, (unsigned long long)hold.max);
+	}
+}
+#endif /* KND_LOCK_PROFILE */
+
+#ifdef KND_ALLOC_COUNT
+static void allocs_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+{
+	uint64_t total, frame, frames;
+
+	if(argc == 1 && !strcmp(args, "reset")) {
+		reset_alloc_counts();
+		__atomic_store_n(&client->server->alloc_frames,
+				__atomic_load_n(&client->server->info->counts.depth_processed, __ATOMIC_RELAXED),
+				__ATOMIC_RELAXED);
+		evbuffer_add_printf(client->buffer, "OK - Cleared allocation counts\n");
+		return;
+	}
+	if(argc != 0) {
+		evbuffer_add_printf(client->buffer, "ERR - Expected no arguments or reset\n");
+		return;
+	}
+
+	get_alloc_counts(&total, &frame);
+	frames = __atomic_load_n(&client->server->info->counts.depth_processed, __ATOMIC_RELAXED) -
+		__atomic_load_n(&client->server->alloc_frames, __ATOMIC_RELAXED);
+	evbuffer_add_printf(client->buffer, "OK - frames=%llu frame_allocs=%llu per_frame=%.2f total_allocs=%llu\n",
+			(unsigned long long)frames, (unsigned long long)frame,
+			frames ? (double)frame / frames : 0.0, (unsigned long long)total);
+}
+#endif /* KND_ALLOC_COUNT */
+
+#ifdef DEBUG
+static void die_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+{
+	evbuffer_add_printf(client->buffer, "OK - Stopping server\n");
+	client->server->info->stop = 1;
+}
+
+static void segv_func(struct knd_client *client, struct knd_cmd *command, int argc, const char *args)
+{
+	// Write directly to the client's fd since the server is about to crash
+	const char * const msg = "OK - Crashing server\n";
+	if(write(client->fd, msg, strlen(msg)) != (ssize_t)strlen(msg)) {
+		ERRNO_KNDSRV(client, "Error writing crash message to client.\n");
+	}
+	*(volatile int *)NULL = 0;
+}
+#endif /* DEBUG */
+
+
+/*
+ * Adds a command started at start_ns (from latency_now()) to the given
+ * client's command count, rate, and service time.
+ */
+static void count_command(struct knd_client *client, uint64_t start_ns)
+{
+	uint64_t now = latency_now();
+	uint64_t second = now / 1000000000;
+
+	if(second != client->command_second) {
+		__atomic_store_n(&client->command_prev,
+				second == client->command_second + 1 ? client->command_count : 0,
+				__ATOMIC_RELAXED);
+		__atomic_store_n(&client->command_count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&client->command_second, second, __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&client->command_count, client->command_count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&client->commands, client->commands + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&client->command_ns, client->command_ns + (now - start_ns), __ATOMIC_RELAXED);
+}
+
+/*
+ * Parses an individual command line.  The contents of the line are modified
+ * during parsing.  Responses are sent to the given socket.  Socket errors are
+ * not reported (it is expected that they will be caught in the outer socket
+ * loop).
+ */
+static void parse_line(struct knd_client *client, char *line)
+{
+	char *cmd, *args;
+	size_t line_len;
+	size_t cmd_len;
+	size_t args_len;
+	size_t args_count;
+	uint64_t start;
+	unsigned int i;
+
+	// TODO: Client API that speaks this protocol to a server
+
+	line_len = strlen(line);
+
+	cmd_len = strcspn(line, " ");
+
+	line[cmd_len] = 0;
+	cmd = line;
+
+	// FIXME: Support escaping of argument separator in string values
+	args = line + MIN_NUM(cmd_len + 1, line_len);
+	args_len = strlen(args);
+	args_count = nl_strcount(args, ',') + MIN_NUM(args_len, 1); // If args_len is 0, args_count will not have 1 added
+
+	// TODO: Allow the user to assign a sequence number to each incoming
+	// command, and use an internal sequence number, to allow asynchronous
+	// command completion, track return values, and identify any dropped
+	// commands?
+	start = latency_now();
+	for(i = 0; i < ARRAY_SIZE(commands); i++) {
+		if(!strcmp(commands[i].name, cmd)) {
+			trace_begin(commands[i].name);
+			set_loop_activity(client->shard->monitor, commands[i].name);
+			if(commands[i].locked) {
+				lock_commands(client->server);
+			}
+			commands[i].func(client, &commands[i], args_count, args);
+			if(commands[i].locked) {
+				unlock_commands(client->server);
+			}
+			set_loop_activity(client->shard->monitor, NULL);
+			trace_end(commands[i].name);
+			break;
+		}
+	}
+	count_command(client, start);
+	if(i == ARRAY_SIZE(commands)) {
+		DEBUG_KNDSRV(client, "Unknown command\n");
+		evbuffer_add_printf(client->buffer, "ERR - Unknown command\n");
+	}
+
+	return;
+}
+
+/*
+ * Parses command lines from the given client's input buffer, calling
+ * parse_line() for each line found.  The client buffer is modified as
+ * part of parsing.  If a newline is not encountered at the end of the buffer,
+ * the remaining data is moved to the beginning of the buffer.  Returns the
+ * amount of data left over after parsing all complete lines.
+ */
+static size_t parse_buffer(struct knd_client *client, size_t count) // TODO: Use evbuffers
+{
+	char *buf = client->in_buffer;
+	char *tmp;
+	char *last;
+	size_t len;
+	int i = 0;
+
+	count += client->last_len;
+
+	last = buf;
+	do {
+		if(i == 0) {
+			// FIXME: Come up with a cleaner/better way of using last_len for the first iteration
+			tmp = nl_strnpbrk(last + client->last_len, "\r\n", count - (last + client->last_len - buf));
+		} else {
+			tmp = nl_strnpbrk(last, "\r\n", count - (last - buf));
+		}
+
+		if(tmp == last) {
+			// Found a newline character right away (perhaps \r\n)
+			*tmp = 0;
+			tmp++;
+			last = tmp;
+		} else if(tmp != NULL) {
+			*tmp = 0;
+			tmp++;
+			parse_line(client, last);
+			last = tmp;
+		}
+
+		i++;
+	} while(tmp != NULL && !client->shutdown_requested);
+	// TODO: Reintroduce MAX_LINES_PER_CYCLE and queue another event on the
+	// loop to handle the remaining lines so that a single client can't
+	// starve the event loop
+
+	len = count - (last - buf);
+	client->last_len = len;
+	if(len) {
+		if(last != buf) {
+			memmove(buf, last, len);
+		}
+	}
+
+	return len;
+}
+
+/*
+ * Converts an inet6 address to its string equivalent (uses IPv4 form for
+ * IPv4-in-IPv6 addresses).  The returned string must be free()d.  Returns NULL
+ * on error.
+ */
+static char *addr_to_string(struct sockaddr_in6 *addr6)
+{
+	char addr[INET6_ADDRSTRLEN];
+	char addr2[INET6_ADDRSTRLEN + 2];
+	const char *addr_start;
+
+	addr_start = inet_ntop(addr6->sin6_family, &addr6->sin6_addr, addr, sizeof(addr));
+	if(!strncmp(addr, "::ffff:", 7) && strchr(addr, '.') != NULL) {
+		return strdup(addr_start + 7);
+	}
+
+	snprintf(addr2, ARRAY_SIZE(addr2), "[%s]", addr);
+	return strdup(addr2);
+}
+
+/*
+ * Inserts a client structure into the list of clients.  The list is only
+ * changed with the update lock held, so the clients command can walk every
+ * shard's list from any thread.
+ */
+static void add_client(struct knd_shard *shard, struct knd_client *client)
+{
+	lock_updates(shard->server);
+	client->prev = shard->client_list;
+	client->next = shard->client_list->next;
+	if(client->next != NULL) {
+		client->next->prev = client;
+	}
+	shard->client_list->next = client;
+	unlock_updates(shard->server);
+}
+
+static struct knd_client *create_client(struct knd_shard *shard, int sockfd, char *remote_addr, unsigned short port)
+{
+	struct knd_client *client;
+
+	client = calloc(1, sizeof(struct knd_client));
+	if(client == NULL) {
+		ERRNO_OUT("Error allocating command handler info for client %s:%hu on fd %d",
+				remote_addr, port, sockfd);
+		close(sockfd);
+		return NULL;
+	}
+	client->fd = sockfd;
+	client->remote_addr = remote_addr;
+	client->remote_port = ntohs(port);
+	client->server = shard->server;
+	client->shard = shard;
+	client->id = __atomic_add_fetch(&shard->server->next_client_id, 1, __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &client->connect_time);
+
+	add_client(shard, client);
+
+	return client;
+}
+
+static void free_client(struct knd_client *client)
+{
+	struct knd_shard *shard;
+
+	if(CHECK_NULL(client)) {
+		abort();
+	}
+
+	shard = client->shard;
+
+	// Remove socket info from list of sockets
+	lock_updates(shard->server);
+	if(client->prev->next == client) {
+		client->prev->next = client->next;
+	} else {
+		ERROR_OUT("BUG: Socket list is inconsistent: client->prev->next != client!\n");
+		abort();
+	}
+	if(client->next != NULL) {
+		if(client->next->prev == client) {
+			client->next->prev = client->prev;
+		} else {
+			ERROR_OUT("BUG: Socket list is inconsistent: client->next->prev != client!\n");
+			abort();
+		}
+	}
+	shard->client_count--;
+	unlock_updates(shard->server);
+
+	// Close socket and free resources
+	if(client->buf_event != NULL) {
+		bufferevent_free(client->buf_event);
+	}
+	if(client->buffer != NULL) {
+		evbuffer_free(client->buffer);
+	}
+	if(client->remote_addr != NULL) {
+		free(client->remote_addr);
+	}
+	if(client->fd >= 0) {
+		shutdown_client(client);
+		if(close(client->fd)) {
+			ERRNO_OUT("Error closing connection on fd %d", client->fd);
+		}
+	}
+	if(client->zones != NULL) {
+		destroy_zonelist(client->zones);
+	}
+	put_depth_stream(&shard->depth_streams, client->depth_stream);
+	client->subdepth = 0;
+	update_depth_encoding(client);
+	free(client);
+}
+
+/*
+ * Sets all bits in fl in the given file descriptor's flags using F_SETFL.
+ */
+static int set_flags(int fd, int fl)
+{
+	int flags;
+
+	flags = fcntl(fd, F_GETFL);
+	if(flags == -1) {
+		ERRNO_OUT("Error getting flags on fd %d", fd);
+		return -1;
+	}
+	flags |= fl;
+	if(fcntl(fd, F_SETFL, flags)) {
+		ERRNO_OUT("Error setting non-blocking I/O on fd %d", fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void knd_read(struct bufferevent *buf_event, void *arg)
+{
+	struct knd_client *client = (struct knd_client *)arg;
+	size_t len;
+
+	// Ignore data if the client connection is, or should be, shut down
+	if(client->shutdown_requested) {
+		return;
+	}
+
+	len = bufferevent_read(buf_event, client->in_buffer + client->last_len, ARRAY_SIZE(client->in_buffer) - client->last_len);
+	if(parse_buffer(client, len) == ARRAY_SIZE(client->in_buffer)) {
+		ERROR_OUT("Client buffer is full on fd %d with length %zu.  Closing connection.\n", client->fd, client->last_len);
+		client->in_buffer[ARRAY_SIZE(client->in_buffer) - 1] = 0;
+		evbuffer_add_printf(client->buffer, "\n\n\nBuffer overflow.\n\n\n");
+		request_shutdown_client(client);
+		flush_client(client);
+	}
+
+	// Send the results to the client
+	flush_client(client);
+}
+
+static void knd_write(struct bufferevent *buf_event, void *arg)
+{
+	struct knd_client *client = (struct knd_client *)arg;
+
+	update_client_stats(client);
+
+	if(client->shutdown_requested && EVBUFFER_LENGTH(buf_event->output) == 0) {
+		shutdown_client(client);
+	}
+}
+
+static void knd_error(struct bufferevent *buf_event, short error, void *arg)
+{
+	struct knd_client *client = (struct knd_client *)arg;
+
+	if(error & EVBUFFER_EOF) {
+		/*I*/ERROR_OUT("Client %s disconnected from fd %d.\n", client->remote_addr, client->fd);
+		client->shutdown = 1;
+	} else if(error & EVBUFFER_TIMEOUT) {
+		/*I*/ERROR_OUT("Client %s:%hu on fd %d timed out.\n",
+				client->remote_addr, client->remote_port, client->fd);
+		evbuffer_add_printf(client->buffer, "Timeout.\n");
+		request_shutdown_client(client);
+		flush_client(client);
+		// TODO: Distinguish between read and write timeouts (if timeouts are ever used)
+	} else if(error & EVBUFFER_WRITE) {
+		ERROR_OUT("Error writing to %s on fd %d.\n", client->remote_addr, client->fd);
+		client->shutdown = 1;
+	} else {
+		ERROR_OUT("A socket error (0x%hx) occurred on fd %d.\n", error, client->fd);
+		client->shutdown = 1;
+	}
+
+	if(client->shutdown) {
+		free_client(client);
+	}
+}
+
+// Compatibility shim for libevent 1.4 through libevent 2.x
+// See https://github.com/libevent/libevent/pull/678
+// See also https://github.com/nitrogenlogic/nlutils/blob/5612cd1592277913b101b93dc5183b13e40edcc8/src/url_req.c#L965-L983
+static struct bufferevent *create_bufferevent(struct knd_shard *shard, struct knd_client *client, int fd)
+{
+	struct bufferevent *newbuf;
+#if defined(EVENT__NUMERIC_VERSION) && EVENT__NUMERIC_VERSION >= 0x02000000
+	// libevent 2 (libevent 2.1 introduced a segfault in bufferevent_new())
+	newbuf = bufferevent_socket_new(shard->evloop, fd, 0);
+	if(newbuf != NULL) {
+		bufferevent_setcb(newbuf, knd_read, knd_write, knd_error, client);
+	}
+#else
+	// libevent 1.4
+	newbuf = bufferevent_new(fd, knd_read, knd_write, knd_error, client);
+#endif
+
+	return newbuf;
 }
 
 /*
- * Parses command lines from the given client's input buffer, calling
- * parse_line() for each line found.  The client buffer is modified as
- * part of parsing.  If a newline is not encountered at the end of the buffer,
- * the remaining data is moved to the beginning of the buffer.  Returns the
- * amount of data left over after parsing all complete lines.
+ * Creates a client in the given shard for an accepted connection and starts
+ * reading commands from it.  The client takes ownership of conn->addr.
+ * Returns the new client, or NULL on error (the socket is closed and the
+ * address is freed).  Call from the shard's thread.
  */
-static size_t parse_buffer(struct knd_client *client, size_t count) // TODO: Use evbuffers
+static struct knd_client *setup_client(struct knd_shard *shard, struct knd_connection *conn)
+{
+	struct knd_client *client;
+	int sockfd = conn->fd;
+
+	/*I*/ERROR_OUT("Client %s connected on fd %d\n", conn->addr, sockfd);
+
+	if(set_flags(sockfd, O_NONBLOCK)) {
+		ERROR_OUT("Error setting non-blocking I/O on an incoming connection.\n");
+		goto error;
+	}
+
+	// Copy connection info into a command handler info structure
+	client = create_client(shard, sockfd, conn->addr, conn->port);
+	if(client == NULL) {
+		sockfd = -1; // Closed by create_client()
+		goto error;
+	}
+	client->local = conn->local;
+	client->trusted = conn->trusted;
+
+	// Initialize a buffered I/O event
+	client->buf_event = create_bufferevent(shard, client, sockfd);
+	if(CHECK_NULL(client->buf_event)) {
+		ERROR_OUT("Error initializing buffered I/O event for fd %d.\n", sockfd);
+		free_client(client);
+		return NULL;
+	}
+	bufferevent_base_set(shard->evloop, client->buf_event);
+	bufferevent_settimeout(client->buf_event, CLIENT_TIMEOUT, 0);
+	if(bufferevent_enable(client->buf_event, EV_READ)) {
+		ERROR_OUT("Error enabling buffered I/O event for fd %d.\n", sockfd);
+		free_client(client);
+		return NULL;
+	}
+
+	// Create the outgoing data buffer
+	client->buffer = evbuffer_new();
+	if(CHECK_NULL(client->buffer)) {
+		ERROR_OUT("Error creating output buffer for fd %d.\n", sockfd);
+		free_client(client);
+		return NULL;
+	}
+
+	return client;
+
+error:
+	free(conn->addr);
+	if(sockfd >= 0) {
+		close(sockfd);
+	}
+	lock_updates(shard->server);
+	shard->client_count--;
+	unlock_updates(shard->server);
+	return NULL;
+}
+
+/*
+ * Assigns an accepted connection to the shard with the fewest clients.  The
+ * connection is set up immediately if it goes to shard 0 (the server thread);
+ * otherwise it is queued for the shard's thread.  Call from the server thread.
+ */
+static void assign_connection(struct knd_server *server, struct knd_connection *conn)
+{
+	struct knd_connection *queued;
+	struct knd_shard *shard;
+	int i;
+
+	lock_updates(server);
+	shard = &server->shards[0];
+	for(i = 1; i < server->shard_count; i++) {
+		if(server->shards[i].client_count < shard->client_count) {
+			shard = &server->shards[i];
+		}
+	}
+	shard->client_count++;
+	unlock_updates(server);
+
+	if(shard->index == 0) {
+		setup_client(shard, conn);
+		return;
+	}
+
+	queued = malloc(sizeof(struct knd_connection));
+	if(queued == NULL) {
+		ERRNO_OUT("Error queueing connection on fd %d for shard %d", conn->fd, shard->index);
+		free(conn->addr);
+		close(conn->fd);
+		lock_updates(server);
+		shard->client_count--;
+		unlock_updates(server);
+		return;
+	}
+	*queued = *conn;
+
+	lock_updates(server);
+	queued->next = shard->connections;
+	shard->connections = queued;
+	unlock_updates(server);
+
+	wake_shard(shard, WAKE_CONNECTIONS);
+}
+
+static void setup_connection(int sockfd, struct sockaddr_in6 *remote_addr, struct knd_server *server)
+{
+	struct knd_connection conn = {
+		.fd = sockfd,
+		.addr = addr_to_string(remote_addr),
+		.port = remote_addr->sin6_port,
+	};
+
+	if(conn.addr == NULL) {
+		ERROR_OUT("Error converting client address to string for connection on fd %d\n", sockfd);
+		close(sockfd);
+		return;
+	}
+
+	assign_connection(server, &conn);
+}
+
+/*
+ * Returns nonzero if gid is one of the supplementary groups of the peer of the
+ * given UNIX domain socket.  SO_PEERCRED only reports the primary group, so
+ * this uses SO_PEERGROUPS (Linux 4.13 and later), and returns 0 where that
+ * isn't available.
+ */
+static int peer_in_group(int sockfd, gid_t gid)
+{
+#ifdef SO_PEERGROUPS
+	gid_t buf[32];
+	gid_t *groups = buf;
+	socklen_t len = sizeof(buf);
+	size_t i;
+	int found = 0;
+
+	if(getsockopt(sockfd, SOL_SOCKET, SO_PEERGROUPS, groups, &len)) {
+		if(errno != ERANGE) {
+			if(errno != ENOPROTOOPT) {
+				ERRNO_OUT("Error getting peer groups for connection on fd %d", sockfd);
+			}
+			return 0;
+		}
+
+		// len now holds the size needed
+		groups = malloc(len);
+		if(groups == NULL) {
+			ERRNO_OUT("Error allocating peer groups for connection on fd %d", sockfd);
+			return 0;
+		}
+		if(getsockopt(sockfd, SOL_SOCKET, SO_PEERGROUPS, groups, &len)) {
+			ERRNO_OUT("Error getting peer groups for connection on fd %d", sockfd);
+			free(groups);
+			return 0;
+		}
+	}
+
+	for(i = 0; i < len / sizeof(gid_t); i++) {
+		if(groups[i] == gid) {
+			found = 1;
+			break;
+		}
+	}
+
+	if(groups != buf) {
+		free(groups);
+	}
+
+	return found;
+#else /* SO_PEERGROUPS */
+	return 0;
+#endif /* SO_PEERGROUPS */
+}
+
+/*
+ * Sets up a connection from the UNIX domain socket, identifying and deciding
+ * whether to trust the peer by its credentials.
+ */
+static void setup_unix_connection(int sockfd, struct knd_server *server)
+{
+	struct knd_connection conn = { .fd = sockfd, .local = 1 };
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+
+	if(getsockopt(sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen)) {
+		ERRNO_OUT("Error getting peer credentials for connection on fd %d", sockfd);
+		close(sockfd);
+		return;
+	}
+
+	if(asprintf(&conn.addr, "unix:pid=%d,uid=%u", (int)cred.pid, (unsigned int)cred.uid) < 0) {
+		ERROR_OUT("Error converting client credentials to string for connection on fd %d\n", sockfd);
+		close(sockfd);
+		return;
+	}
+
+	conn.trusted = cred.uid == 0 || cred.uid == geteuid() ||
+		(server->trusted_uid != (uid_t)-1 && cred.uid == server->trusted_uid) ||
+		(server->trusted_gid != (gid_t)-1 &&
+		 (cred.gid == server->trusted_gid || peer_in_group(sockfd, server->trusted_gid)));
+
+	assign_connection(server, &conn);
+}
+
+static void knd_connect(int listenfd, short evtype, void *arg)
+{
+	struct sockaddr_in6 remote_addr;
+	socklen_t addrlen = sizeof(remote_addr);
+	int sockfd;
+	int i;
+
+	if(!(evtype & EV_READ)) {
+		ERROR_OUT("Unknown event type in connect callback: 0x%hx\n", evtype);
+		return;
+	}
+
+	// Accept and configure incoming connections (up to QUEUED_CONNECTIONS connections in one go)
+	for(i = 0; i < QUEUED_CONNECTIONS; i++) {
+		sockfd = accept(listenfd, (struct sockaddr *)&remote_addr, &addrlen);
+		if(sockfd < 0) {
+			if(errno != EWOULDBLOCK && errno != EAGAIN) {
+				ERRNO_OUT("Error accepting an incoming connection");
+			}
+			break;
+		}
+
+		setup_connection(sockfd, &remote_addr, (struct knd_server *)arg);
+	}
+}
+
+static void knd_connect_unix(int listenfd, short evtype, void *arg)
+{
+	int sockfd;
+	int i;
+
+	if(!(evtype & EV_READ)) {
+		ERROR_OUT("Unknown event type in connect callback: 0x%hx\n", evtype);
+		return;
+	}
+
+	for(i = 0; i < QUEUED_CONNECTIONS; i++) {
+		sockfd = accept(listenfd, NULL, NULL);
+		if(sockfd < 0) {
+			if(errno != EWOULDBLOCK && errno != EAGAIN) {
+				ERRNO_OUT("Error accepting an incoming local connection");
+			}
+			break;
+		}
+
+		setup_unix_connection(sockfd, (struct knd_server *)arg);
+	}
+}
+
+static void free_http_client(struct knd_http_client *http)
+{
+	if(http->prev != NULL) {
+		http->prev->next = http->next;
+	} else {
+		http->server->http_clients = http->next;
+	}
+	if(http->next != NULL) {
+		http->next->prev = http->prev;
+	}
+
+	if(http->buf_event != NULL) {
+		bufferevent_free(http->buf_event);
+	}
+	if(close(http->fd)) {
+		ERRNO_OUT("Error closing metrics connection on fd %d", http->fd);
+	}
+	free(http);
+}
+
+// Returns the number of command clients connected to all shards.
+static int count_clients(struct knd_server *server)
+{
+	int count = 0;
+	int i;
+
+	lock_updates(server);
+	for(i = 0; i < server->shard_count; i++) {
+		count += server->shards[i].client_count;
+	}
+	unlock_updates(server);
+
+	return count;
+}
+
+// Queues an HTTP response with the given status line, content type, and body.
+static void http_respond(struct knd_http_client *http, const char *status,
+		const char *type, const char *body, size_t len)
+{
+	struct evbuffer *out = EVBUFFER_OUTPUT(http->buf_event);
+
+	evbuffer_add_printf(out, "HTTP/1.1 %s\r\n"
+			"Content-Type: %s\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: close\r\n"
+			"\r\n", status, type, len);
+	evbuffer_add(out, body, len);
+	if(bufferevent_enable(http->buf_event, EV_WRITE)) {
+		ERROR_OUT("Error enabling output for metrics connection on fd %d.\n", http->fd);
+	}
+
+	http->responded = 1;
+	if(bufferevent_disable(http->buf_event, EV_READ)) {
+		ERROR_OUT("Error disabling input for metrics connection on fd %d.\n", http->fd);
+	}
+}
+
+static void http_read(struct bufferevent *buf_event, void *arg)
 {
-	char *buf = client->in_buffer;
-	char *tmp;
-	char *last;
+	struct knd_http_client *http = arg;
+	struct evbuffer *in = EVBUFFER_INPUT(buf_event);
+	const char *metrics;
+	char *line;
 	size_t len;
-	int i = 0;
 
-	count += client->last_len;
+	if(http->responded) {
+		return;
+	}
 
-	last = buf;
-	do {
-		if(i == 0) {
-			// FIXME: Come up with a cleaner/better way of using last_len for the first iteration
-			tmp = nl_strnpbrk(last + client->last_len, "\r\n", count - (last + client->last_len - buf));
+	// Wait for the end of the request header
+	if(evbuffer_find(in, (unsigned char *)"\r\n\r\n", 4) == NULL) {
+		if(EVBUFFER_LENGTH(in) > HTTP_MAX_REQUEST) {
+			http_respond(http, "431 Request Header Fields Too Large", "text/plain", "", 0);
+		}
+		return;
+	}
+
+	line = evbuffer_readline(in);
+	if(line == NULL) {
+		http_respond(http, "400 Bad Request", "text/plain", "", 0);
+		return;
+	}
+
+	if(strncmp(line, "GET ", 4)) {
+		http_respond(http, "405 Method Not Allowed", "text/plain", "", 0);
+	} else if(strncmp(line + 4, "/metrics ", 9) && strncmp(line + 4, "/metrics?", 9)) {
+		http_respond(http, "404 Not Found", "text/plain", "", 0);
+	} else {
+		metrics = get_metrics(http->server->metrics, count_clients(http->server), &len);
+		if(metrics == NULL) {
+			http_respond(http, "500 Internal Server Error", "text/plain", "", 0);
 		} else {
-			tmp = nl_strnpbrk(last, "\r\n", count - (last - buf));
+			http_respond(http, "200 OK", "text/plain; version=0.0.4", metrics, len);
 		}
+	}
 
-		if(tmp == last) {
-			// Found a newline character right away (perhaps \r\n)
-			*tmp = 0;
-			tmp++;
-			last = tmp;
-		} else if(tmp != NULL) {
-			*tmp = 0;
-			tmp++;
-			parse_line(client, last);
-			last = tmp;
+	free(line);
+}
+
+static void http_write(struct bufferevent *buf_event, void *arg)
+{
+	struct knd_http_client *http = arg;
+
+	if(http->responded && EVBUFFER_LENGTH(EVBUFFER_OUTPUT(buf_event)) == 0) {
+		free_http_client(http);
+	}
+}
+
+static void http_error(struct bufferevent *buf_event, short error, void *arg)
+{
+	free_http_client(arg);
+}
+
+// Compatibility shim for libevent 1.4 through libevent 2.x (see create_bufferevent())
+static struct bufferevent *create_http_bufferevent(struct knd_server *server, struct knd_http_client *http, int fd)
+{
+	struct bufferevent *newbuf;
+#if defined(EVENT__NUMERIC_VERSION) && EVENT__NUMERIC_VERSION >= 0x02000000
+	newbuf = bufferevent_socket_new(server->evloop, fd, 0);
+	if(newbuf != NULL) {
+		bufferevent_setcb(newbuf, http_read, http_write, http_error, http);
+	}
+#else
+	newbuf = bufferevent_new(fd, http_read, http_write, http_error, http);
+#endif
+
+	return newbuf;
+}
+
+static void knd_connect_metrics(int listenfd, short evtype, void *arg)
+{
+	struct knd_server *server = arg;
+	struct knd_http_client *http;
+	int sockfd;
+	int i;
+
+	if(!(evtype & EV_READ)) {
+		ERROR_OUT("Unknown event type in connect callback: 0x%hx\n", evtype);
+		return;
+	}
+
+	for(i = 0; i < QUEUED_CONNECTIONS; i++) {
+		sockfd = accept(listenfd, NULL, NULL);
+		if(sockfd < 0) {
+			if(errno != EWOULDBLOCK && errno != EAGAIN) {
+				ERRNO_OUT("Error accepting an incoming metrics connection");
+			}
+			break;
 		}
 
-		i++;
-	} while(tmp != NULL && !client->shutdown_requested);
-	// TODO: Reintroduce MAX_LINES_PER_CYCLE and queue another event on the
-	// loop to handle the remaining lines so that a single client can't
-	// starve the event loop
+		if(set_flags(sockfd, O_NONBLOCK)) {
+			close(sockfd);
+			continue;
+		}
 
-	len = count - (last - buf);
-	client->last_len = len;
-	if(len) {
-		if(last != buf) {
-			memmove(buf, last, len);
+		http = calloc(1, sizeof(struct knd_http_client));
+		if(http == NULL) {
+			ERRNO_OUT("Error allocating metrics connection on fd %d", sockfd);
+			close(sockfd);
+			continue;
+		}
+		http->server = server;
+		http->fd = sockfd;
+		http->next = server->http_clients;
+		if(http->next != NULL) {
+			http->next->prev = http;
+		}
+		server->http_clients = http;
+
+		http->buf_event = create_http_bufferevent(server, http, sockfd);
+		if(CHECK_NULL(http->buf_event)) {
+			ERROR_OUT("Error initializing buffered I/O event for metrics fd %d.\n", sockfd);
+			free_http_client(http);
+			continue;
+		}
+		bufferevent_base_set(server->evloop, http->buf_event);
+		bufferevent_settimeout(http->buf_event, HTTP_TIMEOUT, HTTP_TIMEOUT);
+		if(bufferevent_enable(http->buf_event, EV_READ)) {
+			ERROR_OUT("Error enabling buffered I/O event for metrics fd %d.\n", sockfd);
+			free_http_client(http);
 		}
 	}
+}
 
-	return len;
+// Used by knd_wake() to build zone updates for a depth frame
+static void subs_callback(void *data, struct zone *zone)
+{
+	struct knd_update *update = data;
+	char line[ZONE_INFO_LENGTH + 6];
+	size_t len;
+
+	// It is extremely unlikely that any parameter (such as center of
+	// gravity) will change without pop also changing, due to the high
+	// noise levels present at the fringes of objects.  However, we
+	// also need to check occupied because it can change from 1 to 0
+	// long after pop stops changing, due to rising/falling delay logic.
+	if(zone->lastpop != zone->pop || zone->lastoccupied != zone->occupied || zone->new_zone) {
+		memcpy(line, "SUB - ", 6);
+		len = 6 + format_zone_info(line + 6, sizeof(line) - 6, zone, zone->new_zone);
+		add_update_text(update, line, len);
+	}
+}
+
+static void depthsub_callback(uint8_t *buf, void *data)
+{
+	struct knd_client *client = data;
+
+	if(client->depth_stream != NULL) {
+		// Each stream is only computed once per frame for all clients
+		buf = (uint8_t *)encode_depth_stream(client->depth_stream, buf, client->shard->depth_frame);
+	}
+
+	evbuffer_add(client->buffer, buf, depth_frame_size(client));
 }
 
 /*
- * Converts an inet6 address to its string equivalent (uses IPv4 form for
- * IPv4-in-IPv6 addresses).  The returned string must be free()d.  Returns NULL
- * on error.
+ * Returns 1 if the given client's depth rate limit (if any) allows sending the
+ * current depth frame, 0 otherwise.
  */
-static char *addr_to_string(struct sockaddr_in6 *addr6)
+static int depth_frame_due(struct knd_client *client)
 {
-	char addr[INET6_ADDRSTRLEN];
-	char addr2[INET6_ADDRSTRLEN + 2];
-	const char *addr_start;
+	struct timespec *now = &client->shard->depth_time;
 
-	addr_start = inet_ntop(addr6->sin6_family, &addr6->sin6_addr, addr, sizeof(addr));
-	if(!strncmp(addr, "::ffff:", 7) && strchr(addr, '.') != NULL) {
-		return strdup(addr_start + 7);
+	if(client->depth_interval.tv_sec == 0 && client->depth_interval.tv_nsec == 0) {
+		return 1;
 	}
 
-	snprintf(addr2, ARRAY_SIZE(addr2), "[%s]", addr);
-	return strdup(addr2);
+	if(!NL_TIMESPEC_GTE(*now, client->next_depth)) {
+		return 0;
+	}
+
+	// Schedule from the previous deadline so the average rate is exact,
+	// unless the client has fallen more than a frame behind.
+	client->next_depth = nl_add_timespec(client->next_depth, client->depth_interval);
+	if(NL_TIMESPEC_GTE(*now, client->next_depth)) {
+		client->next_depth = nl_add_timespec(*now, client->depth_interval);
+	}
+
+	return 1;
 }
 
 /*
- * Inserts a client structure into the list of clients.
+ * Called by process_updates() for each client when a depth frame has
+ * arrived.
  */
-static void add_client(struct knd_server *server, struct knd_client *client)
+static void process_subscriptions(struct knd_client *client)
 {
-	client->prev = server->client_list;
-	client->next = server->client_list->next;
-	if(client->next != NULL) {
-		client->next->prev = client;
+	if(client->subdepth && !client->depth_compress && depth_frame_due(client)) {
+		if(client->depth_limit > 0) {
+			if(--client->depth_limit == 0) {
+				client->subdepth = 0;
+			}
+		}
+
+		evbuffer_add_printf(client->buffer, "DEPTH - %zu bytes of raw data follow newline\n",
+				depth_frame_size(client));
+		if(get_depth(client->server->info->vid, depthsub_callback, client)) {
+			ERROR_KNDSRV(client, "Error getting depth data.\n");
+			request_shutdown_client(client);
+			return;
+		}
+
+		__atomic_fetch_add(&client->server->info->counts.depth_sent, 1, __ATOMIC_RELAXED);
 	}
-	server->client_list->next = client;
-	server->client_count++;
 }
 
-static struct knd_client *create_client(struct knd_server *server, int sockfd, char *remote_addr, unsigned short port)
+/*
+ * Sends the given compressed frame to the given client if it is subscribed to
+ * compressed depth and can decode the frame (a delta frame can only follow the
+ * previous frame).  Called by process_updates() after the depth encoder
+ * has compressed a frame.
+ */
+static void process_compressed(struct knd_client *client, unsigned int seq,
+		const uint8_t *delta, size_t delta_size, const uint8_t *key, size_t key_size)
 {
-	struct knd_client *client;
+	int use_key;
 
-	client = calloc(1, sizeof(struct knd_client));
-	if(client == NULL) {
-		ERRNO_OUT("Error allocating command handler info for client %s:%hu on fd %d",
-				remote_addr, port, sockfd);
-		close(sockfd);
-		return NULL;
+	if(!client->subdepth || !client->depth_compress) {
+		return;
+	}
+
+	if(client->depth_synced && delta_size && client->depth_seq + 1 == seq) {
+		use_key = 0;
+	} else if(key_size) {
+		use_key = 1;
+	} else {
+		// Wait for a key frame
+		__atomic_store_n(&client->frames_skipped, client->frames_skipped + 1, __ATOMIC_RELAXED);
+		client->depth_synced = 0;
+		depth_encoder_request_key(client->server->encoder);
+		return;
 	}
-	client->fd = sockfd;
-	client->remote_addr = remote_addr;
-	client->remote_port = ntohs(port);
-	client->server = server;
 
-	add_client(server, client);
+	if(!depth_frame_due(client)) {
+		return;
+	}
 
-	return client;
+	if(client->depth_limit > 0) {
+		if(--client->depth_limit == 0) {
+			client->subdepth = 0;
+			update_depth_encoding(client);
+		}
+	}
+
+	evbuffer_add_printf(client->buffer, "DEPTH - %zu bytes of compressed data follow newline - key=%d\n",
+			use_key ? key_size : delta_size, use_key);
+	evbuffer_add(client->buffer, use_key ? key : delta, use_key ? key_size : delta_size);
+
+	client->depth_seq = seq;
+	client->depth_synced = 1;
+
+	__atomic_fetch_add(&client->server->info->counts.depth_sent, 1, __ATOMIC_RELAXED);
 }
 
-static void free_client(struct knd_client *client)
+static void videosub_callback(uint8_t *buf, void *data)
 {
-	struct knd_server *server;
+	struct knd_client *client = data;
+	evbuffer_add(client->buffer, buf, KND_VIDEO_SIZE);
+}
 
-	if(CHECK_NULL(client)) {
-		abort();
-	}
+// Used by process_video to iterate over the list of zones
+static void bright_callback(void *data, struct zone *zone)
+{
+	struct knd_client *client = data;
 
-	server = client->server;
+	// TODO: escape name
+	evbuffer_add_printf(client->buffer, "BRIGHT - bright=%d name=\"%s\"\n",
+			zone->bsum * 256 / zone->maxpop, zone->name);
+}
 
-	// Remove socket info from list of sockets
-	if(client->prev->next == client) {
-		client->prev->next = client->next;
-	} else {
-		ERROR_OUT("BUG: Socket list is inconsistent: client->prev->next != client!\n");
-		abort();
+/*
+ * Called by process_updates() for each client when a video frame has
+ * arrived.
+ */
+static void process_video(struct knd_client *client)
+{
+	if(client->subbright) {
+		// TODO: Generate the text once and send it to all subscribed clients.
+		iterate_zonelist(client->server->info->zones, bright_callback, client);
+		client->subbright = 0;
 	}
-	if(client->next != NULL) {
-		if(client->next->prev == client) {
-			client->next->prev = client->prev;
-		} else {
-			ERROR_OUT("BUG: Socket list is inconsistent: client->next->prev != client!\n");
-			abort();
+	if(client->subvideo) {
+		evbuffer_add_printf(client->buffer, "VIDEO - %d bytes of video data follow newline\n",
+				KND_VIDEO_SIZE);
+
+		if(get_video(client->server->info->vid, videosub_callback, client)) {
+			ERROR_KNDSRV(client, "Error getting video data.\n");
+			request_shutdown_client(client);
 		}
+
+		client->subvideo = 0;
 	}
+}
 
-	// Close socket and free resources
-	if(client->buf_event != NULL) {
-		bufferevent_free(client->buf_event);
+/*
+ * Wakes the given shard's event loop for the given WAKE_* reasons.  Wakeups
+ * that arrive before the shard handles the first are combined, so the eventfd
+ * is only written once per pass through the shard's event loop.  Safe to call
+ * from any thread or from a signal handler.
+ */
+static void wake_shard(struct knd_shard *shard, unsigned int flags)
+{
+	uint64_t one = 1;
+
+	if(__atomic_fetch_or(&shard->wake_flags, flags, __ATOMIC_ACQ_REL) != 0) {
+		return;
 	}
-	if(client->buffer != NULL) {
-		evbuffer_free(client->buffer);
+
+	if(write(shard->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+		ERRNO_OUT("Error waking event loop for shard %d", shard->index);
 	}
-	if(client->remote_addr != NULL) {
-		free(client->remote_addr);
+}
+
+/*
+ * Clears the given shard's eventfd and returns its pending WAKE_* reasons.
+ * Call from the shard's wakeup event handler.
+ */
+static unsigned int get_wake_flags(struct knd_shard *shard)
+{
+	uint64_t count;
+
+	// The eventfd is cleared first so a wakeup sent after the flags are
+	// taken signals it again
+	if(read(shard->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+		ERRNO_OUT("Error reading wakeup eventfd for shard %d", shard->index);
+	}
+
+	return __atomic_exchange_n(&shard->wake_flags, 0, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * Tells the given server that a depth frame was received, and passes the
+ * frame to the server's compressed depth encoder.  Wakeups are combined if the
+ * server falls behind, so only the most recent frame is published.  Call this
+ * when a depth frame is received, while the depth buffer is locked.
+ */
+void kndsrv_send_depth(struct knd_server *server, const uint8_t *buffer)
+{
+	if(server->encoder != NULL) {
+		depth_encoder_frame(server->encoder, buffer);
+	}
+
+	__atomic_store_n(&server->depth_arrival, server->info->depth_arrival, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&server->depth_received, 1, __ATOMIC_RELEASE);
+	wake_shard(&server->shards[0], WAKE_DEPTH);
+}
+
+/*
+ * Tells the given server that a video frame was received.  Like depth frames,
+ * video wakeups are combined if the server falls behind.  Call this when a
+ * video frame is received.
+ */
+void kndsrv_send_video(struct knd_server *server)
+{
+	__atomic_add_fetch(&server->video_received, 1, __ATOMIC_RELEASE);
+	wake_shard(&server->shards[0], WAKE_VIDEO);
+}
+
+/*
+ * Tells the given server that the camera was disconnected (connected is 0) or
+ * connected again, so clients subscribed to global zone updates are sent a
+ * CAMERA line.  Changes that are undone before the server thread wakes up are
+ * not sent.  May be called from any thread.
+ */
+void kndsrv_set_camera(struct knd_server *server, int connected)
+{
+	__atomic_store_n(&server->camera_connected, !!connected, __ATOMIC_RELAXED);
+	wake_shard(&server->shards[0], WAKE_CAMERA);
+}
+
+/*
+ * Tells the given server that a compressed depth frame is ready (called by the
+ * depth encoder).
+ */
+static void kndsrv_send_compressed(void *data)
+{
+	struct knd_server *server = data;
+
+	wake_shard(&server->shards[0], WAKE_COMPRESSED);
+}
+
+static void free_update(struct knd_update *update)
+{
+	free(update->text);
+	free(update->delta);
+	free(update->key);
+	free(update);
+}
+
+/*
+ * Returns an empty update, reusing a finished update and its buffers if one
+ * is available.  Returns NULL on error.
+ */
+static struct knd_update *get_update(struct knd_server *server)
+{
+	struct knd_update *update;
+
+	lock_updates(server);
+	update = server->spare_updates;
+	if(update != NULL) {
+		server->spare_updates = update->next;
+		server->spare_count--;
 	}
-	if(client->fd >= 0) {
-		shutdown_client(client);
-		if(close(client->fd)) {
-			ERRNO_OUT("Error closing connection on fd %d", client->fd);
+	unlock_updates(server);
+
+	if(update == NULL) {
+		update = calloc(1, sizeof(struct knd_update));
+		if(update == NULL) {
+			ERRNO_OUT("Error allocating update");
 		}
+		return update;
 	}
-	if(client->zones != NULL) {
-		destroy_zonelist(client->zones);
+
+	*update = (struct knd_update){
+		.text = update->text,
+		.text_alloc = update->text_alloc,
+		.delta = update->delta,
+		.delta_alloc = update->delta_alloc,
+		.key = update->key,
+		.key_alloc = update->key_alloc,
+	};
+
+	return update;
+}
+
+/*
+ * Keeps a finished update for reuse by get_update(), or frees it if enough
+ * are already kept.  Call with update_lock held.
+ */
+static void release_update(struct knd_server *server, struct knd_update *update)
+{
+	if(server->spare_count >= SPARE_UPDATES) {
+		free_update(update);
+		return;
 	}
-	free(client);
 
-	server->client_count--;
+	update->next = server->spare_updates;
+	server->spare_updates = update;
+	server->spare_count++;
 }
 
 /*
- * Sets all bits in fl in the given file descriptor's flags using F_SETFL.
+ * Makes sure *buf has room for size bytes, keeping its contents, and stores
+ * its new size in *alloc.  Buffers only grow, so reused updates stop
+ * allocating once they are large enough.  Returns 0 on success, -1 on error.
  */
-static int set_flags(int fd, int fl)
+static int reserve_update_buffer(void **buf, size_t *alloc, size_t size)
 {
-	int flags;
+	size_t new_alloc;
+	void *tmp;
 
-	flags = fcntl(fd, F_GETFL);
-	if(flags == -1) {
-		ERRNO_OUT("Error getting flags on fd %d", fd);
-		return -1;
+	if(size <= *alloc) {
+		return 0;
 	}
-	flags |= fl;
-	if(fcntl(fd, F_SETFL, flags)) {
-		ERRNO_OUT("Error setting non-blocking I/O on fd %d", fd);
+
+	new_alloc = MAX_NUM(size, *alloc * 2);
+	tmp = realloc(*buf, new_alloc);
+	if(tmp == NULL) {
+		ERRNO_OUT("Error growing update buffer to %zu bytes", new_alloc);
 		return -1;
 	}
 
+	*buf = tmp;
+	*alloc = new_alloc;
+
 	return 0;
 }
 
-static void knd_read(struct bufferevent *buf_event, void *arg)
+/*
+ * Appends len bytes of text to the given update's text.  Returns 0 on
+ * success, -1 on error.
+ */
+static int add_update_text(struct knd_update *update, const char *text, size_t len)
 {
-	struct knd_client *client = (struct knd_client *)arg;
-	size_t len;
-
-	// Ignore data if the client connection is, or should be, shut down
-	if(client->shutdown_requested) {
-		return;
+	if(reserve_update_buffer((void **)&update->text, &update->text_alloc, update->text_len + len)) {
+		return -1;
 	}
 
-	len = bufferevent_read(buf_event, client->in_buffer + client->last_len, ARRAY_SIZE(client->in_buffer) - client->last_len);
-	if(parse_buffer(client, len) == ARRAY_SIZE(client->in_buffer)) {
-		ERROR_OUT("Client buffer is full on fd %d with length %zu.  Closing connection.\n", client->fd, client->last_len);
-		client->in_buffer[ARRAY_SIZE(client->in_buffer) - 1] = 0;
-		evbuffer_add_printf(client->buffer, "\n\n\nBuffer overflow.\n\n\n");
-		request_shutdown_client(client);
-		flush_client(client);
-	}
+	memcpy(update->text + update->text_len, text, len);
+	update->text_len += len;
 
-	// Send the results to the client
-	flush_client(client);
+	return 0;
 }
 
-static void knd_write(struct bufferevent *buf_event, void *arg)
+/*
+ * Moves the contents of the given buffer into the given update's text.
+ * Returns 0 on success, -1 on error.
+ */
+static int set_update_text(struct knd_update *update, struct evbuffer *buf)
 {
-	struct knd_client *client = (struct knd_client *)arg;
+	size_t len = EVBUFFER_LENGTH(buf);
 
-	if(client->shutdown_requested && EVBUFFER_LENGTH(buf_event->output) == 0) {
-		shutdown_client(client);
+	if(reserve_update_buffer((void **)&update->text, &update->text_alloc, len)) {
+		return -1;
 	}
+
+	update->text_len = evbuffer_remove(buf, update->text, len);
+
+	return 0;
 }
 
-static void knd_error(struct bufferevent *buf_event, short error, void *arg)
+/*
+ * Adds the given update to every shard's queue and wakes the shards that
+ * weren't already waiting to process updates.  The caller's own shard (self,
+ * which may be NULL) is not woken; call process_updates() for it instead.
+ * Updates are delivered to each shard in the order they are published.
+ */
+static void publish_update(struct knd_server *server, struct knd_update *update, struct knd_shard *self)
 {
-	struct knd_client *client = (struct knd_client *)arg;
+	struct knd_update **queue;
+	struct knd_shard *shard;
+	char wake[MAX_SHARDS];
+	int size;
+	int i;
 
-	if(error & EVBUFFER_EOF) {
-		/*I*/ERROR_OUT("Client %s disconnected from fd %d.\n", client->remote_addr, client->fd);
-		client->shutdown = 1;
-	} else if(error & EVBUFFER_TIMEOUT) {
-		/*I*/ERROR_OUT("Client %s:%hu on fd %d timed out.\n",
-				client->remote_addr, client->remote_port, client->fd);
-		evbuffer_add_printf(client->buffer, "Timeout.\n");
-		request_shutdown_client(client);
-		flush_client(client);
-		// TODO: Distinguish between read and write timeouts (if timeouts are ever used)
-	} else if(error & EVBUFFER_WRITE) {
-		ERROR_OUT("Error writing to %s on fd %d.\n", client->remote_addr, client->fd);
-		client->shutdown = 1;
-	} else {
-		ERROR_OUT("A socket error (0x%hx) occurred on fd %d.\n", error, client->fd);
-		client->shutdown = 1;
+	lock_updates(server);
+
+	update->refs = 0;
+	for(i = 0; i < server->shard_count; i++) {
+		shard = &server->shards[i];
+		wake[i] = 0;
+
+		if(shard->queue_len == shard->queue_size) {
+			size = shard->queue_size ? shard->queue_size * 2 : 16;
+			queue = realloc(shard->queue, size * sizeof(shard->queue[0]));
+			if(queue == NULL) {
+				ERRNO_OUT("Error growing update queue for shard %d", i);
+				continue;
+			}
+			shard->queue = queue;
+			shard->queue_size = size;
+		}
+
+		wake[i] = shard->queue_len == 0 && shard != self;
+		shard->queue[shard->queue_len++] = update;
+		update->refs++;
 	}
 
-	if(client->shutdown) {
-		free_client(client);
+	if(update->refs == 0) {
+		release_update(server, update);
+	}
+
+	unlock_updates(server);
+
+	for(i = 0; i < server->shard_count; i++) {
+		if(wake[i]) {
+			wake_shard(&server->shards[i], WAKE_UPDATES);
+		}
 	}
 }
 
-// Compatibility shim for libevent 1.4 through libevent 2.x
-// See https://github.com/libevent/libevent/pull/678
-// See also https://github.com/nitrogenlogic/nlutils/blob/5612cd1592277913b101b93dc5183b13e40edcc8/src/url_req.c#L965-L983
-static struct bufferevent *create_bufferevent(struct knd_server *server, struct knd_client *client, int fd)
+/*
+ * Sends the zone events in the given buffer to all subscribed clients of all
+ * shards.  The events are delivered to the calling shard's clients before
+ * this function returns.  Call with the command lock held, so events are
+ * delivered in the order the zones were changed.
+ */
+static void publish_text(struct knd_shard *shard, struct evbuffer *buf)
 {
-	struct bufferevent *newbuf;
-#if defined(EVENT__NUMERIC_VERSION) && EVENT__NUMERIC_VERSION >= 0x02000000
-	// libevent 2 (libevent 2.1 introduced a segfault in bufferevent_new())
-	newbuf = bufferevent_socket_new(server->evloop, fd, 0);
-	if(newbuf != NULL) {
-		bufferevent_setcb(newbuf, knd_read, knd_write, knd_error, client);
+	struct knd_update *update;
+
+	update = get_update(shard->server);
+	if(update == NULL) {
+		return;
 	}
-#else
-	// libevent 1.4
-	newbuf = bufferevent_new(fd, knd_read, knd_write, knd_error, client);
-#endif
 
-	return newbuf;
+	if(set_update_text(update, buf)) {
+		lock_updates(shard->server);
+		release_update(shard->server, update);
+		unlock_updates(shard->server);
+		return;
+	}
+
+	publish_update(shard->server, update, shard);
+	process_updates(shard);
 }
 
-static void setup_connection(int sockfd, struct sockaddr_in6 *remote_addr, struct knd_server *server)
+/*
+ * Delivers the updates queued for the given shard to its clients.  When
+ * several depth or video frames are queued, only the most recent frame is
+ * sent, so slow shards catch up instead of falling further behind.  Call from
+ * the shard's thread.
+ */
+static void process_updates(struct knd_shard *shard)
 {
+	struct knd_server *server = shard->server;
+	struct knd_update **tmp;
+	struct knd_update *update;
 	struct knd_client *client;
-	char *addr = addr_to_string(remote_addr);
+	uint64_t arrival = 0;
+	size_t pending;
+	int count, size;
+	int last_depth = -1;
+	int depth_count = 0;
+	int video = 0;
+	int i;
 
-	if(addr == NULL) {
-		ERROR_OUT("Error converting client address to string for connection on fd %d\n", sockfd);
+	lock_updates(server);
+	tmp = shard->work;
+	size = shard->work_size;
+	shard->work = shard->queue;
+	shard->work_size = shard->queue_size;
+	count = shard->queue_len;
+	shard->queue = tmp;
+	shard->queue_size = size;
+	shard->queue_len = 0;
+	unlock_updates(server);
+
+	if(count == 0) {
 		return;
 	}
 
-	/*I*/ERROR_OUT("Client %s connected on fd %d\n", addr, sockfd);
-
-	if(set_flags(sockfd, O_NONBLOCK)) {
-		ERROR_OUT("Error setting non-blocking I/O on an incoming connection.\n");
-		free(addr);
-		close(sockfd);
+	for(i = 0; i < count; i++) {
+		if(shard->work[i]->depth) {
+			last_depth = i;
+			depth_count++;
+		}
+		video |= shard->work[i]->video;
 	}
 
-	// Copy connection info into a command handler info structure
-	client = create_client(server, sockfd, addr, remote_addr->sin6_port);
-	if(client == NULL) {
-		free(addr);
-		close(sockfd);
-		return;
+	for(i = 0; i < count; i++) {
+		update = shard->work[i];
+
+		if(update->text_len) {
+			for(client = shard->client_list->next; client != NULL; client = client->next) {
+				if(client->subglobal) {
+					evbuffer_add(client->buffer, update->text, update->text_len);
+				}
+			}
+		}
+
+		if(i == last_depth) {
+			arrival = update->depth_arrival;
+			shard->depth_frame = update->depth_frame;
+			shard->depth_time = update->depth_time;
+			for(client = shard->client_list->next; client != NULL; client = client->next) {
+				if(depth_count > 1 && client->subdepth && !client->depth_compress) {
+					__atomic_store_n(&client->frames_skipped,
+							client->frames_skipped + depth_count - 1,
+							__ATOMIC_RELAXED);
+				}
+				process_subscriptions(client);
+			}
+		}
+
+		if(update->compressed) {
+			for(client = shard->client_list->next; client != NULL; client = client->next) {
+				process_compressed(client, update->seq,
+						update->delta, update->delta_size,
+						update->key, update->key_size);
+			}
+		}
+
+		// Sent like SUB lines so command-only clients never see an
+		// unsolicited line between a command and its reply
+		if(update->camera) {
+			for(client = shard->client_list->next; client != NULL; client = client->next) {
+				if(client->subglobal) {
+					evbuffer_add_printf(client->buffer, "CAMERA - %s\n",
+							update->camera_connected ? "connected" : "disconnected");
+				}
+			}
+		}
 	}
 
-	// Initialize a buffered I/O event
-	client->buf_event = create_bufferevent(server, client, sockfd);
-	if(CHECK_NULL(client->buf_event)) {
-		ERROR_OUT("Error initializing buffered I/O event for fd %d.\n", sockfd);
-		free_client(client);
-		return;
+	for(client = shard->client_list->next; client != NULL; client = client->next) {
+		if(video) {
+			process_video(client);
+		}
+		pending = EVBUFFER_LENGTH(client->buffer);
+		flush_client(client);
+		if(arrival && pending) {
+			record_latency(server->info->latency, LATENCY_FLUSH, arrival);
+		}
 	}
-	bufferevent_base_set(server->evloop, client->buf_event);
-	bufferevent_settimeout(client->buf_event, CLIENT_TIMEOUT, 0);
-	if(bufferevent_enable(client->buf_event, EV_READ)) {
-		ERROR_OUT("Error enabling buffered I/O event for fd %d.\n", sockfd);
-		free_client(client);
-		return;
+
+	lock_updates(server);
+	for(i = 0; i < count; i++) {
+		if(--shard->work[i]->refs == 0) {
+			release_update(server, shard->work[i]);
+		}
 	}
+	unlock_updates(server);
+}
 
-	// Create the outgoing data buffer
-	client->buffer = evbuffer_new();
-	if(CHECK_NULL(client->buffer)) {
-		ERROR_OUT("Error creating output buffer for fd %d.\n", sockfd);
-		free_client(client);
+/*
+ * Publishes an update with the zone changes for the given depth frame.  Frames
+ * received while the server was busy are skipped, since the zones only reflect
+ * the most recent frame.
+ */
+static void publish_depth(struct knd_server *server, unsigned int frame)
+{
+	struct knd_update *update;
+
+	update = get_update(server);
+	if(update == NULL) {
 		return;
 	}
+
+	// Zone changes are generated once for all clients, in order with zone
+	// events from commands
+	lock_commands(server);
+
+	server->depth_frame = frame;
+	update->depth = 1;
+	update->depth_frame = server->depth_frame;
+	update->depth_arrival = __atomic_load_n(&server->depth_arrival, __ATOMIC_RELAXED);
+	record_latency(server->info->latency, LATENCY_WAKE, update->depth_arrival);
+	__atomic_fetch_add(&server->info->counts.depth_published, 1, __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &update->depth_time);
+
+	iterate_zonelist(server->info->zones, subs_callback, update);
+	touch_zonelist(server->info->zones);
+
+	publish_update(server, update, &server->shards[0]);
+
+	unlock_commands(server);
 }
 
-static void knd_connect(int listenfd, short evtype, void *arg)
+/*
+ * Copies the most recent compressed depth frame (if any) into an update, so
+ * the encoder can move on to the next frame while shards send this one.
+ */
+static void publish_compressed(struct knd_server *server)
 {
-	struct sockaddr_in6 remote_addr;
-	socklen_t addrlen = sizeof(remote_addr);
-	int sockfd;
-	int i;
+	struct knd_update *update;
+	const uint8_t *delta, *key;
+	size_t delta_size, key_size;
+	unsigned int seq;
 
-	if(!(evtype & EV_READ)) {
-		ERROR_OUT("Unknown event type in connect callback: 0x%hx\n", evtype);
+	if(get_depth_encoder_frame(server->encoder, &seq, &delta, &delta_size, &key, &key_size) <= 0) {
 		return;
 	}
 
-	// Accept and configure incoming connections (up to QUEUED_CONNECTIONS connections in one go)
-	for(i = 0; i < QUEUED_CONNECTIONS; i++) {
-		sockfd = accept(listenfd, (struct sockaddr *)&remote_addr, &addrlen);
-		if(sockfd < 0) {
-			if(errno != EWOULDBLOCK && errno != EAGAIN) {
-				ERRNO_OUT("Error accepting an incoming connection");
-			}
-			break;
-		}
+	update = get_update(server);
+	if(update == NULL) {
+		release_depth_encoder(server->encoder);
+		return;
+	}
 
-		setup_connection(sockfd, &remote_addr, (struct knd_server *)arg);
+	if(reserve_update_buffer((void **)&update->delta, &update->delta_alloc, delta_size) ||
+			reserve_update_buffer((void **)&update->key, &update->key_alloc, key_size)) {
+		release_depth_encoder(server->encoder);
+		lock_updates(server);
+		release_update(server, update);
+		unlock_updates(server);
+		return;
 	}
+
+	update->compressed = 1;
+	update->seq = seq;
+	update->delta_size = delta_size;
+	update->key_size = key_size;
+	memcpy(update->delta, delta, delta_size);
+	memcpy(update->key, key, key_size);
+
+	release_depth_encoder(server->encoder);
+
+	publish_update(server, update, &server->shards[0]);
 }
 
-// Used by process_subscriptions to iterate over the list of zones
-static void subs_callback(void *data, struct zone *zone)
+/*
+ * Publishes an update telling shards a video frame has arrived.
+ */
+static void publish_video(struct knd_server *server)
 {
-	struct knd_client *client = data;
+	struct knd_update *update;
 
-	// It is extremely unlikely that any parameter (such as center of
-	// gravity) will change without pop also changing, due to the high
-	// noise levels present at the fringes of objects.  However, we
-	// also need to check occupied because it can change from 1 to 0
-	// long after pop stops changing, due to rising/falling delay logic.
-	if(zone->lastpop != zone->pop || zone->lastoccupied != zone->occupied || zone->new_zone) {
-		evbuffer_add(client->buffer, "SUB - ", 6);
-		send_zone_info(client, zone, zone->new_zone);
+	update = get_update(server);
+	if(update == NULL) {
+		return;
 	}
-}
 
-static void depthsub_callback(uint8_t *buf, void *data)
-{
-	struct knd_client *client = data;
-	evbuffer_add(client->buffer, buf, FREENECT_DEPTH_11BIT_PACKED_SIZE);
+	update->video = 1;
+	publish_update(server, update, &server->shards[0]);
 }
 
 /*
- * Called by the wakeup pipe handler for each client after kndsrv_send_depth() has
- * been called.
+ * Publishes an update telling every client the camera's new status, if it
+ * differs from the status last published.
  */
-static void process_subscriptions(struct knd_client *client)
+static void publish_camera(struct knd_server *server)
 {
-	if(client->subglobal) {
-		// TODO: Generate the text once and send it to all subscribed clients.
-		iterate_zonelist(client->server->info->zones, subs_callback, client);
+	struct knd_update *update;
+	int connected;
+
+	connected = __atomic_load_n(&server->camera_connected, __ATOMIC_RELAXED);
+	if(connected == server->camera_published) {
+		return;
 	}
-	if(client->subdepth) {
-		if(client->depth_limit > 0) {
-			if(--client->depth_limit == 0) {
-				client->subdepth = 0;
-			}
-		}
 
-		evbuffer_add_printf(client->buffer, "DEPTH - %d bytes of raw data follow newline\n",
-				FREENECT_DEPTH_11BIT_PACKED_SIZE);
-		if(get_depth(client->server->info->vid, depthsub_callback, client)) {
-			ERROR_KNDSRV(client, "Error getting depth data.\n");
-			request_shutdown_client(client);
-		}
+	update = get_update(server);
+	if(update == NULL) {
+		return;
 	}
 
-	flush_client(client);
+	server->camera_published = connected;
+	update->camera = 1;
+	update->camera_connected = connected;
+	publish_update(server, update, &server->shards[0]);
 }
 
-static void videosub_callback(uint8_t *buf, void *data)
+/*
+ * Handles notification from the image processing thread (via
+ * kndsrv_send_depth()) that it's time to update subscriptions or shut down.
+ * Runs in the server thread, which is also shard 0.
+ */
+static void knd_wake(int fd, short evtype, void *arg)
 {
-	struct knd_client *client = data;
-	evbuffer_add(client->buffer, buf, KND_VIDEO_SIZE);
-}
+	struct knd_server *server = arg;
+	unsigned int flags;
+	unsigned int frame;
 
-// Used by process_video to iterate over the list of zones
-static void bright_callback(void *data, struct zone *zone)
-{
-	struct knd_client *client = data;
+	flags = get_wake_flags(&server->shards[0]);
 
-	// TODO: escape name
-	evbuffer_add_printf(client->buffer, "BRIGHT - bright=%d name=\"%s\"\n",
-			zone->bsum * 256 / zone->maxpop, zone->name);
-}
+	if(flags & WAKE_KILL) {
+		event_base_loopexit(server->evloop, NULL);
+		return;
+	}
+
+	trace_begin("knd_wake");
+	set_loop_activity(server->shards[0].monitor, "knd_wake");
+	KND_FRAME_PATH_BEGIN();
+
+	if(flags & WAKE_DEPTH) {
+		frame = __atomic_load_n(&server->depth_received, __ATOMIC_ACQUIRE);
+		if(frame != server->depth_frame) {
+			publish_depth(server, frame);
+		}
+	}
 
-/*
- * Called by the wakeup pipe handler for each client after kndsrv_send_video()
- * has been called.
- */
-static void process_video(struct knd_client *client)
-{
-	if(client->subbright) {
-		// TODO: Generate the text once and send it to all subscribed clients.
-		iterate_zonelist(client->server->info->zones, bright_callback, client);
-		client->subbright = 0;
+	if(flags & WAKE_COMPRESSED) {
+		publish_compressed(server);
 	}
-	if(client->subvideo) {
-		evbuffer_add_printf(client->buffer, "VIDEO - %d bytes of video data follow newline\n",
-				KND_VIDEO_SIZE);
 
-		if(get_video(client->server->info->vid, videosub_callback, client)) {
-			ERROR_KNDSRV(client, "Error getting video data.\n");
-			request_shutdown_client(client);
+	if(flags & WAKE_VIDEO) {
+		frame = __atomic_load_n(&server->video_received, __ATOMIC_ACQUIRE);
+		if(frame != server->video_frame) {
+			server->video_frame = frame;
+			publish_video(server);
 		}
+	}
 
-		client->subvideo = 0;
+	if(flags & WAKE_CAMERA) {
+		publish_camera(server);
 	}
 
-	flush_client(client);
+	process_updates(&server->shards[0]);
+
+	KND_FRAME_PATH_END();
+	set_loop_activity(server->shards[0].monitor, NULL);
+	trace_end("knd_wake");
 }
 
 /*
- * Writes a depth wakeup instruction to the given server's wakeup pipe.  Call
- * this when a depth frame is received.
+ * Sets up connections assigned to the given shard by the server thread.
  */
-void kndsrv_send_depth(struct knd_server *server)
+static void setup_shard_connections(struct knd_shard *shard)
 {
-	errno = 0;
-	if(write(server->wake_write, "Z", 1) != 1) {
-		ERRNO_OUT("Error writing depth wakeup to server wakeup pipe");
+	struct knd_connection *conn, *next;
+
+	lock_updates(shard->server);
+	conn = shard->connections;
+	shard->connections = NULL;
+	unlock_updates(shard->server);
+
+	for(; conn != NULL; conn = next) {
+		next = conn->next;
+		setup_client(shard, conn);
+		free(conn);
 	}
 }
 
 /*
- * Writes a video wakeup instruction to the given server's wakeup pipe.  Call
- * this when a video frame is received.
+ * Handles wakeups for shards other than shard 0.
  */
-void kndsrv_send_video(struct knd_server *server)
+static void shard_wake(int fd, short evtype, void *arg)
 {
-	errno = 0;
-	if(write(server->wake_write, "V", 1) != 1) {
-		ERRNO_OUT("Error writing video wakeup to server wakeup pipe");
+	struct knd_shard *shard = arg;
+	unsigned int flags;
+
+	flags = get_wake_flags(shard);
+
+	if(flags & WAKE_KILL) {
+		event_base_loopexit(shard->evloop, NULL);
+		return;
 	}
-}
 
-/*
- * Writes a kill instruction to the given server's wakeup pipe.
- */
-static void kndsrv_send_kill(struct knd_server *server)
-{
-	errno = 0;
-	if(write(server->wake_write, "K", 1) != 1) {
-		ERRNO_OUT("Error writing kill command to server wakeup pipe");
+	trace_begin("shard_wake");
+	set_loop_activity(shard->monitor, "shard_wake");
+
+	if(flags & WAKE_CONNECTIONS) {
+		setup_shard_connections(shard);
 	}
+
+	KND_FRAME_PATH_BEGIN();
+	process_updates(shard);
+	KND_FRAME_PATH_END();
+	set_loop_activity(shard->monitor, NULL);
+	trace_end("shard_wake");
 }
 
 /*
- * Handles notification from the image processing thread (via
- * kndsrv_send_depth()) that it's time to update subscriptions or shut down.
+ * Tells the watchdog that the shard's event loop is still running.
  */
-static void knd_wake(int fd, short evtype, void *arg)
+static void shard_heartbeat(int fd, short evtype, void *arg)
 {
-	struct knd_server *server = arg;
-	struct knd_client *client;
-	char buf[1024];
-	ssize_t depthcount = 0;
-	ssize_t videocount = 0;
-	ssize_t ret;
-	ssize_t i;
-
-	do {
-		ret = read(server->wake_read, buf, ARRAY_SIZE(buf));
-		for(i = 0; i < ret; i++) {
-			if(buf[i] == 'K') {
-				event_base_loopexit(server->evloop, NULL);
-				depthcount = 0;
-				break;
-			} else if(buf[i] == 'V') {
-				videocount++;
-			} else {
-				depthcount++;
-			}
-		}
-	} while(ret > 0);
-
-	if(ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
-		ERRNO_OUT("Error reading from event loop wakeup pipe");
-	}
+	struct knd_shard *shard = arg;
 
-	if(depthcount) {
-		client = server->client_list->next;
-		while(client != NULL) {
-			process_subscriptions(client);
-			client = client->next;
-		}
-		touch_zonelist(server->info->zones);
-	}
+	loop_heartbeat(shard->monitor);
 
-	if(videocount) {
-		client = server->client_list->next;
-		while(client != NULL) {
-			process_video(client);
-			client = client->next;
-		}
+	// Persistent timers aren't supported by libevent 1.4
+	if(evtimer_add(shard->heartbeat_event, &(struct timeval){ .tv_usec = HEARTBEAT_MS * 1000 })) {
+		ERROR_OUT("Error rescheduling heartbeat on shard %d's event loop.\n", shard->index);
 	}
 }
 
@@ -1228,9 +3340,11 @@ static void knd_wake(int fd, short evtype, void *arg)
 struct knd_server *kndsrv_create(struct knd_info *info, unsigned short port)
 {
 	struct knd_server *server = NULL;
+	struct knd_shard *shard;
 	struct sockaddr_in6 local_addr;
-	int wakefds[2] = {-1, -1};
+	pthread_mutexattr_t mutex_attr;
 	int ret;
+	int i;
 
 	if(info == NULL) {
 		ERROR_OUT("Cannot create a server for a null knd info.\n");
@@ -1247,28 +3361,63 @@ struct knd_server *kndsrv_create(struct knd_info *info, unsigned short port)
 		goto error;
 	}
 
-	server->client_list = calloc(1, sizeof(struct knd_client));
-	if(server->client_list == NULL) {
-		ERRNO_OUT("Error allocating memory for server's client list");
-		goto error;
-	}
-
+	server->unix_fd = -1;
+	server->metrics_fd = -1;
+	server->trusted_uid = (uid_t)-1;
+	server->trusted_gid = (gid_t)-1;
+	server->camera_connected = 1;
+	server->camera_published = 1;
 	server->info = info;
 
-	// Create wakeup pipe
-	ret = pipe(wakefds);
-	server->wake_read = wakefds[0];
-	server->wake_write = wakefds[1];
-	if(ret) {
-		ERRNO_OUT("Error creating event loop wakeup pipe.");
+	if((ret = pthread_mutexattr_init(&mutex_attr))) {
+		ERROR_OUT("Error initializing server mutex attributes: %s\n", strerror(ret));
 		goto error;
 	}
+	if((ret = pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_ERRORCHECK))) {
+		ERROR_OUT("Error setting server mutex type: %s\n", strerror(ret));
+		pthread_mutexattr_destroy(&mutex_attr);
+		goto error;
+	}
+	if((ret = pthread_mutex_init(&server->command_lock, &mutex_attr))) {
+		ERROR_OUT("Error initializing server command mutex: %s\n", strerror(ret));
+		pthread_mutexattr_destroy(&mutex_attr);
+		goto error;
+	}
+	if((ret = pthread_mutex_init(&server->update_lock, &mutex_attr))) {
+		ERROR_OUT("Error initializing server update mutex: %s\n", strerror(ret));
+		pthread_mutex_destroy(&server->command_lock);
+		pthread_mutexattr_destroy(&mutex_attr);
+		goto error;
+	}
+	pthread_mutexattr_destroy(&mutex_attr);
+	server->locks_ready = 1;
 
-	if(set_flags(server->wake_read, O_NONBLOCK)) {
-		ERROR_OUT("Error setting event loop wakeup read pipe for non-blocking I/O.\n");
+	server->shard_count = CLAMP(1, MAX_SHARDS, info->server_threads);
+	server->shards = calloc(server->shard_count, sizeof(struct knd_shard));
+	if(server->shards == NULL) {
+		ERRNO_OUT("Error allocating memory for server's event loops");
 		goto error;
 	}
 
+	for(i = 0; i < server->shard_count; i++) {
+		shard = &server->shards[i];
+		shard->server = server;
+		shard->index = i;
+		shard->wake_fd = -1;
+
+		shard->client_list = calloc(1, sizeof(struct knd_client));
+		if(shard->client_list == NULL) {
+			ERRNO_OUT("Error allocating memory for server's client list");
+			goto error;
+		}
+	}
+
+	// Compressed depth is optional, so failure to start the encoder isn't fatal
+	server->encoder = create_depth_encoder(info, kndsrv_send_compressed, server);
+	if(server->encoder == NULL) {
+		ERROR_OUT("Error creating depth encoder; compressed depth will not be available.\n");
+	}
+
 	// Initialize libevent
 	server->evloop = event_base_new();
 	if(server->evloop == NULL) {
@@ -1276,6 +3425,50 @@ struct knd_server *kndsrv_create(struct knd_info *info, unsigned short port)
 		goto error;
 	}
 
+	// Shard 0 runs in the server's event loop; the others get their own
+	for(i = 0; i < server->shard_count; i++) {
+		shard = &server->shards[i];
+
+		if(i == 0) {
+			shard->evloop = server->evloop;
+		} else {
+			shard->evloop = event_base_new();
+			if(shard->evloop == NULL) {
+				ERROR_OUT("Error initializing event loop for shard %d.\n", i);
+				goto error;
+			}
+		}
+
+		shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(shard->wake_fd == -1) {
+			ERRNO_OUT("Error creating wakeup eventfd for shard %d", i);
+			goto error;
+		}
+
+		shard->wake_event = calloc(1, sizeof(struct event));
+		if(shard->wake_event == NULL) {
+			ERRNO_OUT("Error allocating memory for shard %d wakeup event", i);
+			goto error;
+		}
+		if(i == 0) {
+			// Also watches for frames from the camera callbacks
+			event_set(shard->wake_event, shard->wake_fd, EV_READ | EV_PERSIST, knd_wake, server);
+		} else {
+			event_set(shard->wake_event, shard->wake_fd, EV_READ | EV_PERSIST, shard_wake, shard);
+		}
+		event_base_set(shard->evloop, shard->wake_event);
+		if(event_add(shard->wake_event, NULL)) {
+			ERROR_OUT("Error scheduling wakeup event on shard %d's event loop.\n", i);
+			free(shard->wake_event);
+			shard->wake_event = NULL;
+			goto error;
+		}
+	}
+
+	if(server->shard_count > 1) {
+		nl_ptmf("Serving clients from %d event loop threads.\n", server->shard_count);
+	}
+
 	// Initialize socket address
 	memset(&local_addr, 0, sizeof(local_addr));
 	local_addr.sin6_family = AF_INET6;
@@ -1324,37 +3517,310 @@ struct knd_server *kndsrv_create(struct knd_info *info, unsigned short port)
 		goto error;
 	}
 
-	// Add event to watch for wakeup requests from info callback
-	server->wake_event = calloc(1, sizeof(struct event));
-	if(server->wake_event == NULL) {
-		ERRNO_OUT("Error allocating memory for server wakeup event");
+	return server;
+
+error:
+	if(server != NULL) {
+		kndsrv_destroy(server);
+	}
+
+	return NULL;
+}
+
+/*
+ * Adds a UNIX domain socket listener to the given server, using the same
+ * event loop and protocol as TCP connections.  The spec is the socket path,
+ * optionally followed by comma-separated options: mode=octal (permissions of
+ * the socket file, default 0660), uid=N and gid=N (additional peer user and
+ * group IDs to trust).  Peers running as root or as knd's user are always
+ * trusted.  Any existing socket at the path is replaced, and the socket is
+ * removed when the server is destroyed.  Call before kndsrv_run().  Returns 0
+ * on success, -1 on error.
+ */
+int kndsrv_listen_unix(struct knd_server *server, const char *spec)
+{
+	struct sockaddr_un local_addr;
+	struct stat st;
+	char value[32];
+	mode_t mode = 0660;
+	size_t pathlen;
+
+	if(server->unix_fd >= 0) {
+		ERROR_OUT("The server is already listening on a local socket.\n");
+		return -1;
+	}
+
+	pathlen = strcspn(spec, ",");
+	if(pathlen == 0 || pathlen >= sizeof(local_addr.sun_path)) {
+		ERROR_OUT("Local socket path must be between 1 and %zu characters.\n", sizeof(local_addr.sun_path) - 1);
+		return -1;
+	}
+
+	if(vidproc_get_opt(spec + pathlen, "mode", value, sizeof(value))) {
+		mode = strtoul(value, NULL, 8);
+	}
+	if(vidproc_get_opt(spec + pathlen, "uid", value, sizeof(value))) {
+		server->trusted_uid = strtoul(value, NULL, 10);
+	}
+	if(vidproc_get_opt(spec + pathlen, "gid", value, sizeof(value))) {
+		server->trusted_gid = strtoul(value, NULL, 10);
+	}
+
+	memset(&local_addr, 0, sizeof(local_addr));
+	local_addr.sun_family = AF_UNIX;
+	memcpy(local_addr.sun_path, spec, pathlen);
+
+	server->unix_path = strdup(local_addr.sun_path);
+	if(server->unix_path == NULL) {
+		ERRNO_OUT("Error copying local socket path");
+		return -1;
+	}
+
+	// Replace a socket left behind by a previous run, but nothing else
+	if(!lstat(server->unix_path, &st)) {
+		if(!S_ISSOCK(st.st_mode)) {
+			ERROR_OUT("'%s' exists and is not a socket.\n", server->unix_path);
+			goto error;
+		}
+		if(unlink(server->unix_path)) {
+			ERRNO_OUT("Error removing old local socket '%s'", server->unix_path);
+			goto error;
+		}
+	}
+
+	server->unix_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(server->unix_fd == -1) {
+		ERRNO_OUT("Error creating local listening socket");
+		goto error;
+	}
+	if(bind(server->unix_fd, (struct sockaddr *)&local_addr, sizeof(local_addr))) {
+		ERRNO_OUT("Error binding local listening socket to '%s'", server->unix_path);
+		goto error;
+	}
+	if(chmod(server->unix_path, mode)) {
+		ERRNO_OUT("Error setting permissions on local socket '%s'", server->unix_path);
+		goto error;
+	}
+	if(listen(server->unix_fd, QUEUED_CONNECTIONS)) {
+		ERRNO_OUT("Error listening to local listening socket");
+		goto error;
+	}
+	if(set_flags(server->unix_fd, O_NONBLOCK)) {
+		ERROR_OUT("Error setting local listening socket to non-blocking I/O.\n");
 		goto error;
 	}
 
-	event_set(server->wake_event, server->wake_read, EV_READ | EV_PERSIST, knd_wake, server);
-	event_base_set(server->evloop, server->wake_event);
-	if(event_add(server->wake_event, NULL)) {
-		ERROR_OUT("Error scheduling wakeup event on the event loop.\n");
+	server->unix_event = calloc(1, sizeof(struct event));
+	if(server->unix_event == NULL) {
+		ERRNO_OUT("Error allocating memory for server local connection event");
 		goto error;
 	}
 
-	return server;
+	event_set(server->unix_event, server->unix_fd, EV_READ | EV_PERSIST, knd_connect_unix, server);
+	event_base_set(server->evloop, server->unix_event);
+	if(event_add(server->unix_event, NULL)) {
+		ERROR_OUT("Error scheduling local connection event on the event loop.\n");
+		free(server->unix_event);
+		server->unix_event = NULL;
+		goto error;
+	}
+
+	return 0;
 
 error:
-	if(server != NULL) {
-		kndsrv_destroy(server);
+	if(server->unix_fd >= 0) {
+		close(server->unix_fd);
+		server->unix_fd = -1;
+		unlink(server->unix_path);
+	}
+	free(server->unix_path);
+	server->unix_path = NULL;
+	return -1;
+}
+
+/*
+ * Serves Prometheus metrics (see metrics.c) over HTTP at /metrics on the given
+ * TCP port, using the server thread's event loop.  Call before kndsrv_run().
+ * Returns 0 on success, -1 on error.
+ */
+int kndsrv_listen_metrics(struct knd_server *server, unsigned short port)
+{
+	struct sockaddr_in6 local_addr;
+	int reuse = 1;
+
+	if(server->metrics_fd >= 0) {
+		ERROR_OUT("The server is already serving metrics.\n");
+		return -1;
 	}
 
-	return NULL;
+	server->metrics = create_metrics(server->info);
+	if(server->metrics == NULL) {
+		return -1;
+	}
+
+	memset(&local_addr, 0, sizeof(local_addr));
+	local_addr.sin6_family = AF_INET6;
+	local_addr.sin6_port = htons(port);
+	local_addr.sin6_addr = in6addr_any;
+
+	server->metrics_fd = socket(AF_INET6, SOCK_STREAM, 0);
+	if(server->metrics_fd == -1) {
+		ERRNO_OUT("Error creating metrics listening socket");
+		goto error;
+	}
+	if(setsockopt(server->metrics_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse))) {
+		ERRNO_OUT("Error enabling socket address reuse on metrics listening socket");
+		goto error;
+	}
+	if(bind(server->metrics_fd, (struct sockaddr *)&local_addr, sizeof(local_addr))) {
+		ERRNO_OUT("Error binding metrics listening socket to port %hu", port);
+		goto error;
+	}
+	if(listen(server->metrics_fd, QUEUED_CONNECTIONS)) {
+		ERRNO_OUT("Error listening to metrics listening socket");
+		goto error;
+	}
+	if(set_flags(server->metrics_fd, O_NONBLOCK)) {
+		ERROR_OUT("Error setting metrics listening socket to non-blocking I/O.\n");
+		goto error;
+	}
+
+	server->metrics_event = calloc(1, sizeof(struct event));
+	if(server->metrics_event == NULL) {
+		ERRNO_OUT("Error allocating memory for metrics connection event");
+		goto error;
+	}
+
+	event_set(server->metrics_event, server->metrics_fd, EV_READ | EV_PERSIST, knd_connect_metrics, server);
+	event_base_set(server->evloop, server->metrics_event);
+	if(event_add(server->metrics_event, NULL)) {
+		ERROR_OUT("Error scheduling metrics connection event on the event loop.\n");
+		free(server->metrics_event);
+		server->metrics_event = NULL;
+		goto error;
+	}
+
+	return 0;
+
+error:
+	if(server->metrics_fd >= 0) {
+		close(server->metrics_fd);
+		server->metrics_fd = -1;
+	}
+	destroy_metrics(server->metrics);
+	server->metrics = NULL;
+	return -1;
+}
+
+/*
+ * Has the given watchdog monitor each of the server's event loops for stalls
+ * (see add_loop_monitor()), using a heartbeat timer on each loop.  Call
+ * before kndsrv_run().  Returns 0 on success, -1 on error.
+ */
+int kndsrv_monitor_loops(struct knd_server *server, struct knd_watchdog *wd)
+{
+	struct knd_shard *shard;
+	char name[32];
+	int i;
+
+	for(i = 0; i < server->shard_count; i++) {
+		shard = &server->shards[i];
+		if(shard->monitor != NULL) {
+			continue;
+		}
+
+		if(i == 0) {
+			snprintf(name, sizeof(name), "server");
+		} else {
+			snprintf(name, sizeof(name), "shard %d", i);
+		}
+
+		shard->heartbeat_event = calloc(1, sizeof(struct event));
+		if(shard->heartbeat_event == NULL) {
+			ERRNO_OUT("Error allocating memory for shard %d heartbeat event", i);
+			return -1;
+		}
+
+		shard->monitor = add_loop_monitor(wd, name, HEARTBEAT_MS, STALL_MS);
+		if(shard->monitor == NULL) {
+			free(shard->heartbeat_event);
+			shard->heartbeat_event = NULL;
+			return -1;
+		}
+
+		evtimer_set(shard->heartbeat_event, shard_heartbeat, shard);
+		event_base_set(shard->evloop, shard->heartbeat_event);
+		if(evtimer_add(shard->heartbeat_event, &(struct timeval){ .tv_usec = HEARTBEAT_MS * 1000 })) {
+			ERROR_OUT("Error scheduling heartbeat on shard %d's event loop.\n", i);
+			free(shard->heartbeat_event);
+			shard->heartbeat_event = NULL;
+			shard->monitor = NULL; // Freed with the watchdog
+			return -1;
+		}
+	}
+
+	return 0;
 }
 
 /*
  * Shuts down and frees all client connections on the given server.
  */
-static void knd_free_clients(struct knd_server *server)
+static void knd_free_clients(struct knd_shard *shard)
 {
-	while(server->client_list->next != NULL) {
-		free_client(server->client_list->next);
+	while(shard->client_list->next != NULL) {
+		free_client(shard->client_list->next);
+	}
+}
+
+/*
+ * Frees the given shard's clients, queued updates, pending connections, and
+ * (except for shard 0, which belongs to the server) event loop.
+ */
+static void destroy_shard(struct knd_shard *shard)
+{
+	struct knd_connection *conn;
+	int i;
+
+	if(shard->client_list != NULL) {
+		knd_free_clients(shard);
+		free(shard->client_list);
+	}
+
+	while(shard->connections != NULL) {
+		conn = shard->connections;
+		shard->connections = conn->next;
+		free(conn->addr);
+		close(conn->fd);
+		free(conn);
+	}
+
+	for(i = 0; i < shard->queue_len; i++) {
+		if(--shard->queue[i]->refs == 0) {
+			free_update(shard->queue[i]);
+		}
+	}
+	free(shard->queue);
+	free(shard->work);
+
+	if(shard->wake_event != NULL) {
+		if(event_del(shard->wake_event)) {
+			ERROR_OUT("Error removing wakeup event from shard %d's event loop.\n", shard->index);
+		}
+		free(shard->wake_event);
+	}
+	if(shard->wake_fd >= 0 && close(shard->wake_fd)) {
+		ERRNO_OUT("Error closing shard %d wakeup eventfd", shard->index);
+	}
+	if(shard->heartbeat_event != NULL) {
+		if(event_del(shard->heartbeat_event)) {
+			ERROR_OUT("Error removing heartbeat event from shard %d's event loop.\n", shard->index);
+		}
+		free(shard->heartbeat_event);
+	}
+
+	// Shard 0's event loop belongs to the server
+	if(shard->index != 0 && shard->evloop != NULL) {
+		event_base_free(shard->evloop);
 	}
 }
 
@@ -1365,6 +3831,8 @@ static void knd_free_clients(struct knd_server *server)
  */
 void kndsrv_destroy(struct knd_server *server)
 {
+	int i;
+
 	if(CHECK_NULL(server)) {
 		ERROR_OUT("Cannot destroy a null server.\n");
 		return;
@@ -1376,11 +3844,41 @@ void kndsrv_destroy(struct knd_server *server)
 		}
 		free(server->connect_event);
 	}
-	if(server->wake_event != NULL) {
-		if(event_del(server->wake_event)) {
-			ERROR_OUT("Error removing wakeup event from the event loop.\n");
+	if(server->unix_event != NULL) {
+		if(event_del(server->unix_event)) {
+			ERROR_OUT("Error removing local connection event from the event loop.\n");
+		}
+		free(server->unix_event);
+	}
+	if(server->metrics_event != NULL) {
+		if(event_del(server->metrics_event)) {
+			ERROR_OUT("Error removing metrics connection event from the event loop.\n");
+		}
+		free(server->metrics_event);
+	}
+	while(server->http_clients != NULL) {
+		free_http_client(server->http_clients);
+	}
+	destroy_metrics(server->metrics);
+	// The encoder thread wakes shard 0, so it must stop first
+	destroy_depth_encoder(server->encoder);
+	server->encoder = NULL;
+
+	// Clients must be freed before their event loops
+	if(server->shards != NULL) {
+		for(i = server->shard_count - 1; i >= 0; i--) {
+			destroy_shard(&server->shards[i]);
 		}
-		free(server->wake_event);
+		free(server->shards);
+	}
+
+	reap_recorders(server, 1);
+	free(server->closing);
+
+	while(server->spare_updates != NULL) {
+		struct knd_update *update = server->spare_updates;
+		server->spare_updates = update->next;
+		free_update(update);
 	}
 
 	if(server->evloop != NULL) {
@@ -1391,19 +3889,25 @@ void kndsrv_destroy(struct knd_server *server)
 			ERRNO_OUT("Error closing listening socket");
 		}
 	}
-	if(server->client_list != NULL) {
-		knd_free_clients(server);
-		free(server->client_list);
+	if(server->unix_fd >= 0) {
+		if(close(server->unix_fd)) {
+			ERRNO_OUT("Error closing local listening socket");
+		}
 	}
-	if(server->wake_read >= 0) {
-		if(close(server->wake_read)) {
-			ERRNO_OUT("Error closing server's wakeup read fd.\n");
+	if(server->metrics_fd >= 0) {
+		if(close(server->metrics_fd)) {
+			ERRNO_OUT("Error closing metrics listening socket");
 		}
 	}
-	if(server->wake_write >= 0) {
-		if(close(server->wake_write)) {
-			ERROR_OUT("Error closing server's wakeup write fd.\n");
+	if(server->unix_path != NULL) {
+		if(unlink(server->unix_path) && errno != ENOENT) {
+			ERRNO_OUT("Error removing local socket '%s'", server->unix_path);
 		}
+		free(server->unix_path);
+	}
+	if(server->locks_ready) {
+		pthread_mutex_destroy(&server->update_lock);
+		pthread_mutex_destroy(&server->command_lock);
 	}
 
 	free(server);
@@ -1422,13 +3926,58 @@ static void *kndsrv_thread(void *d)
 	if(event_base_dispatch(server->evloop)) {
 		ERROR_OUT("Error running event loop.\n");
 	}
+	if(server->shards[0].monitor != NULL) {
+		stop_loop_monitor(server->shards[0].monitor);
+	}
 
 	// Clean up and close open connections
-	knd_free_clients(server);
+	knd_free_clients(&server->shards[0]);
+
+	return NULL;
+}
+
+/*
+ * Event loop thread for shards other than shard 0.
+ */
+static void *shard_thread(void *d)
+{
+	struct knd_shard *shard = d;
+
+	nl_set_threadname("kndsrv_shard");
+
+	if(event_base_dispatch(shard->evloop)) {
+		ERROR_OUT("Error running event loop for shard %d.\n", shard->index);
+	}
+	if(shard->monitor != NULL) {
+		stop_loop_monitor(shard->monitor);
+	}
+
+	knd_free_clients(shard);
 
 	return NULL;
 }
 
+/*
+ * Tells the given number of shards after shard 0 to exit, and waits for them.
+ */
+static void stop_shards(struct knd_server *server, int count)
+{
+	int ret;
+	int i;
+
+	for(i = 1; i <= count; i++) {
+		wake_shard(&server->shards[i], WAKE_KILL);
+	}
+
+	for(i = 1; i <= count; i++) {
+		ret = nl_join_thread(server->shards[i].thread, NULL);
+		if(ret) {
+			ERROR_OUT("Error joining shard %d thread: %s\n", i, strerror(ret));
+		}
+		server->shards[i].thread = NULL;
+	}
+}
+
 /*
  * Starts the given server's event loop in a newly-created thread.  Returns 0
  * on success, -1 on error.
@@ -1436,15 +3985,27 @@ static void *kndsrv_thread(void *d)
 int kndsrv_run(struct knd_server *server)
 {
 	int ret;
+	int i;
 
 	if(CHECK_NULL(server)) {
 		ERROR_OUT("Cannot run a null server.\n");
 		return -1;
 	}
 
+	for(i = 1; i < server->shard_count; i++) {
+		ret = nl_create_thread(server->info->thread_ctx, NULL, shard_thread, &server->shards[i],
+				"kndsrv_shard", &server->shards[i].thread);
+		if(ret) {
+			ERROR_OUT("Error starting server thread for shard %d: %s\n", i, strerror(ret));
+			stop_shards(server, i - 1);
+			return -1;
+		}
+	}
+
 	ret = nl_create_thread(server->info->thread_ctx, NULL, kndsrv_thread, server, "kndsrv_thread", &server->thread);
 	if(ret) {
 		ERROR_OUT("Error starting server thread: %s\n", strerror(ret));
+		stop_shards(server, server->shard_count - 1);
 		return -1;
 	}
 
@@ -1452,18 +4013,20 @@ int kndsrv_run(struct knd_server *server)
 }
 
 /*
- * Stops the given server's event loop.  This function waits for the server
- * event thread to exit.
+ * Stops the given server's event loops.  This function waits for the server
+ * event threads to exit.
  */
 void kndsrv_stop(struct knd_server *server)
 {
 	int ret;
 
-	kndsrv_send_kill(server);
+	wake_shard(&server->shards[0], WAKE_KILL);
 
 	ret = nl_join_thread(server->thread, NULL);
 	if(ret) {
 		ERROR_OUT("Error joining server thread: %s\n", strerror(ret));
 	}
+
+	stop_shards(server, server->shard_count - 1);
 }
 
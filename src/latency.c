@@ -0,0 +1,217 @@
+/*
+ * latency.c - Per-stage latency histograms for the depth frame pipeline
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * Each pipeline stage has a histogram of the time (in microseconds) from a
+ * depth frame's arrival from the camera to the frame reaching that stage.
+ * Buckets are logarithmic with LATENCY_SUB_BUCKETS linear sub-buckets per
+ * power of two, so values are kept to within 1/LATENCY_SUB_BUCKETS of their
+ * true value across the whole range, as in an HDR histogram.  Recording only
+ * uses relaxed atomic increments, so it never allocates, locks, or blocks.
+ * The histograms are also used for lock profiling (see lockprof.c).
+ */
+#include <stdlib.h>
+
+#include "knd.h"
+
+struct knd_latency {
+	struct latency_histogram stages[LATENCY_STAGES];
+};
+
+static const char * const stage_names[LATENCY_STAGES] = {
+	[LATENCY_DEQUEUE] = "dequeue",
+	[LATENCY_ZONES] = "zones",
+	[LATENCY_WAKE] = "wake",
+	[LATENCY_FLUSH] = "flush",
+};
+
+
+// Returns the bucket that holds the given value.
+static unsigned int latency_bucket(uint64_t value)
+{
+	unsigned int shift;
+
+	if(value < LATENCY_SUB_BUCKETS) {
+		return value;
+	}
+
+	if(value >= (1ULL << LATENCY_MAX_BITS)) {
+		value = (1ULL << LATENCY_MAX_BITS) - 1;
+	}
+
+	shift = 63 - __builtin_clzll(value) - LATENCY_SUB_BITS;
+	return (shift + 1) * LATENCY_SUB_BUCKETS + ((value >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// Returns the largest value that falls into the given bucket.
+static uint64_t latency_bucket_limit(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if(bucket < LATENCY_SUB_BUCKETS) {
+		return bucket;
+	}
+
+	shift = bucket / LATENCY_SUB_BUCKETS - 1;
+	return (((uint64_t)LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS + 1) << shift) - 1;
+}
+
+/*
+ * Adds a value to the given histogram.  Safe to call from any thread; never
+ * allocates or locks.
+ */
+void record_histogram(struct latency_histogram *hist, uint64_t value)
+{
+	uint64_t max;
+
+	__atomic_fetch_add(&hist->counts[latency_bucket(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	while(value > max && !__atomic_compare_exchange_n(&hist->max, &max, value, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		// max was reloaded by the failed exchange
+	}
+}
+
+/*
+ * Fills *stats with the number and sum of the values and the 50th, 90th, and
+ * 99th percentile and maximum values recorded in the given histogram.
+ * Percentiles are the upper limit of the bucket holding the percentile, so
+ * they may be up to 1/8 above the true value.  Values recorded while the
+ * statistics are read may or may not be included.
+ */
+void get_histogram_stats(struct latency_histogram *hist, struct latency_stats *stats)
+{
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t total = 0, sum = 0;
+	uint64_t targets[3];
+	uint64_t *results[3] = { &stats->p50, &stats->p90, &stats->p99 };
+	unsigned int next = 0;
+	unsigned int i;
+
+	for(i = 0; i < LATENCY_BUCKETS; i++) {
+		counts[i] = __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+		total += counts[i];
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	stats->count = total;
+	stats->sum = __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+	stats->max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	if(total == 0) {
+		return;
+	}
+
+	// Smallest sample counts that reach each percentile
+	targets[0] = (total * 50 + 99) / 100;
+	targets[1] = (total * 90 + 99) / 100;
+	targets[2] = (total * 99 + 99) / 100;
+
+	for(i = 0; i < LATENCY_BUCKETS && next < ARRAY_SIZE(targets); i++) {
+		sum += counts[i];
+		while(next < ARRAY_SIZE(targets) && sum >= targets[next]) {
+			*results[next] = MIN_NUM(latency_bucket_limit(i), stats->max);
+			next++;
+		}
+	}
+}
+
+/*
+ * Clears the given histogram.  Values recorded during the reset may be lost.
+ */
+void reset_histogram(struct latency_histogram *hist)
+{
+	int i;
+
+	for(i = 0; i < LATENCY_BUCKETS; i++) {
+		__atomic_store_n(&hist->counts[i], 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&hist->sum, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->max, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Creates an empty set of latency histograms.  Returns NULL on error.
+ */
+struct knd_latency *create_latency(void)
+{
+	struct knd_latency *lat;
+
+	lat = calloc(1, sizeof(struct knd_latency));
+	if(lat == NULL) {
+		ERRNO_OUT("Error allocating latency histograms");
+		return NULL;
+	}
+
+	return lat;
+}
+
+/*
+ * Frees the given latency histograms.  Ignores a NULL lat.
+ */
+void destroy_latency(struct knd_latency *lat)
+{
+	free(lat);
+}
+
+/*
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds, for use as the
+ * start time passed to record_latency().
+ */
+uint64_t latency_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Records the time from start_ns (from latency_now()) to now in the given
+ * stage's histogram.  Does nothing if lat is NULL or start_ns is 0.  Safe to
+ * call from any thread; never allocates or locks.
+ */
+void record_latency(struct knd_latency *lat, enum latency_stage stage, uint64_t start_ns)
+{
+	uint64_t now = latency_now();
+
+	if(lat == NULL || start_ns == 0) {
+		return;
+	}
+
+	record_histogram(&lat->stages[stage], now > start_ns ? (now - start_ns) / 1000 : 0);
+}
+
+/*
+ * Fills *stats with the number of samples and the 50th, 90th, and 99th
+ * percentile and maximum latencies (in microseconds) recorded for the given
+ * stage.  Percentiles are the upper limit of the bucket holding the
+ * percentile, so they may be up to 1/8 above the true value.  Samples
+ * recorded while the statistics are read may or may not be included.
+ */
+void get_latency_stats(struct knd_latency *lat, enum latency_stage stage, struct latency_stats *stats)
+{
+	get_histogram_stats(&lat->stages[stage], stats);
+}
+
+/*
+ * Clears all of the histograms.  Samples recorded during the reset may be
+ * lost.
+ */
+void reset_latency(struct knd_latency *lat)
+{
+	int stage;
+
+	for(stage = 0; stage < LATENCY_STAGES; stage++) {
+		reset_histogram(&lat->stages[stage]);
+	}
+}
+
+/*
+ * Returns the name of the given latency stage.
+ */
+const char *latency_stage_name(enum latency_stage stage)
+{
+	return stage_names[stage];
+}
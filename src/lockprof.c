@@ -0,0 +1,128 @@
+/*
+ * lockprof.c - Mutex contention profiling
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * When knd is built with KND_LOCK_PROFILE, KND_MUTEX_LOCK() records how long
+ * each call site waited for its mutex and how long the mutex was held, in
+ * nanoseconds.  Each call site has its own statically allocated statistics,
+ * registered on first use, so profiling never allocates.  Without
+ * KND_LOCK_PROFILE, the macros are plain pthread calls and this file is empty.
+ */
+#include "knd.h"
+
+#ifdef KND_LOCK_PROFILE
+
+#define LOCK_PROFILE_DEPTH	8	// Nested profiled locks tracked per thread
+
+struct held_lock {
+	pthread_mutex_t *mutex;
+	struct lock_site *site;
+	uint64_t acquired; // From latency_now()
+};
+
+static struct lock_site *lock_sites; // Registered call sites (accessed atomically)
+
+// Profiled mutexes held by the current thread, innermost last
+static __thread struct held_lock held_locks[LOCK_PROFILE_DEPTH];
+static __thread int held_count;
+
+
+// Adds a call site to the list of call sites the first time it is used.
+static void register_site(struct lock_site *site)
+{
+	struct lock_site *head;
+
+	if(__atomic_exchange_n(&site->registered, 1, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	head = __atomic_load_n(&lock_sites, __ATOMIC_RELAXED);
+	do {
+		site->next = head;
+	} while(!__atomic_compare_exchange_n(&lock_sites, &head, site, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Locks the given mutex like pthread_mutex_lock(), recording the wait in the
+ * given call site's statistics.  Use KND_MUTEX_LOCK() instead of calling this
+ * directly.
+ */
+int profile_mutex_lock(struct lock_site *site, pthread_mutex_t *mutex)
+{
+	uint64_t start, acquired;
+	int ret;
+
+	register_site(site);
+
+	start = latency_now();
+	ret = pthread_mutex_trylock(mutex);
+	if(ret == EBUSY) {
+		__atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+		ret = pthread_mutex_lock(mutex);
+	}
+	if(ret) {
+		return ret;
+	}
+	acquired = latency_now();
+
+	record_histogram(&site->wait, acquired - start);
+
+	if(held_count < LOCK_PROFILE_DEPTH) {
+		held_locks[held_count++] = (struct held_lock){
+			.mutex = mutex,
+			.site = site,
+			.acquired = acquired,
+		};
+	}
+
+	return 0;
+}
+
+/*
+ * Unlocks the given mutex like pthread_mutex_unlock(), recording how long it
+ * was held in the statistics of the call site that locked it.  Use
+ * KND_MUTEX_UNLOCK() instead of calling this directly.
+ */
+int profile_mutex_unlock(pthread_mutex_t *mutex)
+{
+	uint64_t now = latency_now();
+	int i;
+
+	for(i = held_count - 1; i >= 0; i--) {
+		if(held_locks[i].mutex == mutex) {
+			record_histogram(&held_locks[i].site->hold, now - held_locks[i].acquired);
+			memmove(&held_locks[i], &held_locks[i + 1], sizeof(held_locks[0]) * (held_count - i - 1));
+			held_count--;
+			break;
+		}
+	}
+
+	return pthread_mutex_unlock(mutex);
+}
+
+/*
+ * Returns the first profiled call site that has been used, or NULL if none
+ * have.  Follow each site's next pointer for the rest.
+ */
+struct lock_site *get_lock_sites(void)
+{
+	return __atomic_load_n(&lock_sites, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Clears the statistics of every call site.  Locks taken during the reset may
+ * or may not be counted.
+ */
+void reset_lock_profile(void)
+{
+	struct lock_site *site;
+
+	for(site = get_lock_sites(); site != NULL; site = site->next) {
+		__atomic_store_n(&site->contended, 0, __ATOMIC_RELAXED);
+		reset_histogram(&site->wait);
+		reset_histogram(&site->hold);
+	}
+}
+
+#endif /* KND_LOCK_PROFILE */
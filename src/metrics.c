@@ -0,0 +1,271 @@
+/*
+ * metrics.c - Prometheus text format metrics
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * Renders frame rate, frame counts, pipeline latency, zone state, client
+ * count, and memory use in the Prometheus text exposition format.  The
+ * rendered text is cached for METRICS_MAX_AGE_NS, so however often the
+ * metrics are scraped, the zone list is locked at most once per interval.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "knd.h"
+
+#define METRICS_MAX_AGE_NS	1000000000 // How long rendered metrics are reused
+
+struct knd_metrics {
+	struct knd_info *knd;
+
+	char *text; // Most recently rendered metrics (NULL before the first render)
+	size_t len;
+	uint64_t time; // When text was rendered (from latency_now())
+};
+
+
+// Writes the given string to out with Prometheus label value escaping.
+static void write_label(FILE *out, const char *value)
+{
+	for(; *value; value++) {
+		switch(*value) {
+			case '\\':
+				fputs("\\\\", out);
+				break;
+			case '"':
+				fputs("\\\"", out);
+				break;
+			case '\n':
+				fputs("\\n", out);
+				break;
+			default:
+				fputc(*value, out);
+				break;
+		}
+	}
+}
+
+struct zone_metrics {
+	FILE *pop;
+	FILE *occupied;
+	int count;
+};
+
+// Used by write_zones() to write each zone's population and occupied flag.
+static void write_zone(void *data, struct zone *zone)
+{
+	struct zone_metrics *zm = data;
+
+	fputs("knd_zone_pop{zone=\"", zm->pop);
+	write_label(zm->pop, zone->name);
+	fprintf(zm->pop, "\"} %d\n", zone->pop);
+
+	fputs("knd_zone_occupied{zone=\"", zm->occupied);
+	write_label(zm->occupied, zone->name);
+	fprintf(zm->occupied, "\"} %d\n", zone->occupied ^ zone->negate);
+
+	zm->count++;
+}
+
+// Writes the zone metrics to out, locking the zone list only once so every
+// value comes from the same frame.
+static void write_zones(struct knd_info *knd, FILE *out)
+{
+	struct zone_metrics zm = { .pop = out };
+	char *occupied = NULL;
+	size_t len;
+
+	zm.occupied = open_memstream(&occupied, &len);
+	if(zm.occupied == NULL) {
+		ERRNO_OUT("Error opening zone metrics buffer");
+		return;
+	}
+
+	fprintf(out, "# HELP knd_zone_pop Pixels within each zone.\n");
+	fprintf(out, "# TYPE knd_zone_pop gauge\n");
+	iterate_zonelist(knd->zones, write_zone, &zm);
+
+	if(fclose(zm.occupied) || occupied == NULL) {
+		ERRNO_OUT("Error rendering zone metrics");
+	} else {
+		fprintf(out, "# HELP knd_zone_occupied Whether each zone is occupied.\n");
+		fprintf(out, "# TYPE knd_zone_occupied gauge\n");
+		fwrite(occupied, 1, len, out);
+	}
+	free(occupied);
+
+	fprintf(out, "# HELP knd_zones Number of zones.\n");
+	fprintf(out, "# TYPE knd_zones gauge\n");
+	fprintf(out, "knd_zones %d\n", zm.count);
+}
+
+// Writes the resident and virtual memory size of the process to out.
+static void write_memory(FILE *out)
+{
+	unsigned long size, resident;
+	long page_size = sysconf(_SC_PAGESIZE);
+	FILE *statm;
+
+	statm = fopen("/proc/self/statm", "r");
+	if(statm == NULL) {
+		ERRNO_OUT("Error opening /proc/self/statm");
+		return;
+	}
+
+	if(fscanf(statm, "%lu %lu", &size, &resident) == 2) {
+		fprintf(out, "# HELP knd_memory_bytes Memory used by knd.\n");
+		fprintf(out, "# TYPE knd_memory_bytes gauge\n");
+		fprintf(out, "knd_memory_bytes{type=\"resident\"} %llu\n", (unsigned long long)resident * page_size);
+		fprintf(out, "knd_memory_bytes{type=\"virtual\"} %llu\n", (unsigned long long)size * page_size);
+	} else {
+		ERROR_OUT("Error reading memory use from /proc/self/statm.\n");
+	}
+
+	fclose(statm);
+}
+
+// Writes all of the metrics to out.
+static void render_metrics(struct knd_metrics *metrics, int clients, FILE *out)
+{
+	struct knd_info *knd = metrics->knd;
+	struct knd_frame_counts *counts = &knd->counts;
+	struct latency_stats stats;
+	uint64_t average, jitter;
+	int i;
+
+	fprintf(out, "# HELP knd_fps Depth frames processed per second.\n");
+	fprintf(out, "# TYPE knd_fps gauge\n");
+	fprintf(out, "knd_fps %d\n", knd->fps);
+
+	fprintf(out, "# HELP knd_depth_frames_total Depth frames that reached each stage of processing.\n");
+	fprintf(out, "# TYPE knd_depth_frames_total counter\n");
+	fprintf(out, "knd_depth_frames_total{stage=\"received\"} %llu\n",
+			(unsigned long long)__atomic_load_n(&counts->depth_received, __ATOMIC_RELAXED));
+	fprintf(out, "knd_depth_frames_total{stage=\"dropped\"} %llu\n",
+			(unsigned long long)__atomic_load_n(&counts->depth_dropped, __ATOMIC_RELAXED));
+	fprintf(out, "knd_depth_frames_total{stage=\"processed\"} %llu\n",
+			(unsigned long long)__atomic_load_n(&counts->depth_processed, __ATOMIC_RELAXED));
+	fprintf(out, "knd_depth_frames_total{stage=\"published\"} %llu\n",
+			(unsigned long long)__atomic_load_n(&counts->depth_published, __ATOMIC_RELAXED));
+	fprintf(out, "knd_depth_frames_total{stage=\"sent\"} %llu\n",
+			(unsigned long long)__atomic_load_n(&counts->depth_sent, __ATOMIC_RELAXED));
+
+	fprintf(out, "# HELP knd_video_frames_total Video frames received from the camera.\n");
+	fprintf(out, "# TYPE knd_video_frames_total counter\n");
+	fprintf(out, "knd_video_frames_total %llu\n",
+			(unsigned long long)__atomic_load_n(&counts->video_received, __ATOMIC_RELAXED));
+
+	fprintf(out, "# HELP knd_video_starts_total Times the video stream was started for a request.\n");
+	fprintf(out, "# TYPE knd_video_starts_total counter\n");
+	fprintf(out, "knd_video_starts_total %llu\n",
+			(unsigned long long)__atomic_load_n(&counts->video_starts, __ATOMIC_RELAXED));
+
+	if(knd->latency != NULL) {
+		fprintf(out, "# HELP knd_latency_microseconds Time from a depth frame's arrival from the camera to each pipeline stage.\n");
+		fprintf(out, "# TYPE knd_latency_microseconds summary\n");
+		for(i = 0; i < LATENCY_STAGES; i++) {
+			get_latency_stats(knd->latency, i, &stats);
+			fprintf(out, "knd_latency_microseconds{stage=\"%s\",quantile=\"0.5\"} %llu\n",
+					latency_stage_name(i), (unsigned long long)stats.p50);
+			fprintf(out, "knd_latency_microseconds{stage=\"%s\",quantile=\"0.9\"} %llu\n",
+					latency_stage_name(i), (unsigned long long)stats.p90);
+			fprintf(out, "knd_latency_microseconds{stage=\"%s\",quantile=\"0.99\"} %llu\n",
+					latency_stage_name(i), (unsigned long long)stats.p99);
+			fprintf(out, "knd_latency_microseconds_sum{stage=\"%s\"} %llu\n",
+					latency_stage_name(i), (unsigned long long)stats.sum);
+			fprintf(out, "knd_latency_microseconds_count{stage=\"%s\"} %llu\n",
+					latency_stage_name(i), (unsigned long long)stats.count);
+		}
+	}
+
+	if(knd->wd != NULL) {
+		get_watchdog_intervals(knd->wd, &stats, &average, &jitter);
+		fprintf(out, "# HELP knd_frame_interval_microseconds Time between depth frames.\n");
+		fprintf(out, "# TYPE knd_frame_interval_microseconds summary\n");
+		fprintf(out, "knd_frame_interval_microseconds{quantile=\"0.5\"} %llu\n", (unsigned long long)stats.p50);
+		fprintf(out, "knd_frame_interval_microseconds{quantile=\"0.9\"} %llu\n", (unsigned long long)stats.p90);
+		fprintf(out, "knd_frame_interval_microseconds{quantile=\"0.99\"} %llu\n", (unsigned long long)stats.p99);
+		fprintf(out, "knd_frame_interval_microseconds_sum %llu\n", (unsigned long long)stats.sum);
+		fprintf(out, "knd_frame_interval_microseconds_count %llu\n", (unsigned long long)stats.count);
+		fprintf(out, "# HELP knd_frame_jitter_microseconds Rolling standard deviation of the time between depth frames.\n");
+		fprintf(out, "# TYPE knd_frame_jitter_microseconds gauge\n");
+		fprintf(out, "knd_frame_jitter_microseconds %llu\n", (unsigned long long)jitter);
+	}
+
+	write_zones(knd, out);
+
+	fprintf(out, "# HELP knd_clients Connected clients.\n");
+	fprintf(out, "# TYPE knd_clients gauge\n");
+	fprintf(out, "knd_clients %d\n", clients);
+
+	write_memory(out);
+}
+
+/*
+ * Creates a metrics cache for the given knd context.  Returns NULL on error.
+ */
+struct knd_metrics *create_metrics(struct knd_info *knd)
+{
+	struct knd_metrics *metrics;
+
+	metrics = calloc(1, sizeof(struct knd_metrics));
+	if(metrics == NULL) {
+		ERRNO_OUT("Error allocating metrics cache");
+		return NULL;
+	}
+
+	metrics->knd = knd;
+
+	return metrics;
+}
+
+/*
+ * Frees the given metrics cache.  Ignores a NULL metrics.
+ */
+void destroy_metrics(struct knd_metrics *metrics)
+{
+	if(metrics == NULL) {
+		return;
+	}
+
+	free(metrics->text);
+	free(metrics);
+}
+
+/*
+ * Returns the metrics in the Prometheus text format, storing the length in
+ * *len.  The metrics are rendered again, with the given number of connected
+ * clients, only if the cached copy is older than one second.  The returned
+ * text belongs to the cache and remains valid until the next call.  Call from
+ * one thread at a time.  Returns NULL on error.
+ */
+const char *get_metrics(struct knd_metrics *metrics, int clients, size_t *len)
+{
+	uint64_t now = latency_now();
+	char *text = NULL;
+	size_t text_len;
+	FILE *out;
+
+	if(metrics->text == NULL || now - metrics->time >= METRICS_MAX_AGE_NS) {
+		out = open_memstream(&text, &text_len);
+		if(out == NULL) {
+			ERRNO_OUT("Error opening metrics buffer");
+			return NULL;
+		}
+
+		render_metrics(metrics, clients, out);
+
+		if(fclose(out) || text == NULL) {
+			ERRNO_OUT("Error rendering metrics");
+			free(text);
+			return NULL;
+		}
+
+		free(metrics->text);
+		metrics->text = text;
+		metrics->len = text_len;
+		metrics->time = now;
+	}
+
+	*len = metrics->len;
+	return metrics->text;
+}
@@ -0,0 +1,368 @@
+/*
+ * multicast.c - UDP multicast publication of zone state
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * Sends compact datagrams describing zone changes to a multicast group, so
+ * any number of listeners can follow zone state at a fixed cost to the
+ * server.  All fields are in network byte order.  Each datagram begins with a
+ * 20-byte header:
+ *
+ *	0  uint32  magic (0x4b4e444d, "KNDM")
+ *	4  uint8   protocol version (1)
+ *	5  uint8   type (1 = changes, 2 = full state)
+ *	6  uint16  number of entries in this datagram
+ *	8  uint32  depth frame number
+ *	12 uint32  zone list version
+ *	16 uint16  total number of zones
+ *	18 uint16  reserved (0)
+ *
+ * Change entries (8 bytes) are sent for each zone whose pop or occupied
+ * state changed in a frame:
+ *
+ *	0  uint16  zone index
+ *	2  uint8   flags (bit 0 = occupied)
+ *	3  uint8   reserved (0)
+ *	4  int32   pop
+ *
+ * Full state entries are sent for every zone periodically and whenever the
+ * zone list version changes (zone indices are only meaningful within a zone
+ * list version):
+ *
+ *	0  uint16  zone index
+ *	2  uint8   flags (bit 0 = occupied)
+ *	3  uint8   name length
+ *	4  int32   pop
+ *	8  int32   maxpop
+ *	12 char[]  name (not terminated)
+ *
+ * A frame's entries may span several datagrams, which are never larger than
+ * MCAST_MAX_PACKET bytes.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "knd.h"
+
+#define MCAST_MAGIC		0x4b4e444d
+#define MCAST_VERSION		1
+#define MCAST_TYPE_CHANGES	1
+#define MCAST_TYPE_FULL		2
+#define MCAST_HEADER_SIZE	20
+#define MCAST_CHANGE_SIZE	8
+#define MCAST_FULL_SIZE		12
+#define MCAST_MAX_PACKET	1400 // Stays below a typical path MTU
+
+/*
+ * Last published state of a single zone.
+ */
+struct mcast_zone {
+	int pop;
+	int maxpop;
+	unsigned int occupied:1;
+	unsigned int changed:1;
+	char name[ZONE_NAME_LENGTH];
+};
+
+struct knd_multicast {
+	int fd;
+	struct sockaddr_in group;
+	struct timespec refresh_interval;
+	struct timespec next_refresh;
+
+	uint32_t frame; // Depth frames published
+	unsigned int version; // Zone list version of the zones array
+	unsigned int have_version:1;
+
+	struct mcast_zone *zones;
+	int count; // Zones in the current list
+	int size; // Allocated length of zones
+	int index; // Next zone index during iteration
+	unsigned int names_stale:1; // Zone names must be copied during iteration
+
+	uint8_t packet[MCAST_MAX_PACKET];
+	size_t packet_len;
+	uint16_t packet_entries;
+	uint8_t packet_type;
+};
+
+
+static void put_u16(uint8_t *buf, uint16_t v)
+{
+	v = htons(v);
+	memcpy(buf, &v, sizeof(v));
+}
+
+static void put_u32(uint8_t *buf, uint32_t v)
+{
+	v = htonl(v);
+	memcpy(buf, &v, sizeof(v));
+}
+
+// Sends the datagram being built, if it has any entries (or if send_empty
+// is nonzero).
+static void send_packet(struct knd_multicast *mc, int send_empty)
+{
+	if(mc->packet_entries == 0 && !send_empty) {
+		return;
+	}
+
+	put_u32(mc->packet, MCAST_MAGIC);
+	mc->packet[4] = MCAST_VERSION;
+	mc->packet[5] = mc->packet_type;
+	put_u16(mc->packet + 6, mc->packet_entries);
+	put_u32(mc->packet + 8, mc->frame);
+	put_u32(mc->packet + 12, mc->version);
+	put_u16(mc->packet + 16, mc->count);
+	put_u16(mc->packet + 18, 0);
+
+	// Listeners recover from a dropped datagram at the next full refresh
+	if(sendto(mc->fd, mc->packet, mc->packet_len, MSG_DONTWAIT,
+				(struct sockaddr *)&mc->group, sizeof(mc->group)) < 0 &&
+			errno != EAGAIN && errno != EWOULDBLOCK) {
+		ERRNO_OUT("Error sending zone multicast datagram");
+	}
+
+	mc->packet_len = MCAST_HEADER_SIZE;
+	mc->packet_entries = 0;
+}
+
+// Starts a datagram of the given type.
+static void begin_packet(struct knd_multicast *mc, uint8_t type)
+{
+	mc->packet_type = type;
+	mc->packet_len = MCAST_HEADER_SIZE;
+	mc->packet_entries = 0;
+}
+
+// Returns space for an entry of the given size, sending a datagram first if
+// the entry would not fit.
+static uint8_t *add_entry(struct knd_multicast *mc, size_t size)
+{
+	uint8_t *entry;
+
+	if(mc->packet_len + size > MCAST_MAX_PACKET) {
+		send_packet(mc, 0);
+	}
+
+	entry = mc->packet + mc->packet_len;
+	mc->packet_len += size;
+	mc->packet_entries++;
+
+	return entry;
+}
+
+// Records one zone's state (called with the zone list locked).
+static void mcast_zone_callback(void *data, struct zone *zone)
+{
+	struct knd_multicast *mc = data;
+	struct mcast_zone *z;
+	struct mcast_zone *tmp;
+	int occupied = zone->occupied ^ zone->negate;
+
+	if(mc->index >= mc->size) {
+		tmp = realloc(mc->zones, sizeof(struct mcast_zone) * (mc->size + 16));
+		if(tmp == NULL) {
+			ERRNO_OUT("Error allocating multicast zone state");
+			return;
+		}
+		memset(tmp + mc->size, 0, sizeof(struct mcast_zone) * 16);
+		mc->zones = tmp;
+		mc->size += 16;
+	}
+
+	z = &mc->zones[mc->index++];
+	z->changed = mc->names_stale || z->pop != zone->pop || z->occupied != occupied;
+	z->pop = zone->pop;
+	z->maxpop = zone->maxpop;
+	z->occupied = occupied;
+	if(mc->names_stale) {
+		memcpy(z->name, zone->name, sizeof(z->name));
+		z->name[sizeof(z->name) - 1] = 0;
+	}
+}
+
+/*
+ * Creates a multicast publisher from the given specification:
+ * group[:port][,ttl=N][,iface=addr][,refresh=ms].  The port defaults to
+ * KND_PORT, the TTL to 1 (local network only), and the full-state refresh
+ * interval to 1000ms.  Only IPv4 groups are supported.  Returns NULL on error.
+ */
+struct knd_multicast *create_multicast(const char *spec)
+{
+	struct knd_multicast *mc;
+	struct in_addr iface;
+	char group[INET_ADDRSTRLEN];
+	char value[INET_ADDRSTRLEN];
+	size_t grouplen;
+	const char *opts;
+	int port = KND_PORT;
+	int refresh;
+	int ttl;
+
+	grouplen = strcspn(spec, ":,");
+	if(grouplen == 0 || grouplen >= sizeof(group)) {
+		ERROR_OUT("Invalid multicast group in '%s'.\n", spec);
+		return NULL;
+	}
+	memcpy(group, spec, grouplen);
+	group[grouplen] = 0;
+
+	opts = spec + grouplen;
+	if(*opts == ':') {
+		port = atoi(opts + 1);
+		opts += 1 + strcspn(opts + 1, ",");
+	}
+	ttl = vidproc_get_int_opt(opts, "ttl", 1);
+	refresh = vidproc_get_int_opt(opts, "refresh", 1000);
+
+	if(port <= 0 || port > 65535 || ttl < 0 || ttl > 255 || refresh <= 0) {
+		ERROR_OUT("Invalid multicast port, ttl, or refresh interval in '%s'.\n", spec);
+		return NULL;
+	}
+
+	mc = calloc(1, sizeof(struct knd_multicast));
+	if(mc == NULL) {
+		ERRNO_OUT("Error allocating multicast publisher");
+		return NULL;
+	}
+
+	mc->group.sin_family = AF_INET;
+	mc->group.sin_port = htons(port);
+	if(inet_pton(AF_INET, group, &mc->group.sin_addr) != 1 || !IN_MULTICAST(ntohl(mc->group.sin_addr.s_addr))) {
+		ERROR_OUT("'%s' is not an IPv4 multicast group.\n", group);
+		goto error;
+	}
+
+	mc->refresh_interval.tv_sec = refresh / 1000;
+	mc->refresh_interval.tv_nsec = (refresh % 1000) * 1000000;
+
+	mc->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if(mc->fd == -1) {
+		ERRNO_OUT("Error creating multicast socket");
+		goto error;
+	}
+
+	if(setsockopt(mc->fd, IPPROTO_IP, IP_MULTICAST_TTL, &(unsigned char){ttl}, sizeof(unsigned char))) {
+		ERRNO_OUT("Error setting multicast TTL");
+		goto error_close;
+	}
+
+	if(vidproc_get_opt(opts, "iface", value, sizeof(value))) {
+		if(inet_pton(AF_INET, value, &iface) != 1) {
+			ERROR_OUT("Invalid multicast interface address '%s'.\n", value);
+			goto error_close;
+		}
+		if(setsockopt(mc->fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface))) {
+			ERRNO_OUT("Error setting multicast interface");
+			goto error_close;
+		}
+	}
+
+	nl_ptmf("Publishing zone state to multicast group %s:%d (ttl %d).\n", group, port, ttl);
+
+	return mc;
+
+error_close:
+	close(mc->fd);
+error:
+	free(mc);
+	return NULL;
+}
+
+/*
+ * Closes the given multicast publisher's socket and frees its resources.
+ * Ignores a NULL mc.
+ */
+void destroy_multicast(struct knd_multicast *mc)
+{
+	if(mc == NULL) {
+		return;
+	}
+
+	if(close(mc->fd)) {
+		ERRNO_OUT("Error closing multicast socket");
+	}
+
+	free(mc->zones);
+	free(mc);
+}
+
+/*
+ * Sends the zones that changed since the previous call (and the full state of
+ * all zones if the refresh interval has passed or the zone list changed).
+ * Call from the depth callback after the zones have been updated for the
+ * frame.  The cost is independent of the number of listeners.
+ */
+void publish_multicast(struct knd_multicast *mc, struct zonelist *zones)
+{
+	unsigned int version, version_after;
+	struct timespec now;
+	struct mcast_zone *z;
+	uint8_t *entry;
+	size_t namelen;
+	int full;
+	int i;
+
+	mc->frame++;
+
+	version = get_zonelist_version(zones);
+	mc->names_stale = !mc->have_version || version != mc->version;
+
+	mc->index = 0;
+	iterate_zonelist(zones, mcast_zone_callback, mc);
+
+	// Zones changed during iteration; indices may be inconsistent, so
+	// send a full refresh on the next frame instead
+	version_after = get_zonelist_version(zones);
+	if(version_after != version) {
+		mc->have_version = 0;
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	full = mc->names_stale || NL_TIMESPEC_GTE(now, mc->next_refresh);
+
+	mc->version = version;
+	mc->have_version = 1;
+	mc->count = mc->index;
+
+	if(full) {
+		mc->next_refresh = nl_add_timespec(now, mc->refresh_interval);
+
+		begin_packet(mc, MCAST_TYPE_FULL);
+		for(i = 0; i < mc->count; i++) {
+			z = &mc->zones[i];
+			namelen = strlen(z->name);
+			entry = add_entry(mc, MCAST_FULL_SIZE + namelen);
+			put_u16(entry, i);
+			entry[2] = z->occupied;
+			entry[3] = namelen;
+			put_u32(entry + 4, z->pop);
+			put_u32(entry + 8, z->maxpop);
+			memcpy(entry + MCAST_FULL_SIZE, z->name, namelen);
+		}
+
+		// An empty zone list is still announced so listeners can clear theirs
+		send_packet(mc, mc->count == 0);
+		return;
+	}
+
+	begin_packet(mc, MCAST_TYPE_CHANGES);
+	for(i = 0; i < mc->count; i++) {
+		z = &mc->zones[i];
+		if(!z->changed) {
+			continue;
+		}
+
+		entry = add_entry(mc, MCAST_CHANGE_SIZE);
+		put_u16(entry, i);
+		entry[2] = z->occupied;
+		entry[3] = 0;
+		put_u32(entry + 4, z->pop);
+	}
+	send_packet(mc, 0);
+}
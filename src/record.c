@@ -0,0 +1,908 @@
+/*
+ * record.c - Compressed depth recordings (.knr files)
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "knd.h"
+
+// File format (all values in host byte order, which is little-endian on every
+// supported platform):
+//
+// 64-byte file header (struct knr_header)
+// Chunks, each starting on an 8-byte boundary:
+//   32-byte chunk header (struct knr_chunk)
+//   size bytes of payload, zero-padded to a multiple of 8 bytes
+//
+// Depth chunks are either key frames (compressed with no reference to other
+// frames, or stored as raw packed data if compression doesn't help) or delta
+// frames (compressed against the previous depth chunk).  A key frame is
+// written every keyframe_interval depth frames.  Video chunks hold a raw
+// Bayer image captured between the surrounding depth frames.
+//
+// When a recording is closed, an index chunk listing the frame number and file
+// offset of every key frame is appended, and the header is updated to point to
+// it.  Recordings that were not closed (e.g. due to a crash or power loss) are
+// indexed at load time by walking the chunk headers, so everything up to the
+// last complete chunk can still be replayed.
+
+#define KNR_MAGIC		"KNDREC\r\n"
+#define KNR_VERSION		1
+#define KNR_CHUNK_MAGIC		0x43524e4b // "KNRC"
+
+#define KNR_DEPTH		'D'
+#define KNR_VIDEO		'V'
+#define KNR_INDEX		'I'
+
+#define KNR_RAW			0 // Uncompressed (packed 11-bit depth or Bayer video)
+#define KNR_KEY			1 // Depth compressed without a reference frame
+#define KNR_DELTA		2 // Depth compressed against the previous frame
+
+#define RECORD_QUEUE_SIZE	8	// Frames buffered for the writer thread
+#define RECORD_BUFFER_SIZE	262144	// stdio buffer size for the output file
+
+#define KNR_PAD(size) (((size) + 7) & ~(size_t)7)
+
+struct knr_header {
+	char magic[8];			// KNR_MAGIC
+	uint32_t version;		// KNR_VERSION
+	uint32_t header_size;		// sizeof(struct knr_header)
+	uint16_t width, height;		// Depth image dimensions
+	uint32_t keyframe_interval;
+	uint32_t frame_count;		// Depth frames (0 until closed)
+	uint32_t index_count;		// Key frame index entries (0 until closed)
+	uint64_t index_offset;		// Offset of the index chunk (0 until closed)
+	uint64_t start_time;		// CLOCK_REALTIME ns when recording started
+	uint8_t reserved[16];
+};
+
+struct knr_chunk {
+	uint32_t magic;			// KNR_CHUNK_MAGIC
+	uint8_t type;			// KNR_DEPTH, KNR_VIDEO, or KNR_INDEX
+	uint8_t encoding;		// KNR_RAW, KNR_KEY, or KNR_DELTA
+	uint16_t reserved;
+	uint32_t size;			// Payload bytes, excluding header and padding
+	uint32_t frame;			// Depth frame number (next depth frame for video)
+	uint32_t timestamp;		// libfreenect timestamp
+	uint32_t reserved2;
+	uint64_t time_ns;		// CLOCK_MONOTONIC ns since start of recording
+};
+
+struct knr_index {
+	uint32_t frame;
+	uint32_t reserved;
+	uint64_t offset;		// File offset of the key frame's chunk header
+};
+
+/*
+ * A frame waiting to be compressed and written.
+ */
+struct record_slot {
+	uint8_t type;
+	uint32_t timestamp;
+	uint64_t time_ns;
+	uint8_t data[KND_DEPTH_SIZE];
+};
+
+struct knd_recorder {
+	struct nl_thread *thread;
+
+	char *path;
+	FILE *file;
+	uint64_t offset; // Current end of file
+	struct knr_header header;
+	struct timespec start;
+
+	// Frames waiting for the writer thread (protected by lock)
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct record_slot *slots;
+	unsigned int head; // Next slot to fill
+	unsigned int count; // Slots waiting to be written
+	unsigned int dropped; // Frames dropped because the queue was full
+	unsigned int stop:1;
+	unsigned int finished:1; // The writer thread has closed the file
+
+	// Writer thread state
+	uint16_t *cur; // Unpacked current frame
+	uint16_t *prev; // Unpacked previous frame
+	uint8_t *encoded;
+	struct knr_index *index;
+	unsigned int index_size;
+	unsigned int frames; // Depth frames written
+	unsigned int video_frames; // Video frames written
+	unsigned int write_error:1;
+};
+
+struct knd_recording {
+	char *path;
+	const uint8_t *data; // Mapped file
+	size_t size;
+	size_t end; // End of the last complete chunk
+
+	const struct knr_header *header;
+	const struct knr_index *index;
+	struct knr_index *scanned_index; // Allocated if the file wasn't closed
+	unsigned int index_count;
+	unsigned int frame_count;
+
+	// Sequential decoding state
+	size_t offset; // Next chunk to read
+	unsigned int next_frame; // Number of the next depth frame to decode
+	uint16_t *cur;
+	uint16_t *prev;
+	const uint8_t *video; // Most recent video chunk payload
+	uint32_t video_timestamp;
+};
+
+
+// Returns the number of nanoseconds elapsed since the given start time.
+static uint64_t elapsed_ns(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+}
+
+// Writes a chunk to the recording file.  Returns 0 on success, -1 on error.
+static int write_chunk(struct knd_recorder *rec, uint8_t type, uint8_t encoding, uint32_t frame,
+		uint32_t timestamp, uint64_t time_ns, const void *payload, uint32_t size)
+{
+	static const uint8_t padding[8];
+	struct knr_chunk chunk = {
+		.magic = KNR_CHUNK_MAGIC,
+		.type = type,
+		.encoding = encoding,
+		.size = size,
+		.frame = frame,
+		.timestamp = timestamp,
+		.time_ns = time_ns,
+	};
+	size_t pad = KNR_PAD(size) - size;
+
+	if(fwrite(&chunk, sizeof(chunk), 1, rec->file) != 1 ||
+			(size && fwrite(payload, size, 1, rec->file) != 1) ||
+			(pad && fwrite(padding, pad, 1, rec->file) != 1)) {
+		ERRNO_OUT("Error writing to recording '%s'", rec->path);
+		return -1;
+	}
+
+	rec->offset += sizeof(chunk) + size + pad;
+
+	return 0;
+}
+
+// Compresses and writes a depth frame, adding it to the index if it is a key
+// frame.  Called only by the writer thread.
+static int write_depth(struct knd_recorder *rec, struct record_slot *slot)
+{
+	uint16_t *tmp;
+	int key = rec->frames % rec->header.keyframe_interval == 0;
+	uint64_t offset = rec->offset;
+	size_t len;
+	int ret;
+
+	unpack_11(slot->data, rec->cur, FREENECT_FRAME_PIX);
+	len = encode_depth(rec->cur, key ? NULL : rec->prev, FREENECT_FRAME_PIX, FREENECT_FRAME_W, rec->encoded);
+
+	if(len >= KND_DEPTH_SIZE) {
+		// Compression didn't help (very noisy scene?), so store the raw data
+		key = 1;
+		ret = write_chunk(rec, KNR_DEPTH, KNR_RAW, rec->frames, slot->timestamp, slot->time_ns,
+				slot->data, KND_DEPTH_SIZE);
+	} else {
+		ret = write_chunk(rec, KNR_DEPTH, key ? KNR_KEY : KNR_DELTA, rec->frames,
+				slot->timestamp, slot->time_ns, rec->encoded, len);
+	}
+	if(ret) {
+		return -1;
+	}
+
+	if(key) {
+		if(rec->header.index_count == rec->index_size) {
+			struct knr_index *index;
+			unsigned int size = rec->index_size ? rec->index_size * 2 : 64;
+
+			index = realloc(rec->index, size * sizeof(rec->index[0]));
+			if(index == NULL) {
+				ERRNO_OUT("Error growing key frame index for recording '%s'", rec->path);
+				return -1;
+			}
+			rec->index = index;
+			rec->index_size = size;
+		}
+
+		rec->index[rec->header.index_count++] = (struct knr_index){
+			.frame = rec->frames,
+			.offset = offset,
+		};
+	}
+
+	// The decoder predicts from the previous frame's reconstruction, which
+	// is identical to the original since the codec is lossless
+	tmp = rec->prev;
+	rec->prev = rec->cur;
+	rec->cur = tmp;
+	rec->frames++;
+
+	return 0;
+}
+
+// Writes the key frame index, closes the file, and frees the buffers that are
+// only needed while recording.  Called by the writer thread once stopped.
+static void finish_recording(struct knd_recorder *rec)
+{
+	if(!rec->write_error) {
+		rec->header.frame_count = rec->frames;
+		rec->header.index_offset = rec->offset;
+
+		if(write_chunk(rec, KNR_INDEX, KNR_RAW, rec->frames, 0, elapsed_ns(&rec->start),
+					rec->index, rec->header.index_count * sizeof(rec->index[0])) ||
+				fseek(rec->file, 0, SEEK_SET) ||
+				fwrite(&rec->header, sizeof(rec->header), 1, rec->file) != 1) {
+			ERRNO_OUT("Error writing index to recording '%s'", rec->path);
+		}
+	}
+
+	if(fflush(rec->file) || fsync(fileno(rec->file))) {
+		ERRNO_OUT("Error flushing recording '%s'", rec->path);
+	}
+	if(fclose(rec->file)) {
+		ERRNO_OUT("Error closing recording '%s'", rec->path);
+	}
+	rec->file = NULL;
+
+	nl_ptmf("Recorded %u depth frame(s) and %u video frame(s) (%u dropped) to '%s' (%llu bytes).\n",
+			rec->frames, rec->video_frames, rec->dropped, rec->path,
+			(unsigned long long)rec->offset);
+
+	free(rec->index);
+	free(rec->encoded);
+	free(rec->prev);
+	free(rec->cur);
+	free(rec->slots);
+	rec->index = NULL;
+	rec->encoded = NULL;
+	rec->prev = NULL;
+	rec->cur = NULL;
+	rec->slots = NULL;
+}
+
+static void *record_thread(void *data)
+{
+	struct knd_recorder *rec = data;
+	struct record_slot *slot;
+	int ret, err;
+
+	nl_ptmf("Recording thread started.\n");
+
+	for(;;) {
+		if((ret = pthread_mutex_lock(&rec->lock))) {
+			ERROR_OUT("Error locking recording queue: %s\n", strerror(ret));
+			break;
+		}
+		while(rec->count == 0 && !rec->stop) {
+			if((ret = pthread_cond_wait(&rec->cond, &rec->lock))) {
+				ERROR_OUT("Error waiting for recording queue: %s\n", strerror(ret));
+				break;
+			}
+		}
+		if(rec->count == 0) {
+			// Stop was requested and the queue is drained
+			pthread_mutex_unlock(&rec->lock);
+			break;
+		}
+		slot = &rec->slots[(rec->head + RECORD_QUEUE_SIZE - rec->count) % RECORD_QUEUE_SIZE];
+		if((ret = pthread_mutex_unlock(&rec->lock))) {
+			ERROR_OUT("Error unlocking recording queue: %s\n", strerror(ret));
+		}
+
+		// The slot won't be reused until count is decremented below
+		err = 0;
+		if(!rec->write_error) {
+			if(slot->type == KNR_DEPTH) {
+				err = write_depth(rec, slot);
+			} else {
+				err = write_chunk(rec, KNR_VIDEO, KNR_RAW, rec->frames, slot->timestamp,
+						slot->time_ns, slot->data, KND_VIDEO_SIZE);
+				rec->video_frames++;
+			}
+			if(err) {
+				ERROR_OUT("Stopping recording to '%s' due to an error.\n", rec->path);
+			}
+		}
+
+		if((ret = pthread_mutex_lock(&rec->lock))) {
+			ERROR_OUT("Error locking recording queue: %s\n", strerror(ret));
+			break;
+		}
+		rec->write_error |= !!err;
+		rec->count--;
+		if((ret = pthread_mutex_unlock(&rec->lock))) {
+			ERROR_OUT("Error unlocking recording queue: %s\n", strerror(ret));
+		}
+	}
+
+	finish_recording(rec);
+
+	if((ret = pthread_mutex_lock(&rec->lock))) {
+		ERROR_OUT("Error locking recording queue: %s\n", strerror(ret));
+	}
+	rec->finished = 1;
+	if((ret = pthread_mutex_unlock(&rec->lock))) {
+		ERROR_OUT("Error unlocking recording queue: %s\n", strerror(ret));
+	}
+
+	nl_ptmf("Recording thread exiting.\n");
+
+	return NULL;
+}
+
+// Adds a frame to the writer thread's queue, dropping it if the queue is full.
+static void queue_frame(struct knd_recorder *rec, uint8_t type, const uint8_t *buf, size_t size, uint32_t timestamp)
+{
+	struct record_slot *slot;
+	int ret;
+
+	if((ret = pthread_mutex_lock(&rec->lock))) {
+		ERROR_OUT("Error locking recording queue: %s\n", strerror(ret));
+		return;
+	}
+
+	if(rec->count == RECORD_QUEUE_SIZE || rec->write_error) {
+		rec->dropped++;
+	} else {
+		slot = &rec->slots[rec->head];
+		slot->type = type;
+		slot->timestamp = timestamp;
+		slot->time_ns = elapsed_ns(&rec->start);
+		memcpy(slot->data, buf, size);
+
+		rec->head = (rec->head + 1) % RECORD_QUEUE_SIZE;
+		rec->count++;
+
+		if((ret = pthread_cond_signal(&rec->cond))) {
+			ERROR_OUT("Error signaling recording thread: %s\n", strerror(ret));
+		}
+	}
+
+	if((ret = pthread_mutex_unlock(&rec->lock))) {
+		ERROR_OUT("Error unlocking recording queue: %s\n", strerror(ret));
+	}
+}
+
+/*
+ * Creates the given recording file (failing if the file already exists, so
+ * nothing is ever overwritten) and starts a thread to compress and write
+ * frames passed to record_depth() and record_video().  A key frame will be
+ * written every keyframe_interval depth frames (a default is used if
+ * keyframe_interval <= 0).  Returns NULL on error.
+ */
+struct knd_recorder *create_recorder(struct knd_info *knd, const char *path, int keyframe_interval)
+{
+	struct knd_recorder *rec;
+	pthread_mutexattr_t mutex_attr;
+	struct timespec now;
+	int ret, fd;
+
+	if(CHECK_NULL(knd) || CHECK_NULL(path)) {
+		return NULL;
+	}
+
+	rec = calloc(1, sizeof(struct knd_recorder));
+	if(rec == NULL) {
+		ERRNO_OUT("Error allocating memory for recorder");
+		return NULL;
+	}
+
+	rec->path = strdup(path);
+	rec->slots = malloc(RECORD_QUEUE_SIZE * sizeof(rec->slots[0]));
+	rec->cur = malloc(FREENECT_FRAME_PIX * sizeof(rec->cur[0]));
+	rec->prev = malloc(FREENECT_FRAME_PIX * sizeof(rec->prev[0]));
+	rec->encoded = malloc(DEPTH_CODEC_MAX_SIZE(FREENECT_FRAME_PIX));
+	if(rec->path == NULL || rec->slots == NULL || rec->cur == NULL || rec->prev == NULL || rec->encoded == NULL) {
+		ERRNO_OUT("Error allocating recording buffers");
+		goto error1;
+	}
+
+	if((ret = pthread_mutexattr_init(&mutex_attr)) ||
+			(ret = pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_ERRORCHECK))) {
+		ERROR_OUT("Error initializing mutex attributes: %s\n", strerror(ret));
+		goto error1;
+	}
+	ret = pthread_mutex_init(&rec->lock, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+	if(ret) {
+		ERROR_OUT("Error creating recording queue mutex: %s\n", strerror(ret));
+		goto error1;
+	}
+	if((ret = pthread_cond_init(&rec->cond, NULL))) {
+		ERROR_OUT("Error creating recording queue condition: %s\n", strerror(ret));
+		goto error2;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if(fd == -1) {
+		ERRNO_OUT("Error creating recording '%s'", path);
+		goto error3;
+	}
+	rec->file = fdopen(fd, "wb");
+	if(rec->file == NULL) {
+		ERRNO_OUT("Error opening stream for recording '%s'", path);
+		close(fd);
+		unlink(path);
+		goto error3;
+	}
+	setvbuf(rec->file, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	clock_gettime(CLOCK_MONOTONIC, &rec->start);
+
+	memcpy(rec->header.magic, KNR_MAGIC, sizeof(rec->header.magic));
+	rec->header.version = KNR_VERSION;
+	rec->header.header_size = sizeof(struct knr_header);
+	rec->header.width = FREENECT_FRAME_W;
+	rec->header.height = FREENECT_FRAME_H;
+	rec->header.keyframe_interval = keyframe_interval > 0 ? keyframe_interval : KNR_DEFAULT_KEYFRAME_INTERVAL;
+	rec->header.start_time = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+	if(fwrite(&rec->header, sizeof(rec->header), 1, rec->file) != 1) {
+		ERRNO_OUT("Error writing header to recording '%s'", path);
+		goto error4;
+	}
+	rec->offset = sizeof(rec->header);
+
+	ret = nl_create_thread(knd->thread_ctx, NULL, record_thread, rec, "record_thread", &rec->thread);
+	if(ret) {
+		ERROR_OUT("Error starting recording thread: %s\n", strerror(ret));
+		goto error4;
+	}
+
+	nl_ptmf("Recording to '%s' with a key frame every %u frames.\n", path, rec->header.keyframe_interval);
+
+	return rec;
+
+error4:
+	fclose(rec->file);
+	unlink(path);
+error3:
+	pthread_cond_destroy(&rec->cond);
+error2:
+	pthread_mutex_destroy(&rec->lock);
+error1:
+	free(rec->encoded);
+	free(rec->prev);
+	free(rec->cur);
+	free(rec->slots);
+	free(rec->path);
+	free(rec);
+	return NULL;
+}
+
+/*
+ * Tells the given recorder's thread to write the frames that are still queued
+ * and the key frame index, then close the file, without waiting for it.  The
+ * recorder must still be freed with destroy_recorder(), which returns quickly
+ * once recorder_finished() returns nonzero.  No frames may be queued after
+ * this is called.
+ */
+void stop_recorder(struct knd_recorder *rec)
+{
+	int ret;
+
+	if((ret = pthread_mutex_lock(&rec->lock))) {
+		ERROR_OUT("Error locking recording queue: %s\n", strerror(ret));
+	}
+	rec->stop = 1;
+	if((ret = pthread_cond_signal(&rec->cond))) {
+		ERROR_OUT("Error signaling recording thread: %s\n", strerror(ret));
+	}
+	if((ret = pthread_mutex_unlock(&rec->lock))) {
+		ERROR_OUT("Error unlocking recording queue: %s\n", strerror(ret));
+	}
+}
+
+/*
+ * Returns nonzero once the given recorder's thread has closed the file after
+ * stop_recorder() or destroy_recorder() was called.
+ */
+int recorder_finished(struct knd_recorder *rec)
+{
+	int ret, finished;
+
+	if((ret = pthread_mutex_lock(&rec->lock))) {
+		ERROR_OUT("Error locking recording queue: %s\n", strerror(ret));
+	}
+	finished = rec->finished;
+	if((ret = pthread_mutex_unlock(&rec->lock))) {
+		ERROR_OUT("Error unlocking recording queue: %s\n", strerror(ret));
+	}
+
+	return finished;
+}
+
+/*
+ * Stops the given recorder's thread after all queued frames have been
+ * written, waits for it to write the key frame index and close the file, and
+ * frees the recorder.  Ignores a NULL recorder.
+ */
+void destroy_recorder(struct knd_recorder *rec)
+{
+	int ret;
+
+	if(rec == NULL) {
+		return;
+	}
+
+	stop_recorder(rec);
+
+	ret = nl_join_thread(rec->thread, NULL);
+	if(ret) {
+		ERROR_OUT("Error joining recording thread: %s\n", strerror(ret));
+	}
+
+	pthread_cond_destroy(&rec->cond);
+	pthread_mutex_destroy(&rec->lock);
+	free(rec->path);
+	free(rec);
+}
+
+/*
+ * Queues an 11-bit packed depth frame for recording.  The frame is copied, so
+ * the buffer may be reused as soon as this function returns.  If the writer
+ * thread has fallen behind (e.g. due to slow storage), the frame is dropped.
+ */
+void record_depth(struct knd_recorder *rec, const uint8_t *depthbuf, uint32_t timestamp)
+{
+	queue_frame(rec, KNR_DEPTH, depthbuf, KND_DEPTH_SIZE, timestamp);
+}
+
+/*
+ * Queues a video frame for recording.  See record_depth().
+ */
+void record_video(struct knd_recorder *rec, const uint8_t *videobuf, uint32_t timestamp)
+{
+	queue_frame(rec, KNR_VIDEO, videobuf, KND_VIDEO_SIZE, timestamp);
+}
+
+/*
+ * Retrieves the number of depth frames written, the number of frames dropped,
+ * and the current size of the given recording.  Any of the pointers may be
+ * NULL.  Returns the recording's path.
+ */
+const char *get_recorder_stats(struct knd_recorder *rec, unsigned int *frames, unsigned int *dropped, uint64_t *bytes)
+{
+	int ret;
+
+	if((ret = pthread_mutex_lock(&rec->lock))) {
+		ERROR_OUT("Error locking recording queue: %s\n", strerror(ret));
+	}
+
+	// The writer's counters are read without locking; they are only
+	// approximate while recording is in progress
+	if(frames != NULL) {
+		*frames = rec->frames;
+	}
+	if(dropped != NULL) {
+		*dropped = rec->dropped;
+	}
+	if(bytes != NULL) {
+		*bytes = rec->offset;
+	}
+
+	if((ret = pthread_mutex_unlock(&rec->lock))) {
+		ERROR_OUT("Error unlocking recording queue: %s\n", strerror(ret));
+	}
+
+	return rec->path;
+}
+
+/*
+ * Returns 1 if the given data (e.g. the start of a mapped file) begins with a
+ * recording header, 0 otherwise.
+ */
+int is_recording(const void *data, size_t size)
+{
+	return size >= sizeof(struct knr_header) && !memcmp(data, KNR_MAGIC, 8);
+}
+
+// Returns a pointer to the chunk at the given offset if it is complete and
+// valid, NULL otherwise.
+static const struct knr_chunk *get_chunk(const struct knd_recording *rec, size_t offset)
+{
+	const struct knr_chunk *chunk;
+
+	if(offset > rec->size || rec->size - offset < sizeof(struct knr_chunk)) {
+		return NULL;
+	}
+
+	chunk = (const struct knr_chunk *)(rec->data + offset);
+	if(chunk->magic != KNR_CHUNK_MAGIC ||
+			KNR_PAD(chunk->size) > rec->size - offset - sizeof(struct knr_chunk)) {
+		return NULL;
+	}
+
+	return chunk;
+}
+
+// Builds a key frame index by walking the chunks of a recording that was not
+// closed.  Returns 0 on success, -1 on error.
+static int scan_recording(struct knd_recording *rec)
+{
+	const struct knr_chunk *chunk;
+	unsigned int size = 0;
+	size_t offset;
+
+	rec->frame_count = 0;
+	rec->index_count = 0;
+
+	for(offset = rec->header->header_size; (chunk = get_chunk(rec, offset)) != NULL;
+			offset += sizeof(*chunk) + KNR_PAD(chunk->size)) {
+		if(chunk->type != KNR_DEPTH) {
+			continue;
+		}
+
+		if(chunk->encoding != KNR_DELTA) {
+			if(rec->index_count == size) {
+				struct knr_index *index;
+
+				size = size ? size * 2 : 64;
+				index = realloc(rec->scanned_index, size * sizeof(index[0]));
+				if(index == NULL) {
+					ERRNO_OUT("Error allocating key frame index for '%s'", rec->path);
+					return -1;
+				}
+				rec->scanned_index = index;
+			}
+
+			rec->scanned_index[rec->index_count++] = (struct knr_index){
+				.frame = chunk->frame,
+				.offset = offset,
+			};
+		}
+
+		rec->frame_count = chunk->frame + 1;
+	}
+
+	rec->index = rec->scanned_index;
+	rec->end = offset;
+
+	return 0;
+}
+
+/*
+ * Opens and maps the given recording for reading with read_recording().
+ * Returns NULL on error.
+ */
+struct knd_recording *open_recording(const char *path)
+{
+	struct knd_recording *rec;
+	const struct knr_chunk *chunk;
+	struct stat st;
+	void *map;
+	int fd;
+
+	rec = calloc(1, sizeof(struct knd_recording));
+	if(rec == NULL) {
+		ERRNO_OUT("Error allocating memory for recording");
+		return NULL;
+	}
+
+	rec->path = strdup(path);
+	rec->cur = malloc(FREENECT_FRAME_PIX * sizeof(rec->cur[0]));
+	rec->prev = malloc(FREENECT_FRAME_PIX * sizeof(rec->prev[0]));
+	if(rec->path == NULL || rec->cur == NULL || rec->prev == NULL) {
+		ERRNO_OUT("Error allocating recording decoding buffers");
+		goto error;
+	}
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		ERRNO_OUT("Error opening recording '%s'", path);
+		goto error;
+	}
+	if(fstat(fd, &st)) {
+		ERRNO_OUT("Error getting size of recording '%s'", path);
+		close(fd);
+		goto error;
+	}
+	if(!S_ISREG(st.st_mode) || st.st_size < (off_t)sizeof(struct knr_header)) {
+		ERROR_OUT("'%s' is too small to be a recording.\n", path);
+		close(fd);
+		goto error;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		ERRNO_OUT("Error mapping recording '%s'", path);
+		goto error;
+	}
+	rec->data = map;
+	rec->size = st.st_size;
+	rec->header = map;
+
+	if(!is_recording(rec->data, rec->size) || rec->header->version != KNR_VERSION ||
+			rec->header->header_size < sizeof(struct knr_header) ||
+			rec->header->header_size > rec->size ||
+			rec->header->width != FREENECT_FRAME_W || rec->header->height != FREENECT_FRAME_H) {
+		ERROR_OUT("'%s' is not a supported recording.\n", path);
+		goto error;
+	}
+
+	chunk = rec->header->index_offset ? get_chunk(rec, rec->header->index_offset) : NULL;
+	if(chunk != NULL && chunk->type == KNR_INDEX &&
+			chunk->size == rec->header->index_count * sizeof(struct knr_index)) {
+		rec->index = (const struct knr_index *)(chunk + 1);
+		rec->index_count = rec->header->index_count;
+		rec->frame_count = rec->header->frame_count;
+		rec->end = rec->header->index_offset;
+	} else {
+		INFO_OUT("Recording '%s' was not closed cleanly; scanning for frames.\n", path);
+		if(scan_recording(rec)) {
+			goto error;
+		}
+	}
+
+	if(rec->frame_count == 0 || rec->index_count == 0) {
+		ERROR_OUT("Recording '%s' does not contain any depth frames.\n", path);
+		goto error;
+	}
+
+	rec->offset = rec->header->header_size;
+
+	return rec;
+
+error:
+	close_recording(rec);
+	return NULL;
+}
+
+/*
+ * Unmaps and frees the given recording.  Ignores a NULL recording.
+ */
+void close_recording(struct knd_recording *rec)
+{
+	if(rec == NULL) {
+		return;
+	}
+
+	if(rec->data != NULL && munmap((void *)rec->data, rec->size)) {
+		ERRNO_OUT("Error unmapping recording '%s'", rec->path);
+	}
+
+	free(rec->scanned_index);
+	free(rec->prev);
+	free(rec->cur);
+	free(rec->path);
+	free(rec);
+}
+
+/*
+ * Returns the number of depth frames in the given recording.
+ */
+unsigned int recording_frame_count(struct knd_recording *rec)
+{
+	return rec->frame_count;
+}
+
+/*
+ * Decodes the next depth frame from the given recording into frame.  The
+ * frame's depth and video pointers remain valid until the next call to
+ * read_recording() or seek_recording().  Returns 0 on success, 1 at the end of
+ * the recording, -1 on error.
+ */
+int read_recording(struct knd_recording *rec, struct recording_frame *frame)
+{
+	const struct knr_chunk *chunk;
+	const uint8_t *payload;
+	uint16_t *tmp;
+	int ret;
+
+	while(rec->offset < rec->end && (chunk = get_chunk(rec, rec->offset)) != NULL) {
+		payload = (const uint8_t *)(chunk + 1);
+		rec->offset += sizeof(*chunk) + KNR_PAD(chunk->size);
+
+		if(chunk->type == KNR_VIDEO && chunk->size == KND_VIDEO_SIZE) {
+			rec->video = payload;
+			rec->video_timestamp = chunk->timestamp;
+			continue;
+		}
+		if(chunk->type != KNR_DEPTH) {
+			continue;
+		}
+
+		switch(chunk->encoding) {
+			case KNR_RAW:
+				if(chunk->size != KND_DEPTH_SIZE) {
+					goto corrupt;
+				}
+				unpack_11(payload, rec->cur, FREENECT_FRAME_PIX);
+				ret = 0;
+				break;
+
+			case KNR_KEY:
+				ret = decode_depth(payload, chunk->size, NULL, FREENECT_FRAME_PIX, FREENECT_FRAME_W, rec->cur);
+				break;
+
+			case KNR_DELTA:
+				if(chunk->frame != rec->next_frame || chunk->frame == 0) {
+					ERROR_OUT("Delta frame %u in '%s' has no reference frame.\n", chunk->frame, rec->path);
+					return -1;
+				}
+				ret = decode_depth(payload, chunk->size, rec->prev, FREENECT_FRAME_PIX, FREENECT_FRAME_W, rec->cur);
+				break;
+
+			default:
+				goto corrupt;
+		}
+		if(ret) {
+			goto corrupt;
+		}
+
+		tmp = rec->prev;
+		rec->prev = rec->cur;
+		rec->cur = tmp;
+		rec->next_frame = chunk->frame + 1;
+
+		frame->frame = chunk->frame;
+		frame->timestamp = chunk->timestamp;
+		frame->time_ns = chunk->time_ns;
+		frame->depth = rec->prev;
+		frame->video = rec->video;
+		frame->video_timestamp = rec->video_timestamp;
+
+		return 0;
+
+corrupt:
+		ERROR_OUT("Depth frame %u in '%s' is corrupt.\n", chunk->frame, rec->path);
+		return -1;
+	}
+
+	return 1;
+}
+
+/*
+ * Positions the given recording so the next call to read_recording() returns
+ * the given depth frame.  Decoding resumes at the nearest preceding key frame.
+ * Returns 0 on success, -1 on error.
+ */
+int seek_recording(struct knd_recording *rec, unsigned int frame)
+{
+	struct recording_frame tmp;
+	unsigned int lo = 0, hi, mid;
+
+	if(frame >= rec->frame_count) {
+		ERROR_OUT("Frame %u is past the end of recording '%s' (%u frames).\n",
+				frame, rec->path, rec->frame_count);
+		return -1;
+	}
+
+	// Find the last key frame at or before the requested frame
+	hi = rec->index_count;
+	while(hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if(rec->index[mid].frame <= frame) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	rec->offset = rec->index[lo].offset;
+	rec->next_frame = rec->index[lo].frame;
+	rec->video = NULL;
+
+	while(rec->next_frame < frame) {
+		if(read_recording(rec, &tmp)) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,336 @@
+/*
+ * replay_src.c - Depth file replay frame source
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * Replays either a compressed recording made with the record command or
+ * KND_RECORD (see record.c), or a file of concatenated 11-bit packed depth
+ * frames (422400 bytes each, e.g. the payloads of DEPTH messages saved by a
+ * client).  Files are mapped into memory, so replaying raw frames costs little
+ * more than a memcpy() per frame.
+ *
+ * Arguments: path[,fast][,loop][,fps=N][,start=N][,tilt=N]
+ *   path	File to replay (required; must come first)
+ *   fast	Deliver frames as fast as knd can process them, without
+ *		dropping any, instead of in real time
+ *   loop	Start over at the end of the file instead of stopping knd
+ *   fps=N	Real-time frame rate (default 30 for raw files; recordings
+ *		play at their recorded timing unless fps is given)
+ *   start=N	Frame number at which to start (and loop back to)
+ *   tilt=N	Initial tilt reported by the simulated motor (default 0)
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "knd.h"
+
+struct replay_src {
+	struct vidproc_info *vid;
+
+	char path[PATH_MAX];
+	const uint8_t *data; // Mapped file (raw frames only)
+	size_t size;
+
+	struct knd_recording *rec; // Compressed recording (NULL for raw frames)
+	uint8_t *packed; // Repacked depth from the recording
+	uint64_t first_ns; // Recorded time of the first frame replayed
+	struct timespec base; // When first_ns was (or would have been) replayed
+
+	unsigned int frame_count;
+	unsigned int start;
+	unsigned int frame; // Next frame to deliver
+	unsigned int loops;
+
+	int fps;
+	struct timespec next_frame;
+
+	unsigned int fast:1;
+	unsigned int loop:1;
+	unsigned int fixed_rate:1; // Use fps for recordings instead of recorded timing
+	unsigned int rebase:1; // Reset recorded timing base on the next frame
+	unsigned int video_enabled:1;
+
+	uint8_t *video; // Placeholder video frame (files contain only depth)
+};
+
+static void replay_cleanup(void *data)
+{
+	struct replay_src *src = data;
+
+	if(CHECK_NULL(src)) {
+		return;
+	}
+
+	if(src->data != NULL && munmap((void *)src->data, src->size)) {
+		ERRNO_OUT("Error unmapping replay file '%s'", src->path);
+	}
+	close_recording(src->rec);
+	free(src->packed);
+	free(src->video);
+	free(src);
+}
+
+static void *replay_init(struct vidproc_info *vid, const char *args)
+{
+	struct replay_src *src;
+	struct stat st;
+	size_t pathlen;
+	void *map;
+	int fd;
+
+	pathlen = strcspn(args, ",");
+	if(pathlen == 0) {
+		ERROR_OUT("A file name is required for replay (e.g. replay:/tmp/depth.raw).\n");
+		return NULL;
+	}
+	if(pathlen >= PATH_MAX) {
+		ERROR_OUT("Replay file name is too long.\n");
+		return NULL;
+	}
+
+	src = calloc(1, sizeof(struct replay_src));
+	if(src == NULL) {
+		ERRNO_OUT("Error allocating memory for replay source");
+		return NULL;
+	}
+
+	src->vid = vid;
+	snprintf(src->path, sizeof(src->path), "%.*s", (int)pathlen, args);
+	args += pathlen;
+
+	src->fast = vidproc_get_opt(args, "fast", NULL, 0);
+	src->loop = vidproc_get_opt(args, "loop", NULL, 0);
+	src->fps = CLAMP(1, 1000, vidproc_get_int_opt(args, "fps", 30));
+	src->fixed_rate = vidproc_get_opt(args, "fps", NULL, 0);
+	src->start = MAX_NUM(vidproc_get_int_opt(args, "start", 0), 0);
+
+	src->video = malloc(KND_VIDEO_SIZE);
+	if(src->video == NULL) {
+		ERRNO_OUT("Error allocating replay video buffer");
+		goto error;
+	}
+	memset(src->video, 128, KND_VIDEO_SIZE);
+
+	fd = open(src->path, O_RDONLY);
+	if(fd < 0) {
+		ERRNO_OUT("Error opening replay file '%s'", src->path);
+		goto error;
+	}
+
+	if(fstat(fd, &st)) {
+		ERRNO_OUT("Error getting size of replay file '%s'", src->path);
+		close(fd);
+		goto error;
+	}
+
+	if(st.st_size == 0) {
+		ERROR_OUT("Replay file '%s' is empty.\n", src->path);
+		close(fd);
+		goto error;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		ERRNO_OUT("Error mapping replay file '%s'", src->path);
+		goto error;
+	}
+
+	if(is_recording(map, st.st_size)) {
+		munmap(map, st.st_size);
+
+		src->rec = open_recording(src->path);
+		if(src->rec == NULL) {
+			goto error;
+		}
+
+		src->packed = malloc(KND_DEPTH_SIZE);
+		if(src->packed == NULL) {
+			ERRNO_OUT("Error allocating replay depth buffer");
+			goto error;
+		}
+
+		src->frame_count = recording_frame_count(src->rec);
+	} else {
+		src->data = map;
+		src->size = st.st_size;
+
+		if(madvise(map, st.st_size, MADV_SEQUENTIAL)) {
+			ERRNO_OUT("Error advising kernel of sequential access to '%s'", src->path);
+		}
+
+		src->frame_count = st.st_size / KND_DEPTH_SIZE;
+	}
+
+	if(src->frame_count == 0) {
+		ERROR_OUT("Replay file '%s' does not contain any depth frames.\n", src->path);
+		goto error;
+	}
+	if(src->start >= src->frame_count) {
+		ERROR_OUT("Start frame %u is past the end of '%s' (%u frames).\n",
+				src->start, src->path, src->frame_count);
+		goto error;
+	}
+	if(src->rec != NULL && src->start != 0 && seek_recording(src->rec, src->start)) {
+		goto error;
+	}
+	src->frame = src->start;
+	src->rebase = 1;
+
+	vidproc_set_motor(vid, 1, CLAMP(-15, 15, vidproc_get_int_opt(args, "tilt", 0)));
+	if(src->fast) {
+		vidproc_set_lossless(vid, 1);
+	}
+
+	nl_ptmf("Replaying %u frame(s) from %s '%s' %s%s.\n", src->frame_count,
+			src->rec ? "recording" : "raw file", src->path,
+			src->fast ? "as fast as possible" : "in real time",
+			src->loop ? " in a loop" : "");
+
+	clock_gettime(CLOCK_MONOTONIC, &src->next_frame);
+
+	return src;
+
+error:
+	replay_cleanup(src);
+	return NULL;
+}
+
+// Waits until the given recorded time (relative to the first replayed frame)
+// is due.  Returns without waiting after a long stall or a seek backward.
+static void wait_recorded(struct replay_src *src, uint64_t time_ns)
+{
+	struct timespec now, target;
+	uint64_t offset;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if(src->rebase || time_ns < src->first_ns) {
+		src->first_ns = time_ns;
+		src->base = now;
+		src->rebase = 0;
+		return;
+	}
+
+	offset = time_ns - src->first_ns;
+	target = nl_add_timespec(src->base, (struct timespec){
+			.tv_sec = offset / 1000000000, .tv_nsec = offset % 1000000000 });
+
+	// Don't try to catch up after a long stall
+	if(NL_TIMESPEC_GTE(now, nl_add_timespec(target, (struct timespec){.tv_sec = 1}))) {
+		src->first_ns = time_ns;
+		src->base = now;
+		return;
+	}
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL);
+}
+
+// Waits until the next frame is due at the fixed frame rate.
+static void wait_fixed(struct replay_src *src)
+{
+	struct timespec now;
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &src->next_frame, NULL);
+
+	src->next_frame = nl_add_timespec(src->next_frame,
+			(struct timespec){.tv_sec = 0, .tv_nsec = 1000000000 / src->fps});
+
+	// Don't try to catch up after a long stall
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(NL_TIMESPEC_GTE(now, src->next_frame)) {
+		src->next_frame = now;
+	}
+}
+
+// Decodes and delivers the next frame of a compressed recording.
+static int replay_recording(struct replay_src *src)
+{
+	struct recording_frame frame;
+	int ret;
+
+	ret = read_recording(src->rec, &frame);
+	if(ret < 0) {
+		return -1;
+	}
+	if(ret > 0) {
+		// The index claimed more frames than the file contains
+		src->frame = src->frame_count;
+		return 0;
+	}
+
+	if(!src->fast) {
+		if(src->fixed_rate) {
+			wait_fixed(src);
+		} else {
+			wait_recorded(src, frame.time_ns);
+		}
+	}
+
+	pack_11(frame.depth, src->packed, FREENECT_FRAME_PIX);
+	vidproc_depth_frame(src->vid, src->packed, frame.timestamp);
+	if(src->video_enabled) {
+		vidproc_video_frame(src->vid, frame.video ? frame.video : src->video,
+				frame.video ? frame.video_timestamp : frame.timestamp);
+	}
+
+	src->frame++;
+
+	return 0;
+}
+
+static int replay_doevents(void *data)
+{
+	struct replay_src *src = data;
+
+	if(src->frame >= src->frame_count) {
+		if(!src->loop) {
+			nl_ptmf("Replay of '%s' finished after %u frame(s).\n", src->path, src->frame - src->start);
+			return -1;
+		}
+
+		if(src->rec != NULL && seek_recording(src->rec, src->start)) {
+			return -1;
+		}
+		src->frame = src->start;
+		src->loops++;
+	}
+
+	if(src->rec != NULL) {
+		return replay_recording(src);
+	}
+
+	if(!src->fast) {
+		wait_fixed(src);
+	}
+
+	// Timestamps count microseconds at the nominal frame rate
+	vidproc_depth_frame(src->vid, src->data + (size_t)src->frame * KND_DEPTH_SIZE,
+			(src->loops * src->frame_count + src->frame) * (1000000 / src->fps));
+	if(src->video_enabled) {
+		vidproc_video_frame(src->vid, src->video,
+				(src->loops * src->frame_count + src->frame) * (1000000 / src->fps));
+	}
+
+	src->frame++;
+
+	return 0;
+}
+
+static int replay_set_video(void *data, int enable)
+{
+	struct replay_src *src = data;
+	src->video_enabled = !!enable;
+	return 0;
+}
+
+const struct vidproc_source replay_source = {
+	.name = "replay",
+	.init = replay_init,
+	.cleanup = replay_cleanup,
+	.doevents = replay_doevents,
+	.set_video = replay_set_video,
+};
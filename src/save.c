@@ -5,9 +5,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <limits.h>
 
@@ -19,9 +21,61 @@
 // zone_count\n
 // name,xmin,ymin,zmin,xmax,ymax,zmax,param,on_level,off_level,on_delay,off_delay\n
 // etc. (viewing angle changed in version 3, param..off_delay added in version 4, changed to integer mm in version 5)
+//
+// Changes made since the zone file was written are appended to a journal, one
+// record per line, each ending with the CRC-32 of the rest of the line in hex:
+// A,name,xmin,ymin,zmin,xmax,ymax,zmax,param,on_level,off_level,on_delay,off_delay*crc\n // Zone added
+// S,name,xmin,ymin,zmin,xmax,ymax,zmax,param,on_level,off_level,on_delay,off_delay*crc\n // Zone changed
+// R,name*crc\n // Zone removed
+// T,motor_tilt*crc\n // Tilt changed
+// Records hold a zone's complete state, so replaying them over a newer zone
+// file than the one they were appended to leaves the newer zone file's zones.
+//
+// Whenever the text zone file is written, the same zones are also written to a
+// binary zone file (struct zone_bin_header followed by struct zone_params for
+// each zone) that can be loaded without parsing.  The binary file is only
+// loaded if it was written with the current text file, so the text file can
+// still be edited by hand.  For large zone lists, the zone list's depth map is
+// cached as well (struct zone_map_header followed by the map).
 
 #define ZONE_FORMAT 5 // File format version
 #define ZONE_FILENAME "zones.knd"
+#define JOURNAL_FILENAME "zones.journal"
+#define JOURNAL_COMPACT_SIZE 65536 // Journal size that triggers rewriting the zone file
+#define ZONE_BINARY_FILENAME "zones.bin"
+#define ZONE_BINARY_FORMAT 1 // Binary zone and depth map file format version
+#define ZONE_MAP_FILENAME "zones.map"
+#define ZONE_MAP_MIN_ZONES 64 // Zone count at which the depth map is cached
+#define SAVE_DEBOUNCE_NS 500000000 // Quiet time after a change before saving
+
+// Binary zone file header.  Files are written in native byte order, so a file
+// from a different architecture fails the format check.
+struct zone_bin_header {
+	char magic[4]; // "KNDZ"
+	uint32_t format; // ZONE_BINARY_FORMAT
+	uint32_t record_size; // sizeof(struct zone_params)
+	uint32_t count;
+	int32_t tilt;
+	uint32_t crc; // CRC-32 of the zone records
+	uint32_t text_crc; // CRC-32 of the text zone file written with this file
+};
+
+// Depth map cache file header
+struct zone_map_header {
+	char magic[4]; // "KNDM"
+	uint32_t format; // ZONE_BINARY_FORMAT
+	uint32_t xskip;
+	uint32_t yskip;
+	uint32_t zones_crc; // Binary zone file CRC of the zones in the map
+};
+
+// A growable list of zone parameters
+struct zone_paramss {
+	struct zone_params *records;
+	int count;
+	int size; // Allocated records
+	unsigned int failed:1; // Set if growing the list failed
+};
 
 struct save_info {
 	struct knd_info *knd;
@@ -29,13 +83,28 @@ struct save_info {
 	struct nl_thread *thread;
 
 	struct zonelist *zones;
-	unsigned int last_version;
 
 	char *savedir;
 
-	struct timespec target;
-	struct timespec interval;
+	pthread_mutex_t file_lock; // Held while reading or writing the files
+
+	// Protected by file_lock
+	unsigned int last_version;
+	struct zone_paramss saved; // Zones as stored by the zone file and journal
+	struct zone_paramss current; // Scratch space for finding changes
+	int saved_tilt;
+	off_t journal_size;
+	unsigned int have_file:1; // Whether the zone file was loaded or written
+
+	struct timespec interval; // Longest a change waits for a save
 
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // Signaled when the zones change or the thread should stop
+
+	// Protected by lock
+	struct timespec first_change; // Earliest unsaved change (if pending)
+	struct timespec last_change; // Latest unsaved change (if pending)
+	unsigned int pending:1;
 	unsigned int stop:1;
 };
 
@@ -136,13 +205,101 @@ static int canwrite(const char *pathname)
 	return wr;
 }
 
+// Called by the zone list with its lock held whenever a zone changes.  Wakes
+// the save thread without touching the zone list.
+static void zones_changed(void *data)
+{
+	struct save_info *info = data;
+	struct timespec now;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if((ret = pthread_mutex_lock(&info->lock))) {
+		ERROR_OUT("Error locking zone saving mutex: %s\n", strerror(ret));
+		return;
+	}
+
+	if(!info->pending) {
+		info->first_change = now;
+		info->pending = 1;
+	}
+	info->last_change = now;
+
+	if((ret = pthread_cond_signal(&info->cond))) {
+		ERROR_OUT("Error signaling zone saving thread: %s\n", strerror(ret));
+	}
+
+	if((ret = pthread_mutex_unlock(&info->lock))) {
+		ERROR_OUT("Error unlocking zone saving mutex: %s\n", strerror(ret));
+	}
+}
+
+// Sleeps until the zones change, then saves them once they have been left
+// alone for SAVE_DEBOUNCE_NS, or once the save interval has passed since the
+// first unsaved change, whichever comes first.
 static void *save_thread(void *data)
 {
 	struct save_info *info = (struct save_info *)data;
+	struct timespec deadline, latest;
+	int saved;
+	int ret;
+
+	nl_set_threadname("save_thread");
+
+	if((ret = pthread_mutex_lock(&info->lock))) {
+		ERROR_OUT("Error locking zone saving mutex: %s\n", strerror(ret));
+		return NULL;
+	}
 
 	while(!info->stop) {
-		usleep(500000 + rand() % 100000);
-		check_save(info);
+		if(!info->pending) {
+			ret = pthread_cond_wait(&info->cond, &info->lock);
+			if(ret) {
+				ERROR_OUT("Error waiting for zone changes: %s\n", strerror(ret));
+				break;
+			}
+			continue;
+		}
+
+		deadline = nl_add_timespec(info->last_change, (struct timespec){ .tv_nsec = SAVE_DEBOUNCE_NS });
+		latest = nl_add_timespec(info->first_change, info->interval);
+		if(NL_TIMESPEC_GTE(deadline, latest)) {
+			deadline = latest;
+		}
+
+		// A change during the wait moves the deadline, so check it again
+		ret = pthread_cond_timedwait(&info->cond, &info->lock, &deadline);
+		if(ret == 0) {
+			continue;
+		} else if(ret != ETIMEDOUT) {
+			ERROR_OUT("Error waiting for zone changes to settle: %s\n", strerror(ret));
+			break;
+		}
+
+		info->pending = 0;
+
+		if((ret = pthread_mutex_unlock(&info->lock))) {
+			ERROR_OUT("Error unlocking zone saving mutex: %s\n", strerror(ret));
+		}
+
+		saved = check_save(info);
+
+		if((ret = pthread_mutex_lock(&info->lock))) {
+			ERROR_OUT("Error locking zone saving mutex: %s\n", strerror(ret));
+			return NULL;
+		}
+
+		if(saved < 0 && !info->pending) {
+			// Try again later
+			clock_gettime(CLOCK_MONOTONIC, &info->first_change);
+			info->last_change = info->first_change;
+			info->pending = 1;
+		}
+	}
+
+	if((ret = pthread_mutex_unlock(&info->lock))) {
+		ERROR_OUT("Error unlocking zone saving mutex: %s\n", strerror(ret));
 	}
 
 	return NULL;
@@ -150,13 +307,18 @@ static void *save_thread(void *data)
 
 /*
  * Initializes zone saving (makes sure the directory exists and is writable)
- * and starts a periodic saving background thread.  This should not be called
- * while the given zone list is being accessed by another thread.  Returns a
- * pointer to a save_info struct on success, NULL on error.
+ * and starts a background thread that saves the zones after they change.  The
+ * thread waits for changes to stop for half a second (e.g. while a zone is
+ * dragged in a UI), but no longer than the given interval after the first
+ * unsaved change.  This should not be called while the given zone list is
+ * being accessed by another thread.  Returns a pointer to a save_info struct
+ * on success, NULL on error.
  */
 struct save_info *init_save(struct knd_info *knd, struct zonelist *zones, const char *savedir, struct timespec *interval)
 {
 	struct save_info *info;
+	pthread_mutexattr_t mutex_attr;
+	pthread_condattr_t cond_attr;
 	int ex, dir;
 	int ret;
 
@@ -164,8 +326,8 @@ struct save_info *init_save(struct knd_info *knd, struct zonelist *zones, const
 		return NULL;
 	}
 
-	// savedir length + filename length + directory separator
-	if(strlen(savedir) + strlen(ZONE_FILENAME) + 1 >= PATH_MAX) {
+	// savedir length + longest filename length + directory separator
+	if(strlen(savedir) + MAX_NUM(strlen(ZONE_FILENAME), strlen(JOURNAL_FILENAME)) + 1 >= PATH_MAX) {
 		ERROR_OUT("Save location '%s' is too long.\n", savedir);
 		return NULL;
 	}
@@ -213,17 +375,72 @@ struct save_info *init_save(struct knd_info *knd, struct zonelist *zones, const
 	info->knd = knd;
 	info->zones = zones;
 	info->last_version = get_zonelist_version(zones);
+	info->saved_tilt = INT_MIN;
 	info->interval = *interval;
-	clock_gettime(CLOCK_MONOTONIC, &info->target);
+
+	if((ret = pthread_mutexattr_init(&mutex_attr))) {
+		ERROR_OUT("Error initializing zone saving mutex attributes: %s\n", strerror(ret));
+		goto error;
+	}
+	if((ret = pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_ERRORCHECK))) {
+		ERROR_OUT("Error setting zone saving mutex type: %s\n", strerror(ret));
+		pthread_mutexattr_destroy(&mutex_attr);
+		goto error;
+	}
+	ret = pthread_mutex_init(&info->lock, &mutex_attr);
+	if(ret) {
+		ERROR_OUT("Error initializing zone saving mutex: %s\n", strerror(ret));
+		pthread_mutexattr_destroy(&mutex_attr);
+		goto error;
+	}
+	ret = pthread_mutex_init(&info->file_lock, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+	if(ret) {
+		ERROR_OUT("Error initializing zone file mutex: %s\n", strerror(ret));
+		pthread_mutex_destroy(&info->lock);
+		goto error;
+	}
+
+	// Change times come from the monotonic clock
+	if((ret = pthread_condattr_init(&cond_attr))) {
+		ERROR_OUT("Error initializing zone saving condition attributes: %s\n", strerror(ret));
+		goto error_mutex;
+	}
+	if((ret = pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC))) {
+		ERROR_OUT("Error setting zone saving condition clock: %s\n", strerror(ret));
+		pthread_condattr_destroy(&cond_attr);
+		goto error_mutex;
+	}
+	ret = pthread_cond_init(&info->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	if(ret) {
+		ERROR_OUT("Error initializing zone saving condition: %s\n", strerror(ret));
+		goto error_mutex;
+	}
 
 	ret = nl_create_thread(knd->thread_ctx, NULL, save_thread, info, "save_thread", &info->thread);
 	if(ret) {
 		ERROR_OUT("Error starting zone saving thread: %d (%s)\n", ret, strerror(ret));
+		goto error_cond;
+	}
+
+	if(set_zonelist_notify(zones, zones_changed, info)) {
+		ERROR_OUT("Error registering for zone changes.\n");
 		cleanup_save(info);
 		return NULL;
 	}
 
 	return info;
+
+error_cond:
+	pthread_cond_destroy(&info->cond);
+error_mutex:
+	pthread_mutex_destroy(&info->file_lock);
+	pthread_mutex_destroy(&info->lock);
+error:
+	free(info->savedir);
+	free(info);
+	return NULL;
 }
 
 /*
@@ -238,82 +455,308 @@ void cleanup_save(struct save_info *info)
 		return;
 	}
 
-	if(info->thread != NULL) {
-		info->stop = 1;
-		ret = nl_join_thread(info->thread, NULL);
-		if(ret) {
-			ERROR_OUT("Error joining zone saving thread: %d (%s)\n", ret, strerror(ret));
-		}
+	set_zonelist_notify(info->zones, NULL, NULL);
+
+	if((ret = pthread_mutex_lock(&info->lock))) {
+		ERROR_OUT("Error locking zone saving mutex: %s\n", strerror(ret));
+	}
+	info->stop = 1;
+	if((ret = pthread_cond_signal(&info->cond))) {
+		ERROR_OUT("Error signaling zone saving thread: %s\n", strerror(ret));
 	}
-	if(info->savedir != NULL) {
-		free(info->savedir);
+	if((ret = pthread_mutex_unlock(&info->lock))) {
+		ERROR_OUT("Error unlocking zone saving mutex: %s\n", strerror(ret));
 	}
+
+	ret = nl_join_thread(info->thread, NULL);
+	if(ret) {
+		ERROR_OUT("Error joining zone saving thread: %d (%s)\n", ret, strerror(ret));
+	}
+
+	pthread_cond_destroy(&info->cond);
+	pthread_mutex_destroy(&info->file_lock);
+	pthread_mutex_destroy(&info->lock);
+	free(info->saved.records);
+	free(info->current.records);
+	free(info->savedir);
 	free(info);
 }
 
-/*
- * Writes a single zone's info to the given file.
- */
-static void save_zone_callback(void *data, struct zone *zone)
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static uint32_t crc_table[256];
+
+static void init_crc_table(void)
+{
+	uint32_t crc;
+	int i, bit;
+
+	for(i = 0; i < 256; i++) {
+		crc = i;
+		for(bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+		crc_table[i] = crc;
+	}
+}
+
+// Returns the CRC-32 (as used by zlib) of the given data.
+static uint32_t crc32(const void *data, size_t len)
+{
+	const unsigned char *buf = data;
+	uint32_t crc = 0xffffffff;
+	size_t i;
+
+	pthread_once(&crc_once, init_crc_table);
+
+	for(i = 0; i < len; i++) {
+		crc = (crc >> 8) ^ crc_table[(crc ^ buf[i]) & 0xff];
+	}
+
+	return ~crc;
+}
+
+// Used by collect_zones() to copy each zone into a zone record list.
+static void collect_zone_callback(void *data, struct zone *zone)
+{
+	struct zone_paramss *list = data;
+	struct zone_params *rec;
+
+	if(list->count == list->size) {
+		rec = realloc(list->records, sizeof(struct zone_params) * (list->size * 2 + 16));
+		if(rec == NULL) {
+			list->failed = 1;
+			return;
+		}
+		list->records = rec;
+		list->size = list->size * 2 + 16;
+	}
+
+	rec = &list->records[list->count++];
+	memset(rec, 0, sizeof(struct zone_params)); // Records are compared with memcmp()
+	snprintf(rec->name, sizeof(rec->name), "%s", zone->name);
+	rec->xmin = zone->xmin;
+	rec->ymin = zone->ymin;
+	rec->zmin = zone->zmin;
+	rec->xmax = zone->xmax;
+	rec->ymax = zone->ymax;
+	rec->zmax = zone->zmax;
+	rec->param = zone->occupied_param;
+	rec->rising_threshold = zone->rising_threshold;
+	rec->falling_threshold = zone->falling_threshold;
+	rec->rising_delay = zone->rising_delay;
+	rec->falling_delay = zone->falling_delay;
+}
+
+// Copies every zone into info->current, all from the same moment.  Call with
+// info->file_lock held.  Returns 0 on success, -1 on error.
+static int collect_zones(struct save_info *info)
+{
+	info->current.count = 0;
+	info->current.failed = 0;
+
+	iterate_zonelist(info->zones, collect_zone_callback, &info->current);
+	if(info->current.failed) {
+		ERRNO_OUT("Error allocating memory for saving zones");
+		return -1;
+	}
+
+	return 0;
+}
+
+// Makes info->current the saved zones, keeping the old saved zones' memory
+// for the next collect_zones().  Call with info->file_lock held.
+static void swap_records(struct save_info *info)
+{
+	struct zone_paramss tmp = info->saved;
+	info->saved = info->current;
+	info->current = tmp;
+}
+
+// Returns the zone record with the given name, or NULL if there isn't one.
+static struct zone_params *find_record(struct zone_paramss *list, const char *name)
 {
-	FILE *output = data;
+	int i;
+
+	for(i = 0; i < list->count; i++) {
+		if(!strcmp(list->records[i].name, name)) {
+			return &list->records[i];
+		}
+	}
+
+	return NULL;
+}
 
+// Writes a single zone's info to the given file, without a newline.
+static void write_zone_record(FILE *output, struct zone_params *rec)
+{
 	// TODO: Escape names if commas are ever permitted or format changes
-	fprintf(output, "%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n",
-			zone->name,
-			zone->xmin, zone->ymin, zone->zmin,
-			zone->xmax, zone->ymax, zone->zmax,
-			zone->occupied_param, zone->rising_threshold, zone->falling_threshold,
-			zone->rising_delay, zone->falling_delay);
+	fprintf(output, "%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d",
+			rec->name,
+			rec->xmin, rec->ymin, rec->zmin,
+			rec->xmax, rec->ymax, rec->zmax,
+			rec->param, rec->rising_threshold, rec->falling_threshold,
+			rec->rising_delay, rec->falling_delay);
 }
 
-/*
- * Unconditionally saves the zone list associated with the given save info.
- * First saves into a temporary file in the same directory, then uses rename()
- * to overwrite the original file.
- * Returns 0 on success, -1 on error.
- */
-int save_zones(struct save_info *info)
+// Adds a journal line for the given operation to output, with the given zone
+// record (if rec is not NULL), or name or tilt.
+static void add_journal_record(FILE *output, char op, struct zone_params *rec, const char *name, int tilt)
+{
+	char *line = NULL;
+	size_t len = 0;
+	FILE *out;
+
+	out = open_memstream(&line, &len);
+	if(out == NULL) {
+		ERRNO_OUT("Error opening zone journal record buffer");
+		return;
+	}
+
+	fprintf(out, "%c,", op);
+	if(rec != NULL) {
+		write_zone_record(out, rec);
+	} else if(name != NULL) {
+		fputs(name, out);
+	} else {
+		fprintf(out, "%d", tilt);
+	}
+
+	if(fclose(out) || line == NULL) {
+		ERRNO_OUT("Error formatting zone journal record");
+		free(line);
+		return;
+	}
+
+	fprintf(output, "%s*%08x\n", line, crc32(line, len));
+	free(line);
+}
+
+// Appends records for every difference between info->current and info->saved
+// to the journal, then makes info->current the saved zones.  Call with
+// info->file_lock held.  Returns 0 on success, -1 on error.
+static int append_journal(struct save_info *info, int tilt)
+{
+	struct zone_params *rec, *old;
+	char path[PATH_MAX + 1];
+	char *records = NULL;
+	size_t len = 0;
+	FILE *output;
+	ssize_t written;
+	off_t start;
+	int fd;
+	int ret = 0;
+	int i;
+
+	output = open_memstream(&records, &len);
+	if(output == NULL) {
+		ERRNO_OUT("Error opening zone journal buffer");
+		return -1;
+	}
+
+	if(tilt != info->saved_tilt) {
+		add_journal_record(output, 'T', NULL, NULL, tilt);
+	}
+	for(i = 0; i < info->current.count; i++) {
+		rec = &info->current.records[i];
+		old = find_record(&info->saved, rec->name);
+		if(old == NULL) {
+			add_journal_record(output, 'A', rec, NULL, 0);
+		} else if(memcmp(old, rec, sizeof(struct zone_params))) {
+			add_journal_record(output, 'S', rec, NULL, 0);
+		}
+	}
+	for(i = 0; i < info->saved.count; i++) {
+		if(find_record(&info->current, info->saved.records[i].name) == NULL) {
+			add_journal_record(output, 'R', NULL, info->saved.records[i].name, 0);
+		}
+	}
+
+	if(fclose(output) || (len != 0 && records == NULL)) {
+		ERRNO_OUT("Error formatting zone journal records");
+		free(records);
+		return -1;
+	}
+
+	if(len != 0) {
+		snprintf(path, ARRAY_SIZE(path), "%s/%s", info->savedir, JOURNAL_FILENAME);
+
+		fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if(fd < 0) {
+			ERRNO_OUT("Error opening zone journal '%s' for writing", path);
+			free(records);
+			return -1;
+		}
+
+		start = lseek(fd, 0, SEEK_END);
+		written = write(fd, records, len);
+		if(written < 0) {
+			ERRNO_OUT("Error writing to zone journal '%s'", path);
+			ret = -1;
+		} else if((size_t)written != len) {
+			ERROR_OUT("Only wrote %zd of %zu bytes to zone journal '%s'.\n", written, len, path);
+			ret = -1;
+		}
+		if(ret && start >= 0 && ftruncate(fd, start)) {
+			// Records appended after a partial record would be ignored
+			ERRNO_OUT("Error removing partial record from zone journal '%s'", path);
+		}
+		if(ret == 0) {
+			info->journal_size = start + written;
+		}
+		if(fdatasync(fd)) {
+			ERRNO_OUT("Error syncing zone journal '%s' to disk", path);
+			ret = -1;
+		}
+		if(close(fd)) {
+			ERRNO_OUT("Error closing zone journal '%s'", path);
+			ret = -1;
+		}
+	}
+
+	free(records);
+
+	if(ret == 0) {
+		swap_records(info);
+		info->saved_tilt = tilt;
+	}
+
+	return ret;
+}
+
+// Replaces the named file in the save directory with the given data (and then
+// the given tail, if tail_len is not 0).  First saves into a temporary file in
+// the same directory, then uses rename() to overwrite the original file.
+// Returns 0 on success, -1 on error.
+static int replace_file(struct save_info *info, const char *filename,
+		const void *data, size_t len, const void *tail, size_t tail_len)
 {
 	FILE *output;
 	char tmppath[PATH_MAX + 1];
 	char path[PATH_MAX + 1];
-	size_t len;
+	size_t pathlen;
 	int ret = 0;
 
-	len = snprintf(tmppath, ARRAY_SIZE(tmppath), "%s/%s.tmp", info->savedir, ZONE_FILENAME);
-	if(len >= ARRAY_SIZE(tmppath)) {
+	pathlen = snprintf(tmppath, ARRAY_SIZE(tmppath), "%s/%s.tmp", info->savedir, filename);
+	if(pathlen >= ARRAY_SIZE(tmppath)) {
 		ERROR_OUT("Save filename and path is too long.");
 		return -1;
 	}
-	snprintf(path, ARRAY_SIZE(path), "%s/%s", info->savedir, ZONE_FILENAME);
+	snprintf(path, ARRAY_SIZE(path), "%s/%s", info->savedir, filename);
 
 	// TODO: Make sure tmppath isn't a hardlink to path (indicating an
 	// interrupted rename())?
 
-	output = fopen(tmppath, "wt");
+	output = fopen(tmppath, "wb");
 	if(output == NULL) {
 		ERRNO_OUT("Error opening zone save file '%s' for writing", tmppath);
 		return -1;
 	}
 
-	// Here's where exceptions would be nice for handling a full
-	// filesystem, bad sector, or other error
-	if(fprintf(output, "%d\n", ZONE_FORMAT) < 0 ||
-			fprintf(output, "%d\n", get_tilt(info->knd->vid)) < 0 ||
-			fprintf(output, "%d\n", zone_count(info->zones)) < 0) {
-		ERRNO_OUT("Error writing zone save file header to '%s'", tmppath);
-		fclose(output);
-		return -1;
+	if(fwrite(data, 1, len, output) != len ||
+			(tail_len != 0 && fwrite(tail, 1, tail_len, output) != tail_len)) {
+		ERRNO_OUT("Error writing zone save file '%s'", tmppath);
+		ret = -1;
 	}
-
-	// FIXME: Zone list may have been modified between getting the count
-	// above and this code running.  Maybe a flag could be used to prevent
-	// accidental concurrent modification, where a function that needs
-	// atomic access calls lock_zonelist(), which sets the flag within the
-	// standard zone lock.
-	iterate_zonelist(info->zones, save_zone_callback, output);
-
 	if(fflush(output) == EOF) {
 		ERRNO_OUT("Error flushing zone save file '%s'", tmppath);
 		ret = -1;
@@ -330,39 +773,257 @@ int save_zones(struct save_info *info)
 		ERRNO_OUT("Error closing zone save file '%s'", path);
 		ret = -1;
 	}
-	if(rename(tmppath, path)) {
+	if(ret == 0 && rename(tmppath, path)) {
 		ERRNO_OUT("Error renaming zone save file '%s' to '%s'", tmppath, path);
 		ret = -1;
 	}
 
+	return ret;
+}
+
+// Removes the named file from the save directory if it exists.  Returns 0 on
+// success, -1 on error.
+static int remove_file(struct save_info *info, const char *filename)
+{
+	char path[PATH_MAX + 1];
+
+	snprintf(path, ARRAY_SIZE(path), "%s/%s", info->savedir, filename);
+	if(unlink(path) && errno != ENOENT) {
+		ERRNO_OUT("Error removing '%s'", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Caches the depth map of the zone list if it still matches the zone list at
+// the given version, or removes the cache if the zone list is small.
+static void write_zone_map(struct save_info *info, unsigned int version, uint32_t zones_crc)
+{
+	struct zone_map_header header = {
+		.magic = { 'K', 'N', 'D', 'M' },
+		.format = ZONE_BINARY_FORMAT,
+		.xskip = info->zones->xskip,
+		.yskip = info->zones->yskip,
+		.zones_crc = zones_crc,
+	};
+	uint16_t *map;
+
+	if(info->saved.count < ZONE_MAP_MIN_ZONES) {
+		remove_file(info, ZONE_MAP_FILENAME);
+		return;
+	}
+
+	map = malloc(sizeof(info->zones->depth_map));
+	if(map == NULL) {
+		ERRNO_OUT("Error allocating memory for saving the depth map");
+		return;
+	}
+
+	// The map only matches the saved zones if nothing changed since they
+	// were collected
+	if(get_zone_map(info->zones, map) == version) {
+		replace_file(info, ZONE_MAP_FILENAME, &header, sizeof(header), map, sizeof(info->zones->depth_map));
+	} else {
+		remove_file(info, ZONE_MAP_FILENAME);
+	}
+
+	free(map);
+}
+
+// Writes the saved zones in info->saved, taken from the given zone list
+// version, to the text and binary zone files, then removes the journal.  Call
+// with info->file_lock held.  Returns 0 on success, -1 on error.
+static int write_zone_file(struct save_info *info, unsigned int version)
+{
+	struct zone_bin_header header = {
+		.magic = { 'K', 'N', 'D', 'Z' },
+		.format = ZONE_BINARY_FORMAT,
+		.record_size = sizeof(struct zone_params),
+		.count = info->saved.count,
+		.tilt = info->saved_tilt,
+	};
+	size_t records_len = sizeof(struct zone_params) * info->saved.count;
+	char *text = NULL;
+	size_t len = 0;
+	FILE *output;
+	int ret;
+	int i;
+
+	output = open_memstream(&text, &len);
+	if(output == NULL) {
+		ERRNO_OUT("Error opening zone save buffer");
+		return -1;
+	}
+
+	fprintf(output, "%d\n%d\n%d\n", ZONE_FORMAT, info->saved_tilt, info->saved.count);
+	for(i = 0; i < info->saved.count; i++) {
+		write_zone_record(output, &info->saved.records[i]);
+		fputc('\n', output);
+	}
+
+	if(fclose(output) || text == NULL) {
+		ERRNO_OUT("Error formatting zone save file");
+		free(text);
+		return -1;
+	}
+
+	ret = replace_file(info, ZONE_FILENAME, text, len, NULL, 0);
 	if(ret == 0) {
-		info->last_version = get_zonelist_version(info->zones);
+		// A failure here only slows down the next startup
+		header.crc = crc32(info->saved.records, records_len);
+		header.text_crc = crc32(text, len);
+		if(replace_file(info, ZONE_BINARY_FILENAME, &header, sizeof(header), info->saved.records, records_len)) {
+			remove_file(info, ZONE_BINARY_FILENAME);
+		} else {
+			write_zone_map(info, version, header.crc);
+		}
+	}
+
+	free(text);
+
+	if(ret) {
+		return -1;
+	}
+
+	info->have_file = 1;
+
+	// The zone file now holds everything in the journal
+	if(remove_file(info, JOURNAL_FILENAME)) {
+		return -1;
 	}
+	info->journal_size = 0;
 
+	return 0;
+}
+
+// Saves any changes to the zone list, appending them to the journal if
+// compact is 0 and there is already a zone file and the journal is not too
+// large, or rewriting the zone file otherwise.  Call with info->file_lock
+// held.  Returns 0 on success, -1 on error.
+static int save_changes(struct save_info *info, int compact)
+{
+	unsigned int version;
+	int tilt;
+	int ret;
+
+	trace_begin("save_zones");
+
+	version = get_zonelist_version(info->zones);
+	tilt = get_tilt(info->knd->vid);
+
+	if(collect_zones(info)) {
+		ret = -1;
+		goto out;
+	}
+
+	// The journal is brought up to date before the zone file is rewritten,
+	// so it never holds anything older than the zone file if the journal
+	// can't be removed (see the file format description above)
+	ret = append_journal(info, tilt);
+	if(info->have_file && !compact && (ret || info->journal_size < JOURNAL_COMPACT_SIZE)) {
+		goto out;
+	}
+
+	if(ret) {
+		// Rewriting the zone file saves everything the journal missed
+		swap_records(info);
+		info->saved_tilt = tilt;
+	}
+
+	ret = write_zone_file(info, version);
+
+out:
+	if(ret == 0) {
+		info->last_version = version;
+	}
+
+	trace_end("save_zones");
 	return ret;
 }
 
 /*
- * Loads zone information, if it exists, from the directory pointed to by info.
- * Does not remove any existing zones from the zone list.  Returns number of
+ * Unconditionally saves the zone list associated with the given save info,
+ * rewriting the text and binary zone files and removing the journal.
+ * Returns 0 on success, -1 on error.
+ */
+int save_zones(struct save_info *info)
+{
+	int ret;
+
+	if((ret = pthread_mutex_lock(&info->file_lock))) {
+		ERROR_OUT("Error locking zone file mutex: %s\n", strerror(ret));
+		return -1;
+	}
+
+	ret = save_changes(info, 1);
+
+	if(pthread_mutex_unlock(&info->file_lock)) {
+		ERROR_OUT("Error unlocking zone file mutex.\n");
+	}
+
+	return ret;
+}
+
+// Adds the zone described by rec to the given zone list, or updates the zone
+// with the same name if there is one.  Zero-sized dimensions are expanded to
+// 100mm.  The detection parameters are only set if params is nonzero.  Returns
+// the zone on success, NULL on error.
+static struct zone *apply_zone_record(struct zonelist *zones, struct zone_params *rec, int params)
+{
+	int xmin = rec->xmin, ymin = rec->ymin, zmin = rec->zmin;
+	int xmax = rec->xmax, ymax = rec->ymax, zmax = rec->zmax;
+	struct zone *z;
+
+	if(xmin == xmax) {
+		xmax = xmin + 100;
+	}
+	if(ymin == ymax) {
+		ymax = ymin + 100;
+	}
+	if(zmin == zmax) {
+		zmax = zmin + 100;
+	}
+
+	z = find_zone(zones, rec->name);
+	if(z == NULL) {
+		z = add_zone(zones, rec->name, xmin, ymin, zmin, xmax, ymax, zmax);
+		if(z == NULL) {
+			return NULL;
+		}
+	} else if(set_zone(zones, z, xmin, ymin, zmin, xmax, ymax, zmax)) {
+		return NULL;
+	}
+
+	if(params) {
+		z->occupied_param = rec->param;
+		z->rising_threshold = rec->rising_threshold;
+		z->falling_threshold = rec->falling_threshold;
+		z->rising_delay = rec->rising_delay;
+		z->falling_delay = rec->falling_delay;
+	}
+
+	return z;
+}
+
+/*
+ * Loads zones from the given zone file into the given zone list.  Does not
+ * remove any existing zones from the zone list.  If tilt is not NULL and the
+ * file contains a motor tilt, the tilt is stored in *tilt.  Returns number of
  * zones read on success, -1 on error.
  */
-int load_zones(struct save_info *info)
+int load_zone_file(const char *path, struct zonelist *zones, int *tilt)
 {
 	FILE *input;
-	char path[PATH_MAX];
 	char name[ZONE_NAME_LENGTH];
-	struct zone *z;
+	struct zone_params rec;
 	float fl_xmin, fl_ymin, fl_zmin, fl_xmax, fl_ymax, fl_zmax;
 	int xmin, ymin, zmin, xmax, ymax, zmax;
 	int param, rising_threshold, falling_threshold, rising_delay, falling_delay;
-	unsigned int version;
 	int filever, count;
-	int tilt;
+	int file_tilt;
 	int i;
 
-	snprintf(path, ARRAY_SIZE(path), "%s/%s", info->savedir, ZONE_FILENAME);
-
 	input = fopen(path, "rt");
 	if(input == NULL) {
 		ERRNO_OUT("Error opening zone save file '%s' for reading", path);
@@ -383,10 +1044,10 @@ int load_zones(struct save_info *info)
 	}
 
 	if(filever >= 2) {
-		if(fscanf(input, "%d\n", &tilt) != 1) {
+		if(fscanf(input, "%d\n", &file_tilt) != 1) {
 			ERRNO_OUT("Error reading motor tilt from '%s'", path);
-		} else {
-			set_tilt(info->knd->vid, tilt);
+		} else if(tilt != NULL) {
+			*tilt = file_tilt;
 		}
 	}
 
@@ -448,29 +1109,20 @@ int load_zones(struct save_info *info)
 			zmax = (int)(fl_zmax * 1000);
 		}
 
-		if(xmin == xmax) {
-			xmax = xmin + 100;
-		}
-		if(ymin == ymax) {
-			ymax = ymin + 100;
-		}
-		if(zmin == zmax) {
-			zmax = zmin + 100;
-		}
-
-		z = add_zone(info->knd->zones, name, xmin, ymin, zmin, xmax, ymax, zmax);
-		if(z == NULL) {
+		rec = (struct zone_params){
+			.xmin = xmin, .ymin = ymin, .zmin = zmin,
+			.xmax = xmax, .ymax = ymax, .zmax = zmax,
+			.param = param,
+			.rising_threshold = rising_threshold,
+			.falling_threshold = falling_threshold,
+			.rising_delay = rising_delay,
+			.falling_delay = falling_delay,
+		};
+		snprintf(rec.name, sizeof(rec.name), "%s", name);
+
+		if(apply_zone_record(zones, &rec, filever >= 4) == NULL) {
 			ERROR_OUT("Error adding zone %d ('%s') from '%s' to the zone list.\n",
 					i + 1, name, path);
-			continue;
-		}
-
-		if(filever >= 4) {
-			z->occupied_param = param;
-			z->rising_threshold = rising_threshold;
-			z->falling_threshold = falling_threshold;
-			z->rising_delay = rising_delay;
-			z->falling_delay = falling_delay;
 		}
 	}
 	if(i != count) {
@@ -485,6 +1137,282 @@ int load_zones(struct save_info *info)
 		return -1;
 	}
 
+	fclose(input);
+	return count;
+}
+
+// Applies the records in the journal to the zone list, storing the tilt from
+// the last tilt record in *tilt.  Damaged records at the end of the journal
+// (e.g. from losing power while appending) are discarded along with anything
+// after them.  Call with info->file_lock held.  Returns the number of records
+// applied (0 if there is no journal), -1 on error.
+static int replay_journal(struct save_info *info, int *tilt)
+{
+	char path[PATH_MAX + 1];
+	char line[ZONE_NAME_LENGTH + 256];
+	struct zone_params rec;
+	struct stat statbuf;
+	struct zone *z;
+	unsigned int crc;
+	off_t valid = 0;
+	FILE *input;
+	char *sum;
+	size_t len;
+	int count = 0;
+
+	snprintf(path, ARRAY_SIZE(path), "%s/%s", info->savedir, JOURNAL_FILENAME);
+
+	input = fopen(path, "rt");
+	if(input == NULL) {
+		if(errno == ENOENT) {
+			return 0;
+		}
+		ERRNO_OUT("Error opening zone journal '%s' for reading", path);
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), input) != NULL) {
+		len = strlen(line);
+		sum = strrchr(line, '*');
+		if(len < 3 || line[len - 1] != '\n' || line[1] != ',' || sum == NULL ||
+				sum + 10 != line + len ||
+				sscanf(sum + 1, "%8x", &crc) != 1 ||
+				crc != crc32(line, sum - line)) {
+			break;
+		}
+		valid += len;
+		*sum = 0;
+
+		switch(line[0]) {
+			case 'A':
+			case 'S':
+				if(sscanf(line + 2, "%127[^,],%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d", rec.name,
+							&rec.xmin, &rec.ymin, &rec.zmin, &rec.xmax, &rec.ymax, &rec.zmax,
+							&rec.param, &rec.rising_threshold, &rec.falling_threshold,
+							&rec.rising_delay, &rec.falling_delay) != 12) {
+					ERROR_OUT("Invalid zone record in zone journal '%s': %s\n", path, line);
+				} else if(apply_zone_record(info->zones, &rec, 1) == NULL) {
+					ERROR_OUT("Error applying zone '%s' from zone journal '%s'.\n", rec.name, path);
+				}
+				break;
+
+			case 'R':
+				z = find_zone(info->zones, line + 2);
+				if(z != NULL) {
+					remove_zone(info->zones, z);
+				}
+				break;
+
+			case 'T':
+				*tilt = atoi(line + 2);
+				break;
+
+			default:
+				ERROR_OUT("Unknown record type '%c' in zone journal '%s'.\n", line[0], path);
+				break;
+		}
+
+		count++;
+	}
+
+	if(ferror(input)) {
+		ERROR_OUT("An I/O error occurred while reading zone journal '%s'.\n", path);
+		fclose(input);
+		return -1;
+	}
+
+	if(fstat(fileno(input), &statbuf)) {
+		ERRNO_OUT("Error checking the size of zone journal '%s'", path);
+	} else if(statbuf.st_size > valid) {
+		// New records must not be appended after the damaged data
+		ERROR_OUT("Discarding %lld damaged byte(s) at the end of zone journal '%s'.\n",
+				(long long)(statbuf.st_size - valid), path);
+		if(truncate(path, valid)) {
+			ERRNO_OUT("Error truncating zone journal '%s'", path);
+		}
+	}
+
+	fclose(input);
+
+	info->journal_size = valid;
+
+	return count;
+}
+
+// Maps the named file in the save directory, storing its size in *len.
+// Returns NULL without an error message if the file does not exist, or NULL
+// on error.
+static void *map_file(struct save_info *info, const char *filename, size_t *len)
+{
+	char path[PATH_MAX + 1];
+	struct stat statbuf;
+	void *data;
+	int fd;
+
+	snprintf(path, ARRAY_SIZE(path), "%s/%s", info->savedir, filename);
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		if(errno != ENOENT) {
+			ERRNO_OUT("Error opening '%s' for reading", path);
+		}
+		return NULL;
+	}
+
+	if(fstat(fd, &statbuf)) {
+		ERRNO_OUT("Error checking the size of '%s'", path);
+		close(fd);
+		return NULL;
+	}
+	if(statbuf.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		ERRNO_OUT("Error mapping '%s'", path);
+		return NULL;
+	}
+
+	*len = statbuf.st_size;
+	return data;
+}
+
+// Returns the cached depth map for the given binary zone file CRC, or NULL if
+// it is missing or does not match.  The map must be unmapped with munmap(),
+// using the length stored in *len.
+static void *map_zone_map(struct save_info *info, uint32_t zones_crc, size_t *len)
+{
+	struct zone_map_header *header;
+
+	header = map_file(info, ZONE_MAP_FILENAME, len);
+	if(header == NULL) {
+		return NULL;
+	}
+
+	if(*len != sizeof(*header) + sizeof(info->zones->depth_map) ||
+			memcmp(header->magic, "KNDM", 4) ||
+			header->format != ZONE_BINARY_FORMAT ||
+			header->xskip != (uint32_t)info->zones->xskip ||
+			header->yskip != (uint32_t)info->zones->yskip ||
+			header->zones_crc != zones_crc) {
+		munmap(header, *len);
+		return NULL;
+	}
+
+	return header;
+}
+
+// Loads zones from the binary zone file, along with the cached depth map, if
+// any, as long as the binary file was written with the current text zone file.
+// Stores the motor tilt in *tilt.  Call with info->file_lock held.  Returns the
+// number of zones loaded, or -1 if the binary file can't be used.
+static int load_binary_zones(struct save_info *info, int *tilt)
+{
+	struct zone_bin_header *header;
+	void *text, *map = NULL;
+	size_t len, text_len, map_len;
+	int count = -1;
+
+	header = map_file(info, ZONE_BINARY_FILENAME, &len);
+	if(header == NULL) {
+		return -1;
+	}
+
+	if(len < sizeof(*header) || memcmp(header->magic, "KNDZ", 4) ||
+			header->format != ZONE_BINARY_FORMAT ||
+			header->record_size != sizeof(struct zone_params) ||
+			header->count > INT_MAX / sizeof(struct zone_params) ||
+			len != sizeof(*header) + sizeof(struct zone_params) * header->count) {
+		ERROR_OUT("Ignoring binary zone file with an unsupported format.\n");
+		goto out;
+	}
+	if(crc32(header + 1, len - sizeof(*header)) != header->crc) {
+		ERROR_OUT("Ignoring damaged binary zone file.\n");
+		goto out;
+	}
+
+	text = map_file(info, ZONE_FILENAME, &text_len);
+	if(text == NULL) {
+		goto out;
+	}
+	if(crc32(text, text_len) != header->text_crc) {
+		nl_ptmf("Text zone file has changed; loading it instead of the binary zone file.\n");
+		munmap(text, text_len);
+		goto out;
+	}
+	munmap(text, text_len);
+
+	map = map_zone_map(info, header->crc, &map_len);
+
+	count = add_zones(info->zones, (struct zone_params *)(header + 1), header->count,
+			map == NULL ? NULL : (uint16_t *)((struct zone_map_header *)map + 1));
+	if(count >= 0) {
+		*tilt = header->tilt;
+	}
+
+	if(map != NULL) {
+		munmap(map, map_len);
+	}
+
+out:
+	munmap(header, len);
+	return count;
+}
+
+/*
+ * Loads zone information, if it exists, from the directory pointed to by info,
+ * applying any changes recorded in the journal.  The binary zone file is used
+ * instead of the text zone file if it was saved with the current text file.
+ * Does not remove any existing zones from the zone list.  Returns number of
+ * zones in the zone list on success, -1 on error.
+ */
+int load_zones(struct save_info *info)
+{
+	char path[PATH_MAX];
+	unsigned int version;
+	int tilt = INT_MIN;
+	int count, records;
+	int ret;
+
+	snprintf(path, ARRAY_SIZE(path), "%s/%s", info->savedir, ZONE_FILENAME);
+
+	if((ret = pthread_mutex_lock(&info->file_lock))) {
+		ERROR_OUT("Error locking zone file mutex: %s\n", strerror(ret));
+		return -1;
+	}
+
+	// The text file is rewritten along with the binary file if the binary
+	// file can't be loaded
+	count = load_binary_zones(info, &tilt);
+	if(count >= 0) {
+		info->have_file = 1;
+	} else {
+		count = load_zone_file(path, info->zones, &tilt);
+	}
+
+	records = replay_journal(info, &tilt);
+	if(records > 0) {
+		nl_ptmf("Replayed %d zone change(s) from the journal.\n", records);
+	}
+
+	if(count < 0 && records <= 0) {
+		count = -1;
+		goto out;
+	}
+
+	if(tilt != INT_MIN) {
+		set_tilt(info->knd->vid, tilt);
+	}
+
+	// The files now match the zone list
+	if(collect_zones(info) == 0) {
+		swap_records(info);
+		info->saved_tilt = tilt;
+	}
+
 	version = get_zonelist_version(info->zones);
 	if(version == (unsigned int)-1) {
 		ERROR_OUT("Error getting zone list version.\n");
@@ -492,28 +1420,29 @@ int load_zones(struct save_info *info)
 		info->last_version = version;
 	}
 
-	fclose(input);
+	count = zone_count(info->zones);
+
+out:
+	if((ret = pthread_mutex_unlock(&info->file_lock))) {
+		ERROR_OUT("Error unlocking zone file mutex: %s\n", strerror(ret));
+	}
+
 	return count;
 }
 
 /*
- * Saves the zone list associated with this save info if its save interval has
- * elapsed since the last save and the zone list's version has changed.  On the
- * off chance that approximately (2^32)-1 zone changes occur between calls to
- * this function, the zones will not be saved.  This function should not be
- * called while the zone list is locked.  Returns 1 if the zones were not
- * saved, 0 on successful save, -1 on error.
+ * Saves changes to the zone list associated with this save info if the zone
+ * list's version has changed since it was last saved or loaded.  Changes are
+ * appended to the journal, and the zone file is only rewritten when the
+ * journal grows too large.  On the off chance that approximately (2^32)-1 zone
+ * changes occur between calls to this function, the zones will not be saved.
+ * This function should not be called while the zone list is locked.  Returns
+ * 1 if the zones were not saved, 0 on successful save, -1 on error.
  */
 int check_save(struct save_info *info)
 {
-	struct timespec now;
 	unsigned int version;
-
-	clock_gettime(CLOCK_MONOTONIC, &now);
-
-	if(NL_TIMESPEC_GTE(info->target, now)) {
-		return 1;
-	}
+	int ret;
 
 	version = get_zonelist_version(info->zones);
 	if(version == (unsigned int)-1) {
@@ -521,12 +1450,21 @@ int check_save(struct save_info *info)
 		return -1;
 	}
 
+	if((ret = pthread_mutex_lock(&info->file_lock))) {
+		ERROR_OUT("Error locking zone file mutex: %s\n", strerror(ret));
+		return -1;
+	}
+
 	if(version == info->last_version) {
-		return 1;
+		ret = 1;
+	} else {
+		nl_ptmf("Saving zones.\n");
+		ret = save_changes(info, 0);
 	}
 
-	info->target = nl_add_timespec(now, info->interval);
+	if(pthread_mutex_unlock(&info->file_lock)) {
+		ERROR_OUT("Error unlocking zone file mutex.\n");
+	}
 
-	nl_ptmf("Saving zones.\n");
-	return save_zones(info);
+	return ret;
 }
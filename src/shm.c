@@ -0,0 +1,297 @@
+/*
+ * shm.c - Shared-memory publication of frames and zone results
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * Publishes every depth frame (with the zone results computed from it) and
+ * every video frame to a POSIX shared memory object, so local processes can
+ * read them without copying or parsing.  See the shm.c section of knd.h for
+ * the layout and the reader protocol.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "knd.h"
+
+#define SHM_ALIGN(size) (((size) + 63) & ~(size_t)63)
+
+struct knd_shm {
+	char *name;
+	struct knd_shm_header *hdr;
+	uint8_t *base;
+	size_t size;
+	int ro_fd; // Read-only descriptor passed to local clients (see get_shm_fd())
+
+	struct knd_shm_zone *zones; // Zone results being written (by callback)
+	uint32_t zone_count;
+};
+
+
+// Wakes all processes waiting on the doorbell.
+static void ring_doorbell(struct knd_shm *shm)
+{
+	__atomic_add_fetch(&shm->hdr->doorbell, 1, __ATOMIC_RELEASE);
+	if(syscall(SYS_futex, &shm->hdr->doorbell, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) < 0) {
+		ERRNO_OUT("Error waking shared memory readers");
+	}
+}
+
+// Marks a slot as being written (odd sequence number).
+static void begin_slot(struct knd_shm_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Marks a slot as complete (even sequence number).
+static void end_slot(struct knd_shm_slot *slot)
+{
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Copies one zone's results into the slot being written.
+static void shm_zone_callback(void *data, struct zone *zone)
+{
+	struct knd_shm *shm = data;
+	struct knd_shm_zone *z;
+
+	if(shm->zone_count >= KND_SHM_MAX_ZONES) {
+		return;
+	}
+
+	z = &shm->zones[shm->zone_count++];
+	memcpy(z->name, zone->name, sizeof(z->name));
+	z->occupied = zone->occupied ^ zone->negate;
+	z->pop = zone->pop;
+	z->maxpop = zone->maxpop;
+	z->sa = zone->pop > 0 ? (int)(zone->pop * surface_area((float)zone->zsum / zone->pop)) : 0;
+	z->xc = zone_xc(zone);
+	z->yc = zone_yc(zone);
+	z->zc = zone_zc(zone);
+	z->bright = zone->maxpop > 0 ? zone->bsum * 256 / zone->maxpop : 0;
+}
+
+/*
+ * Creates (replacing any existing object) and maps the POSIX shared memory
+ * object with the given name (e.g. "/knd").  Returns NULL on error.
+ */
+struct knd_shm *create_shm(const char *name)
+{
+	struct knd_shm *shm;
+	struct knd_shm_header *hdr;
+	size_t offset;
+	int fd = -1;
+	int i;
+
+	shm = calloc(1, sizeof(struct knd_shm));
+	if(shm == NULL) {
+		ERRNO_OUT("Error allocating shared memory info");
+		return NULL;
+	}
+
+	shm->ro_fd = -1;
+
+	shm->name = strdup(name);
+	if(shm->name == NULL) {
+		ERRNO_OUT("Error copying shared memory name");
+		goto error;
+	}
+
+	// Compute the layout
+	offset = SHM_ALIGN(sizeof(struct knd_shm_header));
+	offset += KND_SHM_DEPTH_SLOTS * (SHM_ALIGN(KND_DEPTH_SIZE) +
+			SHM_ALIGN(KND_SHM_MAX_ZONES * sizeof(struct knd_shm_zone)));
+	offset += KND_SHM_VIDEO_SLOTS * SHM_ALIGN(KND_VIDEO_SIZE);
+	shm->size = offset;
+
+	// Readers that still have an old object mapped keep their copy
+	if(shm_unlink(name) && errno != ENOENT) {
+		ERRNO_OUT("Error removing old shared memory object '%s'", name);
+	}
+
+	// Only knd's own user may open the object by name; other local clients
+	// get a read-only descriptor from the getshm command once trusted
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd < 0) {
+		ERRNO_OUT("Error creating shared memory object '%s'", name);
+		goto error;
+	}
+	if(ftruncate(fd, shm->size)) {
+		ERRNO_OUT("Error sizing shared memory object '%s'", name);
+		goto error;
+	}
+
+	shm->base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(shm->base == MAP_FAILED) {
+		shm->base = NULL;
+		ERRNO_OUT("Error mapping shared memory object '%s'", name);
+		goto error;
+	}
+
+	if(close(fd)) {
+		ERRNO_OUT("Error closing shared memory object '%s'", name);
+	}
+	fd = -1;
+
+	shm->ro_fd = shm_open(name, O_RDONLY, 0);
+	if(shm->ro_fd < 0) {
+		ERRNO_OUT("Error opening read-only descriptor for shared memory object '%s'", name);
+		goto error;
+	}
+
+	// Fill in the header (the object starts zeroed)
+	hdr = shm->hdr = (struct knd_shm_header *)shm->base;
+	hdr->version = KND_SHM_VERSION;
+	hdr->header_size = sizeof(struct knd_shm_header);
+	hdr->total_size = shm->size;
+	hdr->depth_slots = KND_SHM_DEPTH_SLOTS;
+	hdr->video_slots = KND_SHM_VIDEO_SLOTS;
+	hdr->max_zones = KND_SHM_MAX_ZONES;
+	hdr->depth_size = KND_DEPTH_SIZE;
+	hdr->video_size = KND_VIDEO_SIZE;
+	hdr->width = FREENECT_FRAME_W;
+	hdr->height = FREENECT_FRAME_H;
+	hdr->pid = getpid();
+
+	offset = SHM_ALIGN(sizeof(struct knd_shm_header));
+	for(i = 0; i < KND_SHM_DEPTH_SLOTS; i++) {
+		hdr->depth[i].data_offset = offset;
+		offset += SHM_ALIGN(KND_DEPTH_SIZE);
+		hdr->depth[i].zones_offset = offset;
+		offset += SHM_ALIGN(KND_SHM_MAX_ZONES * sizeof(struct knd_shm_zone));
+	}
+	for(i = 0; i < KND_SHM_VIDEO_SLOTS; i++) {
+		hdr->video[i].data_offset = offset;
+		offset += SHM_ALIGN(KND_VIDEO_SIZE);
+	}
+
+	// Readers check the magic number last
+	__atomic_store_n(&hdr->magic, KND_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	nl_ptmf("Publishing frames to shared memory object '%s' (%zu bytes).\n", name, shm->size);
+
+	return shm;
+
+error:
+	if(shm->ro_fd >= 0) {
+		close(shm->ro_fd);
+	}
+	if(shm->base != NULL) {
+		munmap(shm->base, shm->size);
+	}
+	if(fd >= 0 || shm->base != NULL) {
+		if(fd >= 0) {
+			close(fd);
+		}
+		shm_unlink(name);
+	}
+	free(shm->name);
+	free(shm);
+	return NULL;
+}
+
+/*
+ * Unmaps and removes the given shared memory object.  Ignores a NULL shm.
+ */
+void destroy_shm(struct knd_shm *shm)
+{
+	if(shm == NULL) {
+		return;
+	}
+
+	// Tell readers to stop waiting on this object
+	__atomic_store_n(&shm->hdr->magic, 0, __ATOMIC_RELEASE);
+	ring_doorbell(shm);
+
+	if(close(shm->ro_fd)) {
+		ERRNO_OUT("Error closing shared memory object '%s'", shm->name);
+	}
+	if(munmap(shm->base, shm->size)) {
+		ERRNO_OUT("Error unmapping shared memory object '%s'", shm->name);
+	}
+	if(shm_unlink(shm->name)) {
+		ERRNO_OUT("Error removing shared memory object '%s'", shm->name);
+	}
+
+	free(shm->name);
+	free(shm);
+}
+
+/*
+ * Publishes the given 11-bit packed depth frame and the current results of
+ * the given zone list.  Call from the depth callback after the zones have been
+ * updated for the frame.
+ */
+void publish_shm_depth(struct knd_shm *shm, const uint8_t *buf, struct zonelist *zones)
+{
+	struct knd_shm_header *hdr = shm->hdr;
+	uint32_t frame = hdr->depth_frame + 1;
+	struct knd_shm_slot *slot = &hdr->depth[frame % KND_SHM_DEPTH_SLOTS];
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	begin_slot(slot);
+
+	memcpy(shm->base + slot->data_offset, buf, KND_DEPTH_SIZE);
+
+	shm->zones = (struct knd_shm_zone *)(shm->base + slot->zones_offset);
+	shm->zone_count = 0;
+	iterate_zonelist(zones, shm_zone_callback, shm);
+
+	slot->frame = frame;
+	slot->zone_count = shm->zone_count;
+	slot->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+	end_slot(slot);
+
+	__atomic_store_n(&hdr->depth_frame, frame, __ATOMIC_RELEASE);
+	ring_doorbell(shm);
+}
+
+/*
+ * Publishes the given video frame.  Call from the video callback.
+ */
+void publish_shm_video(struct knd_shm *shm, const uint8_t *buf)
+{
+	struct knd_shm_header *hdr = shm->hdr;
+	uint32_t frame = hdr->video_frame + 1;
+	struct knd_shm_slot *slot = &hdr->video[frame % KND_SHM_VIDEO_SLOTS];
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	begin_slot(slot);
+
+	memcpy(shm->base + slot->data_offset, buf, KND_VIDEO_SIZE);
+	slot->frame = frame;
+	slot->time_ns = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+	end_slot(slot);
+
+	__atomic_store_n(&hdr->video_frame, frame, __ATOMIC_RELEASE);
+	ring_doorbell(shm);
+}
+
+/*
+ * Returns a read-only file descriptor for the shared memory object, suitable
+ * for passing to local clients over a UNIX domain socket.  The descriptor
+ * remains owned by the shm and must not be closed by the caller.
+ */
+int get_shm_fd(struct knd_shm *shm)
+{
+	return shm->ro_fd;
+}
+
+/*
+ * Returns the total size of the shared memory object in bytes.
+ */
+size_t get_shm_size(struct knd_shm *shm)
+{
+	return shm->size;
+}
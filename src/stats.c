@@ -0,0 +1,286 @@
+/*
+ * stats.c - Frame accounting time series
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * A sampling thread reads the frame counters in struct knd_info every
+ * STATS_TICK_NS, updates the frame rate, and records how much each counter
+ * changed in each second.  The frame path only increments counters, so the
+ * frame rate drops to 0 when frames stop arriving.
+ */
+#include <stdlib.h>
+
+#include "knd.h"
+
+#define STATS_TICK_NS	200000000 // Frame rate update interval
+
+struct knd_stats {
+	struct knd_info *knd;
+	struct nl_thread *thread;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // Signaled to stop the thread
+	unsigned int stop:1;
+
+	// Protected by lock
+	struct knd_stats_sample history[KND_STATS_HISTORY];
+	int count; // Samples in history
+	int next; // Index of the next sample to write
+
+	// Only used by the sampling thread
+	struct knd_frame_counts last_sample; // Counters at the previous sample
+	struct timespec next_sample;
+	uint64_t last_processed; // Processed frames at the previous tick
+	struct timespec last_tick;
+};
+
+
+// Copies the frame counters without tearing any individual counter.
+static void read_counts(struct knd_info *knd, struct knd_frame_counts *counts)
+{
+	counts->depth_received = __atomic_load_n(&knd->counts.depth_received, __ATOMIC_RELAXED);
+	counts->depth_dropped = __atomic_load_n(&knd->counts.depth_dropped, __ATOMIC_RELAXED);
+	counts->depth_processed = __atomic_load_n(&knd->counts.depth_processed, __ATOMIC_RELAXED);
+	counts->depth_published = __atomic_load_n(&knd->counts.depth_published, __ATOMIC_RELAXED);
+	counts->depth_sent = __atomic_load_n(&knd->counts.depth_sent, __ATOMIC_RELAXED);
+	counts->video_received = __atomic_load_n(&knd->counts.video_received, __ATOMIC_RELAXED);
+	counts->video_starts = __atomic_load_n(&knd->counts.video_starts, __ATOMIC_RELAXED);
+	counts->video_start_us = __atomic_load_n(&knd->counts.video_start_us, __ATOMIC_RELAXED);
+}
+
+// Updates the frame rate, and records a sample if a second has passed.
+static void stats_tick(struct knd_stats *stats, struct timespec *now)
+{
+	struct knd_frame_counts counts;
+	struct knd_stats_sample *sample;
+	int64_t elapsed;
+	int ret;
+
+	read_counts(stats->knd, &counts);
+
+	elapsed = (int64_t)(now->tv_sec - stats->last_tick.tv_sec) * 1000000000 +
+		(now->tv_nsec - stats->last_tick.tv_nsec);
+	if(elapsed > 0) {
+		stats->knd->fps = (counts.depth_processed - stats->last_processed) * 1000000000 / elapsed;
+	}
+	stats->last_processed = counts.depth_processed;
+	stats->last_tick = *now;
+
+	if(!NL_TIMESPEC_GTE(*now, stats->next_sample)) {
+		return;
+	}
+	stats->next_sample = nl_add_timespec(stats->next_sample, (struct timespec){ .tv_sec = 1 });
+	if(NL_TIMESPEC_GTE(*now, stats->next_sample)) {
+		// Fell more than a second behind; the sample covers the gap
+		stats->next_sample = nl_add_timespec(*now, (struct timespec){ .tv_sec = 1 });
+	}
+
+	if((ret = pthread_mutex_lock(&stats->lock))) {
+		ERROR_OUT("Error locking stats mutex: %s\n", strerror(ret));
+		return;
+	}
+
+	sample = &stats->history[stats->next];
+	sample->time = time(NULL);
+	sample->depth_received = counts.depth_received - stats->last_sample.depth_received;
+	sample->depth_dropped = counts.depth_dropped - stats->last_sample.depth_dropped;
+	sample->depth_processed = counts.depth_processed - stats->last_sample.depth_processed;
+	sample->depth_published = counts.depth_published - stats->last_sample.depth_published;
+	sample->depth_sent = counts.depth_sent - stats->last_sample.depth_sent;
+	sample->video_received = counts.video_received - stats->last_sample.video_received;
+	sample->video_starts = counts.video_starts - stats->last_sample.video_starts;
+	sample->video_start_ms = sample->video_starts ?
+		(counts.video_start_us - stats->last_sample.video_start_us) / sample->video_starts / 1000 : 0;
+
+	stats->next = (stats->next + 1) % KND_STATS_HISTORY;
+	stats->count = MIN_NUM(stats->count + 1, KND_STATS_HISTORY);
+
+	if((ret = pthread_mutex_unlock(&stats->lock))) {
+		ERROR_OUT("Error unlocking stats mutex: %s\n", strerror(ret));
+	}
+
+	stats->last_sample = counts;
+}
+
+static void *stats_thread(void *d)
+{
+	struct knd_stats *stats = d;
+	struct timespec next, now;
+	int ret;
+
+	nl_set_threadname("stats_thread");
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	stats->last_tick = next;
+	stats->next_sample = nl_add_timespec(next, (struct timespec){ .tv_sec = 1 });
+	read_counts(stats->knd, &stats->last_sample);
+	stats->last_processed = stats->last_sample.depth_processed;
+
+	if((ret = pthread_mutex_lock(&stats->lock))) {
+		ERROR_OUT("Error locking stats mutex: %s\n", strerror(ret));
+		return NULL;
+	}
+
+	while(!stats->stop) {
+		next = nl_add_timespec(next, (struct timespec){ .tv_nsec = STATS_TICK_NS });
+
+		while(!stats->stop) {
+			ret = pthread_cond_timedwait(&stats->cond, &stats->lock, &next);
+			if(ret == ETIMEDOUT) {
+				break;
+			} else if(ret) {
+				ERROR_OUT("Error waiting for stats interval: %s\n", strerror(ret));
+				break;
+			}
+		}
+		if(stats->stop) {
+			break;
+		}
+
+		if((ret = pthread_mutex_unlock(&stats->lock))) {
+			ERROR_OUT("Error unlocking stats mutex: %s\n", strerror(ret));
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		stats_tick(stats, &now);
+
+		if((ret = pthread_mutex_lock(&stats->lock))) {
+			ERROR_OUT("Error locking stats mutex: %s\n", strerror(ret));
+			return NULL;
+		}
+	}
+
+	if((ret = pthread_mutex_unlock(&stats->lock))) {
+		ERROR_OUT("Error unlocking stats mutex: %s\n", strerror(ret));
+	}
+
+	return NULL;
+}
+
+/*
+ * Starts a thread that samples the given knd context's frame counters, keeps
+ * the last KND_STATS_HISTORY seconds of samples, and updates knd->fps.
+ * Returns NULL on error.
+ */
+struct knd_stats *create_stats(struct knd_info *knd)
+{
+	struct knd_stats *stats;
+	pthread_mutexattr_t mutex_attr;
+	pthread_condattr_t cond_attr;
+	int ret;
+
+	stats = calloc(1, sizeof(struct knd_stats));
+	if(stats == NULL) {
+		ERRNO_OUT("Error allocating frame statistics");
+		return NULL;
+	}
+
+	stats->knd = knd;
+
+	if((ret = pthread_mutexattr_init(&mutex_attr))) {
+		ERROR_OUT("Error initializing stats mutex attributes: %s\n", strerror(ret));
+		goto error;
+	}
+	if((ret = pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_ERRORCHECK))) {
+		ERROR_OUT("Error setting stats mutex type: %s\n", strerror(ret));
+		pthread_mutexattr_destroy(&mutex_attr);
+		goto error;
+	}
+	ret = pthread_mutex_init(&stats->lock, &mutex_attr);
+	pthread_mutexattr_destroy(&mutex_attr);
+	if(ret) {
+		ERROR_OUT("Error initializing stats mutex: %s\n", strerror(ret));
+		goto error;
+	}
+
+	// The interval is timed with the monotonic clock
+	if((ret = pthread_condattr_init(&cond_attr))) {
+		ERROR_OUT("Error initializing stats condition attributes: %s\n", strerror(ret));
+		goto error_mutex;
+	}
+	if((ret = pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC))) {
+		ERROR_OUT("Error setting stats condition clock: %s\n", strerror(ret));
+		pthread_condattr_destroy(&cond_attr);
+		goto error_mutex;
+	}
+	ret = pthread_cond_init(&stats->cond, &cond_attr);
+	pthread_condattr_destroy(&cond_attr);
+	if(ret) {
+		ERROR_OUT("Error initializing stats condition: %s\n", strerror(ret));
+		goto error_mutex;
+	}
+
+	ret = nl_create_thread(knd->thread_ctx, NULL, stats_thread, stats, "stats_thread", &stats->thread);
+	if(ret) {
+		ERROR_OUT("Error starting stats thread: %s\n", strerror(ret));
+		goto error_cond;
+	}
+
+	return stats;
+
+error_cond:
+	pthread_cond_destroy(&stats->cond);
+error_mutex:
+	pthread_mutex_destroy(&stats->lock);
+error:
+	free(stats);
+	return NULL;
+}
+
+/*
+ * Stops the given stats thread and frees its resources.  Ignores a NULL stats.
+ */
+void destroy_stats(struct knd_stats *stats)
+{
+	int ret;
+
+	if(stats == NULL) {
+		return;
+	}
+
+	if((ret = pthread_mutex_lock(&stats->lock))) {
+		ERROR_OUT("Error locking stats mutex: %s\n", strerror(ret));
+	}
+	stats->stop = 1;
+	if((ret = pthread_cond_signal(&stats->cond))) {
+		ERROR_OUT("Error signaling stats thread: %s\n", strerror(ret));
+	}
+	if((ret = pthread_mutex_unlock(&stats->lock))) {
+		ERROR_OUT("Error unlocking stats mutex: %s\n", strerror(ret));
+	}
+
+	ret = nl_join_thread(stats->thread, NULL);
+	if(ret) {
+		ERROR_OUT("Error joining stats thread: %s\n", strerror(ret));
+	}
+
+	pthread_cond_destroy(&stats->cond);
+	pthread_mutex_destroy(&stats->lock);
+	free(stats);
+}
+
+/*
+ * Copies up to max of the most recent one-second samples into samples, oldest
+ * first.  Returns the number of samples copied.
+ */
+int get_stats_history(struct knd_stats *stats, struct knd_stats_sample *samples, int max)
+{
+	int count;
+	int i;
+	int ret;
+
+	if((ret = pthread_mutex_lock(&stats->lock))) {
+		ERROR_OUT("Error locking stats mutex: %s\n", strerror(ret));
+		return 0;
+	}
+
+	count = MIN_NUM(max, stats->count);
+	for(i = 0; i < count; i++) {
+		samples[i] = stats->history[(stats->next - count + i + KND_STATS_HISTORY) % KND_STATS_HISTORY];
+	}
+
+	if((ret = pthread_mutex_unlock(&stats->lock))) {
+		ERROR_OUT("Error unlocking stats mutex: %s\n", strerror(ret));
+	}
+
+	return count;
+}
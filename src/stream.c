@@ -0,0 +1,359 @@
+/*
+ * stream.c - Cropped, decimated, and converted depth streams for server clients
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ */
+#include <stdlib.h>
+#include <endian.h>
+
+#include "knd.h"
+
+/*
+ * A depth image derived from each camera frame by cropping to a region of
+ * interest, pooling blocks of pixels, and converting to a pixel format.
+ * Streams with identical parameters are shared, so each is computed at most
+ * once per frame no matter how many clients receive it.
+ */
+struct depth_stream {
+	struct depth_stream *next;
+	unsigned int refcount;
+
+	struct depth_stream_params params;
+	int width, height; // Output image size
+
+	unsigned int frame; // Frame number of the data in out
+	unsigned int valid:1; // Whether out contains any frame yet
+
+	uint16_t *rows; // Unpacked rows of the source image (ystride rows)
+	uint16_t *pixels; // Output pixels (padded to a multiple of 8)
+	uint8_t *out; // Output in the stream's format
+	size_t size; // Size of out in bytes
+};
+
+// Depth in millimeters for each raw depth value (0 if invalid)
+static uint16_t mm_lut[2048];
+static int mm_lut_filled;
+
+
+// Returns the number of output pixels, padded for pack_11().
+static size_t padded_pixels(struct depth_stream *stream)
+{
+	return ((size_t)stream->width * stream->height + 7) & ~(size_t)7;
+}
+
+// Fills the millimeter look-up table from the depth look-up table.
+static void init_mm_lut(void)
+{
+	int i;
+
+	if(mm_lut_filled) {
+		return;
+	}
+
+	init_lut();
+
+	// Values beyond PXZMAX are past the end of the depth curve
+	for(i = 0; i < 2048; i++) {
+		mm_lut[i] = (i <= PXZMAX && depth_lut[i] > 0) ? MIN_NUM(depth_lut[i], 65535) : 0;
+	}
+
+	mm_lut_filled = 1;
+}
+
+// Exchanges two 16-bit values.
+static inline void swap_u16(uint16_t *a, uint16_t *b)
+{
+	uint16_t tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+/*
+ * Returns the median (lower median for an even count) of count values,
+ * reordering the values in the process.
+ */
+static uint16_t median(uint16_t *v, int count)
+{
+	int k = (count - 1) / 2;
+	int lo = 0, hi = count - 1;
+	int i, j;
+	uint16_t pivot;
+
+	// Quickselect
+	while(lo < hi) {
+		pivot = v[(lo + hi) / 2];
+		i = lo;
+		j = hi;
+		while(i <= j) {
+			while(v[i] < pivot) {
+				i++;
+			}
+			while(v[j] > pivot) {
+				j--;
+			}
+			if(i <= j) {
+				swap_u16(&v[i], &v[j]);
+				i++;
+				j--;
+			}
+		}
+		if(k <= j) {
+			hi = j;
+		} else if(k >= i) {
+			lo = i;
+		} else {
+			break;
+		}
+	}
+
+	return v[k];
+}
+
+/*
+ * Pools a block of cols x rows pixels starting at column x of the unpacked
+ * rows buffer.  Invalid (2047) pixels are ignored unless the entire block is
+ * invalid.
+ */
+static uint16_t pool_block(struct depth_stream *stream, int x, int cols, int rows)
+{
+	uint16_t block[DEPTH_STREAM_MAX_STRIDE * DEPTH_STREAM_MAX_STRIDE];
+	const uint16_t *row;
+	uint16_t min = 2047;
+	int count = 0;
+	int bx, by;
+
+	for(by = 0; by < rows; by++) {
+		row = stream->rows + by * FREENECT_FRAME_W + x;
+		for(bx = 0; bx < cols; bx++) {
+			if(row[bx] >= 2047) {
+				continue;
+			}
+			if(row[bx] < min) {
+				min = row[bx];
+			}
+			block[count++] = row[bx];
+		}
+	}
+
+	if(count == 0 || stream->params.pool == DEPTH_POOL_MIN) {
+		return min;
+	}
+
+	return median(block, count);
+}
+
+/*
+ * Clamps the region of interest in params to the camera image and fills in
+ * default values.  Returns 0 on success, -1 if the parameters are invalid.
+ */
+int normalize_depth_stream_params(struct depth_stream_params *params)
+{
+	int x2, y2;
+
+	if(params->xstride < 1 || params->xstride > DEPTH_STREAM_MAX_STRIDE ||
+			params->ystride < 1 || params->ystride > DEPTH_STREAM_MAX_STRIDE ||
+			(params->pool != DEPTH_POOL_MIN && params->pool != DEPTH_POOL_MEDIAN) ||
+			(params->format != DEPTH_FORMAT_PACKED && params->format != DEPTH_FORMAT_U16 &&
+			 params->format != DEPTH_FORMAT_MM)) {
+		return -1;
+	}
+
+	x2 = CLAMP(0, FREENECT_FRAME_W, params->x + params->w);
+	y2 = CLAMP(0, FREENECT_FRAME_H, params->y + params->h);
+	params->x = CLAMP(0, FREENECT_FRAME_W, params->x);
+	params->y = CLAMP(0, FREENECT_FRAME_H, params->y);
+	params->w = x2 - params->x;
+	params->h = y2 - params->y;
+
+	if(params->w <= 0 || params->h <= 0) {
+		return -1;
+	}
+
+	// Pooling mode makes no difference without pooling
+	if(params->xstride == 1 && params->ystride == 1) {
+		params->pool = DEPTH_POOL_MIN;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns nonzero if the given normalized parameters describe the full,
+ * unmodified camera image in its original packed format.
+ */
+int is_full_depth_stream(const struct depth_stream_params *params)
+{
+	return params->x == 0 && params->y == 0 &&
+		params->w == FREENECT_FRAME_W && params->h == FREENECT_FRAME_H &&
+		params->xstride == 1 && params->ystride == 1 &&
+		params->format == DEPTH_FORMAT_PACKED;
+}
+
+/*
+ * Returns a reference to the stream with the given parameters from the given
+ * list, creating and adding the stream if no matching stream exists.  The
+ * parameters must have been normalized by normalize_depth_stream_params().
+ * Release the reference with put_depth_stream().  Returns NULL on error.
+ */
+struct depth_stream *get_depth_stream(struct depth_stream **list, const struct depth_stream_params *params)
+{
+	struct depth_stream *stream;
+	size_t i;
+
+	for(stream = *list; stream != NULL; stream = stream->next) {
+		if(!memcmp(&stream->params, params, sizeof(*params))) {
+			stream->refcount++;
+			return stream;
+		}
+	}
+
+	stream = calloc(1, sizeof(struct depth_stream));
+	if(stream == NULL) {
+		ERRNO_OUT("Error allocating depth stream");
+		return NULL;
+	}
+
+	stream->params = *params;
+	stream->width = (params->w + params->xstride - 1) / params->xstride;
+	stream->height = (params->h + params->ystride - 1) / params->ystride;
+	if(params->format == DEPTH_FORMAT_PACKED) {
+		stream->size = padded_pixels(stream) * 11 / 8;
+	} else {
+		stream->size = (size_t)stream->width * stream->height * sizeof(uint16_t);
+	}
+
+	if(params->format == DEPTH_FORMAT_MM) {
+		init_mm_lut();
+	}
+
+	stream->rows = malloc(params->ystride * FREENECT_FRAME_W * sizeof(stream->rows[0]));
+	stream->pixels = malloc(padded_pixels(stream) * sizeof(stream->pixels[0]));
+	stream->out = malloc(stream->size);
+	if(stream->rows == NULL || stream->pixels == NULL || stream->out == NULL) {
+		ERRNO_OUT("Error allocating depth stream buffers");
+		free(stream->rows);
+		free(stream->pixels);
+		free(stream->out);
+		free(stream);
+		return NULL;
+	}
+
+	// Padding pixels are always invalid
+	for(i = (size_t)stream->width * stream->height; i < padded_pixels(stream); i++) {
+		stream->pixels[i] = 2047;
+	}
+
+	stream->refcount = 1;
+	stream->next = *list;
+	*list = stream;
+
+	return stream;
+}
+
+/*
+ * Releases a reference to the given stream (which may be NULL), removing the
+ * stream from the given list and freeing it when the last reference is
+ * released.
+ */
+void put_depth_stream(struct depth_stream **list, struct depth_stream *stream)
+{
+	struct depth_stream **s;
+
+	if(stream == NULL || --stream->refcount > 0) {
+		return;
+	}
+
+	for(s = list; *s != NULL; s = &(*s)->next) {
+		if(*s == stream) {
+			*s = stream->next;
+			break;
+		}
+	}
+
+	free(stream->rows);
+	free(stream->pixels);
+	free(stream->out);
+	free(stream);
+}
+
+/*
+ * Stores the given stream's output image width and height (in pixels) and the
+ * size of each packed image (in bytes) in *width, *height, and *size.
+ */
+void get_depth_stream_size(struct depth_stream *stream, int *width, int *height, size_t *size)
+{
+	*width = stream->width;
+	*height = stream->height;
+	*size = stream->size;
+}
+
+/*
+ * Returns the pixel format of the given stream's images.
+ */
+enum depth_format get_depth_stream_format(struct depth_stream *stream)
+{
+	return stream->params.format;
+}
+
+/*
+ * Returns the given stream's image for the given full-size 11-bit packed
+ * camera frame, computing it only if frame differs from the frame number
+ * given to the previous call.  Packed images are padded with invalid (2047)
+ * pixels to a multiple of 8 pixels.  16-bit images are little-endian.  The
+ * image remains valid until the next call for this stream.
+ */
+const uint8_t *encode_depth_stream(struct depth_stream *stream, const uint8_t *packed, unsigned int frame)
+{
+	const struct depth_stream_params *p = &stream->params;
+	uint16_t *out = stream->pixels;
+	uint16_t *out16 = (uint16_t *)stream->out;
+	size_t count = (size_t)stream->width * stream->height;
+	size_t i;
+	int rows, cols;
+	int x, y;
+
+	if(stream->valid && stream->frame == frame) {
+		return stream->out;
+	}
+
+	for(y = p->y; y < p->y + p->h; y += p->ystride) {
+		rows = MIN_NUM(p->ystride, p->y + p->h - y);
+
+		// Whole rows of 640 pixels start on an 8-pixel (11-byte) boundary
+		unpack_11(packed + (size_t)y * FREENECT_FRAME_W * 11 / 8, stream->rows, rows * FREENECT_FRAME_W);
+
+		if(p->xstride == 1 && p->ystride == 1) {
+			memcpy(out, stream->rows + p->x, p->w * sizeof(out[0]));
+			out += p->w;
+			continue;
+		}
+
+		for(x = p->x; x < p->x + p->w; x += p->xstride) {
+			cols = MIN_NUM(p->xstride, p->x + p->w - x);
+			*out++ = pool_block(stream, x, cols, rows);
+		}
+	}
+
+	// Pooling uses raw values, which are ordered the same as distances
+	switch(p->format) {
+		case DEPTH_FORMAT_PACKED:
+			pack_11(stream->pixels, stream->out, padded_pixels(stream));
+			break;
+
+		case DEPTH_FORMAT_U16:
+			for(i = 0; i < count; i++) {
+				out16[i] = htole16(stream->pixels[i]);
+			}
+			break;
+
+		case DEPTH_FORMAT_MM:
+			for(i = 0; i < count; i++) {
+				out16[i] = htole16(mm_lut[stream->pixels[i]]);
+			}
+			break;
+	}
+
+	stream->frame = frame;
+	stream->valid = 1;
+
+	return stream->out;
+}
@@ -0,0 +1,272 @@
+/*
+ * synth_src.c - Synthetic depth scene frame source
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * Renders a simple room (a floor and a back wall) with people walking back
+ * and forth in front of the camera, so knd can be run, benchmarked, and
+ * load-tested without a camera.  The scene for a given frame number depends
+ * only on the arguments, so runs are reproducible at any frame rate.
+ *
+ * Arguments (comma-separated, all optional):
+ *   fps=N	Frames per second (default 30; 0 runs as fast as possible)
+ *   frames=N	Stop after N frames (default 0, which runs forever)
+ *   people=N	Number of people in the scene (default 2, maximum 16)
+ *   wall=N	Distance to the back wall in mm (default 4000)
+ *   height=N	Camera height above the floor in mm (default 1500, 0 for no floor)
+ *   noise=N	Percentage of pixels with +/-1 raw depth noise (default 5)
+ *   dropout=N	Pixels per thousand that read as out of range (default 2)
+ *   seed=N	Random number seed for noise and dropouts (default 1)
+ *   tilt=N	Initial tilt reported by the simulated motor (default 0)
+ */
+#include <stdlib.h>
+#include <math.h>
+
+#include "knd.h"
+
+#define SYNTH_MAX_PEOPLE	16
+#define SYNTH_TAN28		0.53171f	// Half of the horizontal field of view
+
+struct synth_src {
+	struct vidproc_info *vid;
+
+	int fps;
+	int max_frames;
+	int people;
+	int wall;
+	int height;
+	int noise;
+	int dropout;
+	uint32_t rand_state;
+
+	unsigned int frame;
+	struct timespec next_frame;
+	unsigned int video_enabled:1;
+
+	uint16_t *background; // Unpacked raw depth of the empty room
+	uint16_t *depth; // Unpacked raw depth of the current frame
+	uint8_t *packed; // 11-bit packed depth of the current frame
+	uint8_t *video; // Bayer video of the current frame
+};
+
+// xorshift32 pseudo-random number generator
+static uint32_t synth_rand(struct synth_src *src)
+{
+	uint32_t x = src->rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	src->rand_state = x;
+	return x;
+}
+
+// Converts x in world millimeters to x in pixels at the given distance.
+static int synth_xscreen(float xw, float zw)
+{
+	return (int)(FREENECT_FRAME_W / 2 - xw * (FREENECT_FRAME_W / 2) / (zw * SYNTH_TAN28));
+}
+
+// Converts y in world millimeters to y in pixels at the given distance.
+static int synth_yscreen(float yw, float zw)
+{
+	return (int)(FREENECT_FRAME_H / 2 - yw * (FREENECT_FRAME_W / 2) / (zw * SYNTH_TAN28));
+}
+
+/*
+ * Renders the empty room into src->background.
+ */
+static void render_background(struct synth_src *src)
+{
+	uint16_t wall = reverse_lut(src->wall);
+	uint16_t row;
+	float zw;
+	int x, y;
+
+	for(y = 0; y < FREENECT_FRAME_H; y++) {
+		row = wall;
+
+		// Rows below the horizon may see the floor before the wall
+		if(src->height > 0 && y > FREENECT_FRAME_H / 2) {
+			zw = src->height * (FREENECT_FRAME_W / 2) / ((y - FREENECT_FRAME_H / 2) * SYNTH_TAN28);
+			if(zw < src->wall) {
+				row = reverse_lut((int)zw);
+			}
+		}
+
+		for(x = 0; x < FREENECT_FRAME_W; x++) {
+			src->background[y * FREENECT_FRAME_W + x] = row;
+		}
+	}
+}
+
+/*
+ * Renders the given frame number into src->depth, src->packed, and (if video
+ * is enabled) src->video.
+ */
+static void render_frame(struct synth_src *src, unsigned int frame)
+{
+	float t = frame / 30.0f; // Motion is based on 30fps regardless of actual rate
+	int x, y, xmin, xmax, ymin, ymax;
+	int range = MAX_NUM(src->wall - 1800, 1);
+	int i, px;
+	uint16_t z;
+
+	memcpy(src->depth, src->background, FREENECT_FRAME_PIX * sizeof(src->depth[0]));
+
+	for(i = 0; i < src->people; i++) {
+		// Each person walks side to side at a different distance and speed
+		float zw = 1200 + (i * 977) % range;
+		float xw = 1600.0f * sinf(t * (0.35f + 0.11f * i) + i * 1.7f);
+		float foot = src->height > 0 ? -src->height : -850;
+
+		xmin = MAX_NUM(synth_xscreen(xw + 250, zw), 0);
+		xmax = MIN_NUM(synth_xscreen(xw - 250, zw), FREENECT_FRAME_W - 1);
+		ymin = MAX_NUM(synth_yscreen(foot + 1700, zw), 0);
+		ymax = MIN_NUM(synth_yscreen(foot, zw), FREENECT_FRAME_H - 1);
+		z = reverse_lut((int)zw);
+
+		for(y = ymin; y <= ymax; y++) {
+			for(x = xmin; x <= xmax; x++) {
+				px = y * FREENECT_FRAME_W + x;
+				if(z < src->depth[px]) {
+					src->depth[px] = z;
+				}
+			}
+		}
+	}
+
+	if(src->noise > 0 || src->dropout > 0) {
+		for(px = 0; px < FREENECT_FRAME_PIX; px++) {
+			uint32_t r = synth_rand(src);
+
+			if((int)(r % 1000) < src->dropout) {
+				src->depth[px] = 2047;
+			} else if((int)((r >> 10) % 100) < src->noise) {
+				src->depth[px] += (r & 0x80000000) ? 1 : -1;
+			}
+		}
+	}
+
+	pack_11(src->depth, src->packed, FREENECT_FRAME_PIX);
+
+	if(src->video_enabled) {
+		// Closer objects are brighter
+		for(px = 0; px < FREENECT_FRAME_PIX; px++) {
+			z = src->depth[px];
+			src->video[px] = z >= PXZMAX ? 0 : CLAMP(0, 255, (PXZMAX - z) / 2);
+		}
+	}
+}
+
+static void synth_cleanup(void *data)
+{
+	struct synth_src *src = data;
+
+	if(CHECK_NULL(src)) {
+		return;
+	}
+
+	free(src->background);
+	free(src->depth);
+	free(src->packed);
+	free(src->video);
+	free(src);
+}
+
+static void *synth_init(struct vidproc_info *vid, const char *args)
+{
+	struct synth_src *src;
+
+	src = calloc(1, sizeof(struct synth_src));
+	if(src == NULL) {
+		ERRNO_OUT("Error allocating memory for synthetic source");
+		return NULL;
+	}
+
+	src->vid = vid;
+	src->fps = MAX_NUM(vidproc_get_int_opt(args, "fps", 30), 0);
+	src->max_frames = MAX_NUM(vidproc_get_int_opt(args, "frames", 0), 0);
+	src->people = CLAMP(0, SYNTH_MAX_PEOPLE, vidproc_get_int_opt(args, "people", 2));
+	src->wall = CLAMP(1000, 8000, vidproc_get_int_opt(args, "wall", 4000));
+	src->height = CLAMP(0, 5000, vidproc_get_int_opt(args, "height", 1500));
+	src->noise = CLAMP(0, 100, vidproc_get_int_opt(args, "noise", 5));
+	src->dropout = CLAMP(0, 1000, vidproc_get_int_opt(args, "dropout", 2));
+	src->rand_state = vidproc_get_int_opt(args, "seed", 1);
+	if(src->rand_state == 0) {
+		src->rand_state = 1;
+	}
+
+	src->background = malloc(FREENECT_FRAME_PIX * sizeof(src->background[0]));
+	src->depth = malloc(FREENECT_FRAME_PIX * sizeof(src->depth[0]));
+	src->packed = malloc(KND_DEPTH_SIZE);
+	src->video = calloc(1, KND_VIDEO_SIZE);
+	if(src->background == NULL || src->depth == NULL || src->packed == NULL || src->video == NULL) {
+		ERRNO_OUT("Error allocating synthetic source frame buffers");
+		synth_cleanup(src);
+		return NULL;
+	}
+
+	render_background(src);
+
+	vidproc_set_motor(vid, 1, CLAMP(-15, 15, vidproc_get_int_opt(args, "tilt", 0)));
+	if(src->fps == 0) {
+		vidproc_set_lossless(vid, 1);
+	}
+
+	nl_ptmf("Synthetic scene: %d people, %dmm wall, %dmm camera height, %d fps%s.\n",
+			src->people, src->wall, src->height, src->fps, src->fps ? "" : " (unthrottled)");
+
+	clock_gettime(CLOCK_MONOTONIC, &src->next_frame);
+
+	return src;
+}
+
+static int synth_doevents(void *data)
+{
+	struct synth_src *src = data;
+	struct timespec now;
+
+	if(src->max_frames && src->frame >= (unsigned int)src->max_frames) {
+		nl_ptmf("Synthetic source finished after %u frames.\n", src->frame);
+		return -1;
+	}
+
+	if(src->fps > 0) {
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &src->next_frame, NULL);
+
+		src->next_frame = nl_add_timespec(src->next_frame,
+				(struct timespec){.tv_sec = 0, .tv_nsec = 1000000000 / src->fps});
+
+		// Don't try to catch up after a long stall
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(NL_TIMESPEC_GTE(now, src->next_frame)) {
+			src->next_frame = now;
+		}
+	}
+
+	render_frame(src, src->frame);
+
+	// Timestamps count microseconds at a nominal 30fps
+	vidproc_depth_frame(src->vid, src->packed, src->frame * 33333);
+	if(src->video_enabled) {
+		vidproc_video_frame(src->vid, src->video, src->frame * 33333);
+	}
+
+	src->frame++;
+
+	return 0;
+}
+
+static int synth_set_video(void *data, int enable)
+{
+	struct synth_src *src = data;
+	src->video_enabled = !!enable;
+	return 0;
+}
+
+const struct vidproc_source synth_source = {
+	.name = "synth",
+	.init = synth_init,
+	.cleanup = synth_cleanup,
+	.doevents = synth_doevents,
+	.set_video = synth_set_video,
+};
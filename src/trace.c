@@ -0,0 +1,317 @@
+/*
+ * trace.c - In-process trace of pipeline stages
+ * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * Each thread that records trace events gets its own ring buffer holding its
+ * most recent TRACE_RING_SIZE begin and end events.  Only the owning thread
+ * writes to a ring, so recording an event never locks, and only a thread's
+ * first event allocates.  Readers copy a ring and then discard any events the
+ * owner may have overwritten during the copy.  The recent past of every ring
+ * can be exported as Chrome trace event JSON, which chrome://tracing and
+ * ui.perfetto.dev can display.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "knd.h"
+
+#define TRACE_RING_SIZE		8192	// Events kept per thread
+#define TRACE_MAX_THREADS	64	// Threads that can record events at once
+
+struct trace_event {
+	uint64_t time; // From latency_now()
+	const char *name;
+	char phase; // 'B' for begin, 'E' for end
+};
+
+struct trace_ring {
+	uint64_t head; // Events ever written (written by the owner with release semantics)
+
+	// Protected by ring_lock
+	unsigned int in_use:1; // Whether a running thread owns the ring
+	pid_t tid;
+	char name[16];
+
+	struct trace_event events[TRACE_RING_SIZE];
+};
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key; // Releases a thread's ring when it exits
+static struct trace_ring *rings[TRACE_MAX_THREADS]; // Protected by ring_lock
+static int ring_count; // Protected by ring_lock
+
+static __thread struct trace_ring *thread_ring;
+static __thread unsigned int thread_ring_failed;
+
+
+// Called when a thread with a ring exits, so another thread can reuse it.
+static void release_ring(void *data)
+{
+	struct trace_ring *ring = data;
+	int ret;
+
+	if((ret = pthread_mutex_lock(&ring_lock))) {
+		ERROR_OUT("Error locking trace ring mutex: %s\n", strerror(ret));
+		return;
+	}
+	ring->in_use = 0;
+	if((ret = pthread_mutex_unlock(&ring_lock))) {
+		ERROR_OUT("Error unlocking trace ring mutex: %s\n", strerror(ret));
+	}
+}
+
+static void create_ring_key(void)
+{
+	int ret;
+
+	if((ret = pthread_key_create(&ring_key, release_ring))) {
+		ERROR_OUT("Error creating trace ring key: %s\n", strerror(ret));
+	}
+}
+
+// Claims a ring for the calling thread, reusing one left by an exited thread
+// if possible.  Returns NULL if every ring is taken or allocation fails.
+static struct trace_ring *claim_ring(void)
+{
+	struct trace_ring *ring = NULL;
+	char *c;
+	int ret;
+	int i;
+
+	pthread_once(&ring_once, create_ring_key);
+
+	if((ret = pthread_mutex_lock(&ring_lock))) {
+		ERROR_OUT("Error locking trace ring mutex: %s\n", strerror(ret));
+		return NULL;
+	}
+
+	for(i = 0; i < ring_count; i++) {
+		if(!rings[i]->in_use) {
+			ring = rings[i];
+			break;
+		}
+	}
+
+	if(ring == NULL && ring_count < TRACE_MAX_THREADS) {
+		ring = calloc(1, sizeof(struct trace_ring));
+		if(ring == NULL) {
+			ERRNO_OUT("Error allocating trace ring");
+		} else {
+			rings[ring_count++] = ring;
+		}
+	}
+
+	if(ring != NULL) {
+		ring->in_use = 1;
+		ring->tid = syscall(SYS_gettid);
+		if(pthread_getname_np(pthread_self(), ring->name, sizeof(ring->name))) {
+			snprintf(ring->name, sizeof(ring->name), "thread_%d", (int)ring->tid);
+		}
+
+		// Thread names are written into JSON strings without escaping
+		for(c = ring->name; *c; c++) {
+			if(*c == '"' || *c == '\\' || *c < ' ') {
+				*c = '_';
+			}
+		}
+	}
+
+	if((ret = pthread_mutex_unlock(&ring_lock))) {
+		ERROR_OUT("Error unlocking trace ring mutex: %s\n", strerror(ret));
+	}
+
+	if(ring != NULL && (ret = pthread_setspecific(ring_key, ring))) {
+		ERROR_OUT("Error registering trace ring for release: %s\n", strerror(ret));
+	}
+
+	return ring;
+}
+
+static void add_trace_event(const char *name, char phase)
+{
+	struct trace_event *ev;
+	uint64_t head;
+
+	if(thread_ring == NULL) {
+		if(thread_ring_failed) {
+			return;
+		}
+		thread_ring = claim_ring();
+		if(thread_ring == NULL) {
+			thread_ring_failed = 1;
+			return;
+		}
+	}
+
+	head = thread_ring->head;
+	ev = &thread_ring->events[head % TRACE_RING_SIZE];
+	ev->time = latency_now();
+	ev->name = name;
+	ev->phase = phase;
+	__atomic_store_n(&thread_ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Records the start of the named stage in the calling thread's trace ring.
+ * The name must be a string constant (only the pointer is stored) without
+ * quotes or backslashes.  Never blocks; only the first event in each thread
+ * allocates.
+ */
+void trace_begin(const char *name)
+{
+	add_trace_event(name, 'B');
+}
+
+/*
+ * Records the end of the named stage started by trace_begin().
+ */
+void trace_end(const char *name)
+{
+	add_trace_event(name, 'E');
+}
+
+// Writes the events from the given ring recorded at or after since (from
+// latency_now()) to out as JSON array elements, using events as scratch
+// space.  Returns the number of events written.  Call with ring_lock held.
+static int write_ring(FILE *out, struct trace_ring *ring, uint64_t since,
+		struct trace_event *events, int count)
+{
+	uint64_t head, start, valid, i;
+	struct trace_event *ev;
+	int written = 0;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	for(i = start; i < head; i++) {
+		events[i - start] = ring->events[i % TRACE_RING_SIZE];
+	}
+
+	// The owner may have overwritten the oldest events while they were
+	// copied, including the slot it is writing now
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	valid = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	valid = valid >= TRACE_RING_SIZE ? valid - TRACE_RING_SIZE + 1 : 0;
+
+	for(i = MAX_NUM(start, valid); i < head; i++) {
+		ev = &events[i - start];
+		if(ev->time < since) {
+			continue;
+		}
+
+		fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d}",
+				(count + written) ? "," : "", ev->name, ev->phase,
+				(unsigned long long)(ev->time / 1000), (unsigned int)(ev->time % 1000),
+				(int)getpid(), (int)ring->tid);
+		written++;
+	}
+
+	return written;
+}
+
+/*
+ * Writes the trace events recorded in the last given number of seconds, with
+ * the names of the threads that recorded them, to out as a Chrome trace event
+ * JSON object.  Returns 0 on success, -1 on error.
+ */
+int write_trace(FILE *out, unsigned int seconds)
+{
+	struct trace_event *events;
+	uint64_t now, since;
+	int count = 0;
+	int ret;
+	int i;
+
+	events = malloc(sizeof(struct trace_event) * TRACE_RING_SIZE);
+	if(events == NULL) {
+		ERRNO_OUT("Error allocating trace export buffer");
+		return -1;
+	}
+
+	now = latency_now();
+	since = now > (uint64_t)seconds * 1000000000 ? now - (uint64_t)seconds * 1000000000 : 0;
+
+	if((ret = pthread_mutex_lock(&ring_lock))) {
+		ERROR_OUT("Error locking trace ring mutex: %s\n", strerror(ret));
+		free(events);
+		return -1;
+	}
+
+	fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for(i = 0; i < ring_count; i++) {
+		fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				count ? "," : "", (int)getpid(), (int)rings[i]->tid, rings[i]->name);
+		count++;
+		count += write_ring(out, rings[i], since, events, count);
+	}
+	fprintf(out, "\n]}\n");
+
+	if((ret = pthread_mutex_unlock(&ring_lock))) {
+		ERROR_OUT("Error unlocking trace ring mutex: %s\n", strerror(ret));
+	}
+
+	free(events);
+
+	if(ferror(out)) {
+		ERROR_OUT("Error writing trace events.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns a newly allocated buffer containing the Chrome trace event JSON for
+ * the last given number of seconds (see write_trace()), storing its length in
+ * *size.  The buffer must be free()d.  Returns NULL on error.
+ */
+char *get_trace_json(unsigned int seconds, size_t *size)
+{
+	char *buf = NULL;
+	FILE *out;
+	int ret;
+
+	out = open_memstream(&buf, size);
+	if(out == NULL) {
+		ERRNO_OUT("Error opening trace export buffer");
+		return NULL;
+	}
+
+	ret = write_trace(out, seconds);
+	if(fclose(out)) {
+		ERRNO_OUT("Error closing trace export buffer");
+		ret = -1;
+	}
+	if(ret) {
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/*
+ * Writes the Chrome trace event JSON for the last given number of seconds to
+ * the file at the given path, replacing the file if it exists.  Returns 0 on
+ * success, -1 on error.
+ */
+int save_trace(const char *path, unsigned int seconds)
+{
+	FILE *out;
+	int ret;
+
+	out = fopen(path, "w");
+	if(out == NULL) {
+		ERRNO_OUT("Error opening trace file '%s'", path);
+		return -1;
+	}
+
+	ret = write_trace(out, seconds);
+	if(fclose(out)) {
+		ERRNO_OUT("Error closing trace file '%s'", path);
+		ret = -1;
+	}
+
+	return ret;
+}
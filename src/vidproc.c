@@ -1,5 +1,5 @@
 /*
- * vidproc.c - Depth camera daemon video processing code and libfreenect callbacks
+ * vidproc.c - Depth camera daemon video processing code and frame source handling
  * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
  */
 #include <stdlib.h>
@@ -7,19 +7,22 @@
 #include <math.h>
 #include <asm/byteorder.h>
 
-#include <libusb-1.0/libusb.h>
-
 #include "knd.h"
 
 struct vidproc_info {
 	struct knd_info *knd;
 
+	const struct vidproc_source *source; // Frame source backend
+	void *source_data; // Returned by the source's init function (NULL while reopening)
+	char *source_args; // Arguments passed to the source's init function
+	int reopen_tilt; // Tilt requested before the source was closed by vidproc_reopen()
+
 	uint32_t depth_timestamp; // Depth timestamp
+	uint64_t depth_arrival; // Time the depth frame arrived (see latency_now())
 	uint8_t *depth_buffer; // Depth buffer
 	sem_t depth_full; // Posted by depth callback
 	sem_t depth_empty; // Posted by depth thread
 	pthread_mutex_t depth_in_use;
-	int busy_count; // The number of times depth callback timed out on semaphore
 
 	uint32_t last_depth;
 	unsigned int depth_frames;
@@ -32,6 +35,7 @@ struct vidproc_info {
 	sem_t video_empty; // Posted by video thread
 	uint32_t video_requested:1;
 	uint32_t video_started:1;
+	uint64_t video_request_time; // When video was requested (see latency_now()), 0 if not waiting
 	pthread_mutex_t video_in_use;
 
 	uint32_t last_video;
@@ -39,12 +43,6 @@ struct vidproc_info {
 	void *video_cb_data;
 	vidproc_func video_cb;
 
-	libusb_context *camera_usb;
-	libusb_context *motor_usb;
-	freenect_context *camera_ctx;
-	freenect_context *motor_ctx;
-	freenect_device *camera_dev;
-	freenect_device *motor_dev;
 	freenect_led_options led;
 	freenect_led_options last_led;
 
@@ -56,6 +54,11 @@ struct vidproc_info {
 	int last_tilt;
 
 	unsigned int motor_missing:1;
+	unsigned int lossless:1; // Wait for the depth thread instead of dropping frames
+
+	// Recording (protected by both depth_in_use and video_in_use)
+	struct knd_recorder *recorder;
+	unsigned int record_video:1; // Keep video running and record it
 
 	struct nl_thread *depth_thread;
 	struct nl_thread *video_thread;
@@ -64,6 +67,15 @@ struct vidproc_info {
 	volatile unsigned int stop:1;
 };
 
+/*
+ * Available frame sources, selected by name in init_vidproc().
+ */
+static const struct vidproc_source * const sources[] = {
+	&freenect_source,
+	&replay_source,
+	&synth_source,
+};
+
 enum frame_type {
 	DEPTH,
 	VIDEO,
@@ -125,12 +137,12 @@ static int get_stop(struct vidproc_info *info)
 {
 	int ret, val;
 
-	ret = pthread_mutex_lock(&info->param_mutex);
+	ret = KND_MUTEX_LOCK(&info->param_mutex, "param_mutex");
 	if(ret) {
 		ERROR_OUT("Error locking vidproc param mutex: %s\n", strerror(ret));
 	}
 	val = info->stop;
-	ret = pthread_mutex_unlock(&info->param_mutex);
+	ret = KND_MUTEX_UNLOCK(&info->param_mutex);
 	if(ret) {
 		ERROR_OUT("Error unlocking vidproc param mutex: %s\n", strerror(ret));
 	}
@@ -145,12 +157,12 @@ static void set_stop(struct vidproc_info *info, int stop)
 {
 	int ret;
 
-	ret = pthread_mutex_lock(&info->param_mutex);
+	ret = KND_MUTEX_LOCK(&info->param_mutex, "param_mutex");
 	if(ret) {
 		ERROR_OUT("Error locking vidproc param mutex: %s\n", strerror(ret));
 	}
 	info->stop = !!stop;
-	ret = pthread_mutex_unlock(&info->param_mutex);
+	ret = KND_MUTEX_UNLOCK(&info->param_mutex);
 	if(ret) {
 		ERROR_OUT("Error unlocking vidproc param mutex: %s\n", strerror(ret));
 	}
@@ -212,27 +224,41 @@ static void *depth_thread(void *d)
 			break;
 		}
 
-		ret = pthread_mutex_lock(&info->depth_in_use);
+		ret = KND_MUTEX_LOCK(&info->depth_in_use, "depth_in_use");
 		if(ret) {
 			ERROR_OUT("Error locking depth buffer mutex: %s\n", strerror(ret));
 		}
 
+		trace_begin("depth_process");
+		KND_FRAME_PATH_BEGIN();
+
+		__atomic_fetch_add(&info->knd->counts.depth_processed, 1, __ATOMIC_RELAXED);
+		info->knd->depth_arrival = info->depth_arrival;
+		record_latency(info->knd->latency, LATENCY_DEQUEUE, info->depth_arrival);
+
 		if(info->depth_frames == 1) {
 			nl_ptmf("Received first depth frame.\n");
 		}
 
+		if(info->recorder != NULL) {
+			record_depth(info->recorder, info->depth_buffer, info->depth_timestamp);
+		}
+
 		if(info->depth_cb != NULL) {
 			info->depth_cb(info->depth_buffer, info->depth_cb_data);
 		}
 
 		update_led(info);
 
+		KND_FRAME_PATH_END();
+		trace_end("depth_process");
+
 		if(sem_post(&info->depth_empty)) {
 			ERRNO_OUT("Error notifying event thread depth is empty");
 			error_count++;
 		}
 
-		ret = pthread_mutex_unlock(&info->depth_in_use);
+		ret = KND_MUTEX_UNLOCK(&info->depth_in_use);
 		if(ret) {
 			ERROR_OUT("Error unlocking depth buffer mutex: %s\n", strerror(ret));
 		}
@@ -263,25 +289,33 @@ static void *video_thread(void *d)
 			break;
 		}
 
-		ret = pthread_mutex_lock(&info->video_in_use);
+		ret = KND_MUTEX_LOCK(&info->video_in_use, "video_in_use");
 		if(ret) {
 			ERROR_OUT("Error locking video buffer mutex: %s\n", strerror(ret));
 		}
 
+		trace_begin("video_process");
+
 		if(info->video_frames == 1) {
 			nl_ptmf("Received first video frame.\n");
 		}
 
+		if(info->recorder != NULL && info->record_video) {
+			record_video(info->recorder, info->video_buffer, info->video_timestamp);
+		}
+
 		if(info->video_cb != NULL) {
 			info->video_cb(info->video_buffer, info->video_cb_data);
 		}
 
+		trace_end("video_process");
+
 		if(sem_post(&info->video_empty)) {
 			ERRNO_OUT("Error notifying event thread video is empty");
 			error_count++;
 		}
 
-		ret = pthread_mutex_unlock(&info->video_in_use);
+		ret = KND_MUTEX_UNLOCK(&info->video_in_use);
 		if(ret) {
 			ERROR_OUT("Error unlocking video buffer mutex: %s\n", strerror(ret));
 		}
@@ -292,104 +326,267 @@ static void *video_thread(void *d)
 	return NULL;
 }
 
-static void depth_callback(freenect_device *dev, void *depthbuf, uint32_t timestamp)
+/*
+ * Hands a packed depth frame from the frame source to the depth processing
+ * thread.  The frame is dropped if the depth thread is still busy with the
+ * previous frame, unless the source asked for lossless delivery with
+ * vidproc_set_lossless().  Called by frame sources from their doevents
+ * function.
+ */
+void vidproc_depth_frame(struct vidproc_info *info, const void *depthbuf, uint32_t timestamp)
 {
-	struct vidproc_info *info = freenect_get_user(dev);
+	uint64_t arrival = latency_now();
 	int ret;
 
-	if(sem_timedwait(&info->depth_empty, &(struct timespec){.tv_nsec = 1000000})) {
+	trace_begin("depth_frame");
+	KND_FRAME_PATH_BEGIN();
+
+	__atomic_fetch_add(&info->knd->counts.depth_received, 1, __ATOMIC_RELAXED);
+
+	if(info->lossless) {
+		ret = sem_wait(&info->depth_empty);
+	} else {
+		ret = sem_timedwait(&info->depth_empty, &(struct timespec){.tv_nsec = 1000000});
+	}
+	if(ret) {
 		if(errno == ETIMEDOUT) {
-			// TODO: Add a way of getting the busy count and comparing it to depth_frames + busy_count
-			// (e.g. show processed fps vs. received fps)
-			info->busy_count++;
+			__atomic_fetch_add(&info->knd->counts.depth_dropped, 1, __ATOMIC_RELAXED);
 		} else {
 			ERRNO_OUT("Error waiting for depth buffer to be empty");
 		}
-		return;
+		goto out;
 	}
 
-	if((ret = pthread_mutex_lock(&info->depth_in_use))) {
+	if((ret = KND_MUTEX_LOCK(&info->depth_in_use, "depth_in_use"))) {
 		ERROR_OUT("Error waiting for exclusive access to depth buffer: %s\n", strerror(ret));
 		sem_post(&info->depth_empty);
-		return;
+		goto out;
 	}
 
 	memcpy(info->depth_buffer, depthbuf, KND_DEPTH_SIZE);
 	info->last_depth = info->depth_timestamp;
 	info->depth_timestamp = timestamp;
+	info->depth_arrival = arrival;
 	info->depth_frames++;
 
 	if(sem_post(&info->depth_full)) {
 		ERRNO_OUT("Error posting depth to processing thread");
 	}
 
-	if((ret = pthread_mutex_unlock(&info->depth_in_use))) {
+	if((ret = KND_MUTEX_UNLOCK(&info->depth_in_use))) {
 		ERROR_OUT("Error unlocking depth buffer: %s\n", strerror(ret));
 	}
+
+out:
+	KND_FRAME_PATH_END();
+	trace_end("depth_frame");
 }
 
-static void video_callback(freenect_device *dev, void *videobuf, uint32_t timestamp)
+/*
+ * Hands a video frame from the frame source to the video processing thread,
+ * waiting for the thread to finish with the previous frame.  Called by frame
+ * sources from their doevents function.
+ */
+void vidproc_video_frame(struct vidproc_info *info, const void *videobuf, uint32_t timestamp)
 {
-	struct vidproc_info *info = freenect_get_user(dev);
 	int ret;
 
+	trace_begin("video_frame");
+
 	if(sem_wait(&info->video_empty)) {
 		ERRNO_OUT("Error waiting for video buffer to be empty");
-		return;
+		goto out;
 	}
 
-	if((ret = pthread_mutex_lock(&info->video_in_use))) {
+	if((ret = KND_MUTEX_LOCK(&info->video_in_use, "video_in_use"))) {
 		ERROR_OUT("Error waiting for exclusive access to video buffer: %s\n", strerror(ret));
 		sem_post(&info->video_empty);
-		return;
+		goto out;
 	}
 
 	memcpy(info->video_buffer, videobuf, KND_VIDEO_SIZE);
 	info->last_video = info->video_timestamp;
 	info->video_timestamp = timestamp;
 	info->video_frames++;
-	info->video_requested = 0;
+	info->video_requested = info->record_video;
+
+	__atomic_fetch_add(&info->knd->counts.video_received, 1, __ATOMIC_RELAXED);
+	if(info->video_request_time) {
+		__atomic_fetch_add(&info->knd->counts.video_starts, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&info->knd->counts.video_start_us,
+				(latency_now() - info->video_request_time) / 1000, __ATOMIC_RELAXED);
+		info->video_request_time = 0;
+	}
 
 	if(sem_post(&info->video_full)) {
 		ERRNO_OUT("Error posting video to processing thread");
 	}
 
-	if((ret = pthread_mutex_unlock(&info->video_in_use))) {
+	if((ret = KND_MUTEX_UNLOCK(&info->video_in_use))) {
 		ERROR_OUT("Error unlocking video buffer: %s\n", strerror(ret));
 	}
+
+out:
+	trace_end("video_frame");
 }
 
-// libfreenect logging callback
-static void log_callback(freenect_context *ctx, freenect_loglevel level, const char *msg)
+/*
+ * Tells vidproc whether the frame source has a tilt motor, and the motor's
+ * current tilt in degrees.  Sources without a motor should not call this
+ * function.  Must only be called from a source's init function, which also
+ * runs during vidproc_reopen() while the server thread is using the motor.
+ */
+void vidproc_set_motor(struct vidproc_info *info, int present, int tilt)
 {
-	static const char * const levels[] = {
-		"fatal error",
-		"error",
-		"warning",
-		"notice",
-		"info",
-		"debug",
-		"spew",
-		"flood",
-	};
-
-	nl_ptmf("Camera %s: %s", levels[level], msg);
+	int ret;
+
+	ret = KND_MUTEX_LOCK(&info->param_mutex, "param_mutex");
+	if(ret) {
+		ERROR_OUT("Error locking vidproc param mutex: %s\n", strerror(ret));
+	}
+	info->motor_missing = !present;
+	info->tilt = tilt;
+	info->last_tilt = tilt;
+	ret = KND_MUTEX_UNLOCK(&info->param_mutex);
+	if(ret) {
+		ERROR_OUT("Error unlocking vidproc param mutex: %s\n", strerror(ret));
+	}
 }
 
 /*
- * Initializes libfreenect and opens the devindex-th camera.  If depth_cb
- * and/or video_cb are not NULL, then they will be called for every frame
- * received and processed.  Callbacks are called from the vidproc thread after
- * vidproc's own processing is complete, so use appropriate locking and avoid
- * spending too much time in callbacks.
+ * Sets whether depth frames passed to vidproc_depth_frame() should wait for
+ * the depth thread instead of being dropped when the thread is busy.  Sources
+ * that can produce frames faster than real time (e.g. file replay) should
+ * enable this.  Must only be called from a source's init function.
  */
-struct vidproc_info *init_vidproc(struct knd_info *knd, int devindex, vidproc_func depth_cb, void *depth_cb_data, vidproc_func video_cb, void *video_cb_data)
+void vidproc_set_lossless(struct vidproc_info *info, int lossless)
+{
+	info->lossless = !!lossless;
+}
+
+/*
+ * Starts (rec is not NULL) or stops recording frames as they are processed.
+ * Depth frames are passed to record_depth() from the depth thread.  If video
+ * is nonzero, video is kept running and every video frame is passed to
+ * record_video().  Returns the previous recorder, if any, which the caller
+ * must destroy.  Only the server thread may change the recorder once the
+ * server is running; the recorder still set when vidproc is cleaned up is
+ * destroyed by cleanup_vidproc().
+ */
+struct knd_recorder *vidproc_set_recorder(struct vidproc_info *info, struct knd_recorder *rec, int video)
+{
+	struct knd_recorder *old;
+	int ret;
+
+	if((ret = KND_MUTEX_LOCK(&info->depth_in_use, "depth_in_use"))) {
+		ERROR_OUT("Error locking depth buffer mutex: %s\n", strerror(ret));
+	}
+	if((ret = KND_MUTEX_LOCK(&info->video_in_use, "video_in_use"))) {
+		ERROR_OUT("Error locking video buffer mutex: %s\n", strerror(ret));
+	}
+
+	old = info->recorder;
+	info->recorder = rec;
+	info->record_video = rec != NULL && video;
+	if(info->record_video) {
+		info->video_requested = 1;
+	}
+
+	if((ret = KND_MUTEX_UNLOCK(&info->video_in_use))) {
+		ERROR_OUT("Error unlocking video buffer mutex: %s\n", strerror(ret));
+	}
+	if((ret = KND_MUTEX_UNLOCK(&info->depth_in_use))) {
+		ERROR_OUT("Error unlocking depth buffer mutex: %s\n", strerror(ret));
+	}
+
+	return old;
+}
+
+/*
+ * Returns the recorder set by vidproc_set_recorder(), or NULL if frames are
+ * not being recorded.  See vidproc_set_recorder() for thread safety.
+ */
+struct knd_recorder *vidproc_get_recorder(struct vidproc_info *info)
+{
+	return info->recorder;
+}
+
+/*
+ * Looks up key in a comma-separated list of source options (key=value, or
+ * just key for flags).  Stores the value (an empty string for a flag) in
+ * value if value is not NULL.  Returns 1 if the key was found, 0 otherwise.
+ */
+int vidproc_get_opt(const char *args, const char *key, char *value, size_t value_size)
+{
+	size_t keylen = strlen(key);
+	size_t len;
+
+	while(*args) {
+		len = strcspn(args, ",");
+
+		if(len >= keylen && !strncmp(args, key, keylen) &&
+				(len == keylen || args[keylen] == '=')) {
+			if(value != NULL && value_size > 0) {
+				args += MIN_NUM(len, keylen + 1);
+				len -= MIN_NUM(len, keylen + 1);
+				snprintf(value, value_size, "%.*s", (int)len, args);
+			}
+			return 1;
+		}
+
+		args += len;
+		if(*args == ',') {
+			args++;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the integer value of the given source option, or def if the option
+ * was not given.
+ */
+int vidproc_get_int_opt(const char *args, const char *key, int def)
+{
+	char value[32];
+
+	if(vidproc_get_opt(args, key, value, sizeof(value))) {
+		return atoi(value);
+	}
+
+	return def;
+}
+
+/*
+ * Initializes the frame source given by source (a source name, optionally
+ * followed by a colon and source-specific arguments, e.g. "freenect:0",
+ * "replay:/tmp/depth.knr,fast", or "synth:people=3"), and starts the depth and
+ * video processing threads.  A NULL or empty source uses the first camera
+ * found by libfreenect.  If depth_cb and/or video_cb are not NULL, then they
+ * will be called for every frame received and processed.  Callbacks are called
+ * from the vidproc thread after vidproc's own processing is complete, so use
+ * appropriate locking and avoid spending too much time in callbacks.
+ */
+struct vidproc_info *init_vidproc(struct knd_info *knd, const char *source, vidproc_func depth_cb, void *depth_cb_data, vidproc_func video_cb, void *video_cb_data)
 {
 	struct vidproc_info *info;
 	pthread_mutexattr_t mutex_attr;
-	int devcount;
+	const char *args;
+	size_t namelen;
+	unsigned int i;
 	int ret;
 
+	if(source == NULL || source[0] == 0) {
+		source = "freenect";
+	}
+
+	namelen = strcspn(source, ":");
+	args = source + namelen;
+	if(*args == ':') {
+		args++;
+	}
+
 	if((ret = pthread_mutexattr_init(&mutex_attr)) ||
 			(ret = pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_ERRORCHECK))) {
 		ERROR_OUT("Error initializing mutex attributes: %s\n", strerror(ret));
@@ -402,6 +599,17 @@ struct vidproc_info *init_vidproc(struct knd_info *knd, int devindex, vidproc_fu
 		goto error1;
 	}
 
+	for(i = 0; i < ARRAY_SIZE(sources); i++) {
+		if(strlen(sources[i]->name) == namelen && !strncmp(sources[i]->name, source, namelen)) {
+			info->source = sources[i];
+			break;
+		}
+	}
+	if(info->source == NULL) {
+		ERROR_OUT("Unknown frame source \"%.*s\".\n", (int)namelen, source);
+		goto error2;
+	}
+
 	if((ret = pthread_mutex_init(&info->param_mutex, &mutex_attr))) {
 		ERROR_OUT("Error creating run/stop mutex: %s\n", strerror(ret));
 		goto error2;
@@ -412,22 +620,41 @@ struct vidproc_info *init_vidproc(struct knd_info *knd, int devindex, vidproc_fu
 		goto error3;
 	}
 
+	if((ret = pthread_mutex_init(&info->video_in_use, &mutex_attr))) {
+		ERROR_OUT("Error creating video buffer mutex: %s\n", strerror(ret));
+		goto error4;
+	}
+
 	if(sem_init(&info->depth_full, 0, 0)) {
 		ERRNO_OUT("Error creating depth buffer full semaphore");
-		goto error4;
+		goto error5;
 	}
 	if(sem_init(&info->depth_empty, 0, 1)) { // Initial value 1 to allow callback to start
 		ERRNO_OUT("Error creating depth buffer empty semaphore");
-		goto error5;
+		goto error6;
 	}
 
 	if(sem_init(&info->video_full, 0, 0)) {
 		ERRNO_OUT("Error creating video buffer full semaphore");
-		goto error6;
+		goto error7;
 	}
 	if(sem_init(&info->video_empty, 0, 1)) { // Initial value 1 to allow callback to start
 		ERRNO_OUT("Error creating video buffer empty semaphore");
-		goto error7;
+		goto error8;
+	}
+
+	info->knd = knd;
+	info->led = LED_GREEN;
+	info->motor_missing = 1;
+	info->depth_cb = depth_cb;
+	info->depth_cb_data = depth_cb_data;
+	info->video_cb = video_cb;
+	info->video_cb_data = video_cb_data;
+
+	info->source_args = strdup(args);
+	if(info->source_args == NULL) {
+		ERRNO_OUT("Error copying frame source arguments");
+		goto error;
 	}
 
 	info->depth_buffer = malloc(FREENECT_DEPTH_11BIT_PACKED_SIZE);
@@ -442,99 +669,12 @@ struct vidproc_info *init_vidproc(struct knd_info *knd, int devindex, vidproc_fu
 		goto error;
 	}
 
-	if((ret = libusb_init(&info->camera_usb)) != 0) {
-		ERROR_OUT("Error initializing libusb camera context: %d.\n", ret);
-		goto error;
-	}
-	if((ret = libusb_init(&info->motor_usb)) != 0) {
-		ERROR_OUT("Error initializing libusb motor context: %d.\n", ret);
-		goto error;
-	}
-
-	if(freenect_init(&info->motor_ctx, info->motor_usb) < 0) {
-		ERROR_OUT("Error initializing libfreenect motor context.\n");
-		goto error;
-	}
-	if(freenect_init(&info->camera_ctx, info->camera_usb) < 0) {
-		ERROR_OUT("Error initializing libfreenect camera context.\n");
-		goto error;
-	}
-
-	if(getenv("KND_LOG_LEVEL") != NULL) {
-		freenect_set_log_level(info->motor_ctx, CLAMP(FREENECT_LOG_FATAL, FREENECT_LOG_FLOOD, atoi(getenv("KND_LOG_LEVEL"))));
-		freenect_set_log_level(info->camera_ctx, CLAMP(FREENECT_LOG_FATAL, FREENECT_LOG_FLOOD, atoi(getenv("KND_LOG_LEVEL"))));
-	} else {
-		freenect_set_log_level(info->motor_ctx, FREENECT_LOG_ERROR);
-		freenect_set_log_level(info->camera_ctx, FREENECT_LOG_ERROR);
-	}
-	freenect_set_log_callback(info->motor_ctx, log_callback);
-	freenect_set_log_callback(info->camera_ctx, log_callback);
-
-	freenect_select_subdevices(info->motor_ctx, FREENECT_DEVICE_MOTOR);
-	freenect_select_subdevices(info->camera_ctx, FREENECT_DEVICE_CAMERA);
-
-	devcount = freenect_num_devices(info->camera_ctx);
-	if(devcount == 0) {
-		ERROR_OUT("No depth cameras were found.\n");
-		goto error;
-	}
-	if(devcount <= devindex) {
-		ERROR_OUT("Requested depth camera %d (zero-indexed) does not exist (there are %d total).\n",
-				devindex, devcount);
-		goto error;
-	}
-
 	init_lut();
 
-	// TODO: Use USB IDs to distinguish between K4Xbox old, K4Xbox new, and K4W
-	if(freenect_open_device(info->motor_ctx, &info->motor_dev, devindex) < 0) {
-		INFO_OUT("Opening motor %d (zero-indexed) failed.  Trying again.\n", devindex);
-		usleep(500000);
-		if(freenect_open_device(info->motor_ctx, &info->motor_dev, devindex) < 0) {
-			INFO_OUT("Opening motor failed.  Operating without tilt and LED support.\n");
-			info->motor_missing = 1;
-		}
-	}
-	if(!info->motor_missing) {
-		freenect_set_user(info->motor_dev, info);
-	}
-
-	if(freenect_open_device(info->camera_ctx, &info->camera_dev, devindex) < 0) {
-		INFO_OUT("Opening camera %d (zero-indexed) failed.  Trying again.\n", devindex);
-		usleep(500000);
-		if(freenect_open_device(info->camera_ctx, &info->camera_dev, devindex) < 0) {
-			ERROR_OUT("Error opening depth camera %d (zero-indexed).\n", devindex);
-			goto error;
-		}
-	}
-
-	freenect_set_user(info->camera_dev, info);
-	freenect_set_depth_callback(info->camera_dev, depth_callback);
-	if(freenect_set_depth_mode(info->camera_dev, freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT_PACKED))) {
-		ERROR_OUT("Error setting depth resolution and image format.\n");
-		goto error;
-	}
-	freenect_set_video_callback(info->camera_dev, video_callback);
-	// TODO: Other video formats
-	if(freenect_set_video_mode(info->camera_dev, freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, KND_VIDEO_FORMAT))) {
-		ERROR_OUT("Error setting video resolution and image format.\n");
-		goto error;
-	}
-
-	info->knd = knd;
-	info->led = LED_GREEN;
-	info->depth_cb = depth_cb;
-	info->depth_cb_data = depth_cb_data;
-	info->video_cb = video_cb;
-	info->video_cb_data = video_cb_data;
-
-	if(!info->motor_missing) {
-		info->tilt = freenect_get_tilt_degs(freenect_get_tilt_state(info->motor_dev));
-		info->last_tilt = info->tilt;
-	}
-
-	if(freenect_start_depth(info->camera_dev)) {
-		ERROR_OUT("Error starting depth processing.\n");
+	nl_ptmf("Opening %s frame source.\n", info->source->name);
+	info->source_data = info->source->init(info, args);
+	if(info->source_data == NULL) {
+		ERROR_OUT("Error initializing %s frame source.\n", info->source->name);
 		goto error;
 	}
 
@@ -558,12 +698,14 @@ error:
 	cleanup_vidproc(info);
 	goto error1;
 
-error7:
+error8:
 	sem_destroy(&info->video_full);
-error6:
+error7:
 	sem_destroy(&info->depth_empty);
-error5:
+error6:
 	sem_destroy(&info->depth_full);
+error5:
+	pthread_mutex_destroy(&info->video_in_use);
 error4:
 	pthread_mutex_destroy(&info->depth_in_use);
 error3:
@@ -578,7 +720,7 @@ error1:
 
 /*
  * Stops video processing associated with the given info structure and frees
- * associated resources.  Should only be called after the libfreenect event
+ * associated resources.  Should only be called after the frame source's event
  * loop has exited. Ignores a null parameter.
  */
 void cleanup_vidproc(struct vidproc_info *info)
@@ -607,37 +749,17 @@ void cleanup_vidproc(struct vidproc_info *info)
 		}
 	}
 
-	if(info->motor_dev != NULL) {
-		if(!info->motor_missing) {
-			freenect_set_led(info->motor_dev, LED_OFF);
-		}
-		freenect_close_device(info->motor_dev);
-	}
-	if(info->motor_ctx != NULL) {
-		freenect_shutdown(info->motor_ctx);
-	}
-
-	if(info->camera_dev != NULL) {
-		freenect_stop_depth(info->camera_dev);
-		freenect_stop_video(info->camera_dev);
-		freenect_close_device(info->camera_dev);
-	}
-	if(info->camera_ctx != NULL) {
-		freenect_shutdown(info->camera_ctx);
+	if(info->source_data != NULL) {
+		info->source->cleanup(info->source_data);
 	}
 
-	if(info->motor_usb != NULL) {
-		libusb_exit(info->motor_usb);
-	}
-	if(info->camera_usb != NULL) {
-		libusb_exit(info->camera_usb);
-	}
+	destroy_recorder(info->recorder);
 
-	if((ret = pthread_mutex_lock(&info->depth_in_use))) {
+	if((ret = KND_MUTEX_LOCK(&info->depth_in_use, "depth_in_use"))) {
 		ERROR_OUT("Error locking depth buffer mutex while cleaning up: %s\n", strerror(ret));
 	}
 
-	if((ret = pthread_mutex_lock(&info->video_in_use))) {
+	if((ret = KND_MUTEX_LOCK(&info->video_in_use, "video_in_use"))) {
 		ERROR_OUT("Error locking video buffer mutex while cleaning up: %s\n", strerror(ret));
 	}
 
@@ -649,17 +771,19 @@ void cleanup_vidproc(struct vidproc_info *info)
 		free(info->video_buffer);
 	}
 
+	free(info->source_args);
+
 	sem_destroy(&info->depth_full);
 	sem_destroy(&info->depth_empty);
 
 	sem_destroy(&info->video_full);
 	sem_destroy(&info->video_empty);
 
-	if((ret = pthread_mutex_unlock(&info->depth_in_use))) {
+	if((ret = KND_MUTEX_UNLOCK(&info->depth_in_use))) {
 		ERROR_OUT("Error unlocking depth buffer mutex while cleaning up: %s\n", strerror(ret));
 	}
 
-	if((ret = pthread_mutex_unlock(&info->video_in_use))) {
+	if((ret = KND_MUTEX_UNLOCK(&info->video_in_use))) {
 		ERROR_OUT("Error unlocking video buffer mutex while cleaning up: %s\n", strerror(ret));
 	}
 
@@ -675,11 +799,11 @@ void cleanup_vidproc(struct vidproc_info *info)
 }
 
 /*
- * Runs one iteration of libfreenect event processing.  This function blocks
- * until there are events to process, so it should be called through its own
- * event loop.  Returns 0 on success, -1 if there was any error other than an
- * interrupted system call (which happens frequently under some code profiling
- * tools).
+ * Runs one iteration of frame source event processing.  This function blocks
+ * until there are events to process (or, for sources that generate frames
+ * themselves, until the next frame is due), so it should be called through
+ * its own event loop.  Returns 0 on success, -1 on error or when the source
+ * has no more frames.
  */
 int vidproc_doevents(struct vidproc_info *info)
 {
@@ -689,55 +813,139 @@ int vidproc_doevents(struct vidproc_info *info)
 		return -1;
 	}
 
-	// Process USB events
-	ret = freenect_process_events(info->camera_ctx);
-	if(ret && ret != LIBUSB_ERROR_INTERRUPTED) {
-		return -1;
-	}
-
-	ret = freenect_process_events_timeout(info->motor_ctx,
-			&(struct timeval){.tv_sec = 0, .tv_usec = 0});
-	if(ret && ret != LIBUSB_ERROR_INTERRUPTED) {
+	if(info->source->doevents(info->source_data)) {
 		return -1;
 	}
 
 	if(!info->motor_missing) {
 		// Update LED state
 		if(info->led != info->last_led) {
-			freenect_set_led(info->motor_dev, info->led);
+			if(info->source->set_led != NULL) {
+				info->source->set_led(info->source_data, info->led);
+			}
 			info->last_led = info->led;
 		}
 
 		// Update tilt
 		if(info->tilt != info->last_tilt) {
-			freenect_set_tilt_degs(info->motor_dev, info->tilt);
+			if(info->source->set_tilt != NULL) {
+				info->source->set_tilt(info->source_data, info->tilt);
+			}
 			info->last_tilt = info->tilt;
 		}
 	}
 
 	// Start/stop video as required
-	if((ret = pthread_mutex_lock(&info->video_in_use))) {
+	if((ret = KND_MUTEX_LOCK(&info->video_in_use, "video_in_use"))) {
 		ERROR_OUT("Error locking video mutex: %s\n", strerror(ret));
 	}
 	if(info->video_requested && !info->video_started) {
-		if(freenect_start_video(info->camera_dev)) {
-			ERROR_OUT("Error starting video processing.\n");
-		} else {
+		if(!info->source->set_video(info->source_data, 1)) {
 			info->video_started = 1;
 		}
 	} else if(info->video_started && !info->video_requested) {
-		if(freenect_stop_video(info->camera_dev)) {
-			ERROR_OUT("Error stopping video processing.\n");
-		}
+		info->source->set_video(info->source_data, 0);
 		info->video_started = 0;
 	}
-	if((ret = pthread_mutex_unlock(&info->video_in_use))) {
+	if((ret = KND_MUTEX_UNLOCK(&info->video_in_use))) {
+		ERROR_OUT("Error unlocking video mutex: %s\n", strerror(ret));
+	}
+
+	return 0;
+}
+
+/*
+ * Closes the frame source and opens it again with the same arguments, after
+ * vidproc_doevents() fails on a source that supports reconnection (e.g. when
+ * the camera is unplugged or its USB connection resets).  The depth and video
+ * threads, buffers, and recorder are kept.  The requested tilt, LED color, and
+ * video state are restored once the source is open.  Call from the thread that
+ * calls vidproc_doevents().  Returns 0 on success, -1 if the source could not
+ * be opened (call again to retry) or does not support reconnection.
+ */
+int vidproc_reopen(struct vidproc_info *info)
+{
+	void *source_data;
+	int ret;
+
+	if(CHECK_NULL(info)) {
+		return -1;
+	}
+
+	if(!info->source->reconnect) {
+		return -1;
+	}
+
+	// The source's init function reports the motor's current position, so
+	// remember the requested tilt across every attempt.  set_tilt() updates
+	// reopen_tilt while source_data is NULL.
+	ret = KND_MUTEX_LOCK(&info->param_mutex, "param_mutex");
+	if(ret) {
+		ERROR_OUT("Error locking vidproc param mutex: %s\n", strerror(ret));
+	}
+	source_data = info->source_data;
+	if(source_data != NULL) {
+		info->reopen_tilt = info->tilt;
+		info->source_data = NULL;
+	}
+	info->motor_missing = 1;
+	ret = KND_MUTEX_UNLOCK(&info->param_mutex);
+	if(ret) {
+		ERROR_OUT("Error unlocking vidproc param mutex: %s\n", strerror(ret));
+	}
+
+	if(source_data != NULL) {
+		info->source->cleanup(source_data);
+	}
+
+	nl_ptmf("Reopening %s frame source.\n", info->source->name);
+	source_data = info->source->init(info, info->source_args);
+	if(source_data == NULL) {
+		return -1;
+	}
+
+	// vidproc_doevents() moves the motor to the restored tilt
+	ret = KND_MUTEX_LOCK(&info->param_mutex, "param_mutex");
+	if(ret) {
+		ERROR_OUT("Error locking vidproc param mutex: %s\n", strerror(ret));
+	}
+	info->source_data = source_data;
+	if(!info->motor_missing) {
+		info->tilt = info->reopen_tilt;
+	}
+	ret = KND_MUTEX_UNLOCK(&info->param_mutex);
+	if(ret) {
+		ERROR_OUT("Error unlocking vidproc param mutex: %s\n", strerror(ret));
+	}
+
+	if(!info->motor_missing) {
+		if(info->source->set_led != NULL) {
+			info->source->set_led(info->source_data, info->led);
+		}
+		info->last_led = info->led;
+	}
+
+	// The reopened device isn't streaming video, so the next call to
+	// vidproc_doevents() starts it again if it is still requested
+	if((ret = KND_MUTEX_LOCK(&info->video_in_use, "video_in_use"))) {
+		ERROR_OUT("Error locking video mutex: %s\n", strerror(ret));
+	}
+	info->video_started = 0;
+	if((ret = KND_MUTEX_UNLOCK(&info->video_in_use))) {
 		ERROR_OUT("Error unlocking video mutex: %s\n", strerror(ret));
 	}
 
 	return 0;
 }
 
+/*
+ * Returns nonzero if the frame source can be reopened by vidproc_reopen().
+ */
+int vidproc_can_reopen(struct vidproc_info *info)
+{
+	return info->source->reconnect;
+}
+
 /*
  * Locks the depth buffer and calls the given callback once with a pointer to
  * the depth buffer.  Also schedules an update of the camera's LED to indicate
@@ -751,7 +959,7 @@ int get_depth(struct vidproc_info *info, vidproc_func cb, void *cb_data)
 		return -1;
 	}
 
-	if((ret = pthread_mutex_lock(&info->depth_in_use))) {
+	if((ret = KND_MUTEX_LOCK(&info->depth_in_use, "depth_in_use"))) {
 		ERROR_OUT("Error locking buffer mutex: %s\n", strerror(ret));
 		return -1;
 	}
@@ -760,7 +968,7 @@ int get_depth(struct vidproc_info *info, vidproc_func cb, void *cb_data)
 
 	cb(info->depth_buffer, cb_data);
 
-	if((ret = pthread_mutex_unlock(&info->depth_in_use))) {
+	if((ret = KND_MUTEX_UNLOCK(&info->depth_in_use))) {
 		ERROR_OUT("Error unlocking buffer mutex: %s\n", strerror(ret));
 		// Return 0 since the callback was called
 	}
@@ -784,16 +992,19 @@ int request_video(struct vidproc_info *info)
 		return -1;
 	}
 
-	if((pth_ret = pthread_mutex_lock(&info->video_in_use))) {
+	if((pth_ret = KND_MUTEX_LOCK(&info->video_in_use, "video_in_use"))) {
 		ERROR_OUT("Error locking video mutex: %s\n", strerror(pth_ret));
 		return -1;
 	}
 
+	if(!info->video_requested && !info->video_started) {
+		info->video_request_time = latency_now();
+	}
 	info->video_requested = 1;
 
 	// TODO: Have watchdog check for excessive delay after video requested
 
-	if((pth_ret = pthread_mutex_unlock(&info->video_in_use))) {
+	if((pth_ret = KND_MUTEX_UNLOCK(&info->video_in_use))) {
 		ERROR_OUT("Error unlocking video mutex: %s\n", strerror(pth_ret));
 		// No change to return value
 	}
@@ -814,7 +1025,7 @@ int get_video(struct vidproc_info *info, vidproc_func cb, void *cb_data)
 		return -1;
 	}
 
-	if((ret = pthread_mutex_lock(&info->video_in_use))) {
+	if((ret = KND_MUTEX_LOCK(&info->video_in_use, "video_in_use"))) {
 		ERROR_OUT("Error locking video mutex: %s\n", strerror(ret));
 		return -1;
 	}
@@ -823,7 +1034,7 @@ int get_video(struct vidproc_info *info, vidproc_func cb, void *cb_data)
 
 	cb(info->video_buffer, cb_data);
 
-	if((ret = pthread_mutex_unlock(&info->video_in_use))) {
+	if((ret = KND_MUTEX_UNLOCK(&info->video_in_use))) {
 		ERROR_OUT("Error unlocking video mutex: %s\n", strerror(ret));
 		// Return 0 since the callback was called
 	}
@@ -861,20 +1072,55 @@ int reverse_lut(int zw)
 	return idx;
 }
 
+/*
+ * Packs count 11-bit depth values from in into the Kinect's 11-bit packed
+ * format (big-endian bit order, as read by pxval_11()).  The count must be a
+ * multiple of 8 (8 pixels occupy 11 bytes).
+ */
+void pack_11(const uint16_t *in, uint8_t *out, int count)
+{
+	uint64_t hi;
+	uint32_t lo;
+	int i;
+
+	for(i = 0; i < count; i += 8, in += 8, out += 11) {
+		hi = ((uint64_t)(in[0] & 0x7ff) << 53) |
+			((uint64_t)(in[1] & 0x7ff) << 42) |
+			((uint64_t)(in[2] & 0x7ff) << 31) |
+			((uint64_t)(in[3] & 0x7ff) << 20) |
+			((uint64_t)(in[4] & 0x7ff) << 9) |
+			((in[5] & 0x7ff) >> 2);
+		lo = ((uint32_t)(in[5] & 0x3) << 22) | ((uint32_t)(in[6] & 0x7ff) << 11) | (in[7] & 0x7ff);
+
+		out[0] = hi >> 56;
+		out[1] = hi >> 48;
+		out[2] = hi >> 40;
+		out[3] = hi >> 32;
+		out[4] = hi >> 24;
+		out[5] = hi >> 16;
+		out[6] = hi >> 8;
+		out[7] = hi;
+		out[8] = lo >> 16;
+		out[9] = lo >> 8;
+		out[10] = lo;
+	}
+}
+
 /*
  * Returns the currently-requested motor tilt in degrees from horizontal.  The
- * motor's actual current position may be different.
+ * motor's actual current position may be different.  While vidproc_reopen() is
+ * reopening the source, returns the tilt that will be restored.
  */
 int get_tilt(struct vidproc_info *info)
 {
 	int ret, val;
 
-	ret = pthread_mutex_lock(&info->param_mutex);
+	ret = KND_MUTEX_LOCK(&info->param_mutex, "param_mutex");
 	if(ret) {
 		ERROR_OUT("Error locking vidproc param mutex: %s\n", strerror(ret));
 	}
-	val = info->tilt;
-	ret = pthread_mutex_unlock(&info->param_mutex);
+	val = info->source_data == NULL ? info->reopen_tilt : info->tilt;
+	ret = KND_MUTEX_UNLOCK(&info->param_mutex);
 	if(ret) {
 		ERROR_OUT("Error unlocking vidproc param mutex: %s\n", strerror(ret));
 	}
@@ -884,24 +1130,26 @@ int get_tilt(struct vidproc_info *info)
 
 /*
  * Requests that the motor tilt the camera to the specified number of degrees
- * from horizontal.  Takes no action if the motor device was not opened.
+ * from horizontal.  Takes no action if the motor device was not opened.  While
+ * vidproc_reopen() is reopening the source, the tilt is saved and applied once
+ * the source is open again.
  */
 void set_tilt(struct vidproc_info *info, int tilt)
 {
 	int ret;
 
-	if(info->motor_missing) {
-		return;
-	}
-
 	tilt = CLAMP(-15, 15, tilt);
 
-	ret = pthread_mutex_lock(&info->param_mutex);
+	ret = KND_MUTEX_LOCK(&info->param_mutex, "param_mutex");
 	if(ret) {
 		ERROR_OUT("Error locking vidproc param mutex: %s\n", strerror(ret));
 	}
-	info->tilt = tilt;
-	ret = pthread_mutex_unlock(&info->param_mutex);
+	if(info->source_data == NULL) {
+		info->reopen_tilt = tilt;
+	} else if(!info->motor_missing) {
+		info->tilt = tilt;
+	}
+	ret = KND_MUTEX_UNLOCK(&info->param_mutex);
 	if(ret) {
 		ERROR_OUT("Error unlocking vidproc param mutex: %s\n", strerror(ret));
 	}
@@ -1,11 +1,42 @@
 /*
  * watchdog.c - Depth camera daemon watchdog implementation.
  * Copyright (C)2012 Mike Bourgeous.  Released under AGPLv3 in 2018.
+ *
+ * Besides the depth frame timeout, the watchdog thread watches event loops
+ * that call loop_heartbeat() from a periodic timer.  A heartbeat that arrives
+ * late means the loop was busy or blocked for that long, so the lateness of
+ * each heartbeat is kept in a histogram, and a loop whose heartbeat is
+ * overdue by more than its stall threshold is logged along with what the loop
+ * said it was doing (see set_loop_activity()).
+ *
+ * kick_watchdog() also records the interval between kicks (one per depth
+ * frame) using only atomic operations.  Each watchdog tick turns the kicks
+ * since the previous tick into a rolling average interval and jitter, and
+ * warns when the average passes the soft limit, well before the timeout.
  */
 #include <stdlib.h>
+#include <math.h>
 
 #include "knd.h"
 
+/*
+ * Event loop heartbeat monitor
+ */
+struct knd_loop_monitor {
+	struct knd_loop_monitor *next;
+
+	char name[32];
+	uint64_t interval; // Expected time between heartbeats in nanoseconds
+	uint64_t threshold; // Lateness in nanoseconds that counts as a stall
+
+	uint64_t last_beat; // latency_now() at the last heartbeat, 0 if stopped (accessed atomically)
+	const char *activity; // What the loop is doing, or NULL (accessed atomically)
+	uint64_t stalls; // Heartbeats later than threshold (accessed atomically)
+	struct latency_histogram lateness; // Heartbeat lateness in microseconds
+
+	unsigned int reported; // Set by the watchdog thread when a stall is logged (accessed atomically)
+};
+
 /*
  * Watchdog thread information
  */
@@ -16,7 +47,7 @@ struct knd_watchdog {
 	struct timespec timeout;	// Timeout interval
 
 	// Internal data
-	struct timespec last_time;
+	uint64_t last_kick;		// latency_now() at the last kick (accessed atomically)
 	struct nl_thread *thread;
 	volatile unsigned int run:1;	// Set to 1 to start loop, set to 0 to end loop
 	volatile unsigned int stop:1;	// Set to 1 to abort before run gets set to 1
@@ -28,6 +59,23 @@ struct knd_watchdog {
 	// Called on initial timeout, and every .interval afterward as long as
 	// kick_watchdog() is not called for this watchdog.
 	watchdog_func callback;
+
+	struct knd_loop_monitor *monitors; // Protected by lock
+
+	// Kick intervals in microseconds (accessed atomically)
+	unsigned int kicked;		// Set by the first kick, which ends startup rather than an interval
+	struct latency_histogram intervals;
+	uint64_t kick_count;
+	uint64_t kick_sum;
+	uint64_t kick_sumsq;
+	uint64_t average;		// Rolling average interval
+	uint64_t jitter;		// Rolling standard deviation of the interval
+
+	uint64_t soft_limit;		// Average interval in microseconds to warn about, 0 for none (protected by lock)
+
+	// Only used by the watchdog thread
+	uint64_t last_count, last_sum, last_sumsq; // Kick totals at the previous tick
+	unsigned int degraded:1;	// The soft limit warning has been logged
 };
 
 /*
@@ -106,6 +154,99 @@ static void set_run(struct knd_watchdog *wd, int run)
 	}
 }
 
+/*
+ * Logs each monitored event loop whose heartbeat is overdue by more than its
+ * stall threshold, once per stall.
+ */
+static void check_loops(struct knd_watchdog *wd)
+{
+	struct knd_loop_monitor *mon;
+	uint64_t now = latency_now();
+	uint64_t last, late;
+	const char *activity;
+	int ret;
+
+	ret = pthread_mutex_lock(&wd->lock);
+	if(ret) {
+		ERROR_OUT("Error locking watchdog mutex: %s\n", strerror(ret));
+		return;
+	}
+
+	for(mon = wd->monitors; mon != NULL; mon = mon->next) {
+		last = __atomic_load_n(&mon->last_beat, __ATOMIC_ACQUIRE);
+		if(last == 0 || now < last + mon->interval) {
+			continue;
+		}
+
+		late = now - last - mon->interval;
+		if(late > mon->threshold && !__atomic_exchange_n(&mon->reported, 1, __ATOMIC_RELAXED)) {
+			activity = __atomic_load_n(&mon->activity, __ATOMIC_RELAXED);
+			ERROR_OUT("Event loop '%s' has been stalled for at least %llums (%s%s).\n",
+					mon->name, (unsigned long long)(late / 1000000),
+					activity ? "in " : "idle or between events",
+					activity ? activity : "");
+		}
+	}
+
+	ret = pthread_mutex_unlock(&wd->lock);
+	if(ret) {
+		ERROR_OUT("Error unlocking watchdog mutex: %s\n", strerror(ret));
+	}
+}
+
+/*
+ * Updates the rolling average and jitter of the kick interval from the kicks
+ * since the previous call, and warns when the average crosses the soft limit.
+ * The gap is the time since the last kick in nanoseconds.
+ */
+static void check_intervals(struct knd_watchdog *wd, uint64_t gap, uint64_t soft_limit)
+{
+	uint64_t count, sum, sumsq, mean, average, jitter;
+	struct latency_stats stats;
+	double variance;
+
+	count = __atomic_load_n(&wd->kick_count, __ATOMIC_RELAXED);
+	sum = __atomic_load_n(&wd->kick_sum, __ATOMIC_RELAXED);
+	sumsq = __atomic_load_n(&wd->kick_sumsq, __ATOMIC_RELAXED);
+
+	average = __atomic_load_n(&wd->average, __ATOMIC_RELAXED);
+	jitter = __atomic_load_n(&wd->jitter, __ATOMIC_RELAXED);
+
+	if(count != wd->last_count) {
+		mean = (sum - wd->last_sum) / (count - wd->last_count);
+		variance = (double)(sumsq - wd->last_sumsq) / (count - wd->last_count) - (double)mean * mean;
+		jitter = average ? (jitter * 3 + (uint64_t)sqrt(MAX_NUM(variance, 0))) / 4 : (uint64_t)sqrt(MAX_NUM(variance, 0));
+		average = average ? (average * 3 + mean) / 4 : mean;
+	} else if(__atomic_load_n(&wd->kicked, __ATOMIC_RELAXED) && gap / 1000 > average) {
+		// No kicks this tick; the interval in progress is already longer
+		average = (average * 3 + gap / 1000) / 4;
+	} else {
+		return;
+	}
+
+	wd->last_count = count;
+	wd->last_sum = sum;
+	wd->last_sumsq = sumsq;
+	__atomic_store_n(&wd->average, average, __ATOMIC_RELAXED);
+	__atomic_store_n(&wd->jitter, jitter, __ATOMIC_RELAXED);
+
+	if(soft_limit == 0) {
+		return;
+	}
+
+	if(!wd->degraded && average > soft_limit) {
+		get_histogram_stats(&wd->intervals, &stats);
+		ERROR_OUT("Frame interval degraded: average %llums (jitter %llums, longest %llums) exceeds %llums.\n",
+				(unsigned long long)average / 1000, (unsigned long long)jitter / 1000,
+				(unsigned long long)stats.max / 1000, (unsigned long long)soft_limit / 1000);
+		wd->degraded = 1;
+	} else if(wd->degraded && average < soft_limit * 3 / 4) {
+		nl_ptmf("Frame interval recovered: average %llums (jitter %llums).\n",
+				(unsigned long long)average / 1000, (unsigned long long)jitter / 1000);
+		wd->degraded = 0;
+	}
+}
+
 /*
  * Watchdog timer monitoring thread.
  */
@@ -113,6 +254,7 @@ static void *watchdog_thread(void *d)
 {
 	struct knd_watchdog *wd = d;
 	struct timespec ts, to, next;
+	uint64_t now, last, gap, soft_limit;
 	int ret;
 
 	nl_set_threadname("watchdog_thread");
@@ -128,8 +270,6 @@ static void *watchdog_thread(void *d)
 
 	clock_gettime(CLOCK_MONOTONIC, &next);
 	while(get_run(wd)) {
-		clock_gettime(CLOCK_MONOTONIC, &ts);
-
 		next.tv_sec += wd->interval.tv_sec;
 		next.tv_nsec += wd->interval.tv_nsec;
 		if(next.tv_nsec >= 1000000000) {
@@ -141,24 +281,28 @@ static void *watchdog_thread(void *d)
 		if(ret) {
 			ERROR_OUT("Error locking watchdog mutex: %s\n", strerror(ret));
 		}
-		ts.tv_sec -= wd->last_time.tv_sec;
-		ts.tv_nsec -= wd->last_time.tv_nsec;
 		to = wd->timeout;
+		soft_limit = wd->soft_limit;
 		ret = pthread_mutex_unlock(&wd->lock);
 		if(ret) {
 			ERROR_OUT("Error unlocking watchdog mutex: %s\n", strerror(ret));
 		}
 
-		if(ts.tv_nsec < 0) {
-			ts.tv_sec--;
-			ts.tv_nsec += 1000000000;
-		}
+		now = latency_now();
+		last = __atomic_load_n(&wd->last_kick, __ATOMIC_RELAXED);
+		gap = now > last ? now - last : 0;
+		ts.tv_sec = gap / 1000000000;
+		ts.tv_nsec = gap % 1000000000;
+
+		check_intervals(wd, gap, soft_limit);
 
 		if(ts.tv_sec > to.tv_sec ||
 				(ts.tv_sec == to.tv_sec && ts.tv_nsec > to.tv_nsec)) {
 			wd->callback(wd->data, &ts);
 		}
 
+		check_loops(wd);
+
 		// Ignore EINTR (probably indicates it's time to exit)
 		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
 	}
@@ -211,7 +355,7 @@ struct knd_watchdog *create_watchdog(struct knd_info *knd, struct timespec *inte
 	wd->timeout = *timeout;
 	wd->data = data;
 	wd->callback = callback;
-	clock_gettime(CLOCK_MONOTONIC, &wd->last_time);
+	wd->last_kick = latency_now();
 
 	ret = pthread_mutex_init(&wd->lock, &mutex_attr);
 	if(ret) {
@@ -263,14 +407,42 @@ void destroy_watchdog(struct knd_watchdog *wd)
 		ERROR_OUT("Error destroying watchdog mutex: %s\n", strerror(ret));
 	}
 
+	while(wd->monitors != NULL) {
+		struct knd_loop_monitor *mon = wd->monitors;
+		wd->monitors = mon->next;
+		free(mon);
+	}
+
 	free(wd);
 }
 
 /*
- * Resets the given watchdog's timeout countdown.  Doesn't check for a NULL
+ * Resets the given watchdog's timeout countdown, and records the time since
+ * the previous kick.  Never locks or allocates.  Doesn't check for a NULL
  * watchdog.
  */
 void kick_watchdog(struct knd_watchdog *wd)
+{
+	uint64_t now = latency_now();
+	uint64_t last, interval;
+
+	last = __atomic_exchange_n(&wd->last_kick, now, __ATOMIC_RELAXED);
+	if(!__atomic_exchange_n(&wd->kicked, 1, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	interval = now > last ? (now - last) / 1000 : 0;
+	record_histogram(&wd->intervals, interval);
+	__atomic_fetch_add(&wd->kick_sumsq, interval * interval, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&wd->kick_sum, interval, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&wd->kick_count, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sets the given watchdog's timeout in a thread-safe way.  Does not kick the
+ * watchdog.
+ */
+void set_watchdog_timeout(struct knd_watchdog *wd, struct timespec *timeout)
 {
 	int ret;
 
@@ -278,7 +450,7 @@ void kick_watchdog(struct knd_watchdog *wd)
 	if(ret) {
 		ERROR_OUT("Error locking watchdog mutex: %s\n", strerror(ret));
 	}
-	clock_gettime(CLOCK_MONOTONIC, &wd->last_time);
+	wd->timeout = *timeout;
 	ret = pthread_mutex_unlock(&wd->lock);
 	if(ret) {
 		ERROR_OUT("Error unlocking watchdog mutex: %s\n", strerror(ret));
@@ -286,10 +458,11 @@ void kick_watchdog(struct knd_watchdog *wd)
 }
 
 /*
- * Sets the given watchdog's timeout in a thread-safe way.  Does not kick the
- * watchdog.
+ * Sets the rolling average interval between kicks above which the watchdog
+ * logs a warning (and below 3/4 of which it logs a recovery).  A zero limit
+ * disables the warning.
  */
-void set_watchdog_timeout(struct knd_watchdog *wd, struct timespec *timeout)
+void set_watchdog_soft_limit(struct knd_watchdog *wd, struct timespec *limit)
 {
 	int ret;
 
@@ -297,10 +470,130 @@ void set_watchdog_timeout(struct knd_watchdog *wd, struct timespec *timeout)
 	if(ret) {
 		ERROR_OUT("Error locking watchdog mutex: %s\n", strerror(ret));
 	}
-	wd->timeout = *timeout;
+	wd->soft_limit = (uint64_t)limit->tv_sec * 1000000 + limit->tv_nsec / 1000;
+	ret = pthread_mutex_unlock(&wd->lock);
+	if(ret) {
+		ERROR_OUT("Error unlocking watchdog mutex: %s\n", strerror(ret));
+	}
+}
+
+/*
+ * Fills *intervals with statistics of the intervals between kicks, in
+ * microseconds, and stores the rolling average interval and jitter (standard
+ * deviation) in *average and *jitter.
+ */
+void get_watchdog_intervals(struct knd_watchdog *wd, struct latency_stats *intervals,
+		uint64_t *average, uint64_t *jitter)
+{
+	get_histogram_stats(&wd->intervals, intervals);
+	*average = __atomic_load_n(&wd->average, __ATOMIC_RELAXED);
+	*jitter = __atomic_load_n(&wd->jitter, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Adds a monitor for an event loop that will call loop_heartbeat() every
+ * interval_ms.  The watchdog logs the loop as stalled when a heartbeat is
+ * more than threshold_ms late.  The monitor belongs to the watchdog and is
+ * freed by destroy_watchdog().  Stalls are not detected until the first
+ * heartbeat.  Returns NULL on error.
+ */
+struct knd_loop_monitor *add_loop_monitor(struct knd_watchdog *wd, const char *name,
+		unsigned int interval_ms, unsigned int threshold_ms)
+{
+	struct knd_loop_monitor *mon;
+	int ret;
+
+	mon = calloc(1, sizeof(struct knd_loop_monitor));
+	if(mon == NULL) {
+		ERRNO_OUT("Error allocating memory for event loop monitor");
+		return NULL;
+	}
+
+	snprintf(mon->name, sizeof(mon->name), "%s", name);
+	mon->interval = (uint64_t)interval_ms * 1000000;
+	mon->threshold = (uint64_t)threshold_ms * 1000000;
+
+	ret = pthread_mutex_lock(&wd->lock);
+	if(ret) {
+		ERROR_OUT("Error locking watchdog mutex: %s\n", strerror(ret));
+		free(mon);
+		return NULL;
+	}
+	mon->next = wd->monitors;
+	wd->monitors = mon;
 	ret = pthread_mutex_unlock(&wd->lock);
 	if(ret) {
 		ERROR_OUT("Error unlocking watchdog mutex: %s\n", strerror(ret));
 	}
+
+	return mon;
 }
 
+/*
+ * Records a heartbeat from the monitored event loop, and how late it was.
+ * Call from the loop's thread every interval given to add_loop_monitor().
+ * Never allocates or locks.
+ */
+void loop_heartbeat(struct knd_loop_monitor *mon)
+{
+	uint64_t now = latency_now();
+	uint64_t last, late;
+
+	last = __atomic_exchange_n(&mon->last_beat, now, __ATOMIC_RELEASE);
+	if(last == 0) {
+		return;
+	}
+
+	late = now > last + mon->interval ? now - last - mon->interval : 0;
+	record_histogram(&mon->lateness, late / 1000);
+
+	if(late > mon->threshold) {
+		__atomic_fetch_add(&mon->stalls, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&mon->reported, 0, __ATOMIC_RELAXED);
+		ERROR_OUT("Event loop '%s' resumed after stalling for %llums.\n",
+				mon->name, (unsigned long long)(late / 1000000));
+	}
+}
+
+/*
+ * Tells the watchdog that the monitored event loop has stopped on purpose, so
+ * missing heartbeats are not stalls.  The next heartbeat starts monitoring
+ * again.
+ */
+void stop_loop_monitor(struct knd_loop_monitor *mon)
+{
+	__atomic_store_n(&mon->last_beat, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Sets what the monitored event loop is doing, to be logged if it stalls.
+ * The activity must be a string constant, or NULL when the loop returns to
+ * waiting for events.  Ignores a NULL mon.
+ */
+void set_loop_activity(struct knd_loop_monitor *mon, const char *activity)
+{
+	if(mon != NULL) {
+		__atomic_store_n(&mon->activity, activity, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Fills *lateness with statistics of how late the monitored loop's heartbeats
+ * were, in microseconds.  Returns the number of stalls.
+ */
+uint64_t get_loop_stats(struct knd_loop_monitor *mon, struct latency_stats *lateness)
+{
+	get_histogram_stats(&mon->lateness, lateness);
+	return __atomic_load_n(&mon->stalls, __ATOMIC_RELAXED);
+}
+
+/*
+ * Clears the heartbeat lateness histogram and stall count of the given
+ * monitor.
+ */
+void reset_loop_stats(struct knd_loop_monitor *mon)
+{
+	reset_histogram(&mon->lateness);
+	__atomic_store_n(&mon->stalls, 0, __ATOMIC_RELAXED);
+}
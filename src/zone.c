@@ -73,6 +73,8 @@ static void update_zone_map(struct zonelist *zones)
 	int x, y, px;
 	int i;
 
+	trace_begin("zone_map");
+
 	// It would be faster to update only the sections of the map affected
 	// by the zone that changed.
 
@@ -100,6 +102,8 @@ static void update_zone_map(struct zonelist *zones)
 	}
 
 	zones->zone_map_dirty = 0;
+
+	trace_end("zone_map");
 }
 
 /*
@@ -112,7 +116,7 @@ void update_zonelist_depth(struct zonelist *zones, uint8_t *depthbuf)
 	int i, ret;
 	int skip;
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return;
 	}
@@ -237,7 +241,7 @@ void update_zonelist_depth(struct zonelist *zones, uint8_t *depthbuf)
 		}
 	}
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 	}
 }
@@ -250,7 +254,7 @@ void update_zonelist_video(struct zonelist *zones, uint8_t *videobuf)
 	int x, y, px, b;
 	int i, ret;
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return;
 	}
@@ -282,7 +286,7 @@ void update_zonelist_video(struct zonelist *zones, uint8_t *videobuf)
 		}
 	}
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 	}
 }
@@ -357,13 +361,13 @@ void clear_zonelist(struct zonelist *zones)
 		return;
 	}
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 	}
 
 	clear_zonelist_nolock(zones);
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 	}
 }
@@ -379,13 +383,13 @@ void destroy_zonelist(struct zonelist *zones)
 		return;
 	}
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 	}
 
 	clear_zonelist_nolock(zones);
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 	}
 
@@ -405,7 +409,7 @@ void iterate_zonelist(struct zonelist *zones, zone_callback cb, void *cb_data)
 {
 	int i, ret;
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return;
 	}
@@ -414,7 +418,7 @@ void iterate_zonelist(struct zonelist *zones, zone_callback cb, void *cb_data)
 		cb(cb_data, zones->zones[i]);
 	}
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 		return;
 	}
@@ -428,7 +432,7 @@ void touch_zonelist(struct zonelist *zones)
 {
 	int i, ret;
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return;
 	}
@@ -439,7 +443,7 @@ void touch_zonelist(struct zonelist *zones)
 		zones->zones[i]->lastoccupied = zones->zones[i]->occupied;
 	}
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 		return;
 	}
@@ -452,11 +456,11 @@ int zone_count(struct zonelist *zones)
 {
 	int count, ret;
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 	}
 	count = zones->count;
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 	}
 
@@ -476,14 +480,14 @@ int occupied_count(struct zonelist *zones)
 		return -1;
 	}
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
 
 	occ = zones->occupied;
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
@@ -492,33 +496,33 @@ int occupied_count(struct zonelist *zones)
 }
 
 /*
- * Returns the name of the zone with the highest occupation.  The returned name
- * must be free()d.  If index, pop, and/or maxpop are not NULL, then the zone's
- * index, population, and screen area will be stored in *index, *pop, and
- * *maxpop.  Returns NULL and stores -1 if no zone is occupied.
+ * Returns the index of the zone with the highest occupation, and copies its
+ * name into name, which must hold ZONE_NAME_LENGTH bytes.  If pop and/or
+ * maxpop are not NULL, then the zone's population and screen area will be
+ * stored in *pop and *maxpop.  Returns -1 (and stores an empty name and -1)
+ * if no zone is occupied.
  */
-char *peak_zone(struct zonelist *zones, int *index, int *pop, int *maxpop)
+int peak_zone(struct zonelist *zones, char *name, int *pop, int *maxpop)
 {
-	char *name = NULL;
 	int idx = -1, p = -1, mp = -1;
 	int ret;
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	name[0] = 0;
+
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 	}
 	if(zones->max_zone >= 0) {
-		name = strdup(zones->zones[zones->max_zone]->name);
+		// Zone names are always shorter than ZONE_NAME_LENGTH
+		strcpy(name, zones->zones[zones->max_zone]->name);
 		idx = zones->max_zone;
 		p = zones->zones[idx]->pop;
 		mp = zones->zones[idx]->maxpop;
 	}
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 	}
 
-	if(index) {
-		*index = idx;
-	}
 	if(pop) {
 		*pop = p;
 	}
@@ -526,7 +530,7 @@ char *peak_zone(struct zonelist *zones, int *index, int *pop, int *maxpop)
 		*maxpop = mp;
 	}
 
-	return name;
+	return idx;
 }
 
 /*
@@ -563,7 +567,7 @@ struct zone *add_zone(struct zonelist *zones, char *name, float xmin, float ymin
 		return NULL;
 	}
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return NULL;
 	}
@@ -571,7 +575,7 @@ struct zone *add_zone(struct zonelist *zones, char *name, float xmin, float ymin
 	for(i = 0; i < zones->count; i++) {
 		if(!strcasecmp(name, zones->zones[i]->name)) {
 			ERROR_OUT("Zone \"%s\" already exists.\n", name);
-			pthread_mutex_unlock(&zones->lock);
+			KND_MUTEX_UNLOCK(&zones->lock);
 			return NULL;
 		}
 	}
@@ -579,7 +583,7 @@ struct zone *add_zone(struct zonelist *zones, char *name, float xmin, float ymin
 	z = calloc(1, sizeof(struct zone));
 	if(z == NULL) {
 		ERRNO_OUT("Error allocating memory for zone");
-		pthread_mutex_unlock(&zones->lock);
+		KND_MUTEX_UNLOCK(&zones->lock);
 		return NULL;
 	}
 
@@ -587,7 +591,7 @@ struct zone *add_zone(struct zonelist *zones, char *name, float xmin, float ymin
 	// this function.
 	snprintf(z->name, sizeof(z->name), "%s", name);
 	if(set_zone_nolock(zones, z, xmin, ymin, zmin, xmax, ymax, zmax)) {
-		pthread_mutex_unlock(&zones->lock);
+		KND_MUTEX_UNLOCK(&zones->lock);
 		free(z);
 		return NULL;
 	}
@@ -601,7 +605,7 @@ struct zone *add_zone(struct zonelist *zones, char *name, float xmin, float ymin
 	tmp = realloc(zones->zones, sizeof(struct zone *) * (zones->count + 1));
 	if(tmp == NULL) {
 		ERRNO_OUT("Error growing zone list");
-		pthread_mutex_unlock(&zones->lock);
+		KND_MUTEX_UNLOCK(&zones->lock);
 		free(z);
 		return NULL;
 	}
@@ -610,7 +614,7 @@ struct zone *add_zone(struct zonelist *zones, char *name, float xmin, float ymin
 	zones->zones[zones->count] = z;
 	zones->count++;
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 		free(z);
 		return NULL;
@@ -651,18 +655,10 @@ static void recalc_screen_from_world(struct zone *zone)
 	zone->px_zmax = reverse_lut(zone->zmax);
 }
 
-/*
- * Sets all base parameters on the given zone to the given values.  Does not
- * lock the zone list.  Only call this function if the zone list is already
- * locked.  Does increment the zone list version.  Returns 0 on success, -1 on
- * error.
- */
-int set_zone_nolock(struct zonelist *zones, struct zone *zone, float xmin, float ymin, float zmin, float xmax, float ymax, float zmax)
+// Sets the given zone's bounding box without locking the zone list or
+// incrementing its version.  Returns 0 on success, -1 on error.
+static int set_zone_bounds(struct zone *zone, float xmin, float ymin, float zmin, float xmax, float ymax, float zmax)
 {
-	if(CHECK_NULL(zones) || CHECK_NULL(zone)) {
-		return -1;
-	}
-
 	if(xmin >= xmax || ymin >= ymax || zmin >= zmax) {
 		ERROR_OUT("Minimum must be < maximum.\n");
 		return -1;
@@ -694,6 +690,25 @@ int set_zone_nolock(struct zonelist *zones, struct zone *zone, float xmin, float
 	zone->pop = 0;
 	zone->occupied = 0;
 
+	return 0;
+}
+
+/*
+ * Sets all base parameters on the given zone to the given values.  Does not
+ * lock the zone list.  Only call this function if the zone list is already
+ * locked.  Does increment the zone list version.  Returns 0 on success, -1 on
+ * error.
+ */
+int set_zone_nolock(struct zonelist *zones, struct zone *zone, float xmin, float ymin, float zmin, float xmax, float ymax, float zmax)
+{
+	if(CHECK_NULL(zones) || CHECK_NULL(zone)) {
+		return -1;
+	}
+
+	if(set_zone_bounds(zone, xmin, ymin, zmin, xmax, ymax, zmax)) {
+		return -1;
+	}
+
 	bump_zonelist_nolock(zones);
 
 	return 0;
@@ -711,14 +726,14 @@ int set_zone(struct zonelist *zones, struct zone *zone, float xmin, float ymin,
 		return -1;
 	}
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
 
 	result = set_zone_nolock(zones, zone, xmin, ymin, zmin, xmax, ymax, zmax);
 
-	if(zones != NULL && (ret = pthread_mutex_unlock(&zones->lock))) {
+	if(zones != NULL && (ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
@@ -726,6 +741,128 @@ int set_zone(struct zonelist *zones, struct zone *zone, float xmin, float ymin,
 	return result;
 }
 
+/*
+ * Adds count zones with the given parameters to the given zone list, locking
+ * the list and incrementing its version only once.  Names must not already be
+ * in the zone list or repeat within params.  If depth_map is not NULL and the
+ * zone list was empty, depth_map (640*480*2 entries, see struct zonelist) is
+ * used as the zone list's depth map instead of rebuilding it; it must have
+ * been built from the same zones (see get_zone_map()).  Invalid zones are
+ * skipped.  Returns the number of zones added, or -1 on error.
+ */
+int add_zones(struct zonelist *zones, const struct zone_params *params, int count, const uint16_t *depth_map)
+{
+	struct zone **tmp;
+	struct zone *z;
+	int was_empty;
+	int added = 0;
+	int i, ret;
+
+	if(CHECK_NULL(zones) || CHECK_NULL(params)) {
+		return -1;
+	}
+
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
+		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
+		return -1;
+	}
+
+	tmp = realloc(zones->zones, sizeof(struct zone *) * (zones->count + count));
+	if(tmp == NULL && zones->count + count != 0) {
+		ERRNO_OUT("Error growing zone list");
+		KND_MUTEX_UNLOCK(&zones->lock);
+		return -1;
+	}
+	zones->zones = tmp;
+	was_empty = zones->count == 0;
+
+	for(i = 0; i < count; i++) {
+		const struct zone_params *p = &params[i];
+
+		if(p->name[0] == 0 || memchr(p->name, 0, sizeof(p->name)) == NULL ||
+				strpbrk(p->name, "\r\n\t")) {
+			ERROR_OUT("Skipping zone %d with an invalid name.\n", i + 1);
+			continue;
+		}
+		if(p->param < ZONE_POP || p->param > ZONE_ZC) {
+			ERROR_OUT("Skipping zone \"%s\" with invalid parameter %d.\n", p->name, p->param);
+			continue;
+		}
+
+		z = calloc(1, sizeof(struct zone));
+		if(z == NULL) {
+			ERRNO_OUT("Error allocating memory for zone");
+			break;
+		}
+
+		snprintf(z->name, sizeof(z->name), "%s", p->name);
+		if(set_zone_bounds(z, p->xmin, p->ymin, p->zmin, p->xmax, p->ymax, p->zmax)) {
+			ERROR_OUT("Skipping zone \"%s\" with invalid dimensions.\n", p->name);
+			free(z);
+			continue;
+		}
+
+		z->occupied_param = p->param;
+		z->rising_threshold = p->rising_threshold;
+		z->falling_threshold = p->falling_threshold;
+		z->rising_delay = p->rising_delay;
+		z->falling_delay = p->falling_delay;
+
+		zones->zones[zones->count++] = z;
+		added++;
+	}
+
+	if(added != 0) {
+		bump_zonelist_nolock(zones);
+
+		if(depth_map != NULL && was_empty && added == count) {
+			memcpy(zones->depth_map, depth_map, sizeof(zones->depth_map));
+			zones->zone_map_dirty = 0;
+		}
+	}
+
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
+		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
+		return -1;
+	}
+
+	return added;
+}
+
+/*
+ * Copies the given zone list's depth map (640*480*2 entries, see struct
+ * zonelist) into depth_map, building it first if any zones changed since it
+ * was last built.  Returns the zone list version the map was built for, or
+ * (unsigned int)-1 on error.
+ */
+unsigned int get_zone_map(struct zonelist *zones, uint16_t *depth_map)
+{
+	unsigned int version;
+	int ret;
+
+	if(CHECK_NULL(zones) || CHECK_NULL(depth_map)) {
+		return -1;
+	}
+
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
+		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
+		return -1;
+	}
+
+	if(zones->zone_map_dirty) {
+		update_zone_map(zones);
+	}
+	memcpy(depth_map, zones->depth_map, sizeof(zones->depth_map));
+	version = zones->version;
+
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
+		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
+		return -1;
+	}
+
+	return version;
+}
+
 /*
  * Sets the named attribute of the given zone to the given value.  A zone's
  * name, pop, maxpop, xc, yc, zc, sa, and occupied attributes may not be
@@ -749,7 +886,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 		ival = atoi(value);
 	}
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
@@ -781,7 +918,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 	} else if(!strcmp(attr, "zmin")) {
 		if(ival <= 0) {
 			ERROR_OUT("Zmin must be > 0.0.\n");
-			pthread_mutex_unlock(&zones->lock);
+			KND_MUTEX_UNLOCK(&zones->lock);
 			return -1;
 		}
 
@@ -793,7 +930,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 	} else if(!strcmp(attr, "zmax")) {
 		if(ival <= 1) {
 			ERROR_OUT("Zmax must be > 0.001.\n");
-			pthread_mutex_unlock(&zones->lock);
+			KND_MUTEX_UNLOCK(&zones->lock);
 			return -1;
 		}
 
@@ -805,7 +942,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 	} else if(!strcmp(attr, "px_xmin")) {
 		if(ival < 0 || ival > FREENECT_FRAME_W - 2) {
 			ERROR_OUT("px_xmin must be between 0 and %d\n", FREENECT_FRAME_W - 2);
-			pthread_mutex_unlock(&zones->lock);
+			KND_MUTEX_UNLOCK(&zones->lock);
 			return -1;
 		}
 
@@ -817,7 +954,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 	} else if(!strcmp(attr, "px_xmax")) {
 		if(ival < 1 || ival > FREENECT_FRAME_W - 1) {
 			ERROR_OUT("px_xmax must be between 1 and %d\n", FREENECT_FRAME_W - 1);
-			pthread_mutex_unlock(&zones->lock);
+			KND_MUTEX_UNLOCK(&zones->lock);
 			return -1;
 		}
 
@@ -829,7 +966,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 	} else if(!strcmp(attr, "px_ymin")) {
 		if(ival < 0 || ival > FREENECT_FRAME_W - 2) {
 			ERROR_OUT("px_ymin must be between 0 and %d\n", FREENECT_FRAME_W - 2);
-			pthread_mutex_unlock(&zones->lock);
+			KND_MUTEX_UNLOCK(&zones->lock);
 			return -1;
 		}
 
@@ -841,7 +978,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 	} else if(!strcmp(attr, "px_ymax")) {
 		if(ival < 1 || ival > FREENECT_FRAME_W - 1) {
 			ERROR_OUT("px_ymax must be between 1 and %d inclusive.\n", FREENECT_FRAME_W - 1);
-			pthread_mutex_unlock(&zones->lock);
+			KND_MUTEX_UNLOCK(&zones->lock);
 			return -1;
 		}
 
@@ -853,7 +990,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 	} else if(!strcmp(attr, "px_zmin")) {
 		if(ival < 0 || ival > PXZMAX) {
 			ERROR_OUT("px_zmin must be between 0 and %d inclusive.\n", PXZMAX);
-			pthread_mutex_unlock(&zones->lock);
+			KND_MUTEX_UNLOCK(&zones->lock);
 			return -1;
 		}
 		zone->px_zmin = ival;
@@ -864,7 +1001,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 	} else if(!strcmp(attr, "px_zmax")) {
 		if(ival < 0 || ival > PXZMAX) {
 			ERROR_OUT("px_zmax must be between 0 and %d inclusive.\n", PXZMAX);
-			pthread_mutex_unlock(&zones->lock);
+			KND_MUTEX_UNLOCK(&zones->lock);
 			return -1;
 		}
 		zone->px_zmax = ival;
@@ -875,7 +1012,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 	} else if(!strcmp(attr, "negate")) {
 		if(ival != 0 && ival != 1) {
 			ERROR_OUT("negate must be 0 or 1.\n");
-			pthread_mutex_unlock(&zones->lock);
+			KND_MUTEX_UNLOCK(&zones->lock);
 			return -1;
 		}
 		zone->negate = ival;
@@ -897,7 +1034,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 			param = ZONE_ZC;
 		} else {
 			ERROR_OUT("Invalid zone control parameter: \"%s\"\n", value);
-			pthread_mutex_unlock(&zones->lock);
+			KND_MUTEX_UNLOCK(&zones->lock);
 			return -1;
 		}
 
@@ -926,7 +1063,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 		zone->falling_delay = MAX_NUM(0, ival);
 	} else {
 		ERROR_OUT("Unknown attribute: \"%s\"\n", attr);
-		pthread_mutex_unlock(&zones->lock);
+		KND_MUTEX_UNLOCK(&zones->lock);
 		return -1;
 	}
 
@@ -949,7 +1086,7 @@ int set_zone_attr(struct zonelist *zones, struct zone *zone, const char *attr, c
 
 	bump_zonelist_nolock(zones);
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
@@ -980,7 +1117,7 @@ int remove_zone(struct zonelist *zones, struct zone *zone)
 		return -1;
 	}
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
@@ -1010,7 +1147,7 @@ int remove_zone(struct zonelist *zones, struct zone *zone)
 
 	bump_zonelist_nolock(zones);
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
@@ -1025,7 +1162,9 @@ int remove_zone(struct zonelist *zones, struct zone *zone)
 
 /*
  * Finds the first zone with the given name.  Returns NULL if the zone wasn't
- * found or on error.
+ * found or on error.  The zone may be freed as soon as the zone list is
+ * unlocked, so only use the result while preventing zone removal (e.g. with
+ * the server's command lock held); otherwise use copy_zone().
  */
 struct zone *find_zone(struct zonelist *zones, const char *name)
 {
@@ -1036,7 +1175,7 @@ struct zone *find_zone(struct zonelist *zones, const char *name)
 		return NULL;
 	}
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return NULL;
 	}
@@ -1048,7 +1187,7 @@ struct zone *find_zone(struct zonelist *zones, const char *name)
 		}
 	}
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 		return NULL;
 	}
@@ -1056,6 +1195,41 @@ struct zone *find_zone(struct zonelist *zones, const char *name)
 	return z;
 }
 
+/*
+ * Copies the first zone with the given name into *copy while the zone list is
+ * locked, so the copy stays valid if the zone is changed or removed
+ * afterward.  The copy's shape pointers must not be used.  Returns 0 on
+ * success, -1 if the zone wasn't found or on error.
+ */
+int copy_zone(struct zonelist *zones, const char *name, struct zone *copy)
+{
+	int i, ret;
+	int found = 0;
+
+	if(CHECK_NULL(zones) || CHECK_NULL(name) || CHECK_NULL(copy)) {
+		return -1;
+	}
+
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
+		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
+		return -1;
+	}
+
+	for(i = 0; i < zones->count; i++) {
+		if(!strcmp(zones->zones[i]->name, name)) {
+			*copy = *zones->zones[i];
+			found = 1;
+			break;
+		}
+	}
+
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
+		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
+	}
+
+	return found ? 0 : -1;
+}
+
 /*
  * Returns the version number of the given zone list.  The version number is
  * incremented every time a zone is added, removed, or modified.  Returns
@@ -1070,14 +1244,14 @@ unsigned int get_zonelist_version(struct zonelist *zones)
 		return -1;
 	}
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
 
 	version = zones->version;
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
@@ -1087,8 +1261,8 @@ unsigned int get_zonelist_version(struct zonelist *zones)
 
 /*
  * Increments the version number of the given zone list without locking or
- * error checking.  The version number is reset to zero if it reaches (unsigned
- * int)-1.
+ * error checking, and calls the zone list's change notification function, if
+ * any.  The version number is reset to zero if it reaches (unsigned int)-1.
  */
 unsigned int bump_zonelist_nolock(struct zonelist *zones)
 {
@@ -1098,6 +1272,11 @@ unsigned int bump_zonelist_nolock(struct zonelist *zones)
 	if(zones->version == (unsigned int)-1) {
 		zones->version = 0;
 	}
+
+	if(zones->notify != NULL) {
+		zones->notify(zones->notify_data);
+	}
+
 	return zones->version;
 }
 
@@ -1116,17 +1295,48 @@ unsigned int bump_zonelist_version(struct zonelist *zones)
 		return -1;
 	}
 
-	if((ret = pthread_mutex_lock(&zones->lock))) {
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
 		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
 
 	version = bump_zonelist_nolock(zones);
 
-	if((ret = pthread_mutex_unlock(&zones->lock))) {
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
 		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
 		return -1;
 	}
 
 	return version;
 }
+
+/*
+ * Locks the given zone list and sets the function called with the given data
+ * each time its version changes, replacing any previous function.  The
+ * function is called with the zone list locked, so it must not lock the zone
+ * list or wait on anything that does.  Pass NULL to remove the function.
+ * Returns 0 on success, -1 on error.
+ */
+int set_zonelist_notify(struct zonelist *zones, void (*notify)(void *data), void *data)
+{
+	int ret;
+
+	if(CHECK_NULL(zones)) {
+		return -1;
+	}
+
+	if((ret = KND_MUTEX_LOCK(&zones->lock, "zonelist"))) {
+		ERROR_OUT("Error locking zone list mutex: %s\n", strerror(ret));
+		return -1;
+	}
+
+	zones->notify = notify;
+	zones->notify_data = data;
+
+	if((ret = KND_MUTEX_UNLOCK(&zones->lock))) {
+		ERROR_OUT("Error unlocking zone list mutex: %s\n", strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,115 @@
+#!/bin/bash
+# Copyright (C)2011 Mike Bourgeous.  Released under AGPLv3 in 2018.
+# Checks that knd's depth frame path doesn't allocate memory once it has
+# warmed up.  Runs knd (which must be built with KND_ALLOC_COUNT) with the
+# synthetic frame source, optionally connects subscribers that receive zone
+# updates every frame, and reads the allocs command.
+#
+# With no subscribers, any frame path allocation fails the test.  Each
+# subscriber is allowed one allocation per frame, the buffer chain libevent 2
+# allocates for each write to a client (libevent 1.4 doesn't allocate).
+#
+# Usage: frame_allocs.sh /path/to/knd [subscribers]
+
+KND="$1"
+SUBS="${2:-0}"
+PORT="${KND_TEST_PORT:-14398}"
+
+if [ ! -x "$KND" ]; then
+	echo "Usage: $0 /path/to/knd [subscribers]" >&2
+	exit 2
+fi
+
+WORKDIR="$(mktemp -d)"
+KND_PID=
+
+cleanup()
+{
+	if [ -n "$KND_PID" ]; then
+		kill "$KND_PID" 2>/dev/null
+		wait "$KND_PID" 2>/dev/null
+	fi
+	rm -rf "$WORKDIR"
+}
+trap cleanup EXIT
+
+fail()
+{
+	echo "FAIL: $*" >&2
+	echo "knd output:" >&2
+	cat "$WORKDIR/knd.log" >&2
+	exit 1
+}
+
+# Sends a command on a new connection and prints the first line of the reply
+knd_cmd()
+{
+	local line
+
+	exec 3<>"/dev/tcp/localhost/$PORT" || return 1
+	echo "$1" >&3
+	read -r -t 5 line <&3
+	exec 3<&-
+	echo "$line"
+}
+
+KND_PORT="$PORT" KND_SOURCE=synth KND_SAVEDIR="$WORKDIR" "$KND" > "$WORKDIR/knd.log" 2>&1 &
+KND_PID=$!
+
+for i in $(seq 50); do
+	VERSION="$(knd_cmd ver 2>/dev/null)" && break
+	sleep 0.1
+done
+case "$VERSION" in
+	"OK - Version"*) ;;
+	*) fail "knd did not start on port $PORT" ;;
+esac
+
+if [ "$(knd_cmd allocs)" = "ERR - Unknown command" ]; then
+	fail "knd was not built with KND_ALLOC_COUNT"
+fi
+
+# A zone covering the whole view changes population on every synthetic frame
+REPLY="$(knd_cmd "addzone All,-3000,-3000,500,3000,3000,8000")"
+case "$REPLY" in
+	"OK -"*) ;;
+	*) fail "could not add a zone: $REPLY" ;;
+esac
+
+# Subscribers read their updates in the background so knd's output buffers
+# for them never grow
+for i in $(seq "$SUBS"); do
+	exec {fd}<>"/dev/tcp/localhost/$PORT" || fail "subscriber $i could not connect"
+	echo sub >&$fd
+	cat <&$fd > "$WORKDIR/sub$i.log" &
+done
+
+# Let buffers reach their working sizes before counting
+sleep 2
+knd_cmd "allocs reset" > /dev/null
+sleep 3
+RESULT="$(knd_cmd allocs)"
+echo "$RESULT"
+
+FRAMES="$(echo "$RESULT" | sed -n 's/.* frames=\([0-9]*\) .*/\1/p')"
+FRAME_ALLOCS="$(echo "$RESULT" | sed -n 's/.* frame_allocs=\([0-9]*\) .*/\1/p')"
+
+if [ -z "$FRAMES" ] || [ -z "$FRAME_ALLOCS" ]; then
+	fail "unexpected allocs reply: $RESULT"
+fi
+if [ "$FRAMES" -eq 0 ]; then
+	fail "no frames were processed"
+fi
+
+for i in $(seq "$SUBS"); do
+	if ! grep -q '^SUB - ' "$WORKDIR/sub$i.log"; then
+		fail "subscriber $i received no zone updates"
+	fi
+done
+
+LIMIT=$((FRAMES * SUBS))
+if [ "$FRAME_ALLOCS" -gt "$LIMIT" ]; then
+	fail "$FRAME_ALLOCS frame path allocations in $FRAMES frames with $SUBS subscriber(s) (limit $LIMIT)"
+fi
+
+echo "PASS: $FRAME_ALLOCS frame path allocations in $FRAMES frames with $SUBS subscriber(s)"